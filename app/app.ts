@@ -22,7 +22,10 @@ import createGameServer, { GameServer } from './game/game-server'
 import { MapStore } from './game/map-store'
 import logger from './logger'
 import { RallyPointManager } from './rally-point/rally-point-manager'
-import { parseShieldbatteryReplayData } from './replays/parse-shieldbattery-replay'
+import {
+  parseShieldbatteryReplayData,
+  readShieldBatteryReplaySection,
+} from './replays/parse-shieldbattery-replay'
 import './security/client'
 import { collect } from './security/client'
 import { LocalSettings, ScrSettings } from './settings'
@@ -432,32 +435,52 @@ function setupIpc(localSettings: LocalSettings, scrSettings: ScrSettings) {
   )
 
   ipcMain.handle('replayParseMetadata', async (event, replayPath) => {
-    return new Promise(async (resolve, reject) => {
+    const parseSection = (buffer: Buffer) => {
+      try {
+        return parseShieldbatteryReplayData(buffer)
+      } catch (err) {
+        logger.error(
+          `Error parsing the replay's ShieldBattery data section: ${(err as any).stack ?? err}`,
+        )
+        return undefined
+      }
+    }
+
+    // Our replays point to their section from the end of the file, so it can be read without
+    // going through the whole replay. Older ones need the parser to find it after the commands.
+    const section = await readShieldBatteryReplaySection(replayPath).catch(err => {
+      logger.error(`Error reading the replay's ShieldBattery data: ${(err as any).stack ?? err}`)
+      return undefined
+    })
+    let shieldBatteryData = section ? parseSection(section) : undefined
+
+    return new Promise((resolve, reject) => {
+      const stream = fs.createReadStream(replayPath)
       const parser = new ReplayParser()
       let headerData: ReplayHeader
       parser.on('replayHeader', header => {
         headerData = header
-      })
-
-      let shieldBatteryData: ReplayShieldBatteryData | undefined
-      parser.rawScrSection('Sbat', buffer => {
-        try {
-          shieldBatteryData = parseShieldbatteryReplayData(buffer)
-        } catch (err) {
-          logger.error(
-            `Error parsing the replay's ShieldBattery data section: ${(err as any).stack ?? err}`,
-          )
+        if (section) {
+          // Nothing else is needed from the rest of the file
+          resolve({ headerData, shieldBatteryData })
+          stream.destroy()
         }
       })
 
+      if (!section) {
+        parser.rawScrSection('Sbat', buffer => {
+          shieldBatteryData = parseSection(buffer)
+        })
+      }
+
       parser.on('end', () => {
         resolve({ headerData, shieldBatteryData })
       })
 
-      const promise = pipeline(fs.createReadStream(replayPath), parser)
-
+      // If the stream was destroyed after the header, the promise has already been resolved and
+      // this rejection is ignored
+      pipeline(stream, parser).catch(reject)
       parser.resume()
-      await promise
     })
   })
 
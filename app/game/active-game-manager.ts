@@ -10,7 +10,11 @@ import {
   isReplayMapInfo,
 } from '../../common/game-launch-config'
 import { GameStatus, ReportedGameStatus, statusToString } from '../../common/game-status'
-import { GameClientPlayerResult, SubmitGameResultsRequest } from '../../common/games/results'
+import {
+  GameClientPlayerResult,
+  GameTimings,
+  SubmitGameResultsRequest,
+} from '../../common/games/results'
 import { EventMap, TypedEventEmitter } from '../../common/typed-emitter'
 import { makeSbUserId, SbUserId } from '../../common/users/sb-user'
 import log from '../logger'
@@ -45,6 +49,8 @@ interface ActiveGameInfo {
     result: Record<SbUserId, GameClientPlayerResult>
     /** How long the game was played, in milliseconds. */
     time: number
+    /** Latency and frame time measurements taken by the game during the game. */
+    timings?: GameTimings
   }
   /**
    * Whether or not the game result was successfully reported to the server by the game process.
@@ -270,16 +276,21 @@ export class ActiveGameManager extends TypedEventEmitter<ActiveGameManagerEvents
     this.setStatus(GameStatus.Playing)
   }
 
-  handleGameResult(gameId: string, result: Record<SbUserId, GameClientPlayerResult>, time: number) {
+  handleGameResult(
+    gameId: string,
+    result: Record<SbUserId, GameClientPlayerResult>,
+    time: number,
+    timings?: GameTimings,
+  ) {
     if (!this.activeGame || this.activeGame.id !== gameId) {
       return
     }
 
-    log.verbose(`Game results: ${JSON.stringify({ result, time })}`)
+    log.verbose(`Game results: ${JSON.stringify({ result, time, timings })}`)
 
     this.activeGame = {
       ...this.activeGame,
-      result: { result, time },
+      result: { result, time, timings },
     }
     this.setStatus(GameStatus.HasResult)
 
@@ -360,6 +371,7 @@ export class ActiveGameManager extends TypedEventEmitter<ActiveGameManagerEvents
           makeSbUserId(Number(id)),
           result,
         ]),
+        timings: this.activeGame.result.timings,
       }
 
       this.emit('resendResults', this.activeGame.id, submission)
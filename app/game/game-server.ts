@@ -94,7 +94,12 @@ export class GameServer {
         this.activeGameManager.handleGameStart(gameId)
         break
       case '/game/result':
-        this.activeGameManager.handleGameResult(gameId, payload.results, payload.time)
+        this.activeGameManager.handleGameResult(
+          gameId,
+          payload.results,
+          payload.time,
+          payload.timings,
+        )
         break
       case '/game/resultSent':
         this.activeGameManager.handleGameResultSent(gameId)
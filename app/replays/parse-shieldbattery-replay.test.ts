@@ -1,4 +1,7 @@
-import { parseGameId } from './parse-shieldbattery-replay'
+import fsPromises from 'fs/promises'
+import os from 'os'
+import path from 'path'
+import { parseGameId, readShieldBatteryReplaySection } from './parse-shieldbattery-replay'
 
 function gameIdAsBuffer(gameId: string): Buffer {
   return Buffer.from(gameId.replace(/-/g, ''), 'hex')
@@ -20,3 +23,54 @@ describe('app/replays/parse-shieldbattery-replays/parseGameId', () => {
     expect(parseGameId(gameIdAsBuffer(gameId))).toBe(gameId)
   })
 })
+
+/** Creates the contents of a replay: `body` followed by a Sbat section with a footer. */
+function replayWithSection(body: Buffer, data: Buffer, footerOffset = body.length): Buffer {
+  const header = Buffer.alloc(8)
+  header.write('Sbat', 0, 'ascii')
+  header.writeUint32LE(data.length + 8, 4)
+  const footer = Buffer.alloc(8)
+  footer.writeUint32LE(footerOffset, 0)
+  footer.write('SbtF', 4, 'ascii')
+  return Buffer.concat([body, header, data, footer])
+}
+
+describe('app/replays/parse-shieldbattery-replays/readShieldBatteryReplaySection', () => {
+  let dir: string
+  let replayPath: string
+
+  beforeEach(async () => {
+    dir = await fsPromises.mkdtemp(path.join(os.tmpdir(), 'sb-replay-'))
+    replayPath = path.join(dir, 'test.rep')
+  })
+
+  afterEach(async () => {
+    await fsPromises.rm(dir, { recursive: true, force: true })
+  })
+
+  test('reads the section the footer points to', async () => {
+    const data = Buffer.alloc(0x58, 0x42)
+    await fsPromises.writeFile(replayPath, replayWithSection(Buffer.alloc(1000, 1), data))
+
+    const section = await readShieldBatteryReplaySection(replayPath)
+    expect(section).toHaveLength(0x60)
+    expect(section!.subarray(0, 0x58)).toEqual(data)
+    expect(section!.readUint32LE(0x58)).toBe(1000)
+  })
+
+  test("returns undefined for replays that don't have a footer", async () => {
+    await fsPromises.writeFile(replayPath, Buffer.alloc(1000, 1))
+    expect(await readShieldBatteryReplaySection(replayPath)).toBeUndefined()
+  })
+
+  test("returns undefined if the footer doesn't point to the section", async () => {
+    const data = Buffer.alloc(0x58, 0x42)
+    await fsPromises.writeFile(replayPath, replayWithSection(Buffer.alloc(1000, 1), data, 500))
+    expect(await readShieldBatteryReplaySection(replayPath)).toBeUndefined()
+  })
+
+  test('returns undefined for files too small to have a footer', async () => {
+    await fsPromises.writeFile(replayPath, Buffer.from('SbtF'))
+    expect(await readShieldBatteryReplaySection(replayPath)).toBeUndefined()
+  })
+})
@@ -1,6 +1,16 @@
+import fsPromises from 'fs/promises'
 import { ReplayShieldBatteryData } from '../../common/replays'
 import { makeSbUserId, SbUserId } from '../../common/users/sb-user'
 
+const SBAT_SECTION_ID = 0x74616253 // Sbat
+const SECTION_HEADER_LENGTH = 8
+/**
+ * Replays that have our section appended end with a u32 section offset and this u32 magic, so the
+ * section can be found without going through the rest of the replay.
+ */
+const SBAT_FOOTER_MAGIC = 0x46746253 // SbtF
+const SBAT_FOOTER_LENGTH = 8
+
 /**
  * Parse the ShieldBattery version as it's written in the replay file. Since it's a string of 16
  * characters, it's padded by the `\u0000` character at the end, which we trim here.
@@ -66,3 +76,50 @@ export function parseShieldbatteryReplayData(buffer: Buffer): ReplayShieldBatter
 
   return data
 }
+
+/**
+ * Reads the ShieldBattery data section of a replay by seeking to it from the footer at the end of
+ * the file, without reading any of the replay's other sections.
+ *
+ * @returns the data of the section (in the format `parseShieldbatteryReplayData` expects), or
+ *   `undefined` if the replay doesn't end with a valid footer (e.g. it was written before footers
+ *   were added, or isn't a ShieldBattery replay at all).
+ */
+export async function readShieldBatteryReplaySection(
+  replayPath: string,
+): Promise<Buffer | undefined> {
+  const file = await fsPromises.open(replayPath, 'r')
+  try {
+    const { size } = await file.stat()
+    if (size < SECTION_HEADER_LENGTH + SBAT_FOOTER_LENGTH) {
+      return undefined
+    }
+
+    const footer = Buffer.alloc(SBAT_FOOTER_LENGTH)
+    await file.read(footer, 0, SBAT_FOOTER_LENGTH, size - SBAT_FOOTER_LENGTH)
+    if (footer.readUint32LE(4) !== SBAT_FOOTER_MAGIC) {
+      return undefined
+    }
+    const sectionOffset = footer.readUint32LE(0)
+    if (sectionOffset > size - SECTION_HEADER_LENGTH - SBAT_FOOTER_LENGTH) {
+      return undefined
+    }
+
+    const header = Buffer.alloc(SECTION_HEADER_LENGTH)
+    await file.read(header, 0, SECTION_HEADER_LENGTH, sectionOffset)
+    const dataLength = header.readUint32LE(4)
+    // The section is always the last thing in the file, and the footer is a part of it
+    if (
+      header.readUint32LE(0) !== SBAT_SECTION_ID ||
+      sectionOffset + SECTION_HEADER_LENGTH + dataLength !== size
+    ) {
+      return undefined
+    }
+
+    const data = Buffer.alloc(dataLength)
+    await file.read(data, 0, dataLength, sectionOffset + SECTION_HEADER_LENGTH)
+    return data
+  } finally {
+    await file.close()
+  }
+}
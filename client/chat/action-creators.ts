@@ -119,11 +119,11 @@ export function getMessageHistory(channelId: SbChannelId, limit: number): ThunkA
       chat: { idToMessages },
     } = getStore()
     const channelMessages = idToMessages.get(channelId)
-    const earliestMessageTime = channelMessages?.messages.length
-      ? channelMessages.messages[0].time
-      : -1
+    const earliestMessage = channelMessages?.messages[0]
+    const earliestMessageTime = earliestMessage ? earliestMessage.time : -1
     const params = { channelId, limit, beforeTime: earliestMessageTime }
 
+    const url = apiUrl`chat/${channelId}/messages2?limit=${limit}&beforeTime=${earliestMessageTime}`
     dispatch({
       type: '@chat/loadMessageHistoryBegin',
       payload: params,
@@ -131,7 +131,7 @@ export function getMessageHistory(channelId: SbChannelId, limit: number): ThunkA
     dispatch({
       type: '@chat/loadMessageHistory',
       payload: fetchJson<GetChannelHistoryServerResponse>(
-        apiUrl`chat/${channelId}/messages2?limit=${limit}&beforeTime=${earliestMessageTime}`,
+        earliestMessage ? url + urlPath`&beforeId=${earliestMessage.id}` : url,
         { method: 'GET' },
       ),
       meta: params,
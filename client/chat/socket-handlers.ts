@@ -168,6 +168,15 @@ const eventToChatAction: EventToChatActionMap = {
       meta: { channelId },
     }
   },
+
+  batch: (channelId, event) => dispatch => {
+    for (const batched of event.events) {
+      if (!eventToChatAction.hasOwnProperty(batched.action)) continue
+
+      const action = eventToChatAction[batched.action](channelId, batched as any)
+      if (action) dispatch(action)
+    }
+  },
 }
 
 type EventToChatUserActionMap = {
@@ -258,6 +258,12 @@ export interface ChatUserOfflineEvent {
   userId: SbUserId
 }
 
+export interface ChatBatchEvent {
+  action: 'batch'
+  /** Events that happened in the chat channel at (nearly) the same time, in the order they did. */
+  events: ChatEvent[]
+}
+
 /**
  * Events that are sent to all clients in a particular chat channel (except the "init" event which
  * is sent only to the client that initially subscribes to these events).
@@ -273,6 +279,7 @@ export type ChatEvent =
   | ChatUserActiveEvent
   | ChatUserIdleEvent
   | ChatUserOfflineEvent
+  | ChatBatchEvent
 
 export interface ChatPermissionsChangedEvent {
   action: 'permissionsChanged'
@@ -0,0 +1,54 @@
+import { FenwickTree } from './fenwick-tree'
+
+describe('common/data-structures/fenwick-tree', () => {
+  const VALUES = [3, 0, 1, 4, 1, 5, 9, 2, 6, 5, 3]
+
+  function naiveSum(values: number[], start: number, end: number) {
+    let sum = 0
+    for (let i = start; i < end; i++) {
+      sum += values[i]
+    }
+    return sum
+  }
+
+  test('starts out empty', () => {
+    const tree = new FenwickTree(8)
+    expect(tree.prefixSum(8)).toBe(0)
+    expect(tree.rangeSum(2, 5)).toBe(0)
+  })
+
+  test('add', () => {
+    const tree = new FenwickTree(VALUES.length)
+    VALUES.forEach((value, i) => tree.add(i, value))
+
+    for (let start = 0; start <= VALUES.length; start++) {
+      for (let end = start; end <= VALUES.length; end++) {
+        expect(tree.rangeSum(start, end)).toBe(naiveSum(VALUES, start, end))
+      }
+    }
+
+    tree.add(3, -4)
+    expect(tree.prefixSum(3)).toBe(4)
+    expect(tree.prefixSum(4)).toBe(4)
+    expect(tree.prefixSum(VALUES.length)).toBe(naiveSum(VALUES, 0, VALUES.length) - 4)
+  })
+
+  test('setAll', () => {
+    const tree = new FenwickTree(VALUES.length)
+    tree.add(2, 100)
+    tree.setAll(VALUES)
+
+    for (let end = 0; end <= VALUES.length; end++) {
+      expect(tree.prefixSum(end)).toBe(naiveSum(VALUES, 0, end))
+    }
+    expect(() => tree.setAll([1, 2, 3])).toThrow()
+  })
+
+  test('out of range sums are clamped', () => {
+    const tree = new FenwickTree(VALUES.length)
+    tree.setAll(VALUES)
+
+    expect(tree.prefixSum(100)).toBe(naiveSum(VALUES, 0, VALUES.length))
+    expect(tree.rangeSum(5, 2)).toBe(0)
+  })
+})
@@ -0,0 +1,51 @@
+/**
+ * A Fenwick tree (binary indexed tree) over a fixed number of values, which allows updating single
+ * values and summing ranges of values in O(log n) time.
+ */
+export class FenwickTree {
+  private tree: Float64Array
+
+  /** Creates a tree of `size` values, all initially 0. */
+  constructor(readonly size: number) {
+    this.tree = new Float64Array(size + 1)
+  }
+
+  /** Adds `delta` to the value at `index`. */
+  add(index: number, delta: number): void {
+    for (let i = index + 1; i <= this.size; i += i & -i) {
+      this.tree[i] += delta
+    }
+  }
+
+  /** Replaces all of the values at once, in O(n) time. */
+  setAll(values: ArrayLike<number>): void {
+    if (values.length !== this.size) {
+      throw new Error(`Expected ${this.size} values, got ${values.length}`)
+    }
+
+    this.tree[0] = 0
+    for (let i = 1; i <= this.size; i++) {
+      this.tree[i] = values[i - 1]
+    }
+    for (let i = 1; i <= this.size; i++) {
+      const parent = i + (i & -i)
+      if (parent <= this.size) {
+        this.tree[parent] += this.tree[i]
+      }
+    }
+  }
+
+  /** Returns the sum of the values in the range [0, end). */
+  prefixSum(end: number): number {
+    let sum = 0
+    for (let i = Math.min(end, this.size); i > 0; i -= i & -i) {
+      sum += this.tree[i]
+    }
+    return sum
+  }
+
+  /** Returns the sum of the values in the range [start, end). */
+  rangeSum(start: number, end: number): number {
+    return end > start ? this.prefixSum(end) - this.prefixSum(start) : 0
+  }
+}
@@ -107,4 +107,13 @@ export interface GameRoute {
   routeId: string
   /** The ID of the local player, used to identify themselves to the rally-point server. */
   playerId: string
+  /**
+   * A second route to the same player on a different rally-point server. If present, packets are
+   * sent over both routes.
+   */
+  backup?: {
+    server: ResolvedRallyPointServer
+    routeId: string
+    playerId: string
+  }
 }
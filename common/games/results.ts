@@ -80,6 +80,28 @@ export enum GameResultErrorCode {
   InvalidClient = 'InvalidClient',
 }
 
+/**
+ * A summary of timing samples collected by the game client. All values other than `count` are in
+ * microseconds.
+ */
+export interface TimingSummary {
+  count: number
+  mean: number
+  p50: number
+  p90: number
+  p99: number
+  max: number
+}
+
+/** Latency and frame time measurements taken by the game client over the course of a game. */
+export interface GameTimings {
+  sendLatency: TimingSummary
+  receiveLatency: TimingSummary
+  stepReplayCommands: TimingSummary
+  afterStepGame: TimingSummary
+  frameTime: TimingSummary
+}
+
 /** The payload format for submitting game results to the server. */
 export interface SubmitGameResultsRequest {
   /** The ID of the user submitting results. */
@@ -90,6 +112,8 @@ export interface SubmitGameResultsRequest {
   time: number
   /** Each player's result. */
   playerResults: [playerId: SbUserId, result: GameClientPlayerResult][]
+  /** Timing measurements from the submitting player's client, if it collected any. */
+  timings?: GameTimings
 }
 
 // TODO(tec27): Delete once the game code calls the new endpoint
@@ -109,6 +109,19 @@ describe('common/statistics/exponential-smoothing', () => {
     expect(v.add(4096).value).toMatchInlineSnapshot(`2298.8672485351562`)
   })
 
+  test('decay(intervals) is the same as adding 0 that many times', () => {
+    const v = new ExponentialSmoothValue(0.25, 0)
+    const w = new ExponentialSmoothValue(0.25, 0)
+
+    v.add(4096).add(1024)
+    w.add(4096).add(1024)
+    for (let i = 0; i < 7; i++) {
+      v.add(0)
+    }
+    expect(w.decay(7).value).toBeCloseTo(v.value, 10)
+    expect(w.decay(0).value).toBeCloseTo(v.value, 10)
+  })
+
   test('reset(value) sets the value directly', () => {
     const v = new ExponentialSmoothValue(0.25, 0)
 
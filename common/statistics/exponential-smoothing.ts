@@ -41,6 +41,15 @@ export class ExponentialSmoothValue {
     return this
   }
 
+  /**
+   * Updates the smoothed value as if `intervals` values of 0 had been added, without having to add
+   * them one by one.
+   */
+  decay(intervals: number): this {
+    this.curValue *= Math.pow(1 - this.alpha, intervals)
+    return this
+  }
+
   /** A getter that returns the current smoothed value. */
   get value(): number {
     return this.curValue
@@ -0,0 +1,28 @@
+/**
+ * Declares a benchmark, which is a test that only runs when the `SB_BENCHMARK` environment variable
+ * is set, since benchmarks are slow and mostly just report their results. For example:
+ *
+ * `SB_BENCHMARK=1 yarn test server/lib/matchmaking/matchmaker.test.ts`
+ *
+ * `fn` is given a `report` function that prints a line of results, prefixed with the name of the
+ * benchmark.
+ */
+export function benchmark(
+  name: string,
+  fn: (report: (result: string) => void) => void | Promise<void>,
+  timeoutMillis = 5 * 60 * 1000,
+) {
+  const runner = process.env.SB_BENCHMARK ? test : test.skip
+  runner(
+    `benchmark - ${name}`,
+    () => fn(result => console.log(`${name}: ${result}`)),
+    timeoutMillis,
+  )
+}
+
+/** Runs `fn` and returns how long it took, in milliseconds. */
+export async function measure(fn: () => unknown): Promise<number> {
+  const start = performance.now()
+  await fn()
+  return performance.now() - start
+}
@@ -2,7 +2,10 @@
 //! 1) Generates rust code from protobufs
 //! 2) Compiles d3d11 shaders for SC:R
 //! 3) Gathers version information from package.json
+//! 4) Compiles file_hook path rules to lookup tables
 
+use std::collections::BTreeMap;
+use std::fmt::Write;
 use std::fs;
 use std::path::Path;
 
@@ -14,6 +17,8 @@ static SOURCES: &[(&str, &str, &[(&str, &str)])] = &[("mask", "mask.hlsl", &[])]
 
 static PROTOS: &[&str] = &["src/proto/messages.proto"];
 
+static FILE_RULES: &str = "src/bw_scr/file_rules.txt";
+
 fn main() {
     for &path in PROTOS {
         println!("cargo:rerun-if-changed={}", path);
@@ -60,6 +65,11 @@ fn main() {
         "cargo:rustc-env=SHIELDBATTERY_VERSION={}",
         package_json_version("../package.json")
     );
+
+    println!("cargo:rerun-if-changed={}", FILE_RULES);
+    let rules = fs::read_to_string(FILE_RULES).unwrap();
+    let code = compile_file_rules(&rules).unwrap_or_else(|e| panic!("{}: {}", FILE_RULES, e));
+    fs::write(out_path.join("file_rules.rs"), code).unwrap();
 }
 
 fn package_json_version(path: &str) -> String {
@@ -106,3 +116,158 @@ fn disasm_shader(shader_bytes: &[u8], out_path: &Path) -> Result<(), Error> {
         .with_context(|| format!("Failed to write {}", out_path.display()))?;
     Ok(())
 }
+
+struct HdRule {
+    suffix: Vec<u8>,
+    exact: bool,
+    replacement: String,
+    include: Vec<String>,
+    exclude: Vec<String>,
+}
+
+/// Generates the statics that `bw_scr/path_rules.rs` includes.
+///
+/// HD rules are stored as a trie of reversed suffixes, so the hook can find the matching rule
+/// with a single pass over the path from the end, regardless of how many rules there are.
+/// Each node's children are stored contiguously, sorted by byte.
+fn compile_file_rules(text: &str) -> Result<String, Error> {
+    let mut hd_rules = Vec::new();
+    let mut carbot_missing = Vec::new();
+    for (i, line) in text.lines().enumerate() {
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+        let mut fields = line.split_whitespace();
+        match fields.next() {
+            Some("hd") => {
+                let suffix = fields.next().with_context(|| format!("Line {}", i + 1))?;
+                let replacement = fields.next().with_context(|| format!("Line {}", i + 1))?;
+                let (include, exclude) = fields.partition::<Vec<_>, _>(|x| !x.starts_with('!'));
+                let exact = suffix.starts_with('=');
+                hd_rules.push(HdRule {
+                    suffix: suffix.trim_start_matches('=').as_bytes().into(),
+                    exact,
+                    replacement: replacement.into(),
+                    include: include.into_iter().map(|x| x.into()).collect(),
+                    exclude: exclude.iter().map(|x| x[1..].into()).collect(),
+                });
+            }
+            Some("carbot_missing") => {
+                for id in fields {
+                    let id: u32 = id.parse().with_context(|| format!("Line {}", i + 1))?;
+                    anyhow::ensure!(id < 1024, "Line {}: Sprite id {} too large", i + 1, id);
+                    carbot_missing.push(id);
+                }
+            }
+            _ => anyhow::bail!("Line {}: Unknown rule {}", i + 1, line),
+        }
+    }
+    anyhow::ensure!(hd_rules.len() < 255, "Too many hd rules");
+
+    // Build the trie with nodes in a map first, and then flatten it breadth-first.
+    let mut children: Vec<BTreeMap<u8, usize>> = vec![BTreeMap::new()];
+    let mut node_rule: Vec<Option<usize>> = vec![None];
+    for (rule_index, rule) in hd_rules.iter().enumerate() {
+        let mut node = 0;
+        for &byte in rule.suffix.iter().rev() {
+            node = match children[node].get(&byte) {
+                Some(&child) => child,
+                None => {
+                    let child = children.len();
+                    children.push(BTreeMap::new());
+                    node_rule.push(None);
+                    children[node].insert(byte, child);
+                    child
+                }
+            };
+        }
+        anyhow::ensure!(
+            node_rule[node].is_none(),
+            "Duplicate hd rule {:?}",
+            rule.suffix
+        );
+        node_rule[node] = Some(rule_index);
+    }
+    let mut order = vec![(0usize, 0u8)];
+    let mut first_child = vec![0usize; children.len()];
+    let mut i = 0;
+    while i < order.len() {
+        let node = order[i].0;
+        first_child[node] = order.len();
+        order.extend(children[node].iter().map(|(&byte, &child)| (child, byte)));
+        i += 1;
+    }
+    anyhow::ensure!(order.len() < 0x10000, "Too many trie nodes");
+
+    let mut out = String::new();
+    writeln!(out, "// Generated by build.rs from {}", FILE_RULES)?;
+    let mut variants: Vec<String> = hd_rules
+        .iter()
+        .map(|x| camel_case(&x.replacement))
+        .collect();
+    variants.sort();
+    variants.dedup();
+    writeln!(out, "#[derive(Copy, Clone, Debug, Eq, PartialEq)]")?;
+    writeln!(out, "pub enum HdReplacement {{")?;
+    for variant in &variants {
+        writeln!(out, "    {},", variant)?;
+    }
+    writeln!(out, "}}")?;
+    writeln!(out, "static HD_RULES: [HdRule; {}] = [", hd_rules.len())?;
+    for rule in &hd_rules {
+        writeln!(
+            out,
+            "    HdRule {{ exact: {}, include: &{:?}, exclude: &{:?}, \
+                replacement: HdReplacement::{} }},",
+            rule.exact,
+            rule.include.iter().map(|x| ByteStr(x)).collect::<Vec<_>>(),
+            rule.exclude.iter().map(|x| ByteStr(x)).collect::<Vec<_>>(),
+            camel_case(&rule.replacement),
+        )?;
+    }
+    writeln!(out, "];")?;
+    writeln!(out, "static SUFFIX_TRIE: [TrieNode; {}] = [", order.len())?;
+    for &(node, byte) in &order {
+        writeln!(
+            out,
+            "    TrieNode {{ byte: {}, rule: {}, child_count: {}, first_child: {} }},",
+            byte,
+            node_rule[node].map(|x| x + 1).unwrap_or(0),
+            children[node].len(),
+            first_child[node],
+        )?;
+    }
+    writeln!(out, "];")?;
+    let mut bits = [0u64; 16];
+    for id in carbot_missing {
+        bits[id as usize / 64] |= 1 << (id % 64);
+    }
+    writeln!(
+        out,
+        "static CARBOT_MISSING_SPRITES: [u64; 16] = {:#x?};",
+        bits
+    )?;
+    Ok(out)
+}
+
+struct ByteStr<'a>(&'a str);
+
+impl std::fmt::Debug for ByteStr<'_> {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(f, "b{:?}", self.0)
+    }
+}
+
+fn camel_case(name: &str) -> String {
+    name.split('_')
+        .flat_map(|part| {
+            let mut chars = part.chars();
+            chars
+                .next()
+                .map(|x| x.to_ascii_uppercase())
+                .into_iter()
+                .chain(chars)
+        })
+        .collect()
+}
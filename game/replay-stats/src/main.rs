@@ -0,0 +1,252 @@
+//! Extracts APM, build orders and unit counts from a directory of replays, without running BW.
+//!
+//! Usage: `replay-stats [--threads N] <output dir> <replay file or directory>...`
+//!
+//! Replays are parsed in parallel, and the results are written as CSV files in the output
+//! directory, in a format that can be loaded with Postgres `COPY ... WITH (FORMAT csv, HEADER)`:
+//!
+//! - `games.csv` replay path, frames, duration_ms, map_name
+//! - `players.csv` replay path, slot, name, race, team, type, actions, apm, leave_frame
+//! - `builds.csv` replay path, slot, frame, kind, id
+//! - `units.csv` replay path, slot, unit_id, count
+//!
+//! Replays that fail to parse are reported on stderr and skipped.
+
+#[macro_use]
+extern crate log;
+
+#[path = "../../src/bw/commands.rs"]
+#[allow(dead_code)]
+mod commands;
+mod replay_file;
+mod stats;
+
+use std::fs::{self, File};
+use std::io::{self, BufWriter, Write};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::mpsc;
+use std::thread;
+
+use crate::replay_file::Replay;
+use crate::stats::PlayerStats;
+
+struct Output {
+    games: BufWriter<File>,
+    players: BufWriter<File>,
+    builds: BufWriter<File>,
+    units: BufWriter<File>,
+}
+
+fn main() {
+    let mut args = std::env::args_os().skip(1).peekable();
+    let mut threads = thread::available_parallelism()
+        .map(|x| x.get())
+        .unwrap_or(1);
+    if args.peek().map(|x| x == "--threads").unwrap_or(false) {
+        args.next();
+        threads = match args.next().and_then(|x| x.to_str()?.parse().ok()) {
+            Some(n) if n > 0 => n,
+            _ => usage(),
+        };
+    }
+    let out_dir = match args.next() {
+        Some(s) => PathBuf::from(s),
+        None => usage(),
+    };
+    let inputs: Vec<PathBuf> = args.map(PathBuf::from).collect();
+    if inputs.is_empty() {
+        usage();
+    }
+    if let Err(e) = run(&out_dir, &inputs, threads) {
+        eprintln!("{}", e);
+        std::process::exit(1);
+    }
+}
+
+fn usage() -> ! {
+    eprintln!("Usage: replay-stats [--threads N] <output dir> <replay file or directory>...");
+    std::process::exit(2);
+}
+
+fn run(out_dir: &Path, inputs: &[PathBuf], threads: usize) -> io::Result<()> {
+    let mut files = Vec::new();
+    for input in inputs {
+        collect_replays(input, &mut files)?;
+    }
+    fs::create_dir_all(out_dir)?;
+    let create = |name: &str, header: &str| -> io::Result<BufWriter<File>> {
+        let mut file = BufWriter::new(File::create(out_dir.join(name))?);
+        writeln!(file, "{}", header)?;
+        Ok(file)
+    };
+    let mut out = Output {
+        games: create("games.csv", "replay,frames,duration_ms,map_name")?,
+        players: create(
+            "players.csv",
+            "replay,slot,name,race,team,type,actions,apm,leave_frame",
+        )?,
+        builds: create("builds.csv", "replay,slot,frame,kind,id")?,
+        units: create("units.csv", "replay,slot,unit_id,count")?,
+    };
+
+    // Workers take the next file index from `next`; the results are written from this thread
+    // as they come in, so output order depends on timing but memory use doesn't grow with
+    // the amount of replays.
+    let next = AtomicUsize::new(0);
+    let (send, recv) = mpsc::sync_channel(threads * 4);
+    let mut ok = 0usize;
+    let mut failed = 0usize;
+    let result = thread::scope(|s| {
+        for _ in 0..threads.min(files.len()) {
+            let send = send.clone();
+            let next = &next;
+            let files = &files;
+            s.spawn(move || loop {
+                let index = next.fetch_add(1, Ordering::Relaxed);
+                let path = match files.get(index) {
+                    Some(s) => s,
+                    None => break,
+                };
+                if send.send((path, analyze(path))).is_err() {
+                    break;
+                }
+            });
+        }
+        drop(send);
+        for (path, result) in recv {
+            match result {
+                Ok((replay, stats)) => {
+                    write_replay(&mut out, path, &replay, &stats)?;
+                    ok += 1;
+                }
+                Err(e) => {
+                    eprintln!("{}: {}", path.display(), e);
+                    failed += 1;
+                }
+            }
+        }
+        Ok::<(), io::Error>(())
+    });
+    result?;
+    out.games.flush()?;
+    out.players.flush()?;
+    out.builds.flush()?;
+    out.units.flush()?;
+    eprintln!("Processed {} replays, {} failed", ok, failed);
+    Ok(())
+}
+
+fn collect_replays(path: &Path, out: &mut Vec<PathBuf>) -> io::Result<()> {
+    if !path.is_dir() {
+        out.push(path.into());
+        return Ok(());
+    }
+    let mut entries = fs::read_dir(path)?
+        .map(|entry| entry.map(|e| e.path()))
+        .collect::<io::Result<Vec<_>>>()?;
+    entries.sort();
+    for entry in entries {
+        if entry.is_dir() {
+            collect_replays(&entry, out)?;
+        } else if entry
+            .extension()
+            .map(|ext| ext.eq_ignore_ascii_case("rep"))
+            .unwrap_or(false)
+        {
+            out.push(entry);
+        }
+    }
+    Ok(())
+}
+
+fn analyze(path: &Path) -> Result<(Replay, Vec<PlayerStats>), Box<dyn std::error::Error + Send>> {
+    let data = fs::read(path).map_err(|e| Box::new(e) as Box<_>)?;
+    let replay = replay_file::read_replay(&data).map_err(|e| Box::new(e) as Box<_>)?;
+    let stats = stats::player_stats(&replay);
+    Ok((replay, stats))
+}
+
+fn write_replay(
+    out: &mut Output,
+    path: &Path,
+    replay: &Replay,
+    stats: &[PlayerStats],
+) -> io::Result<()> {
+    let path = path.to_string_lossy();
+    let path = csv_field(&path);
+    let header = &replay.header;
+    writeln!(
+        out.games,
+        "{},{},{},{}",
+        path,
+        header.frames,
+        header.frames as u64 * stats::FRAME_MS,
+        csv_field(&header.map_name),
+    )?;
+    for (player, stats) in header.players.iter().zip(stats) {
+        let leave_frame = stats.leave_frame.map(|x| x.to_string()).unwrap_or_default();
+        writeln!(
+            out.players,
+            "{},{},{},{},{},{},{},{:.1},{}",
+            path,
+            player.slot,
+            csv_field(&player.name),
+            race_name(player.race),
+            player.team,
+            if player.player_type == 2 {
+                "human"
+            } else {
+                "computer"
+            },
+            stats.actions,
+            stats.apm(header.frames),
+            leave_frame,
+        )?;
+        for build in &stats.builds {
+            writeln!(
+                out.builds,
+                "{},{},{},{},{}",
+                path,
+                player.slot,
+                build.frame,
+                build.kind.name(),
+                build.id,
+            )?;
+        }
+        for &(unit_id, count) in &stats.units {
+            writeln!(out.units, "{},{},{},{}", path, player.slot, unit_id, count)?;
+        }
+    }
+    Ok(())
+}
+
+fn race_name(race: u8) -> &'static str {
+    match race {
+        0 => "z",
+        1 => "t",
+        2 => "p",
+        _ => "r",
+    }
+}
+
+/// Quotes a CSV field if needed.
+fn csv_field(value: &str) -> std::borrow::Cow<'_, str> {
+    if value.contains(&[',', '"', '\n', '\r'][..]) {
+        format!("\"{}\"", value.replace('"', "\"\"")).into()
+    } else {
+        value.into()
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::csv_field;
+
+    #[test]
+    fn csv_quoting() {
+        assert_eq!(csv_field("abc"), "abc");
+        assert_eq!(csv_field("a,b"), "\"a,b\"");
+        assert_eq!(csv_field("say \"hi\""), "\"say \"\"hi\"\"\"");
+    }
+}
@@ -0,0 +1,233 @@
+//! Reading the sections of a SC:R replay file that are needed without BW.
+
+use std::fmt;
+
+use byteorder::{ByteOrder, LittleEndian};
+
+const REPLAY_MAGIC: u32 = 0x53526573;
+const HEADER_SIZE: usize = 0x279;
+/// Uncompressed size of a section chunk, chunks that are stored smaller than this
+/// (or smaller than the rest of the section) are zlib-compressed.
+const CHUNK_SIZE: usize = 0x2000;
+/// Sanity limit for commands section size, nothing legitimate gets even close.
+const MAX_COMMANDS_SIZE: usize = 256 * 1024 * 1024;
+
+#[derive(Debug)]
+pub enum Error {
+    /// Not a replay, or a pre-1.18 replay using implode compression.
+    UnsupportedFormat,
+    Truncated,
+    Decompress,
+}
+
+impl fmt::Display for Error {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            Error::UnsupportedFormat => write!(f, "Not a SC:R replay"),
+            Error::Truncated => write!(f, "Replay file is truncated"),
+            Error::Decompress => write!(f, "Failed to decompress replay section"),
+        }
+    }
+}
+
+impl std::error::Error for Error {}
+
+pub struct Replay {
+    pub header: ReplayHeader,
+    pub commands: Vec<u8>,
+}
+
+pub struct ReplayHeader {
+    pub frames: u32,
+    pub map_name: String,
+    /// Only slots that are occupied by humans or computers.
+    pub players: Vec<ReplayPlayer>,
+}
+
+pub struct ReplayPlayer {
+    pub slot: u8,
+    /// Player number in replay commands, only humans have one.
+    pub storm_id: Option<u8>,
+    /// 1 = computer, 2 = human
+    pub player_type: u8,
+    pub race: u8,
+    pub team: u8,
+    pub name: String,
+}
+
+pub fn read_replay(data: &[u8]) -> Result<Replay, Error> {
+    let mut pos = 0;
+    let id = read_section(data, &mut pos, 4)?;
+    if LittleEndian::read_u32(&id) != REPLAY_MAGIC {
+        return Err(Error::UnsupportedFormat);
+    }
+    // SC:R extension offset; only needed for the extra sections after map data.
+    pos += 4;
+    let header = read_section(data, &mut pos, HEADER_SIZE)?;
+    let commands_len = read_section(data, &mut pos, 4)?;
+    let commands_len = LittleEndian::read_u32(&commands_len) as usize;
+    if commands_len > MAX_COMMANDS_SIZE {
+        return Err(Error::UnsupportedFormat);
+    }
+    let commands = read_section(data, &mut pos, commands_len)?;
+    Ok(Replay {
+        header: parse_header(&header),
+        commands,
+    })
+}
+
+/// Section layout is
+/// u32 checksum, u32 chunk_count, { u32 length, u8 data[length] }[chunk_count]
+fn read_section(data: &[u8], pos: &mut usize, size: usize) -> Result<Vec<u8>, Error> {
+    let header = data
+        .get(*pos..)
+        .and_then(|x| x.get(..8))
+        .ok_or(Error::Truncated)?;
+    let chunk_count = LittleEndian::read_u32(&header[4..]);
+    *pos += 8;
+    let mut out = Vec::with_capacity(size);
+    for _ in 0..chunk_count {
+        let remaining = size - out.len();
+        let len = data
+            .get(*pos..)
+            .and_then(|x| x.get(..4))
+            .ok_or(Error::Truncated)?;
+        let len = LittleEndian::read_u32(len) as usize;
+        let chunk = data
+            .get(*pos + 4..)
+            .and_then(|x| x.get(..len))
+            .ok_or(Error::Truncated)?;
+        *pos += 4 + len;
+        if len >= remaining.min(CHUNK_SIZE) {
+            out.extend_from_slice(&chunk[..len.min(remaining)]);
+        } else if chunk.get(0) == Some(&0x78) {
+            let result = miniz_oxide::inflate::decompress_to_vec_zlib(chunk)
+                .map_err(|_| Error::Decompress)?;
+            if result.len() > remaining {
+                return Err(Error::Decompress);
+            }
+            out.extend_from_slice(&result);
+        } else {
+            return Err(Error::UnsupportedFormat);
+        }
+    }
+    if out.len() != size {
+        return Err(Error::Truncated);
+    }
+    Ok(out)
+}
+
+fn parse_header(header: &[u8]) -> ReplayHeader {
+    let players = (0..12u8)
+        .filter_map(|slot| {
+            let player = &header[0xa1 + slot as usize * 0x24..][..0x24];
+            let player_type = player[8];
+            if player_type != 1 && player_type != 2 {
+                return None;
+            }
+            let storm_id = LittleEndian::read_u32(&player[4..]);
+            Some(ReplayPlayer {
+                slot,
+                storm_id: if storm_id < 8 {
+                    Some(storm_id as u8)
+                } else {
+                    None
+                },
+                player_type,
+                race: player[9],
+                team: player[0xa],
+                name: c_string(&player[0xb..0x24]),
+            })
+        })
+        .collect();
+    ReplayHeader {
+        frames: LittleEndian::read_u32(&header[1..]),
+        map_name: c_string(&header[0x61..0x81]),
+        players,
+    }
+}
+
+/// BW strings are UTF-8 in SC:R, but may be anything in replays converted from older
+/// versions, so be lenient.
+fn c_string(data: &[u8]) -> String {
+    let end = data.iter().position(|&x| x == 0).unwrap_or(data.len());
+    String::from_utf8_lossy(&data[..end]).into_owned()
+}
+
+#[cfg(test)]
+pub mod test {
+    use byteorder::{ByteOrder, LittleEndian};
+
+    use super::{read_replay, Error, HEADER_SIZE, REPLAY_MAGIC};
+
+    fn push_section(out: &mut Vec<u8>, data: &[u8], compress: bool) {
+        out.extend_from_slice(&[0; 4]);
+        let chunks: Vec<&[u8]> = data.chunks(super::CHUNK_SIZE).collect();
+        out.extend_from_slice(&(chunks.len() as u32).to_le_bytes());
+        for chunk in chunks {
+            let chunk = match compress {
+                true => miniz_oxide::deflate::compress_to_vec_zlib(chunk, 6),
+                false => chunk.to_vec(),
+            };
+            out.extend_from_slice(&(chunk.len() as u32).to_le_bytes());
+            out.extend_from_slice(&chunk);
+        }
+    }
+
+    /// Builds a replay with one human named "Player{slot}" per entry in `races`.
+    pub fn make_replay(frames: u32, races: &[u8], commands: &[u8], compress: bool) -> Vec<u8> {
+        let mut header = vec![0u8; HEADER_SIZE];
+        LittleEndian::write_u32(&mut header[1..], frames);
+        header[0x61..0x67].copy_from_slice(b"(2)Map");
+        for slot in 0..12 {
+            let player = &mut header[0xa1 + slot * 0x24..][..0x24];
+            match races.get(slot) {
+                Some(&race) => {
+                    LittleEndian::write_u32(&mut player[4..], slot as u32);
+                    player[8] = 2;
+                    player[9] = race;
+                    player[0xa] = slot as u8 + 1;
+                    let name = format!("Player{}", slot);
+                    player[0xb..][..name.len()].copy_from_slice(name.as_bytes());
+                }
+                None => LittleEndian::write_u32(&mut player[4..], u32::MAX),
+            }
+        }
+        let mut out = Vec::new();
+        push_section(&mut out, &REPLAY_MAGIC.to_le_bytes(), false);
+        out.extend_from_slice(&[0; 4]);
+        push_section(&mut out, &header, compress);
+        push_section(&mut out, &(commands.len() as u32).to_le_bytes(), false);
+        push_section(&mut out, commands, compress);
+        out
+    }
+
+    #[test]
+    fn read_sections() {
+        let commands: Vec<u8> = (0..0x5000u32).map(|x| (x % 251) as u8).collect();
+        for &compress in &[false, true] {
+            let data = make_replay(1234, &[0, 2], &commands, compress);
+            let replay = read_replay(&data).unwrap();
+            assert_eq!(replay.header.frames, 1234);
+            assert_eq!(replay.header.map_name, "(2)Map");
+            assert_eq!(replay.header.players.len(), 2);
+            let player = &replay.header.players[1];
+            assert_eq!(player.name, "Player1");
+            assert_eq!(player.storm_id, Some(1));
+            assert_eq!(player.race, 2);
+            assert_eq!(player.team, 2);
+            assert_eq!(replay.commands, commands);
+        }
+    }
+
+    #[test]
+    fn bad_replays() {
+        let data = make_replay(1234, &[0, 2], &[1, 2, 3], true);
+        for len in [0, 0x10, 0x30, data.len() - 1] {
+            assert!(matches!(read_replay(&data[..len]), Err(Error::Truncated)));
+        }
+        let mut data = data;
+        data[0xc] = 0x72;
+        assert!(matches!(read_replay(&data), Err(Error::UnsupportedFormat)));
+    }
+}
@@ -0,0 +1,205 @@
+//! Per-player statistics computed from replay commands.
+
+use byteorder::{ByteOrder, LittleEndian};
+
+use crate::commands::{self, id};
+use crate::replay_file::Replay;
+
+/// Lengths of SC:R game commands, including the command id byte. The game DLL gets this
+/// from the executable, but it hasn't changed since the selection commands were widened.
+/// Commands with `!0` lengths are invalid in replays.
+#[rustfmt::skip]
+pub static COMMAND_LENGTHS: &[u32] = &[
+    !0, !0, !0, !0, !0, 1, 33, 33, 1, 26, 26, 26, 8, 3, 5, 2,
+    1, 1, 5, 3, 10, 11, !0, !0, 1, 1, 2, 1, 1, 1, 2, 3,
+    3, 2, 2, 3, 1, 2, 2, 1, 2, 3, 1, 2, 2, 2, 1, 5,
+    2, 1, 2, 1, 1, 3, 1, 7, !0, !0, !0, !0, !0, !0, !0, !0,
+    !0, !0, !0, !0, !0, !0, !0, !0, !0, !0, !0, !0, !0, !0, !0, !0,
+    !0, !0, !0, !0, !0, 2, 10, 2, 5, !0, 1, !0, 82, 5, !0, 2,
+    12, 13, 5, 50, 50, 50, 4,
+];
+
+const BUILD: u8 = 0xc;
+const TRAIN: u8 = 0x1f;
+const UNIT_MORPH: u8 = 0x23;
+const TECH: u8 = 0x30;
+const UPGRADE: u8 = 0x32;
+const BUILDING_MORPH: u8 = 0x35;
+const LEAVE_GAME: u8 = 0x57;
+const CHAT: u8 = 0x5c;
+
+/// Milliseconds per frame on fastest game speed.
+pub const FRAME_MS: u64 = 42;
+
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub enum BuildKind {
+    Build,
+    Train,
+    Morph,
+    Tech,
+    Upgrade,
+}
+
+impl BuildKind {
+    pub fn name(self) -> &'static str {
+        match self {
+            BuildKind::Build => "build",
+            BuildKind::Train => "train",
+            BuildKind::Morph => "morph",
+            BuildKind::Tech => "tech",
+            BuildKind::Upgrade => "upgrade",
+        }
+    }
+}
+
+#[derive(Debug, Eq, PartialEq)]
+pub struct BuildEvent {
+    pub frame: u32,
+    pub kind: BuildKind,
+    /// Unit, tech or upgrade id, depending on `kind`.
+    pub id: u16,
+}
+
+#[derive(Debug, Default)]
+pub struct PlayerStats {
+    /// Commands that count towards APM; excludes chat and automatically sent commands.
+    pub actions: u32,
+    pub leave_frame: Option<u32>,
+    pub builds: Vec<BuildEvent>,
+    /// (unit_id, count) for units that were ordered to be built, trained or morphed,
+    /// sorted by unit id. Cancels aren't accounted for.
+    pub units: Vec<(u16, u32)>,
+}
+
+impl PlayerStats {
+    /// Actions per minute over the time that the player was in game.
+    pub fn apm(&self, replay_frames: u32) -> f64 {
+        let frames = self.leave_frame.unwrap_or(replay_frames).max(1);
+        self.actions as f64 * 60_000.0 / (frames as u64 * FRAME_MS) as f64
+    }
+}
+
+/// Returns stats for each player in `replay.header.players`, in same order.
+pub fn player_stats(replay: &Replay) -> Vec<PlayerStats> {
+    let players = &replay.header.players;
+    let mut result: Vec<PlayerStats> = players.iter().map(|_| PlayerStats::default()).collect();
+    let mut storm_to_index = [None; 8];
+    for (i, player) in players.iter().enumerate() {
+        if let Some(storm_id) = player.storm_id {
+            storm_to_index[storm_id as usize] = Some(i);
+        }
+    }
+    let mut data = &replay.commands[..];
+    while let Some((mut frame, rest)) = commands::replay_next_frame(data) {
+        data = rest;
+        while let Some((storm_player, command)) = frame.next_command(COMMAND_LENGTHS) {
+            let index = match storm_to_index.get(storm_player as usize) {
+                Some(&Some(i)) => i,
+                _ => continue,
+            };
+            add_command(&mut result[index], frame.frame, command);
+        }
+    }
+    for stats in &mut result {
+        let mut units: Vec<(u16, u32)> = Vec::new();
+        for build in &stats.builds {
+            if build.kind == BuildKind::Tech || build.kind == BuildKind::Upgrade {
+                continue;
+            }
+            match units.binary_search_by_key(&build.id, |x| x.0) {
+                Ok(i) => units[i].1 += 1,
+                Err(i) => units.insert(i, (build.id, 1)),
+            }
+        }
+        stats.units = units;
+    }
+    result
+}
+
+fn add_command(stats: &mut PlayerStats, frame: u32, command: &[u8]) {
+    let (kind, id) = match command[0] {
+        id::NOP
+        | id::SYNC
+        | id::REPLAY_SPEED
+        | id::REPLAY_SEEK
+        | id::SET_TURN_RATE
+        | id::SET_NETWORK_SPEED
+        | CHAT => return,
+        LEAVE_GAME => {
+            stats.leave_frame = Some(frame);
+            return;
+        }
+        BUILD => (
+            Some(BuildKind::Build),
+            LittleEndian::read_u16(&command[6..]),
+        ),
+        TRAIN => (
+            Some(BuildKind::Train),
+            LittleEndian::read_u16(&command[1..]),
+        ),
+        UNIT_MORPH | BUILDING_MORPH => (
+            Some(BuildKind::Morph),
+            LittleEndian::read_u16(&command[1..]),
+        ),
+        TECH => (Some(BuildKind::Tech), command[1] as u16),
+        UPGRADE => (Some(BuildKind::Upgrade), command[1] as u16),
+        _ => (None, 0),
+    };
+    stats.actions += 1;
+    if let Some(kind) = kind {
+        stats.builds.push(BuildEvent { frame, kind, id });
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::{player_stats, BuildEvent, BuildKind};
+    use crate::replay_file::{read_replay, test::make_replay};
+
+    #[test]
+    fn stats() {
+        #[rustfmt::skip]
+        let commands = &[
+            // Frame 10: player 0 builds, player 1 trains, both send sync
+            0x0a, 0x00, 0x00, 0x00, 0x15,
+            0x00, 0x0c, 0x1e, 0x10, 0x00, 0x20, 0x00, 0x6a, 0x00,
+            0x01, 0x1f, 0x07, 0x00,
+            0x00, 0x37, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            // Frame 20: player 1 trains, researches, then leaves; unknown player 5 is ignored
+            0x14, 0x00, 0x00, 0x00, 0x0c,
+            0x01, 0x1f, 0x07, 0x00,
+            0x01, 0x30, 0x01,
+            0x01, 0x57, 0x01,
+            0x05, 0x08,
+        ];
+        let replay = read_replay(&make_replay(1428, &[0, 1], commands, false)).unwrap();
+        let stats = player_stats(&replay);
+        assert_eq!(stats.len(), 2);
+        assert_eq!(stats[0].actions, 1);
+        assert_eq!(stats[0].leave_frame, None);
+        assert_eq!(
+            stats[0].builds,
+            vec![BuildEvent {
+                frame: 10,
+                kind: BuildKind::Build,
+                id: 0x6a
+            }],
+        );
+        assert_eq!(stats[0].units, vec![(0x6a, 1)]);
+        // 1428 frames is one minute
+        assert!((stats[0].apm(1428) - 1.0).abs() < 0.001);
+
+        assert_eq!(stats[1].actions, 3);
+        assert_eq!(stats[1].leave_frame, Some(20));
+        assert_eq!(stats[1].builds.len(), 3);
+        assert_eq!(
+            stats[1].builds[2],
+            BuildEvent {
+                frame: 20,
+                kind: BuildKind::Tech,
+                id: 1
+            }
+        );
+        assert_eq!(stats[1].units, vec![(7, 2)]);
+    }
+}
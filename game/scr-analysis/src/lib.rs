@@ -346,6 +346,11 @@ impl<'e> Analysis<'e> {
         self.0.dat(dat)
     }
 
+    /// Same as `dat_table`, but as a plain (address, entry_size) pair.
+    pub fn dat_table_address(&mut self, dat: DatType) -> Option<(Operand<'e>, u32)> {
+        self.0.dat(dat).map(|x| (x.address, x.entry_size))
+    }
+
     pub fn allocator(&mut self) -> Option<Operand<'e>> {
         self.0.allocator()
     }
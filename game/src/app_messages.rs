@@ -87,15 +87,38 @@ pub struct GameResults {
     pub time_ms: u32,
     pub results: HashMap<u32, GamePlayerResult>,
     pub network_stalls: NetworkStallInfo,
+    pub timings: GameTimings,
+}
+
+/// All values other than `count` are in microseconds.
+#[derive(Debug, Default, Serialize)]
+pub struct TimingSummary {
+    pub count: u32,
+    pub mean: u32,
+    pub p50: u32,
+    pub p90: u32,
+    pub p99: u32,
+    pub max: u32,
+}
+
+#[derive(Debug, Serialize)]
+#[serde(rename_all = "camelCase")]
+pub struct GameTimings {
+    pub send_latency: TimingSummary,
+    pub receive_latency: TimingSummary,
+    pub step_replay_commands: TimingSummary,
+    pub after_step_game: TimingSummary,
+    pub frame_time: TimingSummary,
 }
 
 #[derive(Serialize)]
 #[serde(rename_all = "camelCase")]
-pub struct GameResultsReport {
+pub struct GameResultsReport<'a> {
     pub user_id: u32,
     pub result_code: String,
     pub time: u32,
     pub player_results: Vec<(u32, GamePlayerResult)>,
+    pub timings: &'a GameTimings,
 }
 
 #[derive(Serialize)]
@@ -227,6 +250,18 @@ pub struct Route {
     pub server: RallyPointServer,
     pub route_id: String,
     pub player_id: u32,
+    /// Second route to the same player on a different server, if the server has enabled
+    /// redundant routing. Packets get sent over both routes.
+    #[serde(default)]
+    pub backup: Option<BackupRoute>,
+}
+
+#[derive(Deserialize, Debug)]
+#[serde(rename_all = "camelCase")]
+pub struct BackupRoute {
+    pub server: RallyPointServer,
+    pub route_id: String,
+    pub player_id: u32,
 }
 
 #[derive(Deserialize, Clone, Debug)]
@@ -37,6 +37,8 @@ pub trait Bw: Sync + Send {
     /// Guaranteed to be called before any of BW's code is ran.
     fn set_settings(&self, settings: &Settings);
     unsafe fn run_game_loop(&self);
+    /// Starts reading files that game init is expected to need on background threads.
+    fn prefetch_game_files(&'static self, tileset: u16);
     unsafe fn clean_up_for_exit(&self);
     unsafe fn init_sprites(&self);
     unsafe fn remaining_game_init(&self, local_player_name: &str);
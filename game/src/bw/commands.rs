@@ -34,6 +34,40 @@ pub fn command_length(data: &[u8], command_lengths: &[u32]) -> Option<usize> {
     }
 }
 
+/// Commands of a single frame in replay command data.
+pub struct ReplayFrame<'a> {
+    pub frame: u32,
+    // (u8 storm_player, u8 command[...]) pairs repeated.
+    // (Command length must be known from the data)
+    commands: &'a [u8],
+}
+
+/// Replay command data is in format
+/// u32 frame, u8 length, { u8 storm_player, u8 cmd[] }[length]
+/// Repeated for each frame in replay, if the commands don't fit in a single frame
+/// then there can be repeated blocks with equal frame number.
+pub fn replay_next_frame<'a>(input: &'a [u8]) -> Option<(ReplayFrame<'a>, &'a [u8])> {
+    let &commands_len = input.get(4)?;
+    let frame = LittleEndian::read_u32(input.get(..4)?);
+    let rest = input.get(5..)?;
+    let commands = rest.get(..commands_len as usize)?;
+    let rest = rest.get(commands_len as usize..)?;
+    Some((ReplayFrame { frame, commands }, rest))
+}
+
+impl<'a> ReplayFrame<'a> {
+    /// Returns (storm_player, command)
+    pub fn next_command(&mut self, command_lengths: &[u32]) -> Option<(u8, &'a [u8])> {
+        let player = *self.commands.get(0)?;
+        let data = self.commands.get(1..)?;
+        let length = command_length(data, command_lengths)?;
+        let command = data.get(..length)?;
+        let rest = data.get(length..)?;
+        self.commands = rest;
+        Some((player, command))
+    }
+}
+
 /// Splits a byte slice that may contain many commands to slices of individual commands.
 pub fn iter_commands<'a>(
     slice: &'a [u8],
@@ -225,6 +259,29 @@ mod test {
         assert_eq!(&*filter_invalid_commands(data, true, false, LENGTHS), expected_bad);
     }
 
+    #[test]
+    fn test_replay_frames() {
+        let data = &[
+            0x01, 0x00, 0x00, 0x00, 0x06,
+            0x00, 0x20, 0xff, 0xff,
+            0x01, 0x05,
+            0x10, 0x00, 0x00, 0x00, 0x02,
+            0x02, 0x37,
+            0x10, 0x00, 0x00, 0x00, 0x03,
+        ];
+        let (mut frame, rest) = replay_next_frame(data).unwrap();
+        assert_eq!(frame.frame, 1);
+        assert_eq!(frame.next_command(LENGTHS).unwrap(), (0, &[0x20, 0xff, 0xff][..]));
+        assert_eq!(frame.next_command(LENGTHS).unwrap(), (1, &[0x05][..]));
+        assert!(frame.next_command(LENGTHS).is_none());
+        let (mut frame, rest) = replay_next_frame(rest).unwrap();
+        assert_eq!(frame.frame, 0x10);
+        // Sync command is longer than the frame
+        assert!(frame.next_command(LENGTHS).is_none());
+        // Truncated
+        assert!(replay_next_frame(rest).is_none());
+    }
+
     #[test]
     fn test_iter_commands() {
         let data = &[
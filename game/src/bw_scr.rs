@@ -14,6 +14,8 @@ use smallvec::SmallVec;
 use winapi::um::errhandlingapi::SetLastError;
 use winapi::um::libloaderapi::GetModuleHandleW;
 
+use analysis_cache::CachedAnalysis;
+use parallel_analysis::ParallelAnalysis;
 use scr_analysis::{scarf, DatType};
 use sdf_cache::{InitSdfCache, SdfCache};
 use shader_replaces::ShaderReplaces;
@@ -28,10 +30,14 @@ use crate::snp;
 use crate::windows;
 use crate::{game_thread, GameThreadMessage};
 
+mod analysis_cache;
 mod bw_hash_table;
 mod dialog_hook;
 mod file_hook;
+mod file_prefetch;
 mod game;
+mod parallel_analysis;
+mod path_rules;
 mod pe_image;
 mod sdf_cache;
 mod shader_replaces;
@@ -138,7 +144,6 @@ pub struct BwScr {
     mainmenu_entry_hook: scarf::VirtualAddress,
     load_snp_list: scarf::VirtualAddress,
     start_udp_server: scarf::VirtualAddress,
-    font_cache_render_ascii: scarf::VirtualAddress,
     ttf_render_sdf: scarf::VirtualAddress,
     step_io: scarf::VirtualAddress,
     init_game_data: scarf::VirtualAddress,
@@ -172,6 +177,7 @@ pub struct BwScr {
     open_replay_files: Mutex<Vec<SendPtr<*mut c_void>>>,
     is_carbot: AtomicBool,
     show_skins: AtomicBool,
+    file_prefetch: file_prefetch::FilePrefetch,
     visualize_network_stalls: AtomicBool,
     is_processing_game_commands: AtomicBool,
     /// True if the network is currently stalled (updated whenever `step_network` is called).
@@ -991,115 +997,247 @@ impl BwScr {
         let mut analysis = scr_analysis::Analysis::new(&binary, &analysis_ctx);
 
         let ctx: scarf::OperandCtx<'static> = Box::leak(Box::new(scarf::OperandContext::new()));
-        let game = analysis.game().ok_or("Game")?;
-        let game_data = analysis.game_data().ok_or("Game Data")?;
-        let players = analysis.players().ok_or("Players")?;
-        let chk_players = analysis.chk_init_players().ok_or("CHK players")?;
+        let (image, exe_hash) = unsafe {
+            let base = GetModuleHandleW(null()) as *const u8;
+            let image = analysis_cache::ImageInfo {
+                base: base as u32,
+                size: pe_image::image_size(base),
+            };
+            (image, pe_image::hash_pe_header(base))
+        };
+        let mut analysis = CachedAnalysis::new(&mut analysis, ctx, image, exe_hash, exe_build);
+        let parallel = ParallelAnalysis::new(&binary, image);
+        analysis.set_parallel(&parallel);
+        let result = std::thread::scope(|scope| {
+            parallel.spawn_workers(scope);
+            let result = match BwScr::from_analysis(&mut analysis, ctx, exe_build) {
+                Err(BwInitError::AnalysisFail(e)) if analysis.used_cache() => {
+                    warn!(
+                        "Initialization failed with cached analysis ({}), analyzing again",
+                        e
+                    );
+                    analysis.discard_loaded();
+                    BwScr::from_analysis(&mut analysis, ctx, exe_build)
+                }
+                result => result,
+            };
+            // Nothing should be left running on success, but on failure there's no
+            // need to wait for the rest of the analysis.
+            parallel.cancel();
+            result
+        });
+        parallel.log_timings();
+        if result.is_ok() {
+            analysis.save();
+        }
+        result
+    }
+
+    fn from_analysis(
+        analysis: &mut CachedAnalysis<'_, '_>,
+        ctx: scarf::OperandCtx<'static>,
+        exe_build: u32,
+    ) -> Result<BwScr, BwInitError> {
+        let game = analysis.get("game", |a| a.game()).ok_or("Game")?;
+        let game_data = analysis
+            .get("game_data", |a| a.game_data())
+            .ok_or("Game Data")?;
+        let players = analysis.get("players", |a| a.players()).ok_or("Players")?;
+        let chk_players = analysis
+            .get("chk_init_players", |a| a.chk_init_players())
+            .ok_or("CHK players")?;
         let init_chk_player_types = analysis
-            .original_chk_player_types()
+            .get("original_chk_player_types", |a| {
+                a.original_chk_player_types()
+            })
             .ok_or("Orig CHK player types")?;
-        let storm_players = analysis.storm_players().ok_or("Storm players")?;
+        let storm_players = analysis
+            .get("storm_players", |a| a.storm_players())
+            .ok_or("Storm players")?;
         let init_network_player_info = analysis
-            .init_net_player()
+            .get("init_net_player", |a| a.init_net_player())
             .ok_or("init_network_player_info")?;
-        let storm_player_flags = analysis.net_player_flags().ok_or("Storm player flags")?;
-        let step_network = analysis.step_network().ok_or("step_network")?;
-        let lobby_state = analysis.lobby_state().ok_or("Lobby state")?;
-        let is_multiplayer = analysis.is_multiplayer().ok_or("is_multiplayer")?;
-        let select_map_entry = analysis.select_map_entry().ok_or("select_map_entry")?;
-        let game_state = analysis.game_state().ok_or("Game state")?;
-        let mainmenu_entry_hook = analysis.mainmenu_entry_hook().ok_or("Entry hook")?;
-        let game_loop = analysis.game_loop().ok_or("Game loop")?;
-        let init_map_from_path = analysis.init_map_from_path().ok_or("init_map_from_path")?;
-        let join_game = analysis.join_game().ok_or("join_game")?;
-        let init_sprites = analysis.load_images().ok_or("Init sprites")?;
-        let init_real_time_lighting = analysis.init_real_time_lighting();
-        let sprites_inited = analysis.images_loaded().ok_or("Sprites inited")?;
-        let init_game_network = analysis.init_game_network().ok_or("Init game network")?;
+        let storm_player_flags = analysis
+            .get("net_player_flags", |a| a.net_player_flags())
+            .ok_or("Storm player flags")?;
+        let step_network = analysis
+            .get("step_network", |a| a.step_network())
+            .ok_or("step_network")?;
+        let lobby_state = analysis
+            .get("lobby_state", |a| a.lobby_state())
+            .ok_or("Lobby state")?;
+        let is_multiplayer = analysis
+            .get("is_multiplayer", |a| a.is_multiplayer())
+            .ok_or("is_multiplayer")?;
+        let select_map_entry = analysis
+            .get("select_map_entry", |a| a.select_map_entry())
+            .ok_or("select_map_entry")?;
+        let game_state = analysis
+            .get("game_state", |a| a.game_state())
+            .ok_or("Game state")?;
+        let mainmenu_entry_hook = analysis
+            .get("mainmenu_entry_hook", |a| a.mainmenu_entry_hook())
+            .ok_or("Entry hook")?;
+        let game_loop = analysis
+            .get("game_loop", |a| a.game_loop())
+            .ok_or("Game loop")?;
+        let init_map_from_path = analysis
+            .get("init_map_from_path", |a| a.init_map_from_path())
+            .ok_or("init_map_from_path")?;
+        let join_game = analysis
+            .get("join_game", |a| a.join_game())
+            .ok_or("join_game")?;
+        let init_sprites = analysis
+            .get("load_images", |a| a.load_images())
+            .ok_or("Init sprites")?;
+        let init_real_time_lighting =
+            analysis.get("init_real_time_lighting", |a| a.init_real_time_lighting());
+        let sprites_inited = analysis
+            .get("images_loaded", |a| a.images_loaded())
+            .ok_or("Sprites inited")?;
+        let init_game_network = analysis
+            .get("init_game_network", |a| a.init_game_network())
+            .ok_or("Init game network")?;
         let process_lobby_commands = analysis
-            .process_lobby_commands()
+            .get("process_lobby_commands", |a| a.process_lobby_commands())
             .ok_or("Process lobby commands")?;
-        let send_command = analysis.send_command().ok_or("send_command")?;
-        let local_player_id = analysis.local_player_id().ok_or("Local player id")?;
-        let local_storm_id = analysis.local_storm_player_id().ok_or("Local storm id")?;
+        let send_command = analysis
+            .get("send_command", |a| a.send_command())
+            .ok_or("send_command")?;
+        let local_player_id = analysis
+            .get("local_player_id", |a| a.local_player_id())
+            .ok_or("Local player id")?;
+        let local_storm_id = analysis
+            .get("local_storm_player_id", |a| a.local_storm_player_id())
+            .ok_or("Local storm id")?;
         let local_unique_player_id = analysis
-            .local_unique_player_id()
+            .get("local_unique_player_id", |a| a.local_unique_player_id())
             .ok_or("Local unique player id")?;
-        let command_user = analysis.command_user().ok_or("Command user")?;
+        let command_user = analysis
+            .get("command_user", |a| a.command_user())
+            .ok_or("Command user")?;
         let unique_command_user = analysis
-            .unique_command_user()
+            .get("unique_command_user", |a| a.unique_command_user())
             .ok_or("Unique command user")?;
-        let storm_command_user = analysis.storm_command_user().ok_or("Storm command user")?;
-        let is_network_ready = analysis.network_ready().ok_or("Is network ready")?;
-        let net_user_latency = analysis.net_user_latency().ok_or("Net user latency")?;
+        let storm_command_user = analysis
+            .get("storm_command_user", |a| a.storm_command_user())
+            .ok_or("Storm command user")?;
+        let is_network_ready = analysis
+            .get("network_ready", |a| a.network_ready())
+            .ok_or("Is network ready")?;
+        let net_user_latency = analysis
+            .get("net_user_latency", |a| a.net_user_latency())
+            .ok_or("Net user latency")?;
         let net_format_turn_rate = analysis
-            .net_format_turn_rate()
+            .get("net_format_turn_rate", |a| a.net_format_turn_rate())
             .ok_or("net_format_turn_rate")?;
-        let net_player_to_game = analysis.net_player_to_game().ok_or("Net player to game")?;
+        let net_player_to_game = analysis
+            .get("net_player_to_game", |a| a.net_player_to_game())
+            .ok_or("Net player to game")?;
         let net_player_to_unique = analysis
-            .net_player_to_unique()
+            .get("net_player_to_unique", |a| a.net_player_to_unique())
             .ok_or("Net player to unique")?;
-        let choose_snp = analysis.choose_snp().ok_or("choose_snp")?;
-        let local_player_name = analysis.local_player_name().ok_or("Local player name")?;
-        let fonts = analysis.fonts().ok_or("Fonts")?;
+        let choose_snp = analysis
+            .get("choose_snp", |a| a.choose_snp())
+            .ok_or("choose_snp")?;
+        let local_player_name = analysis
+            .get("local_player_name", |a| a.local_player_name())
+            .ok_or("Local player name")?;
+        let fonts = analysis.get("fonts", |a| a.fonts()).ok_or("Fonts")?;
         let init_storm_networking = analysis
-            .init_storm_networking()
+            .get("init_storm_networking", |a| a.init_storm_networking())
             .ok_or("init_storm_networking")?;
-        let load_snp_list = analysis.load_snp_list().ok_or("load_snp_list")?;
-        let start_udp_server = analysis.start_udp_server().ok_or("start_udp_server")?;
-        let font_cache_render_ascii = analysis
-            .font_cache_render_ascii()
-            .ok_or("font_cache_render_ascii")?;
-        let ttf_malloc = analysis.ttf_malloc().ok_or("ttf_malloc")?;
-        let ttf_render_sdf = analysis.ttf_render_sdf().ok_or("ttf_render_sdf")?;
+        let load_snp_list = analysis
+            .get("load_snp_list", |a| a.load_snp_list())
+            .ok_or("load_snp_list")?;
+        let start_udp_server = analysis
+            .get("start_udp_server", |a| a.start_udp_server())
+            .ok_or("start_udp_server")?;
+        let ttf_malloc = analysis
+            .get("ttf_malloc", |a| a.ttf_malloc())
+            .ok_or("ttf_malloc")?;
+        let ttf_render_sdf = analysis
+            .get("ttf_render_sdf", |a| a.ttf_render_sdf())
+            .ok_or("ttf_render_sdf")?;
         let lobby_create_callback_offset = analysis
-            .create_game_dialog_vtbl_on_multiplayer_create()
+            .get("create_game_dialog_vtbl_on_multiplayer_create", |a| {
+                a.create_game_dialog_vtbl_on_multiplayer_create()
+            })
             .ok_or("Lobby create callback vtable offset")?;
-        let process_game_commands = analysis.process_commands().ok_or("process_game_commands")?;
-        let game_command_lengths = analysis.command_lengths();
-        let snet_recv_packets = analysis.snet_recv_packets().ok_or("snet_recv_packets")?;
-        let snet_send_packets = analysis.snet_send_packets().ok_or("snet_send_packets")?;
-        let step_io = analysis.step_io().ok_or("step_io")?;
-        let init_game_data = analysis.init_game().ok_or("init_game_data")?;
-        let init_unit_data = analysis.init_units().ok_or("init_unit_data")?;
+        let process_game_commands = analysis
+            .get("process_commands", |a| a.process_commands())
+            .ok_or("process_game_commands")?;
+        let game_command_lengths = analysis.get("command_lengths", |a| a.command_lengths());
+        let snet_recv_packets = analysis
+            .get("snet_recv_packets", |a| a.snet_recv_packets())
+            .ok_or("snet_recv_packets")?;
+        let snet_send_packets = analysis
+            .get("snet_send_packets", |a| a.snet_send_packets())
+            .ok_or("snet_send_packets")?;
+        let step_io = analysis.get("step_io", |a| a.step_io()).ok_or("step_io")?;
+        let init_game_data = analysis
+            .get("init_game", |a| a.init_game())
+            .ok_or("init_game_data")?;
+        let init_unit_data = analysis
+            .get("init_units", |a| a.init_units())
+            .ok_or("init_unit_data")?;
         let step_replay_commands = analysis
-            .step_replay_commands()
+            .get("step_replay_commands", |a| a.step_replay_commands())
             .ok_or("step_replay_commands")?;
 
         let prism_pixel_shaders = analysis
-            .prism_pixel_shaders()
+            .get("prism_pixel_shaders", |a| a.prism_pixel_shaders())
             .ok_or("Prism pixel shaders")?;
-        let prism_renderer_vtable = analysis.prism_renderer_vtable().ok_or("Prism renderer")?;
-
-        let first_active_unit = analysis.first_active_unit().ok_or("first_active_unit")?;
-        let client_selection = analysis.client_selection().ok_or("client_selection")?;
-        let sprite_x = analysis.sprite_x().ok_or("sprite_x")?;
-        let sprite_y = analysis.sprite_y().ok_or("sprite_y")?;
+        let prism_renderer_vtable = analysis
+            .get("prism_renderer_vtable", |a| a.prism_renderer_vtable())
+            .ok_or("Prism renderer")?;
+
+        let first_active_unit = analysis
+            .get("first_active_unit", |a| a.first_active_unit())
+            .ok_or("first_active_unit")?;
+        let client_selection = analysis
+            .get("client_selection", |a| a.client_selection())
+            .ok_or("client_selection")?;
+        let sprite_x = analysis
+            .get("sprite_x", |a| a.sprite_x())
+            .ok_or("sprite_x")?;
+        let sprite_y = analysis
+            .get("sprite_y", |a| a.sprite_y())
+            .ok_or("sprite_y")?;
         let sprites_by_y_tile = analysis
-            .sprites_by_y_tile_start()
+            .get("sprites_by_y_tile_start", |a| a.sprites_by_y_tile_start())
             .ok_or("sprites_by_y_tile_start")?;
         let sprites_by_y_tile_end = analysis
-            .sprites_by_y_tile_end()
+            .get("sprites_by_y_tile_end", |a| a.sprites_by_y_tile_end())
             .ok_or("sprites_by_y_tile_end")?;
-        let step_game = analysis.step_game().ok_or("step_game")?;
+        let step_game = analysis
+            .get("step_game", |a| a.step_game())
+            .ok_or("step_game")?;
         let free_sprites = LinkedList {
             start: Value::new(
                 ctx,
-                analysis.first_free_sprite().ok_or("first_free_sprite")?,
+                analysis
+                    .get("first_free_sprite", |a| a.first_free_sprite())
+                    .ok_or("first_free_sprite")?,
+            ),
+            end: Value::new(
+                ctx,
+                analysis
+                    .get("last_free_sprite", |a| a.last_free_sprite())
+                    .ok_or("last_free_sprite")?,
             ),
-            end: Value::new(ctx, analysis.last_free_sprite().ok_or("last_free_sprite")?),
         };
         let active_fow_sprites = LinkedList {
             start: Value::new(
                 ctx,
                 analysis
-                    .first_active_fow_sprite()
+                    .get("first_active_fow_sprite", |a| a.first_active_fow_sprite())
                     .ok_or("first_active_fow_sprite")?,
             ),
             end: Value::new(
                 ctx,
                 analysis
-                    .last_active_fow_sprite()
+                    .get("last_active_fow_sprite", |a| a.last_active_fow_sprite())
                     .ok_or("last_active_fow_sprite")?,
             ),
         };
@@ -1107,61 +1245,108 @@ impl BwScr {
             start: Value::new(
                 ctx,
                 analysis
-                    .first_free_fow_sprite()
+                    .get("first_free_fow_sprite", |a| a.first_free_fow_sprite())
                     .ok_or("first_free_fow_sprite")?,
             ),
             end: Value::new(
                 ctx,
                 analysis
-                    .last_free_fow_sprite()
+                    .get("last_free_fow_sprite", |a| a.last_free_fow_sprite())
                     .ok_or("last_free_fow_sprite")?,
             ),
         };
         let free_images = LinkedList {
-            start: Value::new(ctx, analysis.first_free_image().ok_or("first_free_image")?),
-            end: Value::new(ctx, analysis.last_free_image().ok_or("last_free_image")?),
+            start: Value::new(
+                ctx,
+                analysis
+                    .get("first_free_image", |a| a.first_free_image())
+                    .ok_or("first_free_image")?,
+            ),
+            end: Value::new(
+                ctx,
+                analysis
+                    .get("last_free_image", |a| a.last_free_image())
+                    .ok_or("last_free_image")?,
+            ),
         };
         let free_orders = LinkedList {
-            start: Value::new(ctx, analysis.first_free_order().ok_or("first_free_order")?),
-            end: Value::new(ctx, analysis.last_free_order().ok_or("last_free_order")?),
+            start: Value::new(
+                ctx,
+                analysis
+                    .get("first_free_order", |a| a.first_free_order())
+                    .ok_or("first_free_order")?,
+            ),
+            end: Value::new(
+                ctx,
+                analysis
+                    .get("last_free_order", |a| a.last_free_order())
+                    .ok_or("last_free_order")?,
+            ),
         };
 
-        let replay_data = analysis.replay_data().ok_or("replay_data")?;
-        let replay_header = analysis.replay_header().ok_or("replay_header")?;
-        let enable_rng = analysis.enable_rng().ok_or("Enable RNG")?;
-        let replay_visions = analysis.replay_visions().ok_or("replay_visions")?;
+        let replay_data = analysis
+            .get("replay_data", |a| a.replay_data())
+            .ok_or("replay_data")?;
+        let replay_header = analysis
+            .get("replay_header", |a| a.replay_header())
+            .ok_or("replay_header")?;
+        let enable_rng = analysis
+            .get("enable_rng", |a| a.enable_rng())
+            .ok_or("Enable RNG")?;
+        let replay_visions = analysis
+            .get("replay_visions", |a| a.replay_visions())
+            .ok_or("replay_visions")?;
         let replay_show_entire_map = analysis
-            .replay_show_entire_map()
+            .get("replay_show_entire_map", |a| a.replay_show_entire_map())
             .ok_or("replay_show_entire_map")?;
-        let allocator = analysis.allocator().ok_or("allocator")?;
+        let allocator = analysis
+            .get("allocator", |a| a.allocator())
+            .ok_or("allocator")?;
         let allocated_order_count = analysis
-            .allocated_order_count()
+            .get("allocated_order_count", |a| a.allocated_order_count())
             .ok_or("allocated_order_count")?;
-        let order_limit = analysis.order_limit().ok_or("order_limit")?;
-        let replay_bfix = analysis.replay_bfix();
-        let replay_gcfg = analysis.replay_gcfg();
+        let order_limit = analysis
+            .get("order_limit", |a| a.order_limit())
+            .ok_or("order_limit")?;
+        let replay_bfix = analysis.get("replay_bfix", |a| a.replay_bfix());
+        let replay_gcfg = analysis.get("replay_gcfg", |a| a.replay_gcfg());
         let prepare_issue_order = analysis
-            .prepare_issue_order()
+            .get("prepare_issue_order", |a| a.prepare_issue_order())
             .ok_or("prepare_issue_order")?;
         let create_game_multiplayer = analysis
-            .create_game_multiplayer()
+            .get("create_game_multiplayer", |a| a.create_game_multiplayer())
             .ok_or("create_game_multiplayer")?;
-        let spawn_dialog = analysis.spawn_dialog().ok_or("spawn_dialog")?;
-        let step_game_logic = analysis.step_game_logic().ok_or("step_game_logic")?;
-        let anti_troll = analysis.anti_troll();
-        let units = analysis.units().ok_or("units")?;
-        let map_width_pixels = analysis.map_width_pixels().ok_or("map_width_pixels")?;
-        let screen_x = analysis.screen_x().ok_or("screen_x")?;
-        let screen_y = analysis.screen_y().ok_or("screen_y")?;
+        let spawn_dialog = analysis
+            .get("spawn_dialog", |a| a.spawn_dialog())
+            .ok_or("spawn_dialog")?;
+        let step_game_logic = analysis
+            .get("step_game_logic", |a| a.step_game_logic())
+            .ok_or("step_game_logic")?;
+        let anti_troll = analysis.get("anti_troll", |a| a.anti_troll());
+        let units = analysis.get("units", |a| a.units()).ok_or("units")?;
+        let map_width_pixels = analysis
+            .get("map_width_pixels", |a| a.map_width_pixels())
+            .ok_or("map_width_pixels")?;
+        let screen_x = analysis
+            .get("screen_x", |a| a.screen_x())
+            .ok_or("screen_x")?;
+        let screen_y = analysis
+            .get("screen_y", |a| a.screen_y())
+            .ok_or("screen_y")?;
         let game_screen_width_bwpx = analysis
-            .game_screen_width_bwpx()
+            .get("game_screen_width_bwpx", |a| a.game_screen_width_bwpx())
             .ok_or("game_screen_width_bwpx")?;
-        let move_screen = analysis.move_screen().ok_or("move_screen")?;
+        let move_screen = analysis
+            .get("move_screen", |a| a.move_screen())
+            .ok_or("move_screen")?;
         let update_game_screen_size = analysis
-            .update_game_screen_size()
+            .get("update_game_screen_size", |a| a.update_game_screen_size())
             .ok_or("update_game_screen_size")?;
 
-        let uses_new_join_param_variant = match analysis.join_param_variant_type_offset() {
+        let uses_new_join_param_variant = match analysis
+            .get("join_param_variant_type_offset", |a| {
+                a.join_param_variant_type_offset()
+            }) {
             Some(0) => false,
             #[cfg(target_arch = "x86")]
             Some(0x20) => true,
@@ -1170,19 +1355,23 @@ impl BwScr {
             _ => return Err(BwInitError::AnalysisFail("join_param_variant_layout")),
         };
 
-        let starcraft_tls_index = analysis.get_tls_index().ok_or("TLS index")?;
+        let starcraft_tls_index = analysis
+            .get("get_tls_index", |a| a.get_tls_index())
+            .ok_or("TLS index")?;
 
         let disable_hd = match std::env::var_os("SB_NO_HD") {
             Some(s) => s == "1",
             None => false,
         };
         let open_file = analysis
-            .file_hook()
+            .get("file_hook", |a| a.file_hook())
             .ok_or("open_file (Required due to SB_NO_HD)")?;
 
-        let replay_minimap_patch = analysis.replay_minimap_unexplored_fog_patch();
+        let replay_minimap_patch = analysis.get("replay_minimap_unexplored_fog_patch", |a| {
+            a.replay_minimap_unexplored_fog_patch()
+        });
 
-        let status_screen_funcs = analysis.status_screen_funcs();
+        let status_screen_funcs = analysis.get("status_screen_funcs", |a| a.status_screen_funcs());
         let original_status_screen_update = if let Some(arr) = status_screen_funcs {
             unsafe {
                 let arr = arr.0 as *const bw::UnitStatusFunc;
@@ -1192,7 +1381,7 @@ impl BwScr {
             Vec::new()
         };
 
-        init_bw_dat(&mut analysis)?;
+        init_bw_dat(analysis)?;
 
         debug!("Found all necessary BW data");
 
@@ -1279,7 +1468,6 @@ impl BwScr {
             mainmenu_entry_hook,
             open_file,
             lobby_create_callback_offset,
-            font_cache_render_ascii,
             ttf_render_sdf,
             step_replay_commands,
             step_game,
@@ -1309,6 +1497,7 @@ impl BwScr {
             open_replay_files: Mutex::new(Vec::new()),
             is_carbot: AtomicBool::new(false),
             show_skins: AtomicBool::new(false),
+            file_prefetch: file_prefetch::FilePrefetch::new(),
             visualize_network_stalls: AtomicBool::new(false),
             is_processing_game_commands: AtomicBool::new(false),
             in_network_stall: AtomicBool::new(false),
@@ -1478,6 +1667,8 @@ impl BwScr {
             StepGame,
             move |orig| {
                 orig();
+                // Game init has been done once the first frame gets stepped
+                self.file_prefetch.finish();
                 game_thread::after_step_game();
             },
             address,
@@ -2096,16 +2287,14 @@ impl BwScr {
         };
         drop(open_files);
 
-        if crate::replay::has_replay_magic_bytes(handle) {
-            if let Err(e) = crate::replay::add_shieldbattery_data(
-                handle,
-                self,
-                self.exe_build,
-                game_thread::setup_info(),
-                game_thread::player_id_mapping(),
-            ) {
-                error!("Unable to write extended replay data: {}", e);
-            }
+        if let Err(e) = crate::replay::add_shieldbattery_data(
+            handle,
+            self,
+            self.exe_build,
+            game_thread::setup_info(),
+            game_thread::player_id_mapping(),
+        ) {
+            error!("Unable to write extended replay data: {}", e);
         }
     }
 
@@ -2236,6 +2425,10 @@ impl bw::Bw for BwScr {
         settings_file_path.push_str(&settings.settings_file_path);
     }
 
+    fn prefetch_game_files(&'static self, tileset: u16) {
+        self.file_prefetch.start(tileset);
+    }
+
     unsafe fn run_game_loop(&self) {
         loop {
             self.reset_state_for_game_init();
@@ -2244,6 +2437,11 @@ impl bw::Bw for BwScr {
             // Replay seeking exits game loop and sets a bool for it to restart,
             // we don't have access to that bool but we hook the replay seek
             // command and set our own
+            //
+            // The restarted game then simulates every frame up to the seek target. Seeking can't
+            // start from a snapshot of an earlier frame instead, as the game state lives in SC:R's
+            // globals and heap objects (units, sprites, pathing, AI, RNG, ...) which we have no
+            // way to save or restore, and restoring only part of it would desync the replay.
             if self.is_replay_seeking.load(Ordering::Relaxed) == false {
                 break;
             }
@@ -2684,34 +2882,39 @@ impl bw::Bw for BwScr {
     }
 }
 
-fn init_bw_dat(analysis: &mut scr_analysis::Analysis<'_>) -> Result<(), &'static str> {
+fn init_bw_dat(analysis: &mut CachedAnalysis<'_, '_>) -> Result<(), &'static str> {
     unsafe fn copy_dat_table(
-        table: &scr_analysis::DatTablePtr<'_>,
+        table: &(scarf::Operand<'static>, u32),
         out: &mut Vec<bw::DatTable>,
         entries: usize,
     ) {
         // Dat tables in SC:R memory have at least one extra field, bw_dat expects
         // 1.16.1 compatible format.
-        let mut value = resolve_operand(table.address, &[]) as *const u8;
+        let (address, entry_size) = *table;
+        let mut value = resolve_operand(address, &[]) as *const u8;
         for _ in 0..entries {
             out.push(bw::DatTable {
                 data: *(value as *const _),
                 entry_size: *(value.add(4) as *const u32),
                 entries: *(value.add(8) as *const u32),
             });
-            value = value.add(table.entry_size as usize);
+            value = value.add(entry_size as usize);
         }
     }
 
-    let units = analysis.dat_table(DatType::Units).ok_or("units.dat")?;
-    let weapons = analysis.dat_table(DatType::Weapons).ok_or("weapons.dat")?;
-    let upgrades = analysis
-        .dat_table(DatType::Upgrades)
-        .ok_or("upgrades.dat")?;
-    let techdata = analysis
-        .dat_table(DatType::TechData)
-        .ok_or("techdata.dat")?;
-    let orders = analysis.dat_table(DatType::Orders).ok_or("orders.dat")?;
+    fn dat_table(
+        analysis: &mut CachedAnalysis<'_, '_>,
+        key: &'static str,
+        dat: DatType,
+    ) -> Option<(scarf::Operand<'static>, u32)> {
+        analysis.get(key, |a| a.dat_table_address(dat))
+    }
+
+    let units = dat_table(analysis, "units_dat", DatType::Units).ok_or("units.dat")?;
+    let weapons = dat_table(analysis, "weapons_dat", DatType::Weapons).ok_or("weapons.dat")?;
+    let upgrades = dat_table(analysis, "upgrades_dat", DatType::Upgrades).ok_or("upgrades.dat")?;
+    let techdata = dat_table(analysis, "techdata_dat", DatType::TechData).ok_or("techdata.dat")?;
+    let orders = dat_table(analysis, "orders_dat", DatType::Orders).ok_or("orders.dat")?;
     let mut out = Vec::with_capacity(0x36 + 0x18 + 0xc + 0xb + 0x13);
     unsafe {
         copy_dat_table(&units, &mut out, 0x36);
@@ -2933,38 +3136,53 @@ fn copy_file_hook(
             }
         }
 
-        let mut i = 2;
-        let mut filename = format!("{}.rep", filename_base);
-        // Add (2) (3) etc if filename already exists.
-        // Since the filename contains a timestamp, this should only happen on super-rare cases
-        // if two games are being ran at a same time in SB development, but losing one of
-        // those replays wouldn't be nice =)
-        loop {
-            path.push(&filename);
-            if !path.exists() {
-                break;
+        // Copying is done on the replay I/O thread once the Sbat section has been added
+        // to LastReplay.rep, so that BW doesn't have to wait for it. BW is told that the copy
+        // succeeded right away, same as when no suitable filename can be found.
+        let src_name: Vec<u16> = src_name_slice.iter().copied().chain(Some(0)).collect();
+        crate::replay::run_after_pending_writes(move || {
+            let mut i = 2;
+            let mut filename = format!("{}.rep", filename_base);
+            // Add (2) (3) etc if filename already exists.
+            // Since the filename contains a timestamp, this should only happen on super-rare
+            // cases if two games are being ran at a same time in SB development, but losing one
+            // of those replays wouldn't be nice =)
+            loop {
+                path.push(&filename);
+                if !path.exists() {
+                    break;
+                }
+                path.pop();
+                if i > 32 {
+                    // ???
+                    error!(
+                        "Couldn't find suitable filename for {} / {}",
+                        path.display(),
+                        filename_base,
+                    );
+                    return;
+                }
+                filename = format!("{} ({}).rep", filename_base, i);
+                i += 1;
             }
-            path.pop();
-            if i > 32 {
-                // ???
+
+            let result = orig(
+                src_name.as_ptr(),
+                windows::winapi_str(&path).as_ptr(),
+                fail_if_exist,
+            );
+            if result != 0 {
+                send_game_msg_to_async(GameThreadMessage::ReplaySaved(path));
+            } else {
                 error!(
-                    "Couldn't find suitable filename for {} / {}",
+                    "Couldn't copy replay to {}: {}",
                     path.display(),
-                    filename_base,
+                    std::io::Error::last_os_error(),
                 );
-                // Return success anyway.
-                return 1;
             }
-            filename = format!("{} ({}).rep", filename_base, i);
-            i += 1;
-        }
-
-        let result = orig(src_name, windows::winapi_str(&path).as_ptr(), fail_if_exist);
-        if result != 0 {
-            send_game_msg_to_async(GameThreadMessage::ReplaySaved(path));
-        }
+        });
 
-        result
+        1
     }
 }
 
@@ -3097,7 +3315,6 @@ mod hooks {
         !0 => EntryPoint();
         !0 => OpenFile(*mut scr::FileHandle, *const u8, *const scr::OpenParams) ->
             *mut scr::FileHandle;
-        !0 => FontCacheRenderAscii(@ecx *mut c_void);
         !0 => Ttf_RenderSdf(
             *mut scr::TtfFont,
             f32,
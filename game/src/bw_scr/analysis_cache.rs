@@ -0,0 +1,865 @@
+//! Caches results of `scr_analysis` between launches.
+//!
+//! Analyzing the SC:R executable is the largest single cost of starting the game, and
+//! its results stay same as long as the executable (and our analysis code) does not change.
+//! After a successful analysis the results are written to `scr_analysis_cache.dat` in
+//! user data directory, keyed by a hash of the exe's PE header and the ShieldBattery version.
+//!
+//! Any value that can't be loaded from the cache falls back to running the analysis for that
+//! value; if the cache as a whole doesn't seem to match the executable, it is ignored and
+//! rewritten after the analysis.
+//!
+//! The executable may be loaded at a different base address on each launch, so addresses
+//! that point inside the image are stored relative to the image base.
+
+use std::fs;
+use std::io::{self, Write};
+use std::path::PathBuf;
+use std::time::{Duration, Instant};
+
+use byteorder::{ByteOrder, LittleEndian, WriteBytesExt};
+use fxhash::FxHashMap;
+
+use scr_analysis::scarf::{
+    ArithOpType, MemAccessSize, Operand, OperandCtx, OperandType, VirtualAddress,
+};
+use scr_analysis::{Analysis, Patch};
+
+use super::parallel_analysis::ParallelAnalysis;
+
+/// Increment whenever the encoding of cached values changes in an incompatible way.
+/// (Changes to what the analysis returns are covered by the ShieldBattery version
+/// being part of the cache key)
+const CACHE_VERSION: u32 = 1;
+const CACHE_MAGIC: u32 = 0x43414253; // 'SBAC'
+/// How many bytes are compared at each cached code address when validating the cache.
+const CODE_CHECK_LEN: usize = 16;
+/// Limit operand nesting so that a corrupted cache can't cause a stack overflow.
+const MAX_OPERAND_DEPTH: u32 = 32;
+
+// File format:
+// u32 magic
+// u32 version
+// u32 exe_hash
+// u32 exe_build
+// u32 image_base (of the process that wrote the cache)
+// u8 sb_version_len
+// u8 sb_version[sb_version_len]
+// u32 code_check_count
+// {
+//      u32 address (relative to image_base)
+//      u8 code[CODE_CHECK_LEN]
+// } code_checks[code_check_count]
+// u32 entry_count
+// {
+//      u8 key_len
+//      u8 key[key_len]
+//      u32 value_len
+//      u8 value[value_len]
+// } entries[entry_count]
+
+#[derive(Copy, Clone)]
+pub struct ImageInfo {
+    pub base: u32,
+    pub size: u32,
+}
+
+impl ImageInfo {
+    fn contains(&self, address: u64) -> bool {
+        address >= self.base as u64 && address < self.base as u64 + self.size as u64
+    }
+}
+
+pub struct CachedAnalysis<'a, 'e> {
+    analysis: &'a mut Analysis<'e>,
+    /// Context that decoded operands are created in. Same as the one `BwScr` keeps its
+    /// `Value`s in.
+    ctx: OperandCtx<'static>,
+    image: ImageInfo,
+    path: PathBuf,
+    exe_hash: u32,
+    exe_build: u32,
+    /// Entries read from disk, value bytes still encoded.
+    loaded: FxHashMap<String, Vec<u8>>,
+    /// Entries that will be written back to disk.
+    entries: Vec<(&'static str, Vec<u8>)>,
+    /// Code addresses that were encoded in `entries`, used to validate the cache on load.
+    code_addresses: Vec<u32>,
+    /// If set, values that aren't cached are first requested from here.
+    parallel: Option<&'a ParallelAnalysis<'a>>,
+    /// Time spent waiting for `parallel` to produce values.
+    parallel_wait: Duration,
+    cache_hits: u32,
+    cache_misses: u32,
+}
+
+/// A value encoded in the cache format, along with code addresses that were encoded in it.
+pub struct EncodedValue {
+    pub data: Vec<u8>,
+    pub code_addresses: Vec<u32>,
+}
+
+#[derive(Debug)]
+pub struct Unsupported;
+
+pub struct Encoder {
+    image: ImageInfo,
+    buffer: Vec<u8>,
+    code_addresses: Vec<u32>,
+}
+
+pub struct Decoder<'a> {
+    image: ImageInfo,
+    ctx: OperandCtx<'static>,
+    data: &'a [u8],
+}
+
+/// A value that analysis returns and can be stored in the cache.
+///
+/// `Output` is the value with any operands moved to the `'static` context.
+pub trait CacheValue {
+    type Output;
+    fn to_output(&self, ctx: OperandCtx<'static>) -> Self::Output;
+    fn encode(&self, out: &mut Encoder) -> Result<(), Unsupported>;
+    fn decode(input: &mut Decoder<'_>) -> Option<Self::Output>;
+}
+
+impl<'a, 'e> CachedAnalysis<'a, 'e> {
+    /// Loads the cache from disk. If loading fails or the cache is for a different executable,
+    /// all values will be analyzed and the cache is rewritten once `save` is called.
+    pub fn new(
+        analysis: &'a mut Analysis<'e>,
+        ctx: OperandCtx<'static>,
+        image: ImageInfo,
+        exe_hash: u32,
+        exe_build: u32,
+    ) -> CachedAnalysis<'a, 'e> {
+        let args = crate::parse_args();
+        let mut path = args.user_data_path.clone();
+        path.push("scr_analysis_cache.dat");
+        let mut result = CachedAnalysis {
+            analysis,
+            ctx,
+            image,
+            path,
+            exe_hash,
+            exe_build,
+            loaded: FxHashMap::default(),
+            entries: Vec::with_capacity(128),
+            code_addresses: Vec::with_capacity(64),
+            parallel: None,
+            parallel_wait: Duration::ZERO,
+            cache_hits: 0,
+            cache_misses: 0,
+        };
+        match fs::read(&result.path) {
+            Ok(data) => match result.parse(&data) {
+                Ok(loaded) => result.loaded = loaded,
+                Err(e) => info!("Not using SC:R analysis cache: {}", e),
+            },
+            Err(e) if e.kind() == io::ErrorKind::NotFound => (),
+            Err(e) => warn!("Couldn't read SC:R analysis cache: {}", e),
+        }
+        result
+    }
+
+    /// Makes values that weren't loaded from the cache be analyzed in parallel by `parallel`.
+    pub fn set_parallel(&mut self, parallel: &'a ParallelAnalysis<'a>) {
+        let loaded = &self.loaded;
+        parallel.schedule(|key| !loaded.contains_key(key));
+        self.parallel = Some(parallel);
+    }
+
+    /// Returns the value for `key`, either from the cache or by calling `analyze`.
+    ///
+    /// Each key must be used only once and always with the same type.
+    pub fn get<T: CacheValue>(
+        &mut self,
+        key: &'static str,
+        analyze: impl FnOnce(&mut Analysis<'e>) -> T,
+    ) -> T::Output {
+        if let Some(data) = self.loaded.remove(key) {
+            if let Some(value) = self.decode::<T>(&data) {
+                self.cache_hits += 1;
+                // There's no need to remember code addresses of loaded values again
+                // as they are only needed if the file gets rewritten, and in that case
+                // all values get analyzed again.
+                self.entries.push((key, data));
+                return value;
+            }
+            warn!("Invalid SC:R analysis cache entry for {}", key);
+        }
+        self.cache_misses += 1;
+        if let Some(parallel) = self.parallel {
+            let start = Instant::now();
+            let result = parallel.wait(key);
+            self.parallel_wait += start.elapsed();
+            if let Some(encoded) = result {
+                if let Some(value) = self.decode::<T>(&encoded.data) {
+                    self.entries.push((key, encoded.data));
+                    self.code_addresses
+                        .extend_from_slice(&encoded.code_addresses);
+                    return value;
+                }
+                warn!("Couldn't decode {} from parallel analysis", key);
+            }
+        }
+        let value = analyze(&mut *self.analysis);
+        match encode_value(self.image, &value) {
+            Ok(encoded) => {
+                self.entries.push((key, encoded.data));
+                self.code_addresses
+                    .extend_from_slice(&encoded.code_addresses);
+            }
+            Err(Unsupported) => debug!("Analysis result {} can't be cached", key),
+        }
+        value.to_output(self.ctx)
+    }
+
+    fn decode<T: CacheValue>(&self, data: &[u8]) -> Option<T::Output> {
+        let mut decoder = Decoder {
+            image: self.image,
+            ctx: self.ctx,
+            data,
+        };
+        T::decode(&mut decoder).filter(|_| decoder.data.is_empty())
+    }
+
+    /// True if any of the values returned so far came from the cache.
+    pub fn used_cache(&self) -> bool {
+        self.cache_hits != 0
+    }
+
+    /// Throws away everything that was loaded from disk, so that every value gets
+    /// analyzed again. Used if initialization fails with cached values, in case the cache
+    /// somehow was wrong.
+    pub fn discard_loaded(&mut self) {
+        self.loaded.clear();
+        self.entries.clear();
+        self.code_addresses.clear();
+        self.cache_hits = 0;
+        self.cache_misses = 0;
+    }
+
+    /// Writes the cache to disk if any value had to be analyzed.
+    pub fn save(self) {
+        debug!(
+            "SC:R analysis cache: {} values cached, {} analyzed, {}ms waited for parallel analysis",
+            self.cache_hits,
+            self.cache_misses,
+            self.parallel_wait.as_millis(),
+        );
+        if self.cache_misses == 0 {
+            return;
+        }
+        if self.cache_hits != 0 {
+            // Mixing cached and fresh values would leave code checks for the cached
+            // values missing, and such partial hits shouldn't really happen unless the
+            // set of analyzed values changes without version changing. Just skip saving.
+            debug!("Partial SC:R analysis cache hit, not rewriting the cache");
+            return;
+        }
+        match self.write_to_disk() {
+            Ok(()) => debug!("SC:R analysis cache written"),
+            Err(e) => warn!("Couldn't write SC:R analysis cache: {}", e),
+        }
+    }
+
+    fn write_to_disk(&self) -> io::Result<()> {
+        let mut buffer = Vec::with_capacity(0x2000);
+        buffer.write_u32::<LittleEndian>(CACHE_MAGIC)?;
+        buffer.write_u32::<LittleEndian>(CACHE_VERSION)?;
+        buffer.write_u32::<LittleEndian>(self.exe_hash)?;
+        buffer.write_u32::<LittleEndian>(self.exe_build)?;
+        buffer.write_u32::<LittleEndian>(self.image.base)?;
+        buffer.write_u8(sb_version().len() as u8)?;
+        buffer.extend_from_slice(sb_version());
+
+        let mut code_addresses = self.code_addresses.clone();
+        code_addresses.sort_unstable();
+        code_addresses.dedup();
+        let image_end = self.image.base as u64 + self.image.size as u64;
+        code_addresses.retain(|&rel| {
+            self.image.base as u64 + rel as u64 + CODE_CHECK_LEN as u64 <= image_end
+        });
+        buffer.write_u32::<LittleEndian>(code_addresses.len() as u32)?;
+        for &rel in &code_addresses {
+            buffer.write_u32::<LittleEndian>(rel)?;
+            buffer.extend_from_slice(unsafe { self.image_bytes(rel) });
+        }
+
+        buffer.write_u32::<LittleEndian>(self.entries.len() as u32)?;
+        for (key, value) in &self.entries {
+            buffer.write_u8(key.len() as u8)?;
+            buffer.extend_from_slice(key.as_bytes());
+            buffer.write_u32::<LittleEndian>(value.len() as u32)?;
+            buffer.extend_from_slice(value);
+        }
+
+        // Write to a temporary file first, so that another process starting at the same time
+        // doesn't see a partially written cache.
+        let tmp_path = self
+            .path
+            .with_extension(format!("{}.tmp", std::process::id()));
+        let mut file = fs::File::create(&tmp_path)?;
+        file.write_all(&buffer)?;
+        drop(file);
+        let result = fs::rename(&tmp_path, &self.path);
+        if result.is_err() {
+            let _ = fs::remove_file(&tmp_path);
+        }
+        result
+    }
+
+    /// Reads CODE_CHECK_LEN bytes from image at `rel`.
+    ///
+    /// Caller must verify that the range is inside the image.
+    unsafe fn image_bytes(&self, rel: u32) -> &'static [u8] {
+        let address = (self.image.base as usize).wrapping_add(rel as usize);
+        std::slice::from_raw_parts(address as *const u8, CODE_CHECK_LEN)
+    }
+
+    fn parse(&self, data: &[u8]) -> Result<FxHashMap<String, Vec<u8>>, &'static str> {
+        let mut input = data;
+        let magic = read_u32(&mut input).ok_or("Truncated file")?;
+        let version = read_u32(&mut input).ok_or("Truncated file")?;
+        if magic != CACHE_MAGIC || version != CACHE_VERSION {
+            return Err("Unknown cache version");
+        }
+        let exe_hash = read_u32(&mut input).ok_or("Truncated file")?;
+        let exe_build = read_u32(&mut input).ok_or("Truncated file")?;
+        let old_base = read_u32(&mut input).ok_or("Truncated file")?;
+        if exe_hash != self.exe_hash || exe_build != self.exe_build {
+            return Err("Executable has changed");
+        }
+        let sb_version_len = read_u8(&mut input).ok_or("Truncated file")?;
+        let sb_version = read_bytes(&mut input, sb_version_len as usize).ok_or("Truncated file")?;
+        if sb_version != self::sb_version() {
+            return Err("ShieldBattery version has changed");
+        }
+
+        let code_check_count = read_u32(&mut input).ok_or("Truncated file")?;
+        let delta = self.image.base.wrapping_sub(old_base);
+        for _ in 0..code_check_count {
+            let rel = read_u32(&mut input).ok_or("Truncated file")?;
+            let expected = read_bytes(&mut input, CODE_CHECK_LEN).ok_or("Truncated file")?;
+            let end = rel as u64 + CODE_CHECK_LEN as u64;
+            if end > self.image.size as u64 {
+                return Err("Cached address outside executable");
+            }
+            let actual = unsafe { self.image_bytes(rel) };
+            if !code_matches(expected, actual, delta) {
+                return Err("Code at cached address has changed");
+            }
+        }
+
+        let entry_count = read_u32(&mut input).ok_or("Truncated file")?;
+        let mut entries = FxHashMap::with_capacity_and_hasher(
+            (entry_count as usize).min(0x400),
+            Default::default(),
+        );
+        for _ in 0..entry_count {
+            let key_len = read_u8(&mut input).ok_or("Truncated file")?;
+            let key = read_bytes(&mut input, key_len as usize).ok_or("Truncated file")?;
+            let key = std::str::from_utf8(key).map_err(|_| "Invalid key")?;
+            let value_len = read_u32(&mut input).ok_or("Truncated file")?;
+            let value = read_bytes(&mut input, value_len as usize).ok_or("Truncated file")?;
+            entries.insert(key.into(), value.into());
+        }
+        Ok(entries)
+    }
+}
+
+pub fn encode_value<T: CacheValue>(
+    image: ImageInfo,
+    value: &T,
+) -> Result<EncodedValue, Unsupported> {
+    let mut encoder = Encoder {
+        image,
+        buffer: Vec::new(),
+        code_addresses: Vec::new(),
+    };
+    value.encode(&mut encoder)?;
+    Ok(EncodedValue {
+        data: encoder.buffer,
+        code_addresses: encoder.code_addresses,
+    })
+}
+
+fn sb_version() -> &'static [u8] {
+    let version = env!("SHIELDBATTERY_VERSION").as_bytes();
+    &version[..version.len().min(0xff)]
+}
+
+/// Compares code that was cached against current code. Any difference in bytes has to be
+/// explained by a relocated 32-bit address, differing by the change in image base (`delta`).
+fn code_matches(expected: &[u8], actual: &[u8], delta: u32) -> bool {
+    let len = expected.len().min(actual.len());
+    let mut pos = 0;
+    while pos < len {
+        if expected[pos] == actual[pos] {
+            pos += 1;
+            continue;
+        }
+        if delta == 0 {
+            return false;
+        }
+        // The relocated dword may have started up to 3 bytes earlier, if its low bytes
+        // happened to be same.
+        let relocated = (pos.saturating_sub(3)..=pos)
+            .filter(|&start| start + 4 <= len)
+            .find(|&start| {
+                let old = LittleEndian::read_u32(&expected[start..]);
+                let new = LittleEndian::read_u32(&actual[start..]);
+                new.wrapping_sub(old) == delta
+            });
+        match relocated {
+            Some(start) => pos = start + 4,
+            None => return false,
+        }
+    }
+    true
+}
+
+fn read_u8(input: &mut &[u8]) -> Option<u8> {
+    let (&value, rest) = input.split_first()?;
+    *input = rest;
+    Some(value)
+}
+
+fn read_u32(input: &mut &[u8]) -> Option<u32> {
+    let bytes = read_bytes(input, 4)?;
+    Some(LittleEndian::read_u32(bytes))
+}
+
+fn read_u64(input: &mut &[u8]) -> Option<u64> {
+    let bytes = read_bytes(input, 8)?;
+    Some(LittleEndian::read_u64(bytes))
+}
+
+fn read_bytes<'a>(input: &mut &'a [u8], len: usize) -> Option<&'a [u8]> {
+    if input.len() < len {
+        return None;
+    }
+    let (bytes, rest) = input.split_at(len);
+    *input = rest;
+    Some(bytes)
+}
+
+impl Encoder {
+    fn u8(&mut self, value: u8) {
+        self.buffer.push(value);
+    }
+
+    fn u32(&mut self, value: u32) {
+        let _ = self.buffer.write_u32::<LittleEndian>(value);
+    }
+
+    fn u64(&mut self, value: u64) {
+        let _ = self.buffer.write_u64::<LittleEndian>(value);
+    }
+
+    /// Encodes an address that must be inside the image.
+    fn image_address(&mut self, address: u64) -> Result<(), Unsupported> {
+        if !self.image.contains(address) {
+            return Err(Unsupported);
+        }
+        self.u32((address - self.image.base as u64) as u32);
+        Ok(())
+    }
+
+    fn code_address(&mut self, address: VirtualAddress) -> Result<(), Unsupported> {
+        self.image_address(address.0 as u64)?;
+        self.code_addresses
+            .push(address.0.wrapping_sub(self.image.base));
+        Ok(())
+    }
+
+    fn operand(&mut self, op: Operand<'_>, depth: u32) -> Result<(), Unsupported> {
+        if depth > MAX_OPERAND_DEPTH {
+            return Err(Unsupported);
+        }
+        match *op.ty() {
+            OperandType::Constant(c) => {
+                if self.image.contains(c) {
+                    self.u8(1);
+                    self.image_address(c)?;
+                } else {
+                    self.u8(0);
+                    self.u64(c);
+                }
+            }
+            OperandType::Memory(ref mem) => {
+                self.u8(2);
+                self.u8(encode_mem_size(mem.size));
+                let (base, offset) = mem.address();
+                self.operand(base, depth + 1)?;
+                if self.image.contains(offset) {
+                    self.u8(1);
+                    self.image_address(offset)?;
+                } else {
+                    self.u8(0);
+                    self.u64(offset);
+                }
+            }
+            OperandType::Arithmetic(ref arith) => {
+                self.u8(3);
+                self.u8(encode_arith(arith.ty)?);
+                self.operand(arith.left, depth + 1)?;
+                self.operand(arith.right, depth + 1)?;
+            }
+            OperandType::Custom(id) => {
+                self.u8(4);
+                self.u32(id);
+            }
+            _ => return Err(Unsupported),
+        }
+        Ok(())
+    }
+}
+
+impl<'a> Decoder<'a> {
+    fn u8(&mut self) -> Option<u8> {
+        read_u8(&mut self.data)
+    }
+
+    fn u32(&mut self) -> Option<u32> {
+        read_u32(&mut self.data)
+    }
+
+    fn u64(&mut self) -> Option<u64> {
+        read_u64(&mut self.data)
+    }
+
+    fn image_address(&mut self) -> Option<u64> {
+        let rel = self.u32()?;
+        if rel >= self.image.size {
+            return None;
+        }
+        Some(self.image.base as u64 + rel as u64)
+    }
+
+    fn constant(&mut self) -> Option<u64> {
+        match self.u8()? {
+            0 => self.u64(),
+            1 => self.image_address(),
+            _ => None,
+        }
+    }
+
+    fn operand(&mut self, depth: u32) -> Option<Operand<'static>> {
+        if depth > MAX_OPERAND_DEPTH {
+            return None;
+        }
+        let ctx = self.ctx;
+        let op = match self.u8()? {
+            0 => ctx.constant(self.u64()?),
+            1 => ctx.constant(self.image_address()?),
+            2 => {
+                let size = decode_mem_size(self.u8()?)?;
+                let base = self.operand(depth + 1)?;
+                let offset = self.constant()?;
+                ctx.mem_any(size, base, offset)
+            }
+            3 => {
+                let ty = decode_arith(self.u8()?)?;
+                let left = self.operand(depth + 1)?;
+                let right = self.operand(depth + 1)?;
+                ctx.arithmetic(ty, left, right)
+            }
+            4 => ctx.custom(self.u32()?),
+            _ => return None,
+        };
+        Some(op)
+    }
+}
+
+fn encode_mem_size(size: MemAccessSize) -> u8 {
+    match size {
+        MemAccessSize::Mem8 => 0,
+        MemAccessSize::Mem16 => 1,
+        MemAccessSize::Mem32 => 2,
+        MemAccessSize::Mem64 => 3,
+    }
+}
+
+fn decode_mem_size(value: u8) -> Option<MemAccessSize> {
+    Some(match value {
+        0 => MemAccessSize::Mem8,
+        1 => MemAccessSize::Mem16,
+        2 => MemAccessSize::Mem32,
+        3 => MemAccessSize::Mem64,
+        _ => return None,
+    })
+}
+
+/// Only arithmetic that `resolve_operand` in bw_scr.rs can evaluate needs to be supported.
+fn encode_arith(ty: ArithOpType) -> Result<u8, Unsupported> {
+    Ok(match ty {
+        ArithOpType::Add => 0,
+        ArithOpType::Sub => 1,
+        ArithOpType::Mul => 2,
+        ArithOpType::Div => 3,
+        ArithOpType::Modulo => 4,
+        ArithOpType::And => 5,
+        ArithOpType::Or => 6,
+        ArithOpType::Xor => 7,
+        ArithOpType::Lsh => 8,
+        ArithOpType::Rsh => 9,
+        ArithOpType::Equal => 10,
+        ArithOpType::GreaterThan => 11,
+        _ => return Err(Unsupported),
+    })
+}
+
+fn decode_arith(value: u8) -> Option<ArithOpType> {
+    Some(match value {
+        0 => ArithOpType::Add,
+        1 => ArithOpType::Sub,
+        2 => ArithOpType::Mul,
+        3 => ArithOpType::Div,
+        4 => ArithOpType::Modulo,
+        5 => ArithOpType::And,
+        6 => ArithOpType::Or,
+        7 => ArithOpType::Xor,
+        8 => ArithOpType::Lsh,
+        9 => ArithOpType::Rsh,
+        10 => ArithOpType::Equal,
+        11 => ArithOpType::GreaterThan,
+        _ => return None,
+    })
+}
+
+impl<T: CacheValue> CacheValue for Option<T> {
+    type Output = Option<T::Output>;
+    fn to_output(&self, ctx: OperandCtx<'static>) -> Self::Output {
+        self.as_ref().map(|x| x.to_output(ctx))
+    }
+
+    fn encode(&self, out: &mut Encoder) -> Result<(), Unsupported> {
+        match self {
+            Some(value) => {
+                out.u8(1);
+                value.encode(out)
+            }
+            None => {
+                out.u8(0);
+                Ok(())
+            }
+        }
+    }
+
+    fn decode(input: &mut Decoder<'_>) -> Option<Self::Output> {
+        match input.u8()? {
+            0 => Some(None),
+            1 => Some(Some(T::decode(input)?)),
+            _ => None,
+        }
+    }
+}
+
+impl<'e> CacheValue for Operand<'e> {
+    type Output = Operand<'static>;
+    fn to_output(&self, ctx: OperandCtx<'static>) -> Self::Output {
+        ctx.copy_operand(*self)
+    }
+
+    fn encode(&self, out: &mut Encoder) -> Result<(), Unsupported> {
+        out.operand(*self, 0)
+    }
+
+    fn decode(input: &mut Decoder<'_>) -> Option<Self::Output> {
+        input.operand(0)
+    }
+}
+
+impl CacheValue for VirtualAddress {
+    type Output = VirtualAddress;
+    fn to_output(&self, _: OperandCtx<'static>) -> Self::Output {
+        *self
+    }
+
+    fn encode(&self, out: &mut Encoder) -> Result<(), Unsupported> {
+        out.code_address(*self)
+    }
+
+    fn decode(input: &mut Decoder<'_>) -> Option<Self::Output> {
+        input.image_address().map(|x| VirtualAddress(x as u32))
+    }
+}
+
+impl CacheValue for *mut u32 {
+    type Output = *mut u32;
+    fn to_output(&self, _: OperandCtx<'static>) -> Self::Output {
+        *self
+    }
+
+    fn encode(&self, out: &mut Encoder) -> Result<(), Unsupported> {
+        out.image_address(*self as usize as u64)
+    }
+
+    fn decode(input: &mut Decoder<'_>) -> Option<Self::Output> {
+        input.image_address().map(|x| x as usize as *mut u32)
+    }
+}
+
+impl CacheValue for usize {
+    type Output = usize;
+    fn to_output(&self, _: OperandCtx<'static>) -> Self::Output {
+        *self
+    }
+
+    fn encode(&self, out: &mut Encoder) -> Result<(), Unsupported> {
+        out.u64(*self as u64);
+        Ok(())
+    }
+
+    fn decode(input: &mut Decoder<'_>) -> Option<Self::Output> {
+        input.u64().map(|x| x as usize)
+    }
+}
+
+impl CacheValue for u32 {
+    type Output = u32;
+    fn to_output(&self, _: OperandCtx<'static>) -> Self::Output {
+        *self
+    }
+
+    fn encode(&self, out: &mut Encoder) -> Result<(), Unsupported> {
+        out.u32(*self);
+        Ok(())
+    }
+
+    fn decode(input: &mut Decoder<'_>) -> Option<Self::Output> {
+        input.u32()
+    }
+}
+
+impl CacheValue for MemAccessSize {
+    type Output = MemAccessSize;
+    fn to_output(&self, _: OperandCtx<'static>) -> Self::Output {
+        *self
+    }
+
+    fn encode(&self, out: &mut Encoder) -> Result<(), Unsupported> {
+        out.u8(encode_mem_size(*self));
+        Ok(())
+    }
+
+    fn decode(input: &mut Decoder<'_>) -> Option<Self::Output> {
+        decode_mem_size(input.u8()?)
+    }
+}
+
+impl<T: CacheValue> CacheValue for Vec<T> {
+    type Output = Vec<T::Output>;
+    fn to_output(&self, ctx: OperandCtx<'static>) -> Self::Output {
+        self.iter().map(|x| x.to_output(ctx)).collect()
+    }
+
+    fn encode(&self, out: &mut Encoder) -> Result<(), Unsupported> {
+        out.u32(self.len() as u32);
+        for value in self {
+            value.encode(out)?;
+        }
+        Ok(())
+    }
+
+    fn decode(input: &mut Decoder<'_>) -> Option<Self::Output> {
+        let len = input.u32()? as usize;
+        // Every value takes at least a byte, don't let a corrupted length allocate a lot.
+        if len > input.data.len() {
+            return None;
+        }
+        (0..len).map(|_| T::decode(input)).collect()
+    }
+}
+
+impl<A: CacheValue, B: CacheValue> CacheValue for (A, B) {
+    type Output = (A::Output, B::Output);
+    fn to_output(&self, ctx: OperandCtx<'static>) -> Self::Output {
+        (self.0.to_output(ctx), self.1.to_output(ctx))
+    }
+
+    fn encode(&self, out: &mut Encoder) -> Result<(), Unsupported> {
+        self.0.encode(out)?;
+        self.1.encode(out)
+    }
+
+    fn decode(input: &mut Decoder<'_>) -> Option<Self::Output> {
+        Some((A::decode(input)?, B::decode(input)?))
+    }
+}
+
+impl<A: CacheValue, B: CacheValue, C: CacheValue> CacheValue for (A, B, C) {
+    type Output = (A::Output, B::Output, C::Output);
+    fn to_output(&self, ctx: OperandCtx<'static>) -> Self::Output {
+        (
+            self.0.to_output(ctx),
+            self.1.to_output(ctx),
+            self.2.to_output(ctx),
+        )
+    }
+
+    fn encode(&self, out: &mut Encoder) -> Result<(), Unsupported> {
+        self.0.encode(out)?;
+        self.1.encode(out)?;
+        self.2.encode(out)
+    }
+
+    fn decode(input: &mut Decoder<'_>) -> Option<Self::Output> {
+        Some((A::decode(input)?, B::decode(input)?, C::decode(input)?))
+    }
+}
+
+impl CacheValue for Patch {
+    type Output = Patch;
+    fn to_output(&self, _: OperandCtx<'static>) -> Self::Output {
+        self.clone()
+    }
+
+    fn encode(&self, out: &mut Encoder) -> Result<(), Unsupported> {
+        // Patched code isn't added to code checks, as it is going to get overwritten anyway.
+        out.image_address(self.address.0 as u64)?;
+        out.u32(self.data.len() as u32);
+        out.buffer.extend_from_slice(&self.data);
+        Ok(())
+    }
+
+    fn decode(input: &mut Decoder<'_>) -> Option<Self::Output> {
+        let address = VirtualAddress(input.image_address()? as u32);
+        let len = input.u32()? as usize;
+        let data = read_bytes(&mut input.data, len)?.to_vec();
+        Some(Patch { address, data })
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn code_matches_relocated() {
+        let old = [
+            0x55, 0x8b, 0xec, 0x6a, 0xff, 0x68, 0x10, 0x20, 0x40, 0x00, 0x64, 0xa1,
+        ];
+        let mut new = old;
+        // Image moved from 0x00400000 to 0x01230000
+        new[6..10].copy_from_slice(&0x01232010u32.to_le_bytes());
+        assert!(code_matches(&old, &old, 0));
+        assert!(code_matches(
+            &old,
+            &new,
+            0x01230000u32.wrapping_sub(0x00400000)
+        ));
+        assert!(!code_matches(&old, &new, 0));
+        assert!(!code_matches(&old, &new, 0x1000));
+        let mut changed = old;
+        changed[1] = 0x89;
+        assert!(!code_matches(
+            &old,
+            &changed,
+            0x01230000u32.wrapping_sub(0x00400000)
+        ));
+    }
+}
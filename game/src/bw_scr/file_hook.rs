@@ -1,11 +1,14 @@
 use std::ffi::CStr;
+use std::ops::Deref;
 use std::ptr::null_mut;
 use std::sync::atomic::Ordering;
+use std::sync::Arc;
 
 use arrayvec::ArrayVec;
 use lazy_static::lazy_static;
 use libc::c_void;
 
+use super::path_rules::{self, HdReplacement};
 use super::thiscall::Thiscall;
 use super::{scr, BwScr};
 
@@ -64,7 +67,7 @@ pub fn open_file_hook(
                             .and_then(|x| {
                                 let num_str = std::str::from_utf8(x.get(..3)?).ok()?;
                                 let num = num_str.parse::<u32>().ok()?;
-                                MISSING_CARBOT_SPRITES_LOOKUP.get(num as usize).copied()
+                                Some(path_rules::is_carbot_missing_sprite(num))
                             })
                             .unwrap_or(false);
                         if !load_anim {
@@ -74,6 +77,10 @@ pub fn open_file_hook(
                     }
                 }
             }
+            if let Some(data) = bw.file_prefetch.file_opened(path, &*params, orig) {
+                memory_buffer_to_bw_file_handle(data, out);
+                return out;
+            }
         }
         orig(out, path, params)
     }
@@ -86,49 +93,15 @@ static EMPTY_SKINS: &[u8] = br#"{"skins":[]}"#;
 static NONCARBOT_SKINS: &[u8] = br#"{"skins":[{"id":1,"name":"PreSale"}]}"#;
 static CARBOT_SKINS: &[u8] = br#"{"skins":[{"id":2,"name":"Carbot"}]}"#;
 
-static MISSING_CARBOT_SPRITES_LOOKUP: [bool; 999] = missing_carbot_sprites();
-const MISSING_CARBOT_SPRITES_LIST: &[u32] = &[
-    106, 503, 561, 562, 563, 564, 565, 566, 567, 568, 569, 570, 571, 572, 573, 574, 575, 576, 577,
-    578, 579, 580, 581, 588, 611, 613, 615, 617, 619, 621, 623, 625, 627, 629, 631, 633, 635, 637,
-    639, 666, 692, 694, 696, 698, 705, 707, 709, 711, 756, 784, 792, 837, 839, 861, 873, 893, 905,
-    908, 910, 932, 965, 972,
-];
-
-const fn missing_carbot_sprites() -> [bool; 999] {
-    let mut result = [false; 999];
-    let mut i = 0;
-    while i < MISSING_CARBOT_SPRITES_LIST.len() {
-        result[MISSING_CARBOT_SPRITES_LIST[i] as usize] = true;
-        i += 1;
-    }
-    result
-}
-
 fn check_dummied_out_hd(path: &[u8]) -> Option<&'static [u8]> {
-    if path.ends_with(b".anim") {
-        // Avoid touching tileset/foliage.anim
-        if path.starts_with(b"anim/") {
-            return Some(DUMMY_ANIM);
-        }
-    } else if path.ends_with(b".dds") {
-        // Font dds files are used (only) in SD, but they aren't loaded
-        // on file param SD.
-        if !path.starts_with(b"font/") {
-            // Anim happens to have a dds inside it :)
-            let dummy_dds = &DUMMY_ANIM[0x174..];
-            return Some(dummy_dds);
-        }
-    } else if path.ends_with(b".dds.vr4") {
-        return Some(DUMMY_DDSGRP);
-    } else if path.ends_with(b".dds.grp") {
-        // Avoid tileset.dds.grps, they need their frames
-        if path.starts_with(b"unit/") || path.starts_with(b"effect/") {
-            return Some(DUMMY_DDSGRP);
-        }
-    } else if path == b"anim/skins.json" {
-        return Some(EMPTY_SKINS);
-    }
-    None
+    let data = match path_rules::hd_replacement(path)? {
+        HdReplacement::Anim => DUMMY_ANIM,
+        // Anim happens to have a dds inside it :)
+        HdReplacement::Dds => &DUMMY_ANIM[0x174..],
+        HdReplacement::Ddsgrp => DUMMY_DDSGRP,
+        HdReplacement::EmptySkins => EMPTY_SKINS,
+    };
+    Some(data)
 }
 
 /// If `params` has a file extension set, it will override whatever
@@ -196,9 +169,15 @@ unsafe fn real_path<'a>(
     Some(slice)
 }
 
-unsafe fn memory_buffer_to_bw_file_handle(buffer: &'static [u8], handle: *mut scr::FileHandle) {
+unsafe fn memory_buffer_to_bw_file_handle(
+    buffer: impl Into<FileBuffer>,
+    handle: *mut scr::FileHandle,
+) {
     let inner = Box::new(FileAllocation {
-        file: FileState { buffer, pos: 0 },
+        file: FileState {
+            buffer: buffer.into(),
+            pos: 0,
+        },
         read: scr::FileRead {
             vtable: &*FILE_READ_VTABLE,
             inner: null_mut(),
@@ -242,10 +221,39 @@ struct FileAllocation {
 }
 
 struct FileState {
-    buffer: &'static [u8],
+    buffer: FileBuffer,
     pos: u32,
 }
 
+/// Either one of the static buffers in this file, or a file that was read to memory
+/// by `file_prefetch`. The latter is freed once BW closes the file.
+enum FileBuffer {
+    Static(&'static [u8]),
+    Shared(Arc<[u8]>),
+}
+
+impl From<&'static [u8]> for FileBuffer {
+    fn from(val: &'static [u8]) -> FileBuffer {
+        FileBuffer::Static(val)
+    }
+}
+
+impl From<Arc<[u8]>> for FileBuffer {
+    fn from(val: Arc<[u8]>) -> FileBuffer {
+        FileBuffer::Shared(val)
+    }
+}
+
+impl Deref for FileBuffer {
+    type Target = [u8];
+    fn deref(&self) -> &[u8] {
+        match self {
+            FileBuffer::Static(buf) => buf,
+            FileBuffer::Shared(buf) => buf,
+        }
+    }
+}
+
 lazy_static! {
     static ref FILE_HANDLE_VTABLE1: scr::V_FileHandle1 = scr::V_FileHandle1 {
         destroy: Thiscall::new(file_handle_destroy_nop),
@@ -0,0 +1,373 @@
+//! Reads files that BW is going to open during game init ahead of time on background threads,
+//! so that `file_hook` can hand them out from memory.
+//!
+//! The files that get opened depend on map (tileset) and settings in ways that aren't practical
+//! to figure out ahead of time, so instead the paths BW opens between receiving the game setup
+//! info and the game starting are recorded to a per-tileset manifest in the user data
+//! directory. The next game on the same tileset prefetches everything in the manifest.
+//!
+//! BW calls the file open function from its own asset loading threads as well, so calling it
+//! from prefetch threads is fine. Setting `SB_NO_PREFETCH=1` disables all of this.
+
+use std::ffi::CString;
+use std::io;
+use std::mem;
+use std::path::{Path, PathBuf};
+use std::ptr::null;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::Arc;
+
+use fxhash::{FxHashMap, FxHashSet};
+use parking_lot::Mutex;
+
+use super::scr;
+
+/// Limit for memory used by prefetched files that BW hasn't opened yet.
+const MAX_PREFETCH_BYTES: usize = 256 * 1024 * 1024;
+/// Loading more files in parallel doesn't help much on HDDs, and SSDs are fast either way.
+const PREFETCH_THREADS: usize = 2;
+
+pub type OpenFileFn = unsafe extern "C" fn(
+    *mut scr::FileHandle,
+    *const u8,
+    *const scr::OpenParams,
+) -> *mut scr::FileHandle;
+
+static TILESET_NAMES: &[&str] = &[
+    "badlands", "platform", "install", "ashworld", "jungle", "desert", "ice", "twilight",
+];
+
+pub struct FilePrefetch {
+    enabled: bool,
+    /// Set while BW is initializing a game and files are recorded / served from `state`.
+    active: AtomicBool,
+    /// `OpenFileFn` of the hooked function, set on first file open.
+    orig_open_file: AtomicUsize,
+    state: Mutex<PrefetchState>,
+}
+
+#[derive(Default)]
+struct PrefetchState {
+    manifest_path: Option<PathBuf>,
+    /// Files in the order that BW opened them, written to the manifest once the game starts.
+    recorded: Vec<ManifestEntry>,
+    opened: FxHashSet<(u32, Box<[u8]>)>,
+    /// Files that have been prefetched, but not opened by BW yet. Keyed by file type and path.
+    loaded: FxHashMap<(u32, Box<[u8]>), Arc<[u8]>>,
+    loaded_bytes: usize,
+    /// Manifest that is waiting for BW to open its first file, as prefetching needs to
+    /// know the original function.
+    pending: Vec<ManifestEntry>,
+    /// Prefetch threads stop once this is set.
+    finished: bool,
+}
+
+#[derive(Clone, Debug, Eq, PartialEq)]
+struct ManifestEntry {
+    unk4: u32,
+    file_type: u32,
+    locale: u32,
+    flags: u32,
+    casc_buffer_size: u32,
+    /// Normalized path, including the extension from `OpenParams`.
+    path: Box<[u8]>,
+}
+
+impl FilePrefetch {
+    pub fn new() -> FilePrefetch {
+        let enabled = match std::env::var_os("SB_NO_PREFETCH") {
+            Some(s) => s != "1",
+            None => true,
+        };
+        FilePrefetch {
+            enabled,
+            active: AtomicBool::new(false),
+            orig_open_file: AtomicUsize::new(0),
+            state: Mutex::new(PrefetchState::default()),
+        }
+    }
+
+    /// Starts recording opened files, and prefetching files that were recorded last time
+    /// a game with this tileset was played.
+    pub fn start(&'static self, tileset: u16) {
+        if !self.enabled {
+            return;
+        }
+        let name = match TILESET_NAMES.get(tileset as usize) {
+            Some(s) => s,
+            None => return,
+        };
+        let dir = crate::parse_args().user_data_path.join("prefetch");
+        let manifest_path = dir.join(format!("{}.txt", name));
+        let manifest = match std::fs::read(&manifest_path) {
+            Ok(o) => parse_manifest(&o),
+            Err(e) => {
+                if e.kind() != io::ErrorKind::NotFound {
+                    warn!("Couldn't read {}: {}", manifest_path.display(), e);
+                }
+                Vec::new()
+            }
+        };
+        let mut state = self.state.lock();
+        if state.manifest_path.is_some() {
+            warn!("File prefetch was already started");
+            return;
+        }
+        state.manifest_path = Some(manifest_path);
+        self.active.store(true, Ordering::Release);
+        if manifest.is_empty() {
+            return;
+        }
+        debug!("Prefetching {} files for {}", manifest.len(), name);
+        let orig = self.orig_open_file.load(Ordering::Relaxed);
+        if orig == 0 {
+            state.pending = manifest;
+        } else {
+            drop(state);
+            self.spawn_prefetch_threads(unsafe { mem::transmute(orig) }, manifest);
+        }
+    }
+
+    fn spawn_prefetch_threads(&'static self, orig: OpenFileFn, manifest: Vec<ManifestEntry>) {
+        let manifest = Arc::new(manifest);
+        let next = Arc::new(AtomicUsize::new(0));
+        for _ in 0..PREFETCH_THREADS {
+            let manifest = manifest.clone();
+            let next = next.clone();
+            std::thread::spawn(move || loop {
+                let index = next.fetch_add(1, Ordering::Relaxed);
+                let entry = match manifest.get(index) {
+                    Some(s) => s,
+                    None => break,
+                };
+                if !self.prefetch_file(orig, entry) {
+                    break;
+                }
+            });
+        }
+    }
+
+    /// Returns false if prefetching should stop.
+    fn prefetch_file(&self, orig: OpenFileFn, entry: &ManifestEntry) -> bool {
+        let key = (entry.file_type, entry.path.clone());
+        {
+            let state = self.state.lock();
+            if state.finished || state.loaded_bytes >= MAX_PREFETCH_BYTES {
+                return false;
+            }
+            if state.opened.contains(&key) {
+                return true;
+            }
+        }
+        let data = match unsafe { read_bw_file(orig, entry) } {
+            Some(s) => s,
+            None => return true,
+        };
+        let mut state = self.state.lock();
+        if state.finished {
+            return false;
+        }
+        // BW may have opened the file while this was reading it
+        if !state.opened.contains(&key) && state.loaded_bytes + data.len() <= MAX_PREFETCH_BYTES {
+            state.loaded_bytes += data.len();
+            state.loaded.insert(key, data.into());
+        }
+        true
+    }
+
+    /// Called from the file open hook for files that aren't replaced with our own data.
+    ///
+    /// Returns the prefetched file contents, if there are any.
+    pub fn file_opened(
+        &'static self,
+        path: &[u8],
+        params: &scr::OpenParams,
+        orig: OpenFileFn,
+    ) -> Option<Arc<[u8]>> {
+        let first_open = self.orig_open_file.load(Ordering::Relaxed) == 0
+            && self.orig_open_file.swap(orig as usize, Ordering::Relaxed) == 0;
+        if !self.active.load(Ordering::Acquire) {
+            return None;
+        }
+        let mut state = self.state.lock();
+        if state.finished {
+            return None;
+        }
+        if first_open && !state.pending.is_empty() {
+            let manifest = mem::take(&mut state.pending);
+            self.spawn_prefetch_threads(orig, manifest);
+        }
+        let key = (params.file_type, Box::<[u8]>::from(path));
+        let result = state.loaded.remove(&key);
+        if let Some(ref data) = result {
+            state.loaded_bytes -= data.len();
+        }
+        if state.opened.insert(key) {
+            state.recorded.push(ManifestEntry {
+                unk4: params._unk4,
+                file_type: params.file_type,
+                locale: params.locale,
+                flags: params.flags,
+                casc_buffer_size: params.casc_buffer_size,
+                path: path.into(),
+            });
+        }
+        result
+    }
+
+    /// Called once the game has been initialized. Stops prefetching, frees any files that
+    /// BW didn't end up opening and saves the recorded manifest.
+    ///
+    /// Cheap to call once finished.
+    pub fn finish(&self) {
+        if !self.active.load(Ordering::Relaxed) || !self.active.swap(false, Ordering::AcqRel) {
+            return;
+        }
+        let mut state = self.state.lock();
+        state.finished = true;
+        if !state.loaded.is_empty() {
+            debug!("{} prefetched files were not used", state.loaded.len());
+        }
+        let manifest_path = state.manifest_path.clone();
+        let recorded = mem::take(&mut state.recorded);
+        *state = PrefetchState {
+            finished: true,
+            ..Default::default()
+        };
+        drop(state);
+        if let Some(path) = manifest_path {
+            std::thread::spawn(move || {
+                if let Err(e) = write_manifest(&path, &recorded) {
+                    warn!("Couldn't write {}: {}", path.display(), e);
+                }
+            });
+        }
+    }
+}
+
+/// Opens a file and reads all of it with BW's functions.
+unsafe fn read_bw_file(orig: OpenFileFn, entry: &ManifestEntry) -> Option<Vec<u8>> {
+    let path = CString::new(&*entry.path).ok()?;
+    let params = scr::OpenParams {
+        extension: null(),
+        _unk4: entry.unk4,
+        file_type: entry.file_type,
+        locale: entry.locale,
+        flags: entry.flags,
+        casc_buffer_size: entry.casc_buffer_size,
+        safety_padding: [0; 4],
+    };
+    let mut handle: scr::FileHandle = mem::zeroed();
+    let handle = &mut handle as *mut scr::FileHandle;
+    orig(handle, path.as_ptr() as *const u8, &params);
+    let result = if (*handle).file_ok != 0 {
+        let metadata = (*handle).metadata;
+        let size = (*(*metadata).vtable).file_size.call1(metadata);
+        let mut data = vec![0u8; size as usize];
+        let read = (*handle).read;
+        let read_len = (*(*read).vtable).read.call3(read, data.as_mut_ptr(), size);
+        if read_len == size {
+            Some(data)
+        } else {
+            None
+        }
+    } else {
+        None
+    };
+    if (*handle).vtable.is_null() {
+        return result;
+    }
+    // Same as what BW does to close the handles that file_hook creates.
+    let close = &mut (*handle).close_callback as *mut scr::Function;
+    (*(*close).vtable).invoke.call1(close);
+    (*(*handle).vtable).destroy.call2(handle, 0);
+    result
+}
+
+/// Each line is
+/// `unk4 file_type locale flags casc_buffer_size path`
+fn parse_manifest(data: &[u8]) -> Vec<ManifestEntry> {
+    data.split(|&x| x == b'\n')
+        .filter_map(|line| {
+            let mut fields = line.splitn(6, |&x| x == b' ');
+            let mut num =
+                || -> Option<u32> { std::str::from_utf8(fields.next()?).ok()?.parse().ok() };
+            let unk4 = num()?;
+            let file_type = num()?;
+            let locale = num()?;
+            let flags = num()?;
+            let casc_buffer_size = num()?;
+            let path = fields.next().filter(|x| !x.is_empty())?;
+            Some(ManifestEntry {
+                unk4,
+                file_type,
+                locale,
+                flags,
+                casc_buffer_size,
+                path: path.into(),
+            })
+        })
+        .collect()
+}
+
+fn write_manifest(path: &Path, entries: &[ManifestEntry]) -> io::Result<()> {
+    let mut out = Vec::with_capacity(entries.len() * 64);
+    for entry in entries {
+        // Paths are at most 256 bytes from file_hook, so they can't contain newlines
+        // unless BW actually tried to open something with a newline in its name.
+        if entry.path.contains(&b'\n') {
+            continue;
+        }
+        out.extend_from_slice(
+            format!(
+                "{} {} {} {} {} ",
+                entry.unk4, entry.file_type, entry.locale, entry.flags, entry.casc_buffer_size
+            )
+            .as_bytes(),
+        );
+        out.extend_from_slice(&entry.path);
+        out.push(b'\n');
+    }
+    if let Some(dir) = path.parent() {
+        std::fs::create_dir_all(dir)?;
+    }
+    std::fs::write(path, out)
+}
+
+#[cfg(test)]
+mod test {
+    use super::{parse_manifest, ManifestEntry};
+
+    #[test]
+    fn manifest_roundtrip() {
+        let entries = vec![
+            ManifestEntry {
+                unk4: 0,
+                file_type: 1,
+                locale: 0,
+                flags: 0x10,
+                casc_buffer_size: 0x1000,
+                path: b"tileset/badlands.cv5"[..].into(),
+            },
+            ManifestEntry {
+                unk4: 1,
+                file_type: 2,
+                locale: 0x409,
+                flags: 0,
+                casc_buffer_size: 0,
+                path: b"effect/some file.dds.grp"[..].into(),
+            },
+        ];
+        let dir = std::env::temp_dir().join(format!("sb-prefetch-test-{}", std::process::id()));
+        let path = dir.join("manifest.txt");
+        super::write_manifest(&path, &entries).unwrap();
+        let data = std::fs::read(&path).unwrap();
+        std::fs::remove_dir_all(&dir).unwrap();
+        assert_eq!(parse_manifest(&data), entries);
+        // Invalid lines are skipped
+        let data = b"0 1 2 3\n0 1 2 3 4 \n0 x 2 3 4 path\n0 1 2 3 4 ok\n";
+        let parsed = parse_manifest(data);
+        assert_eq!(parsed.len(), 1);
+        assert_eq!(&*parsed[0].path, b"ok");
+    }
+}
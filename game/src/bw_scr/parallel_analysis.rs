@@ -0,0 +1,408 @@
+//! Runs scr-analysis on several threads when its results aren't cached.
+//!
+//! samase_scarf's `Analysis` can't be shared between threads, so each worker creates its
+//! own `Analysis` (and `OperandContext`) for the binary. Results are passed back in the
+//! analysis cache encoding, which the main thread decodes into `BwScr`'s `OperandContext`
+//! as `BwScr::new` asks for them.
+//!
+//! The analysis is split into units of related results listed in `ANALYSIS_UNITS`.
+//! A unit that declares dependencies is run after them on the same `Analysis`, so that
+//! it can reuse whatever samase_scarf already had to find for the dependencies; units
+//! that don't depend on each other run in parallel. Getting a dependency wrong only costs
+//! time, as each `Analysis` will find anything it needs by itself.
+//!
+//! Units with `Priority::Deferred` aren't needed until the hooks using them are applied
+//! at the end of `patch_game`, so they are started only once every startup unit has
+//! been started.
+
+use std::collections::VecDeque;
+use std::time::{Duration, Instant};
+
+use fxhash::FxHashMap;
+use parking_lot::{Condvar, Mutex};
+
+use scr_analysis::scarf::{self, BinaryFile, VirtualAddress};
+use scr_analysis::{Analysis, DatType};
+
+use super::analysis_cache::{self, CacheValue, EncodedValue, ImageInfo};
+
+#[derive(Copy, Clone, Eq, PartialEq, Debug)]
+pub enum Priority {
+    Startup,
+    Deferred,
+}
+
+pub struct AnalysisUnit {
+    name: &'static str,
+    priority: Priority,
+    /// Names of units that have to run before this one.
+    deps: &'static [&'static str],
+    keys: &'static [&'static str],
+    run: for<'e> fn(&mut Analysis<'e>, &mut UnitOutput),
+}
+
+pub struct UnitOutput {
+    image: ImageInfo,
+    results: Vec<(&'static str, Option<EncodedValue>)>,
+}
+
+impl UnitOutput {
+    fn put<T: CacheValue>(&mut self, key: &'static str, value: T) {
+        // Values that can't be encoded are left as None, and the main thread
+        // will analyze them by itself.
+        let encoded = analysis_cache::encode_value(self.image, &value).ok();
+        self.results.push((key, encoded));
+    }
+}
+
+macro_rules! analysis_units {
+    ($(
+        $name:ident: $priority:ident, [$($dep:ident),*] {
+            $($key:ident => $func:ident($($arg:expr),*),)*
+        }
+    )*) => {
+        static ANALYSIS_UNITS: &[AnalysisUnit] = &[$(
+            AnalysisUnit {
+                name: stringify!($name),
+                priority: Priority::$priority,
+                deps: &[$(stringify!($dep)),*],
+                keys: &[$(stringify!($key)),*],
+                run: |analysis, out| {
+                    $(out.put(stringify!($key), analysis.$func($($arg),*));)*
+                },
+            },
+        )*];
+    };
+}
+
+// Keys must match the ones used in `BwScr::from_analysis`.
+// Units are roughly in the order that `BwScr::from_analysis` requests them,
+// and dependencies have to be declared before units depending on them.
+analysis_units! {
+    game: Startup, [] {
+        game => game(),
+        game_data => game_data(),
+        players => players(),
+        chk_init_players => chk_init_players(),
+        original_chk_player_types => original_chk_player_types(),
+        first_active_unit => first_active_unit(),
+        client_selection => client_selection(),
+        units => units(),
+        allocator => allocator(),
+    }
+    network: Startup, [] {
+        storm_players => storm_players(),
+        init_net_player => init_net_player(),
+        net_player_flags => net_player_flags(),
+        step_network => step_network(),
+        network_ready => network_ready(),
+        net_user_latency => net_user_latency(),
+        net_format_turn_rate => net_format_turn_rate(),
+        net_player_to_game => net_player_to_game(),
+        net_player_to_unique => net_player_to_unique(),
+        init_storm_networking => init_storm_networking(),
+        load_snp_list => load_snp_list(),
+        choose_snp => choose_snp(),
+        start_udp_server => start_udp_server(),
+        snet_recv_packets => snet_recv_packets(),
+        snet_send_packets => snet_send_packets(),
+    }
+    lobby: Startup, [network] {
+        lobby_state => lobby_state(),
+        is_multiplayer => is_multiplayer(),
+        select_map_entry => select_map_entry(),
+        init_map_from_path => init_map_from_path(),
+        join_game => join_game(),
+        init_game_network => init_game_network(),
+        process_lobby_commands => process_lobby_commands(),
+        local_player_name => local_player_name(),
+        create_game_dialog_vtbl_on_multiplayer_create =>
+            create_game_dialog_vtbl_on_multiplayer_create(),
+        create_game_multiplayer => create_game_multiplayer(),
+        join_param_variant_type_offset => join_param_variant_type_offset(),
+    }
+    game_loop: Startup, [] {
+        game_state => game_state(),
+        mainmenu_entry_hook => mainmenu_entry_hook(),
+        game_loop => game_loop(),
+        load_images => load_images(),
+        images_loaded => images_loaded(),
+        init_real_time_lighting => init_real_time_lighting(),
+        step_io => step_io(),
+        init_game => init_game(),
+        init_units => init_units(),
+        step_game => step_game(),
+        step_game_logic => step_game_logic(),
+        file_hook => file_hook(),
+    }
+    commands: Startup, [game_loop] {
+        send_command => send_command(),
+        process_commands => process_commands(),
+        command_lengths => command_lengths(),
+        local_player_id => local_player_id(),
+        local_storm_player_id => local_storm_player_id(),
+        local_unique_player_id => local_unique_player_id(),
+        command_user => command_user(),
+        unique_command_user => unique_command_user(),
+        storm_command_user => storm_command_user(),
+        enable_rng => enable_rng(),
+        prepare_issue_order => prepare_issue_order(),
+    }
+    replay: Startup, [commands] {
+        step_replay_commands => step_replay_commands(),
+        replay_data => replay_data(),
+        replay_header => replay_header(),
+        replay_visions => replay_visions(),
+        replay_show_entire_map => replay_show_entire_map(),
+        replay_bfix => replay_bfix(),
+        replay_gcfg => replay_gcfg(),
+    }
+    fonts: Startup, [] {
+        fonts => fonts(),
+        ttf_malloc => ttf_malloc(),
+        ttf_render_sdf => ttf_render_sdf(),
+    }
+    sprites: Startup, [] {
+        sprite_x => sprite_x(),
+        sprite_y => sprite_y(),
+        sprites_by_y_tile_start => sprites_by_y_tile_start(),
+        sprites_by_y_tile_end => sprites_by_y_tile_end(),
+        first_free_sprite => first_free_sprite(),
+        last_free_sprite => last_free_sprite(),
+        first_free_image => first_free_image(),
+        last_free_image => last_free_image(),
+    }
+    orders: Startup, [] {
+        first_free_order => first_free_order(),
+        last_free_order => last_free_order(),
+        allocated_order_count => allocated_order_count(),
+        order_limit => order_limit(),
+    }
+    dialogs: Startup, [] {
+        spawn_dialog => spawn_dialog(),
+        anti_troll => anti_troll(),
+    }
+    screen: Startup, [] {
+        map_width_pixels => map_width_pixels(),
+        screen_x => screen_x(),
+        screen_y => screen_y(),
+        game_screen_width_bwpx => game_screen_width_bwpx(),
+        move_screen => move_screen(),
+        update_game_screen_size => update_game_screen_size(),
+        replay_minimap_unexplored_fog_patch => replay_minimap_unexplored_fog_patch(),
+    }
+    dat: Startup, [] {
+        units_dat => dat_table_address(DatType::Units),
+        weapons_dat => dat_table_address(DatType::Weapons),
+        upgrades_dat => dat_table_address(DatType::Upgrades),
+        techdata_dat => dat_table_address(DatType::TechData),
+        orders_dat => dat_table_address(DatType::Orders),
+    }
+    fow_sprites: Deferred, [sprites] {
+        first_active_fow_sprite => first_active_fow_sprite(),
+        last_active_fow_sprite => last_active_fow_sprite(),
+        first_free_fow_sprite => first_free_fow_sprite(),
+        last_free_fow_sprite => last_free_fow_sprite(),
+    }
+    shaders: Deferred, [] {
+        prism_pixel_shaders => prism_pixel_shaders(),
+        prism_renderer_vtable => prism_renderer_vtable(),
+    }
+    status_screen: Deferred, [] {
+        status_screen_funcs => status_screen_funcs(),
+    }
+}
+
+pub struct ParallelAnalysis<'b> {
+    binary: &'b BinaryFile<VirtualAddress>,
+    image: ImageInfo,
+    state: Mutex<State>,
+    condvar: Condvar,
+}
+
+#[derive(Default)]
+struct State {
+    /// Units (indices to `ANALYSIS_UNITS`) that haven't been started yet,
+    /// each entry being run on a single `Analysis`.
+    queue: VecDeque<Vec<usize>>,
+    /// Units that are scheduled for each key.
+    key_units: FxHashMap<&'static str, usize>,
+    unit_done: Vec<bool>,
+    results: FxHashMap<&'static str, Option<EncodedValue>>,
+    timings: Vec<(&'static str, Duration)>,
+    cancelled: bool,
+    start_time: Option<Instant>,
+    end_time: Option<Instant>,
+}
+
+impl<'b> ParallelAnalysis<'b> {
+    pub fn new(binary: &'b BinaryFile<VirtualAddress>, image: ImageInfo) -> ParallelAnalysis<'b> {
+        ParallelAnalysis {
+            binary,
+            image,
+            state: Mutex::new(State::default()),
+            condvar: Condvar::new(),
+        }
+    }
+
+    /// Queues every unit that has at least one key for which `needed` returns true.
+    pub fn schedule(&self, needed: impl Fn(&str) -> bool) {
+        let units = ANALYSIS_UNITS;
+        let mut state = self.state.lock();
+        state.unit_done = vec![false; units.len()];
+        // Merge each unit with its dependencies; the merged groups are what
+        // worker threads take from the queue.
+        let mut group_of: Vec<usize> = (0..units.len()).collect();
+        fn root(group_of: &mut [usize], mut index: usize) -> usize {
+            while group_of[index] != index {
+                group_of[index] = group_of[group_of[index]];
+                index = group_of[index];
+            }
+            index
+        }
+        for (index, unit) in units.iter().enumerate() {
+            for dep in unit.deps {
+                let dep_index = units[..index].iter().position(|x| x.name == *dep);
+                debug_assert!(dep_index.is_some(), "{} must come after {}", unit.name, dep);
+                if let Some(dep_index) = dep_index {
+                    let a = root(&mut group_of, index);
+                    let b = root(&mut group_of, dep_index);
+                    group_of[a.max(b)] = a.min(b);
+                }
+            }
+        }
+        let mut groups: Vec<(Priority, Vec<usize>)> = Vec::new();
+        let mut group_index: FxHashMap<usize, usize> = FxHashMap::default();
+        for (index, unit) in units.iter().enumerate() {
+            if !unit.keys.iter().any(|&key| needed(key)) {
+                continue;
+            }
+            let group_root = root(&mut group_of, index);
+            let entry = *group_index.entry(group_root).or_insert_with(|| {
+                groups.push((unit.priority, Vec::new()));
+                groups.len() - 1
+            });
+            let group = &mut groups[entry];
+            if unit.priority == Priority::Startup {
+                group.0 = Priority::Startup;
+            }
+            // Units are in dependency order, so adding them in the
+            // same order keeps dependencies first.
+            group.1.push(index);
+            for &key in unit.keys {
+                state.key_units.insert(key, index);
+            }
+        }
+        // Stable sort keeps the startup units in order they are requested.
+        groups.sort_by_key(|x| x.0 == Priority::Deferred);
+        state.queue = groups.into_iter().map(|x| x.1).collect();
+    }
+
+    /// Starts worker threads running the scheduled units.
+    pub fn spawn_workers<'scope>(&'scope self, scope: &'scope std::thread::Scope<'scope, '_>) {
+        let mut state = self.state.lock();
+        if state.queue.is_empty() {
+            return;
+        }
+        let thread_count = std::thread::available_parallelism()
+            .map(|x| x.get())
+            .unwrap_or(1)
+            .min(state.queue.len());
+        debug!(
+            "Running {} groups of SC:R analysis on {} threads",
+            state.queue.len(),
+            thread_count,
+        );
+        state.start_time = Some(Instant::now());
+        drop(state);
+        for _ in 0..thread_count {
+            scope.spawn(move || self.worker());
+        }
+    }
+
+    fn worker(&self) {
+        loop {
+            let group = {
+                let mut state = self.state.lock();
+                match state.queue.pop_front() {
+                    Some(s) if !state.cancelled => s,
+                    _ => return,
+                }
+            };
+            let ctx = scarf::OperandContext::new();
+            let mut analysis = Analysis::new(self.binary, &ctx);
+            for unit_index in group {
+                let unit = &ANALYSIS_UNITS[unit_index];
+                let start = Instant::now();
+                let mut output = UnitOutput {
+                    image: self.image,
+                    results: Vec::with_capacity(unit.keys.len()),
+                };
+                (unit.run)(&mut analysis, &mut output);
+                let elapsed = start.elapsed();
+                let mut state = self.state.lock();
+                state.results.extend(output.results);
+                state.unit_done[unit_index] = true;
+                state.timings.push((unit.name, elapsed));
+                state.end_time = Some(Instant::now());
+                let cancelled = state.cancelled;
+                drop(state);
+                self.condvar.notify_all();
+                if cancelled {
+                    return;
+                }
+            }
+        }
+    }
+
+    /// Waits until the unit containing `key` has been analyzed and returns the value.
+    ///
+    /// Returns `None` if the key isn't being analyzed here, or if the value couldn't
+    /// be encoded.
+    pub fn wait(&self, key: &str) -> Option<EncodedValue> {
+        let mut state = self.state.lock();
+        let unit = *state.key_units.get(key)?;
+        loop {
+            if let Some(result) = state.results.remove(key) {
+                return result;
+            }
+            if state.unit_done[unit] || state.cancelled {
+                return None;
+            }
+            self.condvar.wait(&mut state);
+        }
+    }
+
+    /// Makes workers stop after their current unit.
+    pub fn cancel(&self) {
+        let mut state = self.state.lock();
+        state.cancelled = true;
+        state.queue.clear();
+        drop(state);
+        self.condvar.notify_all();
+    }
+
+    /// Logs how long each unit took, slowest first.
+    pub fn log_timings(&self) {
+        let mut state = self.state.lock();
+        if state.timings.is_empty() {
+            return;
+        }
+        let total = match (state.start_time, state.end_time) {
+            (Some(start), Some(end)) => end.saturating_duration_since(start),
+            _ => Duration::ZERO,
+        };
+        state.timings.sort_by(|a, b| b.1.cmp(&a.1));
+        let timings = state
+            .timings
+            .iter()
+            .map(|(name, time)| format!("{} {}ms", name, time.as_millis()))
+            .collect::<Vec<_>>()
+            .join(", ");
+        info!(
+            "SC:R analysis took {}ms; units: {}",
+            total.as_millis(),
+            timings
+        );
+    }
+}
@@ -0,0 +1,160 @@
+//! Lookups for the path rules in `file_rules.txt`, which build.rs compiles to static tables.
+
+struct HdRule {
+    /// Suffix has to match the entire path.
+    exact: bool,
+    /// If not empty, path has to start with one of these.
+    include: &'static [&'static [u8]],
+    /// Path must not start with any of these.
+    exclude: &'static [&'static [u8]],
+    replacement: HdReplacement,
+}
+
+struct TrieNode {
+    byte: u8,
+    /// Index to `HD_RULES` + 1, or 0 if no suffix ends at this node.
+    rule: u8,
+    child_count: u8,
+    first_child: u16,
+}
+
+include!(concat!(env!("OUT_DIR"), "/file_rules.rs"));
+
+/// Returns what a file should be replaced with when HD graphics are disabled.
+/// `path` is expected to be normalized by `file_hook::real_path`.
+///
+/// The longest matching suffix decides; if its prefix conditions don't match, the file isn't
+/// replaced even if there's a shorter suffix that would match.
+pub fn hd_replacement(path: &[u8]) -> Option<HdReplacement> {
+    let mut node = &SUFFIX_TRIE[0];
+    let mut matched = None;
+    for (i, &byte) in path.iter().rev().enumerate() {
+        let first = node.first_child as usize;
+        let children = &SUFFIX_TRIE[first..first + node.child_count as usize];
+        node = match children.iter().find(|x| x.byte == byte) {
+            Some(s) => s,
+            None => break,
+        };
+        if node.rule != 0 {
+            let rule = &HD_RULES[node.rule as usize - 1];
+            if !rule.exact || i + 1 == path.len() {
+                matched = Some(rule);
+            }
+        }
+    }
+    let rule = matched?;
+    if !rule.include.is_empty() && !rule.include.iter().any(|x| path.starts_with(x)) {
+        return None;
+    }
+    if rule.exclude.iter().any(|x| path.starts_with(x)) {
+        return None;
+    }
+    Some(rule.replacement)
+}
+
+/// True if the sprite doesn't have a Carbot variant.
+pub fn is_carbot_missing_sprite(sprite: u32) -> bool {
+    CARBOT_MISSING_SPRITES
+        .get(sprite as usize / 64)
+        .map(|&bits| bits & (1 << (sprite % 64)) != 0)
+        .unwrap_or(false)
+}
+
+#[cfg(test)]
+mod test {
+    use super::{hd_replacement, is_carbot_missing_sprite, HdReplacement};
+
+    #[test]
+    fn hd_rules() {
+        let cases: &[(&[u8], Option<HdReplacement>)] = &[
+            (b"anim/main_000.anim", Some(HdReplacement::Anim)),
+            (b"tileset/foliage.anim", None),
+            (b"anim/main_000.dds", Some(HdReplacement::Dds)),
+            (b"font/font8.dds", None),
+            (b"tileset/badlands.dds.vr4", Some(HdReplacement::Ddsgrp)),
+            (b"unit/cmdicons.dds.grp", Some(HdReplacement::Ddsgrp)),
+            (b"effect/scanner.dds.grp", Some(HdReplacement::Ddsgrp)),
+            (b"tileset/badlands.dds.grp", None),
+            (b"anim/skins.json", Some(HdReplacement::EmptySkins)),
+            (b"x/anim/skins.json", None),
+            (b"rez/badnames.json", None),
+            (b"", None),
+            (b"anim", None),
+            (b".anim", None),
+            (b"sound/zerg/drone/zdrrdy00.wav", None),
+        ];
+        for &(path, expected) in cases {
+            assert_eq!(
+                hd_replacement(path),
+                expected,
+                "{}",
+                String::from_utf8_lossy(path)
+            );
+        }
+    }
+
+    #[test]
+    fn carbot_missing_sprites() {
+        assert!(is_carbot_missing_sprite(106));
+        assert!(is_carbot_missing_sprite(972));
+        assert!(!is_carbot_missing_sprite(0));
+        assert!(!is_carbot_missing_sprite(107));
+        assert!(!is_carbot_missing_sprite(998));
+        assert!(!is_carbot_missing_sprite(100_000));
+    }
+
+    /// `cargo test path_rules::test::bench -- --ignored --nocapture`
+    ///
+    /// Uses the prefetch manifest given in `SB_FILE_TRACE` (see `file_prefetch.rs`, these are
+    /// recorded from the files SC:R opens) if set. Otherwise uses a deterministic synthetic list
+    /// of paths shaped like the ones SC:R opens (anims, tilesets, icons, sounds), which is fine for
+    /// comparing changes to the rules against each other but isn't a real file access pattern.
+    #[test]
+    #[ignore]
+    fn bench() {
+        use std::time::Instant;
+
+        let trace: Vec<Vec<u8>> = match std::env::var_os("SB_FILE_TRACE") {
+            Some(path) => std::fs::read(path)
+                .unwrap()
+                .split(|&x| x == b'\n')
+                .filter_map(|line| line.splitn(6, |&x| x == b' ').nth(5))
+                .map(|x| x.to_vec())
+                .collect(),
+            None => {
+                let mut trace = Vec::new();
+                for i in 0..999 {
+                    trace.push(format!("anim/main_{:03}.anim", i).into_bytes());
+                    trace.push(format!("anim/main_{:03}.dds", i).into_bytes());
+                }
+                for name in &["badlands", "platform", "install", "jungle", "twilight"] {
+                    for ext in &["cv5", "vf4", "vx4ex", "vr4", "wpe", "dds.vr4", "dds.grp"] {
+                        trace.push(format!("tileset/{}.{}", name, ext).into_bytes());
+                    }
+                }
+                for i in 0..200 {
+                    trace.push(format!("unit/icon{}.dds.grp", i).into_bytes());
+                    trace.push(format!("sound/unit/unit{}.wav", i).into_bytes());
+                }
+                trace.push(b"anim/skins.json".to_vec());
+                trace.push(b"font/font16.dds".to_vec());
+                trace
+            }
+        };
+        const ROUNDS: usize = 1000;
+        let start = Instant::now();
+        let mut matched = 0;
+        for _ in 0..ROUNDS {
+            for path in &trace {
+                matched += hd_replacement(std::hint::black_box(path)).is_some() as usize;
+            }
+        }
+        let elapsed = start.elapsed();
+        println!(
+            "{} paths, {} matched, {:.1}ns per lookup",
+            trace.len(),
+            matched / ROUNDS,
+            elapsed.as_nanos() as f64 / (ROUNDS * trace.len()) as f64,
+        );
+    }
+}
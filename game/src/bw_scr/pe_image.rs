@@ -57,6 +57,12 @@ pub unsafe fn hash_pe_header(base: *const u8) -> u32 {
     fxhash::hash32(section_headers)
 }
 
+/// Size of the loaded image in memory (SizeOfImage of PE optional header).
+pub unsafe fn image_size(base: *const u8) -> u32 {
+    let pe_header = read_u32(base, 0x3c);
+    read_u32(base, pe_header as usize + 0x50)
+}
+
 unsafe fn read_u32(base: *const u8, offset: usize) -> u32 {
     (base.add(offset) as *const u32).read_unaligned()
 }
@@ -4,58 +4,43 @@
 //! to 127, for 8 different fonts. The time this takes ends up being
 //! considerable enough that caching this ends up being beneficial.
 //!
-//! The cache file read/write operations are done in the async threads
-//! to reduce the cache overhead a bit. (Reading is initiated well before
-//! the cache is actually needed)
+//! The cache file is opened in the async threads to reduce the cache
+//! overhead a bit. (Opening is initiated well before the cache is actually
+//! needed)
+//!
+//! The file is memory mapped and glyphs are used directly from the mapping,
+//! so opening the cache doesn't have to read the entire file. New glyphs are
+//! appended to the end of the file as soon as they are rendered, which also
+//! lets several game processes share the cache.
 
-use std::collections::hash_map;
+use std::cmp::Ordering;
+use std::io::{Read, Seek, SeekFrom, Write};
+use std::os::windows::fs::FileExt;
 use std::mem::ManuallyDrop;
 use std::sync::Arc;
-use std::path::{Path, PathBuf};
+use std::path::Path;
 
 use byteorder::{ByteOrder, LittleEndian, WriteBytesExt};
-use tokio::fs;
-use tokio::io::{self, AsyncReadExt, AsyncWriteExt, BufReader};
+use tokio::io;
 use fxhash::FxHashMap;
 use parking_lot::{MappedMutexGuard, Mutex, MutexGuard};
 
-use super::{BwScr, scr, hooks};
+use crate::windows::{self, MappedFile};
 
-// 2M
-const MAX_CACHE_SIZE_BYTES: usize = 2 * 1024 * 1024;
+use super::{BwScr, scr, hooks};
 
 pub fn apply_sdf_cache_hooks<'e>(
     scr: &BwScr,
     exe: &mut whack::ModulePatcher<'_>,
     base: usize,
 ) {
-    let font_cache_render_ascii = scr.font_cache_render_ascii;
     let ttf_render_sdf = scr.ttf_render_sdf;
     let ttf_malloc = scr.ttf_malloc;
     let fonts = scr.fonts;
 
     let cache = scr.sdf_cache.clone();
-    let cache2 = cache.clone();
     unsafe {
         let fonts = fonts.resolve();
-        let relative = font_cache_render_ascii.0 as usize - base;
-        exe.hook_closure_address(hooks::FontCacheRenderAscii, move |this, orig| {
-            orig(this);
-            // Moving this to process exit instead could be better,
-            // now it won't write anything that is cached after initialization.
-            // Also now it writes the cache 4 times if starting from empty,
-            // as FontCacheRenderAscii is called for 4 different fonts.
-            if cache2.lock().is_dirty() {
-                let async_handle = crate::async_handle();
-                let mut cache_locked = cache2.clone().lock_owned();
-                async_handle.spawn(async move {
-                    let cache = cache_locked.as_mut().unwrap();
-                    if let Err(e) = cache.write_to_disk().await {
-                        warn!("Writing SDF cache failed: {}", e);
-                    }
-                });
-            }
-        }, relative);
         let relative = ttf_render_sdf.0 as usize - base;
         exe.hook_closure_address(hooks::Ttf_RenderSdf, move |a, b, c, d, e, f, g, h, i, j, orig| {
             render_sdf(&cache, fonts, ttf_malloc, a, b, c, d, e, f, g, h, i, j, orig)
@@ -220,12 +205,30 @@ impl InitSdfCache {
 }
 
 pub struct SdfCache {
-    path: PathBuf,
-    dirty: bool,
-    load_failed: bool,
-    /// Key is (font id, character)
-    glyphs: FxHashMap<(FontId, u32), SdfBuffer>,
-    data: Vec<u8>,
+    /// The cache file, which may be shared with other game processes running at the
+    /// same time. `None` if the file couldn't be opened, in which case the cache
+    /// is only kept in memory.
+    file: Option<std::fs::File>,
+    /// The cache file as it was when it was opened.
+    /// Glyphs that are found from here are used directly from the mapping.
+    mapping: Option<MappedFile>,
+    /// Number of entries in the sorted index at the start of `mapping`.
+    index_count: usize,
+    /// Where the data of indexed entries ends and journal starts.
+    journal_offset: usize,
+    /// Glyphs that were in the journal part of the file, as offsets of their
+    /// entries in `mapping`.
+    journal: FxHashMap<(FontId, u32), u32>,
+    /// Glyphs that were added after the file was mapped, either rendered by this
+    /// process or read from journal entries appended by other processes.
+    new_glyphs: FxHashMap<(FontId, u32), SdfBuffer>,
+    new_data: Vec<u8>,
+    /// File offset up to which the journal has been read, and where the next
+    /// glyph is appended to.
+    file_end: u64,
+    /// Incremented every time the file is opened, glyphs remember the last session
+    /// they were used in so that the least recently used ones can be evicted.
+    session: u32,
     /// Some hash that ideally would change whenever the executable has changed.
     /// As this cache does not know all parameters that the game uses to render
     /// SDFs, we'll just assume that the parameters stay same for a single version
@@ -237,6 +240,7 @@ pub struct SdfCache {
 }
 
 /// SDF data is 8bpp, so data.len() == width * height
+#[derive(Copy, Clone)]
 struct SdfBuffer {
     width: u16,
     height: u16,
@@ -250,9 +254,11 @@ struct CachedSdf<'a> {
 }
 
 struct VacantSdfEntry<'a> {
-    entry: hash_map::VacantEntry<'a, (FontId, u32), SdfBuffer>,
-    data: &'a mut Vec<u8>,
-    dirty: &'a mut bool,
+    cache: &'a mut SdfCache,
+    key: (FontId, u32),
+    /// If set, this process holds `WRITE_LOCK_OFFSET` lock until the glyph has been
+    /// inserted, so that other processes won't render it too.
+    locked: bool,
 }
 
 enum SdfCacheResult<'a> {
@@ -264,182 +270,749 @@ enum SdfCacheResult<'a> {
 /// scale (raw f32)
 /// and TTF variation which is another index withing TTF data
 /// (Though afaik the variation is always same?)
-#[derive(Copy, Clone, Eq, PartialEq, Debug, Hash)]
+#[derive(Copy, Clone, Eq, PartialEq, Ord, PartialOrd, Debug, Hash)]
 struct FontId(u64, u32, u8);
 
 // File format:
-// u32 exe_hash (resetting cache every SCR patch)
-// u32 data_len
-// u32 sdf_count
 // {
-//      (u64, u8) font_id
+//      u32 magic
+//      u32 exe_hash (resetting cache every SCR patch)
+//      u32 session
+//      u32 index_count
+//      u32 journal_offset
+//      u8 padding[0xc]
+// } header
+// Entry index[index_count] (sorted by font id, glyph)
+// u8 data[] (until journal_offset)
+// {
+//      u32 checksum (of entry, excluding last_used, and data)
+//      Entry entry (data_offset points right after the entry)
+//      u8 data[width * height]
+// } journal[] (until end of file)
+//
+// Entry {
+//      (u64, u32, u8, u8[3] padding) font_id
 //      u32 glyph
 //      u16 width
 //      u16 height
-//      u32 offset
-// } sdfs[sdf_count]
-// u8 data[data_len]
+//      u32 data_offset (from start of file)
+//      u32 last_used (session)
+// }
+//
+// New glyphs are appended to the journal. When opening a cache whose journal has grown
+// too large, the journal is merged to the index, evicting least recently used glyphs
+// if the cache has grown larger than MAX_CACHE_SIZE_BYTES.
+//
+// Multiple processes can use the file at once; they synchronize with file locks
+// on bytes far past the end of file, which don't affect reading or writing the file.
+// The file is only rewritten while no other process has it open, as it can't be
+// truncated while it's mapped by someone. Otherwise the journal is only appended
+// to, and a process that doesn't find a glyph checks the journal for glyphs
+// appended by others while holding the write lock.
+
+const CACHE_MAGIC: u32 = 0x32464453; // 'SDF2'
+const HEADER_SIZE: usize = 0x20;
+const ENTRY_SIZE: usize = 0x20;
+const LAST_USED_OFFSET: usize = 0x1c;
+const JOURNAL_HEADER_SIZE: usize = 4 + ENTRY_SIZE;
+/// Glyph data above this size gets evicted when the cache is compacted.
+const MAX_CACHE_SIZE_BYTES: usize = 16 * 1024 * 1024;
+/// The journal is merged into the sorted index on load once it is this large.
+const MAX_JOURNAL_SIZE_BYTES: usize = 512 * 1024;
+/// Every process using the cache holds a shared lock on this, the file is only
+/// rewritten by a process that can lock it exclusively.
+const USERS_LOCK_OFFSET: u64 = 0x7fff_0000_0000_0000;
+/// Held while opening the file, and from not finding a glyph until it has been
+/// rendered and appended to the file.
+const WRITE_LOCK_OFFSET: u64 = USERS_LOCK_OFFSET + 1;
+
+struct Entry {
+    key: (FontId, u32),
+    width: u16,
+    height: u16,
+    data_offset: u32,
+    last_used: u32,
+}
+
+impl Entry {
+    fn read_key(bytes: &[u8]) -> (FontId, u32) {
+        let font = FontId(
+            LittleEndian::read_u64(&bytes[0..]),
+            LittleEndian::read_u32(&bytes[8..]),
+            bytes[12],
+        );
+        (font, LittleEndian::read_u32(&bytes[0x10..]))
+    }
+
+    fn read(bytes: &[u8]) -> Entry {
+        Entry {
+            key: Entry::read_key(bytes),
+            width: LittleEndian::read_u16(&bytes[0x14..]),
+            height: LittleEndian::read_u16(&bytes[0x16..]),
+            data_offset: LittleEndian::read_u32(&bytes[0x18..]),
+            last_used: LittleEndian::read_u32(&bytes[LAST_USED_OFFSET..]),
+        }
+    }
+
+    fn write(&self, out: &mut [u8]) {
+        let (font, glyph) = self.key;
+        LittleEndian::write_u64(&mut out[0..], font.0);
+        LittleEndian::write_u32(&mut out[8..], font.1);
+        out[12] = font.2;
+        out[13..0x10].copy_from_slice(&[0; 3]);
+        LittleEndian::write_u32(&mut out[0x10..], glyph);
+        LittleEndian::write_u16(&mut out[0x14..], self.width);
+        LittleEndian::write_u16(&mut out[0x16..], self.height);
+        LittleEndian::write_u32(&mut out[0x18..], self.data_offset);
+        LittleEndian::write_u32(&mut out[LAST_USED_OFFSET..], self.last_used);
+    }
+
+    fn data_len(&self) -> usize {
+        self.width as usize * self.height as usize
+    }
+}
+
+fn journal_checksum(entry: &[u8], data: &[u8]) -> u32 {
+    fxhash::hash32(&(&entry[..LAST_USED_OFFSET], data))
+}
+
+/// Where `SdfCache::find` found a glyph.
+enum Location {
+    New(SdfBuffer),
+    /// Offset of the entry in mapping
+    Mapped(usize),
+}
 
 impl SdfCache {
     /// Initializes the SDF cache from the on-disk file.
-    /// If it fails to load for some reason, initializes a dummy one so that
+    /// If it fails to load for some reason, initializes a memory-only one so that
     /// we don't have to crash here.
     pub async fn init(exe_hash: u32) -> SdfCache {
         let args = crate::parse_args();
         let mut path = args.user_data_path.clone();
         path.push("sdf_cache.dat");
-        if !path.exists() {
-            return SdfCache::empty(path, exe_hash);
-        }
-        match SdfCache::open(&path, exe_hash).await {
+        let result = tokio::task::spawn_blocking(move || SdfCache::open(&path, exe_hash))
+            .await
+            .unwrap_or_else(|e| Err(io::Error::new(io::ErrorKind::Other, e)));
+        match result {
             Ok(o) => o,
             Err(e) => {
-                warn!("Couldn't open SDF cache: {}", e);
-                if e.kind() == io::ErrorKind::PermissionDenied {
-                    // Cache may be being written by another process, so prefer just
-                    // having this process not write cache at all over starting a
-                    // new cache from nothing.
-                    let mut result = SdfCache::empty(PathBuf::new(), 0);
-                    result.load_failed = true;
-                    result
-                } else {
-                    // Assuming corrupted cache, so reset it
-                    SdfCache::empty(path, exe_hash)
-                }
+                warn!("Couldn't open SDF cache, glyphs won't be saved: {}", e);
+                SdfCache::empty(exe_hash)
             }
         }
     }
 
-    pub fn empty(path: PathBuf, exe_hash: u32) -> SdfCache {
+    pub fn empty(exe_hash: u32) -> SdfCache {
         SdfCache {
-            path,
-            dirty: false,
-            load_failed: false,
-            glyphs: Default::default(),
-            data: Default::default(),
+            file: None,
+            mapping: None,
+            index_count: 0,
+            journal_offset: 0,
+            journal: Default::default(),
+            new_glyphs: Default::default(),
+            new_data: Default::default(),
+            file_end: 0,
+            session: 0,
             exe_hash,
         }
     }
 
-    pub async fn open(path: &Path, exe_hash: u32) -> io::Result<SdfCache> {
-        let mut file = BufReader::new(fs::File::open(path).await?);
-        let mut header = [0u8; 12];
-        file.read_exact(&mut header).await?;
-        let cache_hash = LittleEndian::read_u32(&header[..4]);
-        let data_len = LittleEndian::read_u32(&header[4..8]) as usize;
-        let sdf_count = LittleEndian::read_u32(&header[8..12]) as usize;
+    /// Opens and maps the cache file, creating, resetting or compacting it first if needed.
+    /// Blocking, as it may have to wait for other processes.
+    fn open(path: &Path, exe_hash: u32) -> io::Result<SdfCache> {
+        let mut file = std::fs::OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .open(path)?;
+        // Locks are released when the file gets closed on error.
+        windows::lock_file_range(&file, WRITE_LOCK_OFFSET, true, true)?;
+        let mut cache = SdfCache::open_locked(&mut file, exe_hash)?;
+        windows::unlock_file_range(&file, WRITE_LOCK_OFFSET)?;
+        cache.file = Some(file);
+        Ok(cache)
+    }
 
-        if exe_hash != cache_hash {
+    fn open_locked(file: &mut std::fs::File, exe_hash: u32) -> io::Result<SdfCache> {
+        let only_user = windows::lock_file_range(file, USERS_LOCK_OFFSET, true, false)?;
+        let len = file.metadata()?.len() as usize;
+        let mut header = [0u8; HEADER_SIZE];
+        let valid_header = len >= HEADER_SIZE && {
+            file.read_exact(&mut header)?;
+            LittleEndian::read_u32(&header[0..]) == CACHE_MAGIC
+        };
+        let cache_hash = LittleEndian::read_u32(&header[4..]);
+        let journal_offset = LittleEndian::read_u32(&header[0x10..]) as usize;
+        let keep_glyphs = valid_header && cache_hash == exe_hash;
+        if valid_header && !keep_glyphs {
             info!(
                 "Exe hash has changed, invalidating SDF cache ({:08x} vs {:08x})",
                 exe_hash, cache_hash,
             );
-            return Ok(SdfCache::empty(path.into(), exe_hash));
         }
-        let mut glyph_data = vec![0u8; sdf_count * 25];
-        file.read_exact(&mut glyph_data[..]).await?;
-        let mut data = vec![0u8; data_len];
-        file.read_exact(&mut data[..]).await?;
-        drop(file);
-        let mut glyphs = FxHashMap::with_capacity_and_hasher(sdf_count, Default::default());
-        for sdf in glyph_data.chunks_exact(25) {
-            let hash = LittleEndian::read_u64(&sdf[..]);
-            let scale = LittleEndian::read_u32(&sdf[8..]);
-            let key = (FontId(hash, scale, sdf[12]), LittleEndian::read_u32(&sdf[13..]));
-            let value = SdfBuffer {
-                width: LittleEndian::read_u16(&sdf[17..]),
-                height: LittleEndian::read_u16(&sdf[19..]),
-                data_offset: LittleEndian::read_u32(&sdf[21..]),
+        if !keep_glyphs && !only_user {
+            // Likely another process running a different game version.
+            return Err(io::Error::new(
+                io::ErrorKind::Other,
+                "Cache file is used by another process",
+            ));
+        }
+        // If other processes are using the file, merging the journal is left for
+        // whoever opens the cache next while no one else does.
+        let compact = len.saturating_sub(journal_offset) > MAX_JOURNAL_SIZE_BYTES;
+        if !keep_glyphs || (compact && only_user) {
+            let session = match keep_glyphs {
+                true => LittleEndian::read_u32(&header[8..]),
+                false => 0,
             };
-            let end = (value.data_offset as usize)
-                .wrapping_add(value.width as usize * value.height as usize);
-            if value.data_offset as usize >= data.len() || end > data.len() {
-                return Err(io::Error::new(io::ErrorKind::Other, "Corrupted file"));
+            let mut data = Vec::new();
+            if keep_glyphs {
+                file.seek(SeekFrom::Start(0))?;
+                file.read_to_end(&mut data)?;
             }
-            glyphs.insert(key, value);
+            let glyphs = collect_glyphs(&data);
+            let buffer = build_compacted_file(exe_hash, session, glyphs);
+            // Write the magic last, so that a partially written file won't be used.
+            file.set_len(0)?;
+            file.seek(SeekFrom::Start(4))?;
+            file.write_all(&buffer[4..])?;
+            file.seek(SeekFrom::Start(0))?;
+            file.write_all(&buffer[..4])?;
+            debug!("Compacted SDF cache to {} bytes", buffer.len());
         }
+        if only_user {
+            windows::unlock_file_range(file, USERS_LOCK_OFFSET)?;
+        }
+        windows::lock_file_range(file, USERS_LOCK_OFFSET, false, true)?;
+
+        let mut mapping = MappedFile::new(file)?;
+        let data = mapping.as_mut_slice();
+        if data.len() < HEADER_SIZE || LittleEndian::read_u32(&data[0..]) != CACHE_MAGIC {
+            return Err(io::Error::new(io::ErrorKind::Other, "Corrupted file"));
+        }
+        let session = LittleEndian::read_u32(&data[8..]).wrapping_add(1);
+        LittleEndian::write_u32(&mut data[8..], session);
+        let index_count = LittleEndian::read_u32(&data[0xc..]) as usize;
+        let journal_offset = LittleEndian::read_u32(&data[0x10..]) as usize;
+        let index_end = index_count
+            .checked_mul(ENTRY_SIZE)
+            .and_then(|x| x.checked_add(HEADER_SIZE))
+            .filter(|&end| end <= journal_offset && journal_offset <= data.len());
+        if index_end.is_none() {
+            return Err(io::Error::new(io::ErrorKind::Other, "Corrupted file"));
+        }
+        let (journal, journal_end) = parse_journal(data, journal_offset, 0);
+        debug!(
+            "Opened SDF cache with {} indexed and {} journaled glyphs",
+            index_count,
+            journal.len(),
+        );
         Ok(SdfCache {
-            path: path.into(),
-            dirty: false,
-            load_failed: false,
-            glyphs,
-            data,
+            file: None,
+            mapping: Some(mapping),
+            index_count,
+            journal_offset,
+            journal,
+            new_glyphs: Default::default(),
+            new_data: Default::default(),
+            file_end: journal_end as u64,
+            session,
             exe_hash,
         })
     }
 
+    fn find(&self, key: (FontId, u32)) -> Option<Location> {
+        if let Some(&sdf) = self.new_glyphs.get(&key) {
+            return Some(Location::New(sdf));
+        }
+        let data = self.mapping.as_ref()?.as_slice();
+        if let Some(&offset) = self.journal.get(&key) {
+            // Journal entries were validated when opening
+            return Some(Location::Mapped(offset as usize));
+        }
+        let index = &data[HEADER_SIZE..][..self.index_count * ENTRY_SIZE];
+        let mut low = 0;
+        let mut high = self.index_count;
+        while low < high {
+            let mid = low + (high - low) / 2;
+            let entry_bytes = &index[mid * ENTRY_SIZE..][..ENTRY_SIZE];
+            match Entry::read_key(entry_bytes).cmp(&key) {
+                Ordering::Less => low = mid + 1,
+                Ordering::Greater => high = mid,
+                Ordering::Equal => {
+                    let entry = Entry::read(entry_bytes);
+                    let end = (entry.data_offset as usize).checked_add(entry.data_len())?;
+                    if end > self.journal_offset {
+                        warn!("Corrupted SDF cache entry");
+                        return None;
+                    }
+                    return Some(Location::Mapped(HEADER_SIZE + mid * ENTRY_SIZE));
+                }
+            }
+        }
+        None
+    }
+
     fn get<'a>(&'a mut self, font_id: FontId, glyph: u32) -> SdfCacheResult<'a> {
-        match self.glyphs.entry((font_id, glyph)) {
-            hash_map::Entry::Vacant(entry) => {
-                SdfCacheResult::Missing(VacantSdfEntry {
-                    entry,
-                    data: &mut self.data,
-                    dirty: &mut self.dirty,
+        let key = (font_id, glyph);
+        let mut location = self.find(key);
+        let mut locked = false;
+        if location.is_none() {
+            if let Some(ref file) = self.file {
+                // Another process may have rendered the glyph after it was last checked.
+                // Keep the lock until the glyph has been appended to the file, so any
+                // process trying to render it at the same time will use this one.
+                // This runs on the game thread, so if another process is holding the
+                // lock, the glyph is just rendered here and not saved rather than waiting.
+                match windows::lock_file_range(file, WRITE_LOCK_OFFSET, true, false) {
+                    Ok(false) => debug!("SDF cache is locked, not saving glyph {}", glyph),
+                    Ok(true) => {
+                        if let Err(e) = self.read_appended_glyphs() {
+                            warn!("Couldn't read SDF cache: {}", e);
+                        }
+                        location = self.find(key);
+                        if location.is_some() {
+                            self.unlock_writes();
+                        } else {
+                            locked = true;
+                        }
+                    }
+                    Err(e) => warn!("Couldn't lock SDF cache: {}", e),
+                }
+            }
+        }
+        match location {
+            Some(Location::New(sdf)) => {
+                let length = sdf.width as usize * sdf.height as usize;
+                let data = &self.new_data[(sdf.data_offset as usize)..][..length];
+                SdfCacheResult::Cached(CachedSdf {
+                    width: sdf.width,
+                    height: sdf.height,
+                    data,
                 })
             }
-            hash_map::Entry::Occupied(entry) => {
-                let value = entry.get();
-                let length = value.width as usize * value.height as usize;
-                let data = &self.data[(value.data_offset as usize)..][..length];
+            Some(Location::Mapped(entry_offset)) => {
+                let session = self.session;
+                let mapping = self.mapping.as_mut().expect("Found glyph without mapping");
+                let data = mapping.as_mut_slice();
+                let entry = Entry::read(&data[entry_offset..]);
+                if entry.last_used != session {
+                    LittleEndian::write_u32(&mut data[entry_offset + LAST_USED_OFFSET..], session);
+                }
+                let data = &mapping.as_slice()[entry.data_offset as usize..][..entry.data_len()];
                 SdfCacheResult::Cached(CachedSdf {
-                    width: value.width,
-                    height: value.height,
+                    width: entry.width,
+                    height: entry.height,
                     data,
                 })
             }
+            None => SdfCacheResult::Missing(VacantSdfEntry { cache: self, key, locked }),
         }
     }
 
-    pub fn is_dirty(&self) -> bool {
-        self.dirty
+    fn unlock_writes(&self) {
+        if let Some(ref file) = self.file {
+            if let Err(e) = windows::unlock_file_range(file, WRITE_LOCK_OFFSET) {
+                warn!("Couldn't unlock SDF cache: {}", e);
+            }
+        }
     }
 
-    pub async fn write_to_disk(&mut self) -> io::Result<()> {
-        if self.load_failed {
-            // Don't write to disk if reading from there failed for some reason
+    /// Reads glyphs that other processes have appended to the journal since
+    /// it was last read. Should be called while holding the write lock.
+    fn read_appended_glyphs(&mut self) -> io::Result<()> {
+        let file = match self.file {
+            Some(ref f) => f,
+            None => return Ok(()),
+        };
+        let len = file.metadata()?.len();
+        if len <= self.file_end {
             return Ok(());
         }
-        if self.data.len() > MAX_CACHE_SIZE_BYTES {
-            // Reset the cache if it gets too big
-            self.data.clear();
-            self.glyphs.clear();
+        let mut buffer = vec![0u8; (len - self.file_end) as usize];
+        let mut pos = 0;
+        while pos < buffer.len() {
+            let n = file.seek_read(&mut buffer[pos..], self.file_end + pos as u64)?;
+            if n == 0 {
+                break;
+            }
+            pos += n;
         }
-        debug!("Writing {} pixels of SDF data", self.data.len());
-        let capacity = 12 + self.data.len() + self.glyphs.len() * 25;
-        let mut buffer = Vec::with_capacity(capacity);
-        WriteBytesExt::write_u32::<LittleEndian>(&mut buffer, self.exe_hash)?;
-        WriteBytesExt::write_u32::<LittleEndian>(&mut buffer, self.data.len() as u32)?;
-        WriteBytesExt::write_u32::<LittleEndian>(&mut buffer, self.glyphs.len() as u32)?;
-        let mut glyph_data = [0u8; 25];
-        for (key, val) in self.glyphs.iter() {
-            LittleEndian::write_u64(&mut glyph_data[0..], (key.0).0);
-            LittleEndian::write_u32(&mut glyph_data[8..], (key.0).1);
-            glyph_data[12] = (key.0).2;
-            LittleEndian::write_u32(&mut glyph_data[13..], key.1);
-            LittleEndian::write_u16(&mut glyph_data[17..], val.width);
-            LittleEndian::write_u16(&mut glyph_data[19..], val.height);
-            LittleEndian::write_u32(&mut glyph_data[21..], val.data_offset);
-            buffer.extend_from_slice(&glyph_data[..]);
+        buffer.truncate(pos);
+        let (glyphs, end) = parse_journal(&buffer, 0, self.file_end as usize);
+        for (key, offset) in glyphs {
+            let entry = Entry::read(&buffer[offset as usize..]);
+            let data_offset = self.new_data.len() as u32;
+            let start = offset as usize + ENTRY_SIZE;
+            self.new_data.extend_from_slice(&buffer[start..][..entry.data_len()]);
+            self.new_glyphs.insert(key, SdfBuffer {
+                width: entry.width,
+                height: entry.height,
+                data_offset,
+            });
         }
-        buffer.extend_from_slice(&self.data);
-        let mut file = fs::File::create(&self.path).await?;
-        file.write_all(&buffer).await?;
-        debug_assert_eq!(buffer.len(), capacity);
-        debug!("SDF cache written");
-        self.dirty = false;
+        self.file_end += end as u64;
         Ok(())
     }
+
+    /// Appends a glyph from `new_glyphs` to the journal. Should be called while holding
+    /// the write lock, after `read_appended_glyphs` has made `file_end` current.
+    fn append_glyph(&mut self, key: (FontId, u32)) -> io::Result<()> {
+        let file = match self.file {
+            Some(ref f) => f,
+            None => return Ok(()),
+        };
+        let sdf = self.new_glyphs[&key];
+        let entry = Entry {
+            key,
+            width: sdf.width,
+            height: sdf.height,
+            data_offset: (self.file_end as usize + JOURNAL_HEADER_SIZE) as u32,
+            last_used: self.session,
+        };
+        let data = &self.new_data[(sdf.data_offset as usize)..][..entry.data_len()];
+        let mut entry_bytes = [0u8; ENTRY_SIZE];
+        entry.write(&mut entry_bytes);
+        let mut buffer = Vec::with_capacity(JOURNAL_HEADER_SIZE + data.len());
+        WriteBytesExt::write_u32::<LittleEndian>(
+            &mut buffer,
+            journal_checksum(&entry_bytes, data),
+        )?;
+        buffer.extend_from_slice(&entry_bytes);
+        buffer.extend_from_slice(data);
+        let mut pos = 0;
+        while pos < buffer.len() {
+            pos += file.seek_write(&buffer[pos..], self.file_end + pos as u64)?;
+        }
+        self.file_end += buffer.len() as u64;
+        Ok(())
+    }
+}
+
+/// Collects every valid glyph from a cache file.
+fn collect_glyphs(data: &[u8]) -> Vec<(Entry, &[u8])> {
+    let mut glyphs = FxHashMap::default();
+    if data.len() < HEADER_SIZE {
+        return Vec::new();
+    }
+    let index_count = LittleEndian::read_u32(&data[0xc..]) as usize;
+    let journal_offset = (LittleEndian::read_u32(&data[0x10..]) as usize).min(data.len());
+    let index = data
+        .get(HEADER_SIZE..)
+        .and_then(|x| x.get(..index_count.checked_mul(ENTRY_SIZE)?))
+        .unwrap_or(&[]);
+    for entry_bytes in index.chunks_exact(ENTRY_SIZE) {
+        let entry = Entry::read(entry_bytes);
+        let start = entry.data_offset as usize;
+        if let Some(sdf) = start
+            .checked_add(entry.data_len())
+            .filter(|&end| end <= journal_offset)
+            .map(|end| &data[start..end])
+        {
+            glyphs.insert(entry.key, (entry, sdf));
+        }
+    }
+    let (journal, _) = parse_journal(data, journal_offset, 0);
+    for (_, offset) in journal {
+        let entry = Entry::read(&data[offset as usize..]);
+        let start = entry.data_offset as usize;
+        let sdf = &data[start..][..entry.data_len()];
+        // Journal entries are newer than indexed ones, so they replace them
+        glyphs.insert(entry.key, (entry, sdf));
+    }
+    glyphs.into_iter().map(|x| x.1).collect()
+}
+
+/// Returns valid journal entries as offsets of their `Entry` in `data`, and offset where
+/// the valid part of journal ends. `file_offset` is the file offset of `data[0]`.
+fn parse_journal(
+    data: &[u8],
+    start: usize,
+    file_offset: usize,
+) -> (FxHashMap<(FontId, u32), u32>, usize) {
+    let mut result = FxHashMap::default();
+    let mut pos = start;
+    while let Some(record) = data.get(pos..pos + JOURNAL_HEADER_SIZE) {
+        let checksum = LittleEndian::read_u32(record);
+        let entry_bytes = &record[4..];
+        let entry = Entry::read(entry_bytes);
+        let data_start = pos + JOURNAL_HEADER_SIZE;
+        let sdf = match data.get(data_start..data_start + entry.data_len()) {
+            Some(s) => s,
+            None => break,
+        };
+        if entry.data_offset as usize != file_offset + data_start ||
+            journal_checksum(entry_bytes, sdf) != checksum
+        {
+            // Most likely a write that didn't finish, anything after this
+            // gets overwritten by next write.
+            break;
+        }
+        result.insert(entry.key, (pos + 4) as u32);
+        pos = data_start + sdf.len();
+    }
+    (result, pos)
+}
+
+/// Creates a cache file with `glyphs` in the sorted index and no journal.
+/// Least recently used glyphs are dropped if they don't fit in `MAX_CACHE_SIZE_BYTES`.
+fn build_compacted_file(
+    exe_hash: u32,
+    session: u32,
+    mut glyphs: Vec<(Entry, &[u8])>,
+) -> Vec<u8> {
+    let total_size: usize = glyphs.iter().map(|x| x.1.len()).sum();
+    if total_size > MAX_CACHE_SIZE_BYTES {
+        glyphs.sort_unstable_by_key(|x| session.wrapping_sub(x.0.last_used));
+        let mut size = 0;
+        let keep = glyphs
+            .iter()
+            .take_while(|x| {
+                size += x.1.len();
+                size <= MAX_CACHE_SIZE_BYTES
+            })
+            .count();
+        debug!("Evicting {} glyphs from SDF cache", glyphs.len() - keep);
+        glyphs.truncate(keep);
+    }
+    glyphs.sort_unstable_by_key(|x| x.0.key);
+
+    let data_start = HEADER_SIZE + glyphs.len() * ENTRY_SIZE;
+    let data_size: usize = glyphs.iter().map(|x| x.1.len()).sum();
+    let mut buffer = vec![0u8; data_start];
+    buffer.reserve(data_size);
+    LittleEndian::write_u32(&mut buffer[0..], CACHE_MAGIC);
+    LittleEndian::write_u32(&mut buffer[4..], exe_hash);
+    LittleEndian::write_u32(&mut buffer[8..], session);
+    LittleEndian::write_u32(&mut buffer[0xc..], glyphs.len() as u32);
+    LittleEndian::write_u32(&mut buffer[0x10..], (data_start + data_size) as u32);
+    for (i, (entry, data)) in glyphs.iter_mut().enumerate() {
+        entry.data_offset = buffer.len() as u32;
+        entry.write(&mut buffer[HEADER_SIZE + i * ENTRY_SIZE..][..ENTRY_SIZE]);
+        buffer.extend_from_slice(data);
+    }
+    buffer
 }
 
 impl<'a> VacantSdfEntry<'a> {
     pub fn insert(self, width: u16, height: u16, data: &[u8]) {
-        let data_offset = self.data.len() as u32;
-        self.data.extend_from_slice(data);
-        self.entry.insert(SdfBuffer {
+        let key = self.key;
+        let cache = &mut *self.cache;
+        let data_offset = cache.new_data.len() as u32;
+        cache.new_data.extend_from_slice(data);
+        cache.new_glyphs.insert(key, SdfBuffer {
             width,
             height,
             data_offset,
         });
-        *self.dirty = true;
+        if self.locked {
+            if let Err(e) = cache.append_glyph(key) {
+                warn!("Writing SDF cache failed: {}", e);
+            }
+        }
+    }
+}
+
+impl<'a> Drop for VacantSdfEntry<'a> {
+    fn drop(&mut self) {
+        if self.locked {
+            self.cache.unlock_writes();
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn font() -> FontId {
+        FontId(0x1234_5678_9abc_def0, 0x4180_0000, 0)
+    }
+
+    fn entry(glyph: u32, width: u16, height: u16, last_used: u32) -> Entry {
+        Entry {
+            key: (font(), glyph),
+            width,
+            height,
+            data_offset: 0,
+            last_used,
+        }
+    }
+
+    fn glyph_data(entry: &Entry, fill: u8) -> Vec<u8> {
+        vec![fill; entry.data_len()]
+    }
+
+    /// Appends a journal record the same way `SdfCache::append_glyph` does.
+    fn append_journal(file: &mut Vec<u8>, mut entry: Entry, data: &[u8]) {
+        entry.data_offset = (file.len() + JOURNAL_HEADER_SIZE) as u32;
+        let mut entry_bytes = [0u8; ENTRY_SIZE];
+        entry.write(&mut entry_bytes);
+        WriteBytesExt::write_u32::<LittleEndian>(file, journal_checksum(&entry_bytes, data))
+            .unwrap();
+        file.extend_from_slice(&entry_bytes);
+        file.extend_from_slice(data);
+    }
+
+    fn journal_offset(file: &[u8]) -> usize {
+        LittleEndian::read_u32(&file[0x10..]) as usize
+    }
+
+    /// Returns (glyph, first data byte, data length) of collected glyphs, sorted by glyph.
+    fn collected(file: &[u8]) -> Vec<(u32, u8, usize)> {
+        let mut result = collect_glyphs(file)
+            .into_iter()
+            .map(|(entry, data)| (entry.key.1, data[0], data.len()))
+            .collect::<Vec<_>>();
+        result.sort_unstable();
+        result
+    }
+
+    #[test]
+    fn compacted_file_round_trip() {
+        let glyphs = [entry(66, 4, 8, 1), entry(65, 3, 3, 1), entry(67, 10, 2, 1)];
+        let data = glyphs
+            .iter()
+            .enumerate()
+            .map(|(i, e)| glyph_data(e, i as u8 + 1))
+            .collect::<Vec<_>>();
+        let file = build_compacted_file(
+            0x1234,
+            5,
+            glyphs
+                .into_iter()
+                .zip(data.iter())
+                .map(|(e, d)| (e, &d[..]))
+                .collect(),
+        );
+
+        assert_eq!(LittleEndian::read_u32(&file[0..]), CACHE_MAGIC);
+        assert_eq!(LittleEndian::read_u32(&file[4..]), 0x1234);
+        assert_eq!(LittleEndian::read_u32(&file[8..]), 5);
+        assert_eq!(LittleEndian::read_u32(&file[0xc..]), 3);
+        assert_eq!(journal_offset(&file), file.len());
+        // The index is sorted so that it can be binary searched
+        let index_glyphs = (0..3)
+            .map(|i| Entry::read_key(&file[HEADER_SIZE + i * ENTRY_SIZE..]).1)
+            .collect::<Vec<_>>();
+        assert_eq!(index_glyphs, [65, 66, 67]);
+        assert_eq!(collected(&file), [(65, 2, 9), (66, 1, 32), (67, 3, 20)]);
+    }
+
+    #[test]
+    fn compacting_evicts_least_recently_used() {
+        // Each of these is half of the max size, so only the two most recent ones fit
+        let data = vec![0u8; MAX_CACHE_SIZE_BYTES / 2];
+        let glyphs = vec![
+            (entry(1, 4096, 2048, 8), &data[..]),
+            (entry(2, 4096, 2048, 10), &data[..]),
+            (entry(3, 4096, 2048, 9), &data[..]),
+        ];
+        let file = build_compacted_file(0, 10, glyphs);
+        assert_eq!(LittleEndian::read_u32(&file[0xc..]), 2);
+        let kept = collected(&file).into_iter().map(|x| x.0).collect::<Vec<_>>();
+        assert_eq!(kept, [2, 3]);
+    }
+
+    #[test]
+    fn journal_entries_replace_indexed_ones() {
+        let indexed = entry(65, 2, 2, 1);
+        let indexed_data = glyph_data(&indexed, 1);
+        let mut file = build_compacted_file(0, 1, vec![(indexed, &indexed_data[..])]);
+        let start = journal_offset(&file);
+        append_journal(&mut file, entry(65, 3, 3, 2), &[7; 9]);
+        append_journal(&mut file, entry(66, 1, 4, 2), &[8; 4]);
+
+        let (journal, end) = parse_journal(&file, start, 0);
+        assert_eq!(journal.len(), 2);
+        assert_eq!(end, file.len());
+        assert_eq!(journal[&(font(), 65)] as usize, start + 4);
+        assert_eq!(collected(&file), [(65, 7, 9), (66, 8, 4)]);
+    }
+
+    #[test]
+    fn journal_parsed_from_file_offset() {
+        // Parsing just the appended part of a file, as `read_appended_glyphs` does
+        let mut file = build_compacted_file(0, 1, Vec::new());
+        append_journal(&mut file, entry(65, 2, 2, 1), &[1; 4]);
+        let appended_start = file.len();
+        append_journal(&mut file, entry(66, 2, 2, 1), &[2; 4]);
+
+        let (journal, end) = parse_journal(&file[appended_start..], 0, appended_start);
+        assert_eq!(journal.len(), 1);
+        assert_eq!(journal[&(font(), 66)], 4);
+        assert_eq!(end, file.len() - appended_start);
+
+        // Offsets that don't match where the record is are rejected
+        let (journal, end) = parse_journal(&file[appended_start..], 0, 0);
+        assert!(journal.is_empty());
+        assert_eq!(end, 0);
+    }
+
+    #[test]
+    fn truncated_journal_tail() {
+        let mut file = build_compacted_file(0, 1, Vec::new());
+        let start = journal_offset(&file);
+        append_journal(&mut file, entry(65, 2, 2, 1), &[1; 4]);
+        let valid_end = file.len();
+        append_journal(&mut file, entry(66, 4, 4, 1), &[2; 16]);
+
+        // Cut in the middle of the glyph data
+        let (journal, end) = parse_journal(&file[..file.len() - 3], start, 0);
+        assert_eq!(journal.len(), 1);
+        assert!(journal.contains_key(&(font(), 65)));
+        assert_eq!(end, valid_end);
+
+        // Cut in the middle of the record header
+        let (journal, end) = parse_journal(&file[..valid_end + 10], start, 0);
+        assert_eq!(journal.len(), 1);
+        assert_eq!(end, valid_end);
+
+        assert_eq!(collected(&file[..file.len() - 3]), [(65, 1, 4)]);
+    }
+
+    #[test]
+    fn corrupt_journal_tail() {
+        let mut file = build_compacted_file(0, 1, Vec::new());
+        let start = journal_offset(&file);
+        append_journal(&mut file, entry(65, 2, 2, 1), &[1; 4]);
+        let valid_end = file.len();
+        append_journal(&mut file, entry(66, 2, 2, 1), &[2; 4]);
+        append_journal(&mut file, entry(67, 2, 2, 1), &[3; 4]);
+        // Corrupt the data of the second record, the valid record after it isn't used
+        // either as it gets overwritten by the next write.
+        file[valid_end + JOURNAL_HEADER_SIZE] ^= 0xff;
+
+        let (journal, end) = parse_journal(&file, start, 0);
+        assert_eq!(journal.len(), 1);
+        assert_eq!(end, valid_end);
+        assert_eq!(collected(&file), [(65, 1, 4)]);
+
+        // A huge size from a corrupted entry doesn't read past the data
+        let mut file = build_compacted_file(0, 1, Vec::new());
+        append_journal(&mut file, entry(65, 0xffff, 0xffff, 1), &[]);
+        let (journal, end) = parse_journal(&file, start, 0);
+        assert!(journal.is_empty());
+        assert_eq!(end, start);
+    }
+
+    #[test]
+    fn collect_glyphs_handles_garbage() {
+        assert!(collect_glyphs(&[]).is_empty());
+        assert!(collect_glyphs(&[0xff; HEADER_SIZE - 1]).is_empty());
+
+        let indexed = entry(65, 2, 2, 1);
+        let indexed_data = glyph_data(&indexed, 1);
+        let mut file = build_compacted_file(0, 1, vec![(indexed, &indexed_data[..])]);
+        // An index count and journal offset past the end of the file
+        LittleEndian::write_u32(&mut file[0xc..], 1000);
+        LittleEndian::write_u32(&mut file[0x10..], 0xffff_ffff);
+        assert!(collect_glyphs(&file).is_empty());
+
+        // An index entry pointing past the journal offset is dropped
+        let mut file = build_compacted_file(0, 1, vec![(entry(65, 2, 2, 1), &indexed_data[..])]);
+        LittleEndian::write_u32(&mut file[HEADER_SIZE + 0x18..], file.len() as u32 - 2);
+        assert!(collect_glyphs(&file).is_empty());
     }
 }
@@ -34,6 +34,7 @@ use crate::proto::messages::game_message_payload::Payload;
 use crate::proto::messages::{ClientAckResponseMessage, ClientReadyMessage};
 use crate::replay;
 use crate::snp;
+use crate::timings;
 
 pub struct GameState {
     init_state: InitState,
@@ -270,6 +271,8 @@ impl GameState {
         let game_request_send = self.send_main_thread_requests.clone();
 
         let network_send = self.network_send.clone();
+        let is_host = local_user.name == info.host.name;
+        let join_routes_early_future = self.network.join_routes_early();
         let init_routes_when_ready_future = self.network.init_routes_when_ready();
         let network_ready_future = self.network.wait_network_ready();
         let net_game_info_set_future = self.network.set_game_info(info.clone());
@@ -279,6 +282,12 @@ impl GameState {
             .send(())
             .expect("Main thread should be waiting for a wakeup");
         async move {
+            if !is_host {
+                // Lets rally-point routes be joined while BW is initializing.
+                join_routes_early_future
+                    .await
+                    .map_err(GameInitError::NetworkInit)?;
+            }
             let sbat_replay_data = match info.is_replay() {
                 true => Some(read_sbat_replay_data(Path::new(&info.map_path))),
                 false => None,
@@ -287,7 +296,6 @@ impl GameState {
             // ready to start the game - remaining initialization is done from other threads.
             // Could possibly aim to keep all of BW initialization in the main thread, but this
             // system has worked fine so far.
-            let is_host = local_user.name == info.host.name;
             let req = send_game_request(
                 &game_request_send,
                 GameThreadRequestType::SetupInfo(info.clone()),
@@ -515,6 +523,7 @@ impl GameState {
             }
 
             debug!("Network stall statistics: {:?}", results.network_stalls);
+            debug!("Game timings: {:?}", results.timings);
 
             if !deliver_final_network.is_empty() {
                 select! {
@@ -524,6 +533,10 @@ impl GameState {
             }
             debug!("Final network sends completed");
 
+            // The replay is written on a background thread, make sure that it has been finished
+            // before the app is allowed to close us.
+            replay::wait_for_pending_writes().await;
+
             app_socket::send_message(&ws_send, "/game/finished", ())
                 .await
                 .map_err(|_| GameInitError::Closed)?;
@@ -791,6 +804,7 @@ async fn send_game_result(
             .iter()
             .map(|(&uid, result)| (uid, result.clone()))
             .collect(),
+        timings: &results.timings,
     };
 
     for _ in 0u8..3 {
@@ -1309,6 +1323,7 @@ impl InitInProgress {
                 min: stall_min as u32,
                 max: stall_max as u32,
             },
+            timings: timings::game_timings(),
         });
         for send in self.waiting_for_result.drain(..) {
             let _ = send.send(message.clone());
@@ -1663,28 +1678,39 @@ async fn read_sbat_replay_data(path: &Path) -> Result<Option<replay::SbatReplayD
     let mut buffer = [0u8; 0x14];
     file.read_exact(&mut buffer).await?;
     let magic = LittleEndian::read_u32(&buffer[0xc..]);
-    let scr_extension_offset = LittleEndian::read_u32(&buffer[0x10..]);
+    let scr_extension_offset = LittleEndian::read_u32(&buffer[0x10..]) as u64;
     if magic != 0x53526573 {
         return Ok(None);
     }
     let end_pos = file.seek(io::SeekFrom::End(0)).await?;
-    file.seek(io::SeekFrom::Start(scr_extension_offset as u64))
-        .await?;
-    let length = end_pos.saturating_sub(scr_extension_offset as u64) as usize;
-    let mut buffer = vec![0u8; length];
-    file.read_exact(&mut buffer).await?;
-    let mut pos = 0;
-    while pos < length {
-        let header = match buffer.get(pos..(pos + 8)) {
-            Some(s) => s,
-            None => break,
-        };
-        let id = LittleEndian::read_u32(header);
-        let section_length = LittleEndian::read_u32(&header[4..]) as usize;
+
+    // Replays that we've written end with a footer pointing to the Sbat section; if the
+    // footer isn't there (or doesn't point to a valid section), walk through section headers.
+    let mut section_pos = None;
+    if end_pos >= scr_extension_offset + replay::FOOTER_LENGTH as u64 + 8 {
+        let mut footer = [0u8; replay::FOOTER_LENGTH];
+        file.seek(io::SeekFrom::End(-(replay::FOOTER_LENGTH as i64)))
+            .await?;
+        file.read_exact(&mut footer).await?;
+        section_pos = replay::parse_footer(&footer)
+            .map(|pos| pos as u64)
+            .filter(|&pos| pos >= scr_extension_offset);
+    }
+    let mut pos = section_pos.unwrap_or(scr_extension_offset);
+    let mut header = [0u8; 8];
+    while pos.saturating_add(8) <= end_pos {
+        file.seek(io::SeekFrom::Start(pos)).await?;
+        file.read_exact(&mut header).await?;
+        let id = LittleEndian::read_u32(&header);
+        let section_length = LittleEndian::read_u32(&header[4..]) as u64;
+        let data_end = pos + 8 + section_length;
         if id == replay::SECTION_ID {
-            let data = Some(())
-                .and_then(|()| buffer.get(pos.checked_add(8)?..)?.get(..section_length))
-                .and_then(replay::parse_shieldbattery_data);
+            let mut data = None;
+            if data_end <= end_pos {
+                let mut buffer = vec![0u8; section_length as usize];
+                file.read_exact(&mut buffer).await?;
+                data = replay::parse_shieldbattery_data(&buffer);
+            }
             return match data {
                 Some(o) => Ok(Some(o)),
                 None => Err(io::Error::new(
@@ -1692,8 +1718,11 @@ async fn read_sbat_replay_data(path: &Path) -> Result<Option<replay::SbatReplayD
                     "Failed to parse shieldbattery section",
                 )),
             };
+        } else if section_pos.take().is_some() {
+            // Footer was wrong
+            pos = scr_extension_offset;
         } else {
-            pos = pos.saturating_add(section_length).saturating_add(8);
+            pos = data_end;
         }
     }
     Ok(None)
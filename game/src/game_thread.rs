@@ -4,7 +4,6 @@ use std::path::PathBuf;
 use std::sync::mpsc::Receiver;
 use std::sync::{Arc, Mutex};
 
-use byteorder::{ByteOrder, LittleEndian};
 use fxhash::FxHashSet;
 use lazy_static::lazy_static;
 use libc::c_void;
@@ -14,10 +13,11 @@ use bw_dat::dialog::Dialog;
 use bw_dat::{Unit, UnitId};
 
 use crate::app_messages::GameSetupInfo;
-use crate::bw::{self, get_bw, Bw, StormPlayerId};
+use crate::bw::{self, commands, get_bw, Bw, StormPlayerId};
 use crate::forge;
 use crate::replay;
 use crate::snp;
+use crate::timings;
 
 lazy_static! {
     pub static ref SEND_FROM_GAME_THREAD: Mutex<Option<tokio::sync::mpsc::UnboundedSender<GameThreadMessage>>> =
@@ -124,6 +124,7 @@ unsafe fn handle_game_request(request: GameThreadRequestType) {
         RunWndProc => forge::run_wnd_proc(),
         StartGame => {
             forge::game_started();
+            timings::reset();
             get_bw().run_game_loop();
             debug!("Game loop ended");
             let results = game_results();
@@ -135,6 +136,10 @@ unsafe fn handle_game_request(request: GameThreadRequestType) {
             get_bw().clean_up_for_exit();
         }
         SetupInfo(info) => {
+            if let Some(ref map_data) = info.map.map_data {
+                // Replays don't have map data, so they don't get prefetched.
+                get_bw().prefetch_game_files(map_data.tileset);
+            }
             if SETUP_INFO.set(info).is_err() {
                 warn!("Received second SetupInfo");
             }
@@ -337,6 +342,8 @@ pub fn map_name_for_filename() -> String {
 /// its once-per-gameplay-frame processing but before anything gets rendered. It probably
 /// isn't too useful to us unless we end up having a need to change game rules.
 pub unsafe fn after_step_game() {
+    let start = timings::now();
+    timings::frame_started(start);
     let bw = get_bw();
     if is_replay() && !is_ums() {
         // One thing BW's step_game does is that it removes any fog sprites that were
@@ -375,6 +382,7 @@ pub unsafe fn after_step_game() {
             }
         }
     }
+    timings::AFTER_STEP_GAME.record_since(start);
 }
 
 /// Reimplementation of replay command reading & processing since the default implementation
@@ -383,6 +391,12 @@ pub unsafe fn after_step_game() {
 /// A function pointer for the original function is still needed to handle replay ending
 /// case which we don't need to touch.
 pub unsafe fn step_replay_commands(orig: unsafe extern "C" fn()) {
+    let start = timings::now();
+    step_replay_commands_inner(orig);
+    timings::STEP_REPLAY_COMMANDS.record_since(start);
+}
+
+unsafe fn step_replay_commands_inner(orig: unsafe extern "C" fn()) {
     let bw = get_bw();
     let game = bw.game();
     let replay = bw.replay_data();
@@ -402,7 +416,7 @@ pub unsafe fn step_replay_commands(orig: unsafe extern "C" fn()) {
     }
 
     loop {
-        let (mut frame_data, rest) = match replay_next_frame(data) {
+        let (mut frame_data, rest) = match commands::replay_next_frame(data) {
             Some(s) => s,
             None => {
                 warn!("Broken replay? Unable to read next frame");
@@ -415,41 +429,13 @@ pub unsafe fn step_replay_commands(orig: unsafe extern "C" fn()) {
         }
         data = rest;
         while let Some((storm_player, command)) = frame_data.next_command(command_lengths) {
-            bw.process_replay_commands(command, storm_player);
+            bw.process_replay_commands(command, StormPlayerId(storm_player));
         }
     }
     let new_pos = (data_end as usize - data.len()) as *mut u8;
     (*replay).data_pos = new_pos;
 }
 
-struct ReplayFrame<'a> {
-    frame: u32,
-    // (u8 storm_player, u8 command[...]) pairs repeated.
-    // (Command length must be known from the data)
-    commands: &'a [u8],
-}
-
-fn replay_next_frame<'a>(input: &'a [u8]) -> Option<(ReplayFrame<'a>, &'a [u8])> {
-    let &commands_len = input.get(4)?;
-    let frame = LittleEndian::read_u32(input.get(..4)?);
-    let rest = input.get(5..)?;
-    let commands = rest.get(..commands_len as usize)?;
-    let rest = rest.get(commands_len as usize..)?;
-    Some((ReplayFrame { frame, commands }, rest))
-}
-
-impl<'a> ReplayFrame<'a> {
-    pub fn next_command(&mut self, command_lengths: &[u32]) -> Option<(StormPlayerId, &'a [u8])> {
-        let player = StormPlayerId(*self.commands.get(0)?);
-        let data = self.commands.get(1..)?;
-        let length = bw::commands::command_length(data, command_lengths)?;
-        let command = data.get(..length)?;
-        let rest = data.get(length..)?;
-        self.commands = rest;
-        Some((player, command))
-    }
-}
-
 /// Bw impl is expected to hook the point before init_unit_data and call this.
 /// (It happens to be easy function for SC:R analysis to find and in a nice
 /// spot to inject game init hooks for things that require initialization to
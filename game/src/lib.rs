@@ -41,6 +41,7 @@ mod proto;
 mod rally_point;
 mod replay;
 mod snp;
+mod timings;
 mod udp;
 mod windows;
 
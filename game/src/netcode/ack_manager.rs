@@ -1,6 +1,8 @@
 use prost::Message;
-use std::collections::BTreeMap;
+use std::collections::{BTreeMap, VecDeque};
+use std::time::Instant;
 
+use crate::netcode::rtt::RttEstimator;
 use crate::netcode::sequence_buffer::SequenceBuffer;
 use crate::proto::messages::game_message_payload::Payload;
 use crate::proto::messages::{ClientAckRequestMessage, GameMessage, GameMessagePayload};
@@ -11,9 +13,10 @@ use crate::proto::messages::{ClientAckRequestMessage, GameMessage, GameMessagePa
 const MIN_MTU: u32 = 1200;
 const UDP_OVERHEAD: u32 = 68;
 const RALLY_POINT_OVERHEAD: u32 = 13;
-const MAX_GAME_MESSAGE_OVERHEAD: u32 = (9 + 1) + (9 + 1) + (4 + 1);
-const MAX_PAYLOAD_SIZE: u32 =
-    MIN_MTU - (UDP_OVERHEAD + RALLY_POINT_OVERHEAD + MAX_GAME_MESSAGE_OVERHEAD);
+pub const MAX_GAME_MESSAGE_OVERHEAD: u32 = (9 + 1) + (9 + 1) + (4 + 1);
+/// The largest encoded `GameMessage` that fits in a single packet.
+pub const MAX_MESSAGE_SIZE: u32 = MIN_MTU - (UDP_OVERHEAD + RALLY_POINT_OVERHEAD);
+pub const MAX_PAYLOAD_SIZE: u32 = MAX_MESSAGE_SIZE - MAX_GAME_MESSAGE_OVERHEAD;
 
 /// How many received packets to track before overwriting. We send acks in a 32-bit bitfield, so
 /// storing anything more than 33 isn't valuable (32 bits + the ack for the current packet).
@@ -23,6 +26,12 @@ const PACKET_ACKS_SIZE: usize = 32 + 1;
 /// definitely consider these packets lost.
 const SENT_PACKETS_SIZE: usize = 256;
 
+/// How many packets newer than a sent packet have to be acked before the unacked packet is
+/// considered lost for measuring packet loss.
+const LOSS_REORDER_THRESHOLD: u64 = 3;
+/// Weight of each packet in the exponentially weighted packet loss rate.
+const LOSS_SMOOTHING: f32 = 1.0 / 32.0;
+
 /// Value initially used for `remote_ack_num` before we've seen any packets from the remote client.
 const NO_REMOTE_PACKETS_SEEN_NUM: u64 = 0xFFFF_FFFF_FFFF_FFFF;
 
@@ -58,6 +67,20 @@ pub struct AckManager {
     /// will still be turned into a GameMessage (and considered sent), they just won't have
     /// additional messages added past the initial one.
     max_payload_size: u32,
+    /// Payloads that have been given a payload number, but not yet included in any packet. These
+    /// get sent together in as few packets as possible on the next `build_outgoing` or
+    /// `build_queued` call.
+    queued_payloads: VecDeque<SentPayload>,
+    /// Combined `payload_len` of `queued_payloads`.
+    queued_len: usize,
+    /// Round-trip time estimated from the time it takes for the remote client to ack the packets
+    /// sent by this client. Note that this includes any delay the remote client has before it
+    /// sends a packet that carries the ack.
+    rtt: RttEstimator,
+    /// Smoothed fraction of sent packets that were lost.
+    loss_rate: f32,
+    /// The next sent packet that hasn't been counted in `loss_rate` yet.
+    loss_check_num: u64,
 }
 
 impl AckManager {
@@ -73,9 +96,20 @@ impl AckManager {
             unacked_payloads: BTreeMap::new(),
             received_packets: SequenceBuffer::with_capacity(PACKET_ACKS_SIZE),
             max_payload_size,
+            queued_payloads: VecDeque::new(),
+            queued_len: 0,
+            rtt: RttEstimator::new(),
+            loss_rate: 0.0,
+            loss_check_num: 0,
         }
     }
 
+    /// Changes the combined size of payloads that packets are filled up to, e.g. to leave room
+    /// for FEC parity built over the packets (see `FecEncoder::max_payload_size`).
+    pub fn set_max_payload_size(&mut self, max_payload_size: u32) {
+        self.max_payload_size = max_payload_size;
+    }
+
     fn last_seen_remote_packet_num(&self) -> u64 {
         self.received_packets.sequence().wrapping_sub(1)
     }
@@ -85,6 +119,16 @@ impl AckManager {
         self.unacked_payloads.len()
     }
 
+    pub fn rtt(&self) -> &RttEstimator {
+        &self.rtt
+    }
+
+    /// Estimated fraction (0.0 - 1.0) of packets sent by this client that don't reach the remote
+    /// client.
+    pub fn packet_loss(&self) -> f32 {
+        self.loss_rate
+    }
+
     /// Constructs the `ack_bits` field for a [`GameMessage`], building a 32-bit bitfield with a 1
     /// for each of the last 32 packets that have been seen.
     fn ack_bits(&self) -> u32 {
@@ -127,7 +171,11 @@ impl AckManager {
 
         if incoming.ack != NO_REMOTE_PACKETS_SEEN_NUM {
             let ack = incoming.ack;
-            self.on_packet_acked(ack);
+            // Only the most recent packet is used for RTT, ones in `ack_bits` may have been
+            // received a while ago.
+            if let Some(sent_at) = self.on_packet_acked(ack) {
+                self.rtt.add_sample(sent_at.elapsed());
+            }
 
             let mut ack_bits = incoming.ack_bits;
             for i in 1..=32 {
@@ -139,16 +187,72 @@ impl AckManager {
                 }
                 ack_bits >>= 1;
             }
+
+            self.update_loss_rate(ack);
         }
     }
 
-    fn on_packet_acked(&mut self, sequence: u64) {
-        let acked = self.sent_packets.remove(sequence);
-        if let Some(packet) = acked {
-            for id in packet.payload_nums.iter() {
-                self.unacked_payloads.remove(id);
-            }
+    /// Counts packets that are far enough behind `ack` and still haven't been acked as lost.
+    fn update_loss_rate(&mut self, ack: u64) {
+        let end = ack.saturating_sub(LOSS_REORDER_THRESHOLD);
+        if end > self.loss_check_num + SENT_PACKETS_SIZE as u64 {
+            // Packets this old aren't tracked anymore
+            self.loss_check_num = end - SENT_PACKETS_SIZE as u64;
+        }
+        while self.loss_check_num < end {
+            let lost = if self.sent_packets.exists(self.loss_check_num) {
+                1.0
+            } else {
+                0.0
+            };
+            self.loss_rate += (lost - self.loss_rate) * LOSS_SMOOTHING;
+            self.loss_check_num += 1;
+        }
+    }
+
+    /// Returns the time when the packet was sent, if it hadn't been acked before.
+    fn on_packet_acked(&mut self, sequence: u64) -> Option<Instant> {
+        let packet = self.sent_packets.remove(sequence)?;
+        for id in packet.payload_nums.iter() {
+            self.unacked_payloads.remove(id);
         }
+        packet.sent_at
+    }
+
+    /// Assigns a payload number to `payload` and queues it to be sent with the next packet built,
+    /// so that several small payloads can share the packet header and acks.
+    ///
+    /// The returned [`QueueStatus`] tells whether the caller should build a packet right away, or
+    /// start waiting for more payloads.
+    pub fn queue_payload(&mut self, payload: Payload) -> QueueStatus {
+        let was_empty = self.queued_payloads.is_empty();
+        let payload = GameMessagePayload {
+            payload: Some(payload),
+            payload_num: self.payload_num,
+        };
+        self.payload_num += 1;
+        // Includes the field tag and length prefix that the payload is wrapped in within the
+        // `GameMessage`, so that packets filled up to `max_payload_size` actually fit.
+        let encoded_len = payload.encoded_len();
+        let payload_len = 1 + prost::length_delimiter_len(encoded_len) + encoded_len;
+        self.queued_len += payload_len;
+        self.queued_payloads.push_back(SentPayload {
+            send_count: 0,
+            payload,
+            payload_len,
+        });
+
+        if self.queued_len >= self.max_payload_size as usize {
+            QueueStatus::Full
+        } else if was_empty {
+            QueueStatus::Started
+        } else {
+            QueueStatus::Waiting
+        }
+    }
+
+    pub fn has_queued_payloads(&self) -> bool {
+        !self.queued_payloads.is_empty()
     }
 
     /// Constructs a new [`GameMessage`] containing the specified [`Payload`] and other
@@ -158,74 +262,133 @@ impl AckManager {
     ///
     /// If no payload is given, the request will be considered a [`ClientAckRequest`].
     ///
+    /// Payloads queued with `queue_payload` are sent before the given payload. If they don't all
+    /// fit in a single packet, the rest are left in the queue for `build_queued`.
+    ///
     /// Any messages built this way will be assumed to have been sent to the remote client, if they
     /// are not it can trigger delays in sending payloads.
     pub fn build_outgoing(&mut self, payload: Option<Payload>) -> GameMessage {
-        let mut message = GameMessage {
+        let payload = payload
+            .unwrap_or_else(|| Payload::ClientAckRequest(ClientAckRequestMessage::default()));
+        self.queue_payload(payload);
+        self.build_message()
+    }
+
+    /// Constructs a new [`GameMessage`] from the currently queued payloads, or returns `None` if
+    /// nothing is queued. Should be called until it returns `None` to send everything, as queued
+    /// payloads may not fit in a single packet.
+    pub fn build_queued(&mut self) -> Option<GameMessage> {
+        if self.queued_payloads.is_empty() {
+            None
+        } else {
+            Some(self.build_message())
+        }
+    }
+
+    /// Constructs a new [`GameMessage`] that contains only `payload`, without any queued or
+    /// unacked payloads. The payload is not tracked, so it will not be resent if the packet gets
+    /// lost.
+    pub fn build_untracked(&mut self, payload: Payload) -> GameMessage {
+        let mut message = self.new_message();
+        message.payloads.push(GameMessagePayload {
+            payload: Some(payload),
+            payload_num: self.payload_num,
+        });
+        self.payload_num += 1;
+        self.track_sent(&message);
+        message
+    }
+
+    fn new_message(&mut self) -> GameMessage {
+        let message = GameMessage {
             packet_num: self.packet_num,
             ack: self.last_seen_remote_packet_num(),
             ack_bits: self.ack_bits(),
             ..Default::default()
         };
         self.packet_num += 1;
+        message
+    }
 
-        let payload = payload
-            .or_else(|| Some(Payload::ClientAckRequest(ClientAckRequestMessage::default())))
-            .map(|p| GameMessagePayload {
-                payload: Some(p),
-                payload_num: self.payload_num,
-            })
-            .unwrap();
-        self.payload_num += 1;
+    fn track_sent(&mut self, message: &GameMessage) {
+        self.sent_packets.insert(
+            message.packet_num,
+            SentPacket {
+                packet_num: message.packet_num,
+                payload_nums: message.payloads.iter().map(|p| p.payload_num).collect(),
+                sent_at: Some(Instant::now()),
+            },
+        );
+    }
 
-        message.payloads.push(payload.clone());
-        let payload_len = payload.encoded_len();
-        let unacked_payload = match payload.payload {
-            Some(Payload::ClientAckRequest(_)) | Some(Payload::ClientAckResponse(_)) => None,
-            _ => Some(SentPayload {
-                send_count: 1,
-                payload,
-                payload_len,
-            }),
-        };
+    fn build_message(&mut self) -> GameMessage {
+        let mut message = self.new_message();
+
+        // Take as many queued payloads as fit, but always at least one so that payloads larger
+        // than `max_payload_size` still get sent.
+        let mut remaining = self.max_payload_size as usize;
+        let mut new_payloads = Vec::new();
+        while let Some(next) = self.queued_payloads.front() {
+            if !message.payloads.is_empty() && next.payload_len > remaining {
+                break;
+            }
+            let mut payload = self.queued_payloads.pop_front().unwrap();
+            self.queued_len -= payload.payload_len;
+            remaining = remaining.saturating_sub(payload.payload_len);
+            message.payloads.push(payload.payload.clone());
+            match payload.payload.payload {
+                Some(Payload::ClientAckRequest(_)) | Some(Payload::ClientAckResponse(_)) => (),
+                _ => {
+                    payload.send_count = 1;
+                    new_payloads.push(payload);
+                }
+            }
+        }
 
-        if payload_len < self.max_payload_size as usize {
-            let mut remaining = self.max_payload_size - payload_len as u32;
+        if remaining > 0 {
             for (_, p) in self.unacked_payloads.iter_mut() {
-                if p.payload_len > remaining as usize {
+                if p.payload_len > remaining {
                     continue;
                 }
 
                 p.send_count += 1;
                 message.payloads.push(p.payload.clone());
-                remaining -= p.payload_len as u32;
+                remaining -= p.payload_len;
             }
         }
 
-        // NOTE(tec27): Make sure to insert this *after* adding additional payloads from the unacked
-        // ones, otherwise you can end up doubling this payload in the current packet
-        if let Some(unacked) = unacked_payload {
+        // NOTE(tec27): Make sure to insert these *after* adding additional payloads from the
+        // unacked ones, otherwise you can end up doubling them in the current packet
+        for payload in new_payloads {
             self.unacked_payloads
-                .insert(unacked.payload.payload_num, unacked);
+                .insert(payload.payload.payload_num, payload);
         }
-        self.sent_packets.insert(
-            message.packet_num,
-            SentPacket {
-                packet_num: message.packet_num,
-                payload_nums: message.payloads.iter().map(|p| p.payload_num).collect(),
-            },
-        );
+        self.track_sent(&message);
 
         message
     }
 }
 
+/// Result of [`AckManager::queue_payload`].
+#[derive(Copy, Clone, Debug, Eq, PartialEq)]
+pub enum QueueStatus {
+    /// The queue was empty before this payload, the caller should build a packet once it has
+    /// waited for more payloads.
+    Started,
+    /// The payload was added to a queue that the caller is already waiting to send.
+    Waiting,
+    /// The queued payloads fill a packet, and should be sent now.
+    Full,
+}
+
 #[derive(Default, Clone, Debug, PartialEq)]
 struct SentPacket {
     /// The sequence number associated with this packet.
     pub packet_num: u64,
     /// The `payload_num` of payloads that were contained within this packet.
     pub payload_nums: Box<[u64]>,
+    /// When the packet was built. Only `None` for default-initialized entries.
+    pub sent_at: Option<Instant>,
 }
 
 #[derive(Debug)]
@@ -246,8 +409,8 @@ mod tests {
     use crate::proto::messages::game_message_payload::Payload;
     use crate::proto::messages::{GameMessage, StormWrapper};
 
-    use super::AckManager;
     use super::MAX_GAME_MESSAGE_OVERHEAD;
+    use super::{AckManager, QueueStatus};
 
     #[test]
     fn check_game_message_overhead() {
@@ -338,6 +501,22 @@ mod tests {
         );
     }
 
+    #[test]
+    fn rtt_sampled_from_acks() {
+        let mut manager = AckManager::with_max_payload_size(0);
+        for _ in 0..3 {
+            manager.build_outgoing(Some(make_test_payload()));
+        }
+        assert_eq!(manager.rtt().srtt(), None);
+
+        manager.handle_incoming(&make_fake_incoming(0, 1, &[0]));
+        assert!(manager.rtt().srtt().is_some());
+        let srtt = manager.rtt().srtt();
+        // Duplicate acks don't produce new samples
+        manager.handle_incoming(&make_fake_incoming(1, 1, &[0]));
+        assert_eq!(manager.rtt().srtt(), srtt);
+    }
+
     #[test]
     fn symmetric_500_sends_without_loss() {
         let mut local = AckManager::new();
@@ -410,6 +589,201 @@ mod tests {
         );
     }
 
+    #[test]
+    fn queued_payloads_share_packet() {
+        let mut manager = AckManager::new();
+        assert!(manager.build_queued().is_none());
+
+        assert_eq!(
+            manager.queue_payload(make_test_payload()),
+            QueueStatus::Started
+        );
+        assert_eq!(
+            manager.queue_payload(make_test_payload()),
+            QueueStatus::Waiting
+        );
+        assert_eq!(
+            manager.queue_payload(make_test_payload()),
+            QueueStatus::Waiting
+        );
+        assert!(manager.has_queued_payloads());
+
+        let message = manager.build_queued().unwrap();
+        assert_eq!(message.packet_num, 0);
+        let nums = message
+            .payloads
+            .iter()
+            .map(|p| p.payload_num)
+            .collect::<Vec<_>>();
+        assert_eq!(nums, vec![0, 1, 2]);
+        assert!(!manager.has_queued_payloads());
+        assert!(manager.build_queued().is_none());
+        assert_eq!(manager.payloads_in_flight(), 3);
+
+        // Queued payloads are sent before the one given to build_outgoing
+        manager.queue_payload(make_test_payload());
+        let message = manager.build_outgoing(Some(make_test_payload()));
+        assert_eq!(message.payloads[0].payload_num, 3);
+        assert_eq!(message.payloads[1].payload_num, 4);
+    }
+
+    #[test]
+    fn queued_payloads_split_when_full() {
+        // Fits two of the payloads, but not three
+        let mut manager = AckManager::with_max_payload_size(250);
+
+        assert_eq!(
+            manager.queue_payload(make_sized_payload(100)),
+            QueueStatus::Started
+        );
+        assert_eq!(
+            manager.queue_payload(make_sized_payload(100)),
+            QueueStatus::Waiting
+        );
+        assert_eq!(
+            manager.queue_payload(make_sized_payload(100)),
+            QueueStatus::Full
+        );
+
+        let first = manager.build_queued().unwrap();
+        assert_eq!(first.payloads.len(), 2);
+        let second = manager.build_queued().unwrap();
+        // New payload first, then a resend of one of the unacked ones
+        assert_eq!(second.payloads.len(), 2);
+        assert_eq!(second.payloads[0].payload_num, 2);
+        assert!(manager.build_queued().is_none());
+    }
+
+    /// Bytes and packets sent from one side of a connection over a simulated game, see
+    /// `simulate_turns`.
+    struct SendTotals {
+        /// Bytes on the wire, including the UDP and rally-point headers of every packet.
+        bytes: usize,
+        packets: usize,
+    }
+
+    /// Sends `messages_per_turn` Storm messages of `message_size` bytes each turn for `turns`
+    /// turns, either each in its own packet or coalesced into as few packets as fit, and has
+    /// the remote side ack them once per turn.
+    fn simulate_turns(
+        turns: usize,
+        messages_per_turn: usize,
+        message_size: usize,
+        coalesce: bool,
+    ) -> SendTotals {
+        let mut local = AckManager::new();
+        let mut remote = AckManager::new();
+        let mut totals = SendTotals {
+            bytes: 0,
+            packets: 0,
+        };
+        for _ in 0..turns {
+            let mut outgoing = Vec::new();
+            for _ in 0..messages_per_turn {
+                let payload = make_sized_payload(message_size);
+                if coalesce {
+                    if local.queue_payload(payload) == QueueStatus::Full {
+                        outgoing.extend(local.build_queued());
+                    }
+                } else {
+                    outgoing.push(local.build_outgoing(Some(payload)));
+                }
+            }
+            while let Some(message) = local.build_queued() {
+                outgoing.push(message);
+            }
+            for message in outgoing {
+                totals.bytes += message.encoded_len()
+                    + UDP_OVERHEAD as usize
+                    + RALLY_POINT_OVERHEAD as usize;
+                totals.packets += 1;
+                remote.handle_incoming(&message);
+            }
+            let response = remote.build_outgoing(Some(make_test_payload()));
+            local.handle_incoming(&response);
+        }
+        totals
+    }
+
+    /// Compares sending each Storm message in its own packet against coalescing all messages of
+    /// a turn into one, for a typical pattern of a few small messages per turn.
+    #[test]
+    fn coalescing_reduces_overhead() {
+        const TURNS: usize = 240;
+        const MESSAGES_PER_TURN: usize = 4;
+        const MESSAGE_SIZE: usize = 24;
+
+        let separate = simulate_turns(TURNS, MESSAGES_PER_TURN, MESSAGE_SIZE, false);
+        let coalesced = simulate_turns(TURNS, MESSAGES_PER_TURN, MESSAGE_SIZE, true);
+        assert_eq!(separate.packets, TURNS * MESSAGES_PER_TURN);
+        assert_eq!(coalesced.packets, TURNS);
+        assert!(coalesced.bytes < separate.bytes);
+    }
+
+    /// `cargo test ack_manager::tests::bench_coalescing -- --ignored --nocapture`
+    ///
+    /// Reports bytes on the wire and packets per turn with and without coalescing, for a range
+    /// of message counts and sizes per turn.
+    #[test]
+    #[ignore]
+    fn bench_coalescing() {
+        const TURNS: usize = 24 * 60;
+
+        println!(
+            "{:>9} {:>5} | {:>12} {:>12} | {:>10} {:>10}",
+            "msgs/turn", "size", "bytes", "coalesced", "pkts/turn", "coalesced"
+        );
+        for &messages_per_turn in &[1, 2, 4, 8, 16] {
+            for &message_size in &[8, 24, 64, 256] {
+                let separate = simulate_turns(TURNS, messages_per_turn, message_size, false);
+                let coalesced = simulate_turns(TURNS, messages_per_turn, message_size, true);
+                println!(
+                    "{:>9} {:>5} | {:>12} {:>12} | {:>10.2} {:>10.2}",
+                    messages_per_turn,
+                    message_size,
+                    separate.bytes,
+                    coalesced.bytes,
+                    separate.packets as f64 / TURNS as f64,
+                    coalesced.packets as f64 / TURNS as f64,
+                );
+            }
+        }
+    }
+
+    #[test]
+    fn packet_loss_measured() {
+        let mut local = AckManager::new();
+        let mut remote = AckManager::new();
+        for i in 0..400 {
+            let outgoing = local.build_outgoing(Some(make_test_payload()));
+            if i % 5 != 0 {
+                remote.handle_incoming(&outgoing);
+            }
+            let incoming = remote.build_outgoing(Some(make_test_payload()));
+            local.handle_incoming(&incoming);
+        }
+        assert!(local.packet_loss() > 0.15, "Loss {}", local.packet_loss());
+        assert!(local.packet_loss() < 0.25, "Loss {}", local.packet_loss());
+        assert_eq!(remote.packet_loss(), 0.0);
+    }
+
+    #[test]
+    fn untracked_payload_not_resent() {
+        let mut manager = AckManager::new();
+        let message = manager.build_untracked(make_test_payload());
+        assert_eq!(message.payloads.len(), 1);
+        assert_eq!(manager.payloads_in_flight(), 0);
+        let message = manager.build_outgoing(Some(make_test_payload()));
+        assert_eq!(message.payloads.len(), 1);
+        assert_eq!(message.payloads[0].payload_num, 1);
+    }
+
+    fn make_sized_payload(size: usize) -> Payload {
+        Payload::Storm(StormWrapper {
+            storm_data: vec![0x55; size].into(),
+        })
+    }
+
     fn make_test_payload() -> Payload {
         Payload::Storm(StormWrapper::default())
     }
@@ -0,0 +1,487 @@
+use std::collections::VecDeque;
+
+use bytes::Bytes;
+
+use crate::netcode::ack_manager::{self, MAX_GAME_MESSAGE_OVERHEAD, MAX_MESSAGE_SIZE};
+use crate::netcode::sequence_buffer::SequenceBuffer;
+use crate::proto::messages::FecParityMessage;
+
+/// Packet loss (as measured by `AckManager`) above which parity packets start getting sent.
+const ENABLE_LOSS_RATE: f32 = 0.05;
+/// Packet loss below which parity packets are no longer sent. Lower than `ENABLE_LOSS_RATE` so
+/// that loss hovering around the threshold doesn't keep toggling FEC on and off.
+const DISABLE_LOSS_RATE: f32 = 0.02;
+/// Packet loss above which the smaller group size is used.
+const HIGH_LOSS_RATE: f32 = 0.12;
+/// How many packets a single parity packet covers. A group can only recover from one of its
+/// packets being lost, so high loss uses smaller groups at the cost of more overhead.
+const GROUP_SIZE: usize = 8;
+const HIGH_LOSS_GROUP_SIZE: usize = 4;
+/// Largest group that is accepted from the remote end.
+const MAX_GROUP_SIZE: usize = 16;
+/// Largest packet that is accepted in a parity group. Game messages are limited to a bit below
+/// MTU size, so anything larger than this is a malformed parity message.
+const MAX_PACKET_SIZE: usize = 2048;
+/// The most that a parity message can be larger than the longest packet of its group:
+/// - the `GameMessage` header, with `ack` possibly being `u64::MAX` before anything has been
+///   received (11 + 11 + 5)
+/// - the tag and length of the payload in `payloads` (1 + 2)
+/// - `payload_num` (1 + 10)
+/// - the tag and length of `fec_parity` (1 + 2)
+/// - `first_packet_num` (1 + 10)
+/// - `lengths`, packed, with each length below 16384 (1 + 1 + 2 * MAX_GROUP_SIZE)
+/// - the tag and length of `parity` (1 + 2)
+const PARITY_OVERHEAD: u32 = 27 + 3 + 11 + 3 + 11 + (2 + 2 * MAX_GROUP_SIZE as u32) + 3;
+/// Largest packet that parity is built over, so that the parity message still fits in
+/// `MAX_MESSAGE_SIZE`. Groups with a larger packet (a single payload can go over the payload
+/// budget) don't get parity.
+const MAX_GROUPED_PACKET_SIZE: usize = (MAX_MESSAGE_SIZE - PARITY_OVERHEAD) as usize;
+/// Packet numbers use 63 bits, see `SequenceBuffer`.
+const MAX_PACKET_NUM: u64 = 0x8000_0000_0000_0000;
+/// How many received packets are kept for rebuilding lost packets.
+const RECEIVED_PACKETS_SIZE: usize = 64;
+/// How many parity messages can be waiting for more packets of their group to arrive.
+const MAX_PENDING_PARITY: usize = 4;
+
+/// Whether FEC parity packets are sent on a route.
+#[derive(Copy, Clone, Debug, Eq, PartialEq)]
+pub enum FecMode {
+    /// Sent when measured packet loss gets high enough.
+    Auto,
+    Always,
+    Never,
+}
+
+impl FecMode {
+    /// Reads the mode from the `SB_NET_FEC` environment variable ("on" / "off"), defaulting to
+    /// `Auto`.
+    pub fn from_env() -> FecMode {
+        match std::env::var("SB_NET_FEC").as_deref() {
+            Ok("on") => FecMode::Always,
+            Ok("off") => FecMode::Never,
+            _ => FecMode::Auto,
+        }
+    }
+}
+
+/// Forward error correction state for a single route.
+pub struct FecState {
+    pub encoder: FecEncoder,
+    pub decoder: FecDecoder,
+}
+
+impl FecState {
+    pub fn new(mode: FecMode) -> FecState {
+        FecState {
+            encoder: FecEncoder::new(mode),
+            decoder: FecDecoder::new(),
+        }
+    }
+}
+
+/// Builds XOR parity over groups of consecutive sent packets, so that the receiver can rebuild a
+/// single lost packet of the group without waiting for the payloads in it to be resent.
+pub struct FecEncoder {
+    mode: FecMode,
+    group_size: usize,
+    first_packet_num: u64,
+    lengths: Vec<u32>,
+    parity: Vec<u8>,
+}
+
+impl FecEncoder {
+    pub fn new(mode: FecMode) -> FecEncoder {
+        FecEncoder {
+            mode,
+            group_size: match mode {
+                FecMode::Always => GROUP_SIZE,
+                FecMode::Auto | FecMode::Never => 0,
+            },
+            first_packet_num: 0,
+            lengths: Vec::with_capacity(MAX_GROUP_SIZE),
+            parity: Vec::new(),
+        }
+    }
+
+    pub fn is_enabled(&self) -> bool {
+        self.group_size != 0
+    }
+
+    /// The payload budget that the route's `AckManager` should fill packets up to. Lower while
+    /// parity is being sent, since the parity message is as long as the longest packet of the
+    /// group, and has to fit in a packet as well.
+    pub fn max_payload_size(&self) -> u32 {
+        if self.is_enabled() {
+            MAX_GROUPED_PACKET_SIZE as u32 - MAX_GAME_MESSAGE_OVERHEAD
+        } else {
+            ack_manager::MAX_PAYLOAD_SIZE
+        }
+    }
+
+    /// Enables or disables parity depending on the current packet loss rate (0.0 - 1.0) of the
+    /// route.
+    pub fn update_loss_rate(&mut self, loss_rate: f32) {
+        let enabled = match self.mode {
+            FecMode::Always => true,
+            FecMode::Never => false,
+            FecMode::Auto => {
+                if self.is_enabled() {
+                    loss_rate >= DISABLE_LOSS_RATE
+                } else {
+                    loss_rate >= ENABLE_LOSS_RATE
+                }
+            }
+        };
+        let group_size = if !enabled {
+            0
+        } else if loss_rate >= HIGH_LOSS_RATE {
+            HIGH_LOSS_GROUP_SIZE
+        } else {
+            GROUP_SIZE
+        };
+        if group_size != self.group_size {
+            debug!(
+                "FEC group size {} -> {} (loss {:.1}%)",
+                self.group_size,
+                group_size,
+                loss_rate * 100.0
+            );
+            self.group_size = group_size;
+            if self.lengths.len() >= group_size {
+                self.lengths.clear();
+            }
+        }
+    }
+
+    /// Adds an encoded packet about to be sent to the current group. Returns the message that
+    /// should be sent after it if it completed the group.
+    ///
+    /// Packets of a group must have consecutive packet numbers, a packet that doesn't continue
+    /// the current group starts a new one.
+    pub fn add_packet(&mut self, packet_num: u64, data: &[u8]) -> Option<FecParityMessage> {
+        if !self.is_enabled() || data.len() > MAX_GROUPED_PACKET_SIZE {
+            self.lengths.clear();
+            return None;
+        }
+        if self.lengths.is_empty()
+            || self.first_packet_num + self.lengths.len() as u64 != packet_num
+        {
+            self.first_packet_num = packet_num;
+            self.lengths.clear();
+            self.parity.clear();
+        }
+        xor_into(&mut self.parity, data);
+        self.lengths.push(data.len() as u32);
+        if self.lengths.len() < self.group_size {
+            return None;
+        }
+
+        let message = FecParityMessage {
+            first_packet_num: self.first_packet_num,
+            lengths: self.lengths.clone(),
+            parity: Bytes::copy_from_slice(&self.parity),
+        };
+        self.lengths.clear();
+        Some(message)
+    }
+}
+
+#[derive(Clone, Default)]
+struct ReceivedData(Option<Bytes>);
+
+/// Keeps recently received packets, and rebuilds a packet that was lost once the parity and
+/// every other packet of its group has been received.
+pub struct FecDecoder {
+    received: SequenceBuffer<ReceivedData>,
+    pending: VecDeque<FecParityMessage>,
+}
+
+impl FecDecoder {
+    pub fn new() -> FecDecoder {
+        FecDecoder {
+            received: SequenceBuffer::with_capacity(RECEIVED_PACKETS_SIZE),
+            pending: VecDeque::with_capacity(MAX_PENDING_PARITY),
+        }
+    }
+
+    /// Records a received packet. May return packets that could be rebuilt now that this one
+    /// has been received.
+    pub fn on_packet(&mut self, packet_num: u64, data: Bytes) -> Vec<(u64, Bytes)> {
+        if packet_num >= MAX_PACKET_NUM
+            || self
+                .received
+                .insert(packet_num, ReceivedData(Some(data)))
+                .is_none()
+        {
+            return Vec::new();
+        }
+        let (ready, waiting) = self.pending.drain(..).partition::<Vec<_>, _>(|parity| {
+            let group_end = parity.first_packet_num + parity.lengths.len() as u64;
+            (parity.first_packet_num..group_end).contains(&packet_num)
+        });
+        self.pending.extend(waiting);
+        ready
+            .into_iter()
+            .filter_map(|parity| self.on_parity(parity))
+            .collect()
+    }
+
+    /// Handles a parity message from the remote end. Returns the lost packet of the group if
+    /// it could be rebuilt.
+    pub fn on_parity(&mut self, parity: FecParityMessage) -> Option<(u64, Bytes)> {
+        let max_len = parity.lengths.iter().copied().max().unwrap_or(0) as usize;
+        if parity.lengths.is_empty()
+            || parity.lengths.len() > MAX_GROUP_SIZE
+            || max_len > MAX_PACKET_SIZE
+            || parity.parity.len() != max_len
+            || parity.first_packet_num >= MAX_PACKET_NUM - MAX_GROUP_SIZE as u64
+        {
+            warn!("Received malformed FEC parity");
+            return None;
+        }
+
+        let mut missing = None;
+        for i in 0..parity.lengths.len() {
+            let packet_num = parity.first_packet_num + i as u64;
+            if self
+                .received
+                .get(packet_num)
+                .and_then(|x| x.0.as_ref())
+                .is_none()
+            {
+                if missing.is_some() {
+                    // Can only rebuild one packet, wait in case the others get here late.
+                    self.pending.push_back(parity);
+                    if self.pending.len() > MAX_PENDING_PARITY {
+                        self.pending.pop_front();
+                    }
+                    return None;
+                }
+                missing = Some(i);
+            }
+        }
+        let missing = missing?;
+
+        let mut data = parity.parity.to_vec();
+        for i in 0..parity.lengths.len() {
+            if i == missing {
+                continue;
+            }
+            let packet_num = parity.first_packet_num + i as u64;
+            let packet = self.received.get(packet_num).and_then(|x| x.0.as_ref())?;
+            if packet.len() != parity.lengths[i] as usize {
+                warn!("FEC parity doesn't match received packet {}", packet_num);
+                return None;
+            }
+            xor_into(&mut data, packet);
+        }
+        data.truncate(parity.lengths[missing] as usize);
+        let packet_num = parity.first_packet_num + missing as u64;
+        let data = Bytes::from(data);
+        self.received
+            .insert(packet_num, ReceivedData(Some(data.clone())));
+        Some((packet_num, data))
+    }
+}
+
+/// XORs `data` into `parity`, extending `parity` with zeroes if it is shorter.
+fn xor_into(parity: &mut Vec<u8>, data: &[u8]) {
+    if parity.len() < data.len() {
+        parity.resize(data.len(), 0);
+    }
+    for (out, &byte) in parity.iter_mut().zip(data.iter()) {
+        *out ^= byte;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use bytes::{Bytes, BytesMut};
+    use prost::Message;
+
+    use crate::netcode::ack_manager::{AckManager, QueueStatus, MAX_MESSAGE_SIZE};
+    use crate::proto::messages::game_message_payload::Payload;
+    use crate::proto::messages::{GameMessage, StormWrapper};
+
+    use super::{
+        FecDecoder, FecEncoder, FecMode, GROUP_SIZE, HIGH_LOSS_GROUP_SIZE, MAX_GROUPED_PACKET_SIZE,
+    };
+
+    fn make_packet(packet_num: u64) -> Bytes {
+        let len = 10 + (packet_num as usize * 7) % 30;
+        (0..len)
+            .map(|i| (packet_num as u8).wrapping_mul(31) ^ i as u8)
+            .collect::<Vec<u8>>()
+            .into()
+    }
+
+    #[test]
+    fn rebuilds_lost_packet() {
+        let mut encoder = FecEncoder::new(FecMode::Always);
+        let mut decoder = FecDecoder::new();
+        let mut parity = None;
+        for i in 0..GROUP_SIZE as u64 {
+            let packet = make_packet(i);
+            parity = encoder.add_packet(i, &packet);
+            assert_eq!(parity.is_some(), i == GROUP_SIZE as u64 - 1);
+            if i != 3 {
+                assert!(decoder.on_packet(i, packet).is_empty());
+            }
+        }
+        let (packet_num, data) = decoder.on_parity(parity.unwrap()).unwrap();
+        assert_eq!(packet_num, 3);
+        assert_eq!(data, make_packet(3));
+    }
+
+    #[test]
+    fn nothing_lost() {
+        let mut encoder = FecEncoder::new(FecMode::Always);
+        let mut decoder = FecDecoder::new();
+        let mut parity = None;
+        for i in 0..GROUP_SIZE as u64 {
+            let packet = make_packet(i);
+            parity = encoder.add_packet(i, &packet);
+            decoder.on_packet(i, packet);
+        }
+        assert!(decoder.on_parity(parity.unwrap()).is_none());
+    }
+
+    #[test]
+    fn rebuilds_after_late_packet() {
+        let mut encoder = FecEncoder::new(FecMode::Always);
+        let mut decoder = FecDecoder::new();
+        let mut parity = None;
+        for i in 0..GROUP_SIZE as u64 {
+            parity = encoder.add_packet(i, &make_packet(i));
+            if i != 2 && i != 5 {
+                decoder.on_packet(i, make_packet(i));
+            }
+        }
+        // Two missing, can't do anything yet
+        assert!(decoder.on_parity(parity.unwrap()).is_none());
+        // Packet 5 was only reordered
+        let rebuilt = decoder.on_packet(5, make_packet(5));
+        assert_eq!(rebuilt, vec![(2, make_packet(2))]);
+    }
+
+    #[test]
+    fn gap_starts_new_group() {
+        let mut encoder = FecEncoder::new(FecMode::Always);
+        for i in 0..3 {
+            assert!(encoder.add_packet(i, &make_packet(i)).is_none());
+        }
+        // Packet 3 was sent without going through the encoder
+        for i in 4..(4 + GROUP_SIZE as u64 - 1) {
+            assert!(encoder.add_packet(i, &make_packet(i)).is_none());
+        }
+        let parity = encoder
+            .add_packet(4 + GROUP_SIZE as u64 - 1, &make_packet(11))
+            .unwrap();
+        assert_eq!(parity.first_packet_num, 4);
+        assert_eq!(parity.lengths.len(), GROUP_SIZE);
+    }
+
+    #[test]
+    fn enabled_by_loss() {
+        let mut encoder = FecEncoder::new(FecMode::Auto);
+        assert!(!encoder.is_enabled());
+        assert!(encoder.add_packet(0, &make_packet(0)).is_none());
+        encoder.update_loss_rate(0.03);
+        assert!(!encoder.is_enabled());
+        encoder.update_loss_rate(0.08);
+        assert!(encoder.is_enabled());
+        // Stays enabled until loss drops clearly below the threshold
+        encoder.update_loss_rate(0.03);
+        assert!(encoder.is_enabled());
+        encoder.update_loss_rate(0.3);
+        let parity = (0..HIGH_LOSS_GROUP_SIZE as u64)
+            .filter_map(|i| encoder.add_packet(i, &make_packet(i)))
+            .next()
+            .unwrap();
+        assert_eq!(parity.lengths.len(), HIGH_LOSS_GROUP_SIZE);
+        encoder.update_loss_rate(0.01);
+        assert!(!encoder.is_enabled());
+
+        let mut encoder = FecEncoder::new(FecMode::Never);
+        encoder.update_loss_rate(0.5);
+        assert!(!encoder.is_enabled());
+    }
+
+    #[test]
+    fn malformed_parity_rejected() {
+        let mut encoder = FecEncoder::new(FecMode::Always);
+        let mut decoder = FecDecoder::new();
+        let mut parity = None;
+        for i in 0..GROUP_SIZE as u64 {
+            parity = encoder.add_packet(i, &make_packet(i));
+        }
+        let mut parity = parity.unwrap();
+        parity.parity = parity.parity.slice(1..);
+        assert!(decoder.on_parity(parity).is_none());
+    }
+
+    fn encode(message: &GameMessage) -> Bytes {
+        let mut packet = BytesMut::with_capacity(message.encoded_len());
+        message.encode(&mut packet).unwrap();
+        packet.freeze()
+    }
+
+    /// Builds a packet filled up to the payload budget with small Storm messages, like
+    /// coalescing does when a lot of them are queued at once.
+    fn build_full_packet(ack_manager: &mut AckManager, seed: u8) -> GameMessage {
+        loop {
+            let payload = Payload::Storm(StormWrapper {
+                storm_data: vec![seed; 20].into(),
+            });
+            if ack_manager.queue_payload(payload) == QueueStatus::Full {
+                // Anything that didn't fit stays queued for the next packet
+                return ack_manager.build_queued().unwrap();
+            }
+        }
+    }
+
+    #[test]
+    fn parity_of_full_packets_fits_in_a_packet() {
+        let mut encoder = FecEncoder::new(FecMode::Always);
+        let mut ack_manager = AckManager::new();
+        ack_manager.set_max_payload_size(encoder.max_payload_size());
+
+        let mut parity = None;
+        for i in 0..GROUP_SIZE {
+            let message = build_full_packet(&mut ack_manager, i as u8);
+            let packet = encode(&message);
+            // Within a payload or two of the largest packet that parity is built over
+            assert!(
+                packet.len() + 64 > MAX_GROUPED_PACKET_SIZE,
+                "Packet {} is only {} bytes",
+                i,
+                packet.len()
+            );
+            parity = encoder.add_packet(message.packet_num, &packet);
+            assert_eq!(parity.is_some(), i == GROUP_SIZE - 1);
+        }
+
+        let parity = parity.unwrap();
+        let message = ack_manager.build_untracked(Payload::FecParity(parity));
+        let size = encode(&message).len();
+        assert!(
+            size <= MAX_MESSAGE_SIZE as usize,
+            "Parity message is {} bytes, over the {} byte budget",
+            size,
+            MAX_MESSAGE_SIZE
+        );
+    }
+
+    #[test]
+    fn no_parity_for_packets_over_budget() {
+        let mut encoder = FecEncoder::new(FecMode::Always);
+        // Not lowering the payload budget, so packets get too large for parity to fit
+        let mut ack_manager = AckManager::new();
+        for i in 0..GROUP_SIZE {
+            let message = build_full_packet(&mut ack_manager, i as u8);
+            let packet = encode(&message);
+            assert!(packet.len() > MAX_GROUPED_PACKET_SIZE);
+            assert!(encoder.add_packet(message.packet_num, &packet).is_none());
+        }
+    }
+}
@@ -1,3 +1,8 @@
 pub mod ack_manager;
+pub mod fec;
+pub mod multipath;
+pub mod rtt;
 pub mod sequence_buffer;
+#[cfg(test)]
+mod sim;
 pub mod storm;
@@ -0,0 +1,250 @@
+use std::time::{Duration, Instant};
+
+use crate::netcode::sequence_buffer::SequenceBuffer;
+
+/// How many received packets are remembered for detecting duplicates. Copies arriving later than
+/// this many packets are dropped as well.
+const RECEIVED_PACKETS_SIZE: usize = 256;
+/// A path that hasn't delivered a packet in this long is considered down, and only gets
+/// occasional probe packets until it delivers something again.
+const PATH_TIMEOUT: Duration = Duration::from_millis(1000);
+/// How often packets are still sent on a path that is down, so the remote end can notice if it
+/// has recovered.
+const PROBE_INTERVAL: Duration = Duration::from_millis(250);
+/// A path whose copies of packets arrive on average this much later than the copies from the
+/// fastest path is not helping, and is treated as if it was down.
+const MAX_EXTRA_DELAY: Duration = Duration::from_millis(200);
+
+#[derive(Clone, Default)]
+struct ReceivedPacket {
+    /// When the first copy of this packet was received.
+    first_received: Option<Instant>,
+    /// Bitmask of paths which have delivered this packet.
+    paths: u32,
+}
+
+struct PathState {
+    last_received: Option<Instant>,
+    last_sent: Option<Instant>,
+    /// Smoothed amount of time that packets from this path arrive after their first copy
+    /// has arrived (from this or another path).
+    extra_delay: Duration,
+}
+
+/// Tracks the health of the paths (rally-point routes on different servers) that the packets to
+/// a single player are sent over. Every packet is sent on all paths that are working, so that a
+/// latency spike on one server doesn't stall the game, and the receiving side keeps only the
+/// first copy of each packet.
+pub struct MultipathState {
+    paths: Vec<PathState>,
+    received_packets: SequenceBuffer<ReceivedPacket>,
+    /// Time when this was created, paths are given `PATH_TIMEOUT` from this to deliver their
+    /// first packets.
+    start: Instant,
+}
+
+impl MultipathState {
+    pub fn new(path_count: usize) -> Self {
+        Self::with_start_time(path_count, Instant::now())
+    }
+
+    fn with_start_time(path_count: usize, start: Instant) -> Self {
+        assert!(path_count > 0 && path_count <= 32);
+        Self {
+            paths: (0..path_count)
+                .map(|_| PathState {
+                    last_received: None,
+                    last_sent: None,
+                    extra_delay: Duration::ZERO,
+                })
+                .collect(),
+            received_packets: SequenceBuffer::with_capacity(RECEIVED_PACKETS_SIZE),
+            start,
+        }
+    }
+
+    pub fn path_count(&self) -> usize {
+        self.paths.len()
+    }
+
+    /// Records that a packet was received on `path`. Returns `true` if this is the first copy
+    /// of the packet and it should be handled, `false` for duplicates.
+    pub fn on_receive(&mut self, path: usize, packet_num: u64, now: Instant) -> bool {
+        let path_state = match self.paths.get_mut(path) {
+            Some(s) => s,
+            None => return false,
+        };
+        path_state.last_received = Some(now);
+        if packet_num & 0x8000_0000_0000_0000 != 0 {
+            // Not a valid sequence number, let the packet be rejected elsewhere
+            return true;
+        }
+        let path_bit = 1 << path;
+        if let Some(packet) = self.received_packets.get_mut(packet_num) {
+            if packet.paths & path_bit != 0 {
+                // Same path delivered this twice?
+                return false;
+            }
+            packet.paths |= path_bit;
+            if let Some(first) = packet.first_received {
+                let delay = now.saturating_duration_since(first);
+                path_state.extra_delay = (path_state.extra_delay * 7 + delay) / 8;
+            }
+            return false;
+        }
+        let entry = ReceivedPacket {
+            first_received: Some(now),
+            paths: path_bit,
+        };
+        if self.received_packets.insert(packet_num, entry).is_none() {
+            // Older than anything that can be tracked, so it must've been received already
+            return false;
+        }
+        path_state.extra_delay = (path_state.extra_delay * 7) / 8;
+        true
+    }
+
+    /// Records that a packet was rebuilt from FEC parity without being received on any path.
+    /// Returns `true` if the packet hadn't been received already, in which case any copies that
+    /// arrive later will be dropped as duplicates.
+    pub fn on_recovered(&mut self, packet_num: u64) -> bool {
+        if packet_num & 0x8000_0000_0000_0000 != 0 || self.received_packets.exists(packet_num) {
+            return false;
+        }
+        // No receive time, so a copy arriving later doesn't count as the path being slow
+        let entry = ReceivedPacket {
+            first_received: None,
+            paths: 0,
+        };
+        self.received_packets.insert(packet_num, entry).is_some()
+    }
+
+    fn is_usable(&self, path: &PathState, now: Instant) -> bool {
+        let last_received = path.last_received.unwrap_or(self.start);
+        now.saturating_duration_since(last_received) < PATH_TIMEOUT
+            && path.extra_delay < MAX_EXTRA_DELAY
+    }
+
+    /// Returns a bitmask of the paths that the next packet should be sent on, and records that
+    /// it was sent on them.
+    ///
+    /// Packets are sent on every usable path, falling back to all paths if none of them are.
+    /// Unusable paths get a packet every `PROBE_INTERVAL`.
+    pub fn send_paths(&mut self, now: Instant) -> u32 {
+        let usable = self
+            .paths
+            .iter()
+            .enumerate()
+            .filter(|(_, path)| self.is_usable(path, now))
+            .fold(0u32, |mask, (i, _)| mask | (1 << i));
+        let mut result = 0;
+        for (i, path) in self.paths.iter_mut().enumerate() {
+            let probe = match path.last_sent {
+                Some(last) => now.saturating_duration_since(last) >= PROBE_INTERVAL,
+                None => true,
+            };
+            if usable == 0 || usable & (1 << i) != 0 || probe {
+                result |= 1 << i;
+                path.last_sent = Some(now);
+            }
+        }
+        result
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::{Duration, Instant};
+
+    use super::{MultipathState, MAX_EXTRA_DELAY, PATH_TIMEOUT, PROBE_INTERVAL};
+
+    #[test]
+    fn duplicates_dropped() {
+        let now = Instant::now();
+        let mut state = MultipathState::with_start_time(2, now);
+        assert!(state.on_receive(0, 0, now));
+        assert!(!state.on_receive(1, 0, now));
+        assert!(state.on_receive(1, 1, now));
+        assert!(!state.on_receive(0, 1, now));
+        assert!(!state.on_receive(1, 1, now));
+        // Out of order is fine
+        assert!(state.on_receive(0, 5, now));
+        assert!(state.on_receive(1, 3, now));
+        assert!(!state.on_receive(0, 3, now));
+        // Very old packets are not
+        assert!(state.on_receive(0, 1000, now));
+        assert!(!state.on_receive(1, 2, now));
+    }
+
+    #[test]
+    fn recovered_packets_dropped_later() {
+        let now = Instant::now();
+        let mut state = MultipathState::with_start_time(2, now);
+        assert!(state.on_receive(0, 0, now));
+        assert!(!state.on_recovered(0));
+        assert!(state.on_recovered(1));
+        assert!(!state.on_recovered(1));
+        assert!(!state.on_receive(1, 1, now + MAX_EXTRA_DELAY * 10));
+        assert_eq!(state.send_paths(now), 0b11);
+    }
+
+    #[test]
+    fn sends_on_all_paths() {
+        let now = Instant::now();
+        let mut state = MultipathState::with_start_time(2, now);
+        for i in 0..10 {
+            let time = now + Duration::from_millis(i * 40);
+            assert_eq!(state.send_paths(time), 0b11);
+            state.on_receive(0, i * 2, time);
+            state.on_receive(1, i * 2 + 1, time);
+        }
+    }
+
+    #[test]
+    fn fails_over_to_working_path() {
+        let now = Instant::now();
+        let mut state = MultipathState::with_start_time(2, now);
+        let mut time = now;
+        let mut packet = 0;
+        // Path 1 stops delivering anything
+        while time < now + PATH_TIMEOUT * 2 {
+            state.on_receive(0, packet, time);
+            packet += 1;
+            time += Duration::from_millis(40);
+        }
+        state.send_paths(time);
+        time += Duration::from_millis(40);
+        assert_eq!(state.send_paths(time), 0b01);
+        // But gets probed every once in a while
+        time += PROBE_INTERVAL;
+        assert_eq!(state.send_paths(time), 0b11);
+        assert_eq!(state.send_paths(time), 0b01);
+
+        // And is used again once it delivers packets
+        state.on_receive(1, packet, time);
+        assert_eq!(state.send_paths(time), 0b11);
+    }
+
+    #[test]
+    fn all_paths_down_sends_on_all() {
+        let now = Instant::now();
+        let mut state = MultipathState::with_start_time(2, now);
+        let time = now + PATH_TIMEOUT * 2;
+        assert_eq!(state.send_paths(time), 0b11);
+        assert_eq!(state.send_paths(time), 0b11);
+    }
+
+    #[test]
+    fn slow_path_not_used() {
+        let now = Instant::now();
+        let mut state = MultipathState::with_start_time(2, now);
+        let mut time = now;
+        for packet in 0..50 {
+            state.on_receive(0, packet, time);
+            state.on_receive(1, packet, time + MAX_EXTRA_DELAY * 2);
+            time += Duration::from_millis(40);
+        }
+        state.send_paths(time);
+        assert_eq!(state.send_paths(time), 0b01);
+    }
+}
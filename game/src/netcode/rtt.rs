@@ -0,0 +1,152 @@
+use std::time::Duration;
+
+use rand::Rng;
+
+/// Retransmission timeout used before any RTT samples have been received.
+const INITIAL_RTO: Duration = Duration::from_millis(500);
+/// Lower bound for the retransmission timeout, so that a few fast samples on a low latency
+/// route don't cause resending before the remote end has had any realistic chance to respond.
+const MIN_RTO: Duration = Duration::from_millis(50);
+/// Upper bound for the retransmission timeout, also after backing off.
+const MAX_RTO: Duration = Duration::from_millis(4000);
+/// Keep-alives and other periodic messages are sent at +-25% of their interval, so that
+/// messages of all routes don't end up being sent at the same time.
+const JITTER: f64 = 0.25;
+
+/// Estimates round-trip time of a connection from RTT samples, and the retransmission timeout
+/// (RTO) derived from it, as described in RFC 6298.
+///
+/// Samples should only be taken from messages that were sent once, as a response to a resent
+/// message can't be matched to the send it responds to.
+#[derive(Copy, Clone, Debug)]
+pub struct RttEstimator {
+    /// Smoothed RTT, `None` until the first sample is received.
+    srtt: Option<Duration>,
+    /// Smoothed mean deviation of RTT samples.
+    rttvar: Duration,
+}
+
+impl RttEstimator {
+    pub fn new() -> Self {
+        Self {
+            srtt: None,
+            rttvar: Duration::ZERO,
+        }
+    }
+
+    pub fn add_sample(&mut self, rtt: Duration) {
+        match self.srtt {
+            None => {
+                self.srtt = Some(rtt);
+                self.rttvar = rtt / 2;
+            }
+            Some(srtt) => {
+                let diff = if srtt > rtt { srtt - rtt } else { rtt - srtt };
+                self.rttvar = (self.rttvar * 3 + diff) / 4;
+                self.srtt = Some((srtt * 7 + rtt) / 8);
+            }
+        }
+    }
+
+    /// Smoothed round-trip time, `None` if no samples have been received yet.
+    pub fn srtt(&self) -> Option<Duration> {
+        self.srtt
+    }
+
+    /// How long to wait for a response before resending a message.
+    pub fn rto(&self) -> Duration {
+        match self.srtt {
+            None => INITIAL_RTO,
+            Some(srtt) => (srtt + self.rttvar * 4).clamp(MIN_RTO, MAX_RTO),
+        }
+    }
+
+    /// `rto()` doubled for each time the message has already been resent, `resends` being 0
+    /// for the first send.
+    pub fn backoff_rto(&self, resends: u32) -> Duration {
+        self.rto()
+            .checked_mul(1 << resends.min(16))
+            .unwrap_or(MAX_RTO)
+            .min(MAX_RTO)
+    }
+}
+
+/// Randomizes `interval` slightly, for spreading out periodic sends.
+pub fn jittered(interval: Duration) -> Duration {
+    let factor = rand::thread_rng().gen_range((1.0 - JITTER)..(1.0 + JITTER));
+    interval.mul_f64(factor)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use super::{jittered, RttEstimator, INITIAL_RTO, MAX_RTO, MIN_RTO};
+
+    #[test]
+    fn initial_rto() {
+        let rtt = RttEstimator::new();
+        assert_eq!(rtt.srtt(), None);
+        assert_eq!(rtt.rto(), INITIAL_RTO);
+        assert_eq!(rtt.backoff_rto(1), INITIAL_RTO * 2);
+    }
+
+    #[test]
+    fn first_sample() {
+        let mut rtt = RttEstimator::new();
+        rtt.add_sample(Duration::from_millis(100));
+        assert_eq!(rtt.srtt(), Some(Duration::from_millis(100)));
+        // srtt + 4 * (srtt / 2)
+        assert_eq!(rtt.rto(), Duration::from_millis(300));
+    }
+
+    #[test]
+    fn stable_samples_converge() {
+        let mut rtt = RttEstimator::new();
+        for _ in 0..100 {
+            rtt.add_sample(Duration::from_millis(20));
+        }
+        assert_eq!(rtt.srtt(), Some(Duration::from_millis(20)));
+        // Variance goes near zero, so RTO is limited by MIN_RTO
+        assert_eq!(rtt.rto(), MIN_RTO);
+
+        let mut rtt = RttEstimator::new();
+        for _ in 0..100 {
+            rtt.add_sample(Duration::from_millis(250));
+        }
+        assert!(rtt.rto() >= Duration::from_millis(250));
+        assert!(rtt.rto() < Duration::from_millis(260));
+    }
+
+    #[test]
+    fn variance_increases_rto() {
+        let mut stable = RttEstimator::new();
+        let mut unstable = RttEstimator::new();
+        for i in 0..50 {
+            stable.add_sample(Duration::from_millis(100));
+            let sample = if i % 2 == 0 { 50 } else { 150 };
+            unstable.add_sample(Duration::from_millis(sample));
+        }
+        assert!(unstable.rto() > stable.rto());
+    }
+
+    #[test]
+    fn backoff_is_capped() {
+        let mut rtt = RttEstimator::new();
+        rtt.add_sample(Duration::from_millis(100));
+        assert_eq!(rtt.backoff_rto(0), rtt.rto());
+        assert_eq!(rtt.backoff_rto(2), rtt.rto() * 4);
+        assert_eq!(rtt.backoff_rto(10), MAX_RTO);
+        assert_eq!(rtt.backoff_rto(u32::MAX), MAX_RTO);
+    }
+
+    #[test]
+    fn jitter_in_range() {
+        let interval = Duration::from_millis(500);
+        for _ in 0..100 {
+            let value = jittered(interval);
+            assert!(value >= Duration::from_millis(375));
+            assert!(value <= Duration::from_millis(625));
+        }
+    }
+}
@@ -0,0 +1,581 @@
+//! Deterministic network simulation for measuring how the netcode behaves under packet loss,
+//! latency, jitter, reordering and bandwidth limits.
+//!
+//! Every player sends one Storm payload per turn to every other player through their own
+//! `AckManager`, and the simulated links between them deliver (or drop) the resulting packets.
+//! Time is simulated, so results only depend on the configuration and seed, apart from the
+//! CPU time measurements.
+//!
+//! The scenarios in the tests double as regression checks. Longer benchmark runs are ignored by
+//! default, and can be ran with `cargo test sim::tests::bench -- --ignored --nocapture`.
+
+use std::cmp::Reverse;
+use std::collections::BinaryHeap;
+use std::fmt;
+use std::time::{Duration, Instant};
+
+use prost::Message;
+
+use crate::netcode::ack_manager::AckManager;
+use crate::proto::messages::game_message_payload::Payload;
+use crate::proto::messages::{GameMessage, StormWrapper};
+
+/// One tick of simulated time, the resolution which packet arrivals are processed at.
+const TICK_US: u64 = 500;
+/// Packets that would have to wait in the bandwidth-limited queue for longer than this are
+/// dropped, like a router with a full buffer would.
+const MAX_QUEUE_DELAY_US: u64 = 250_000;
+
+/// Behavior of a single direction of a link between two players.
+#[derive(Clone, Debug)]
+pub struct LinkConfig {
+    /// Probability (0.0 - 1.0) of a packet getting dropped.
+    pub loss: f64,
+    /// Probability of the packet after a dropped one also getting dropped, for simulating
+    /// bursts of loss. 0.0 makes every drop independent.
+    pub burst_loss: f64,
+    /// Minimum one-way latency.
+    pub latency: Duration,
+    /// Random extra latency in range `0..jitter` added to every packet.
+    pub jitter: Duration,
+    /// Probability of a packet getting held back by `reorder_delay`, causing packets sent after
+    /// it to arrive first.
+    pub reorder: f64,
+    pub reorder_delay: Duration,
+    /// Bytes per second that the link can carry, `None` for unlimited.
+    pub bandwidth: Option<u32>,
+}
+
+impl Default for LinkConfig {
+    fn default() -> LinkConfig {
+        LinkConfig {
+            loss: 0.0,
+            burst_loss: 0.0,
+            latency: Duration::from_millis(40),
+            jitter: Duration::ZERO,
+            reorder: 0.0,
+            reorder_delay: Duration::from_millis(30),
+            bandwidth: None,
+        }
+    }
+}
+
+#[derive(Clone, Debug)]
+pub struct SimConfig {
+    pub players: usize,
+    pub turns: u32,
+    pub turn_interval: Duration,
+    /// Size of the Storm payload each player sends to each other player every turn.
+    pub payload_size: usize,
+    pub link: LinkConfig,
+    pub seed: u64,
+}
+
+impl Default for SimConfig {
+    fn default() -> SimConfig {
+        SimConfig {
+            players: 2,
+            turns: 1000,
+            turn_interval: Duration::from_micros(1_000_000 / 24),
+            payload_size: 40,
+            link: LinkConfig::default(),
+            seed: 0x5eed,
+        }
+    }
+}
+
+#[derive(Clone, Debug, Default)]
+pub struct Percentiles {
+    pub p50: Duration,
+    pub p95: Duration,
+    pub p99: Duration,
+    pub max: Duration,
+}
+
+impl Percentiles {
+    fn from_samples(mut samples: Vec<Duration>) -> Percentiles {
+        if samples.is_empty() {
+            return Percentiles::default();
+        }
+        samples.sort_unstable();
+        let at = |fraction: f64| {
+            let index = ((samples.len() - 1) as f64 * fraction).round() as usize;
+            samples[index]
+        };
+        Percentiles {
+            p50: at(0.50),
+            p95: at(0.95),
+            p99: at(0.99),
+            max: *samples.last().unwrap(),
+        }
+    }
+}
+
+impl fmt::Display for Percentiles {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(
+            f,
+            "p50 {:.1}ms, p95 {:.1}ms, p99 {:.1}ms, max {:.1}ms",
+            self.p50.as_secs_f64() * 1000.0,
+            self.p95.as_secs_f64() * 1000.0,
+            self.p99.as_secs_f64() * 1000.0,
+            self.max.as_secs_f64() * 1000.0,
+        )
+    }
+}
+
+#[derive(Clone, Debug, Default)]
+pub struct SimReport {
+    /// Time from a payload being sent to it being received, for each payload.
+    pub payload_latency: Percentiles,
+    /// Time from the start of a turn until every player has received every other player's
+    /// payload for the turn, which is what the lockstep simulation has to wait for.
+    pub turn_latency: Percentiles,
+    /// Payloads that never got delivered by the end of the simulation.
+    pub undelivered: u32,
+    pub packets_sent: u64,
+    pub packets_dropped: u64,
+    pub bytes_sent: u64,
+    /// Bytes sent per second by a single player to a single other player.
+    pub bytes_per_second: f64,
+    /// Wall-clock time spent in `AckManager` building and handling packets, per packet.
+    pub cpu_per_packet: Duration,
+}
+
+impl fmt::Display for SimReport {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        writeln!(f, "payload latency: {}", self.payload_latency)?;
+        writeln!(f, "turn latency: {}", self.turn_latency)?;
+        writeln!(
+            f,
+            "{} packets, {} dropped, {} bytes ({:.0} B/s per route), {} undelivered",
+            self.packets_sent,
+            self.packets_dropped,
+            self.bytes_sent,
+            self.bytes_per_second,
+            self.undelivered,
+        )?;
+        write!(f, "{:?} CPU per packet", self.cpu_per_packet)
+    }
+}
+
+/// Small deterministic PRNG (xorshift64*), so that results don't depend on what `rand` does.
+struct SimRng(u64);
+
+impl SimRng {
+    fn new(seed: u64) -> SimRng {
+        SimRng(seed.max(1))
+    }
+
+    fn next_u64(&mut self) -> u64 {
+        self.0 ^= self.0 >> 12;
+        self.0 ^= self.0 << 25;
+        self.0 ^= self.0 >> 27;
+        self.0.wrapping_mul(0x2545_f491_4f6c_dd1d)
+    }
+
+    /// Returns a value in range 0.0..1.0
+    fn next_f64(&mut self) -> f64 {
+        (self.next_u64() >> 11) as f64 / (1u64 << 53) as f64
+    }
+
+    fn chance(&mut self, probability: f64) -> bool {
+        probability > 0.0 && self.next_f64() < probability
+    }
+
+    fn duration(&mut self, max: Duration) -> u64 {
+        let max = max.as_micros() as u64;
+        if max == 0 {
+            0
+        } else {
+            self.next_u64() % max
+        }
+    }
+}
+
+struct Link {
+    config: LinkConfig,
+    /// Packets in flight, ordered by arrival time, and then send order.
+    in_flight: BinaryHeap<Reverse<(u64, usize)>>,
+    packets: Vec<Option<GameMessage>>,
+    /// Time when the previous packet has been fully sent on a bandwidth-limited link.
+    busy_until: u64,
+    previous_dropped: bool,
+}
+
+impl Link {
+    fn new(config: LinkConfig) -> Link {
+        Link {
+            config,
+            in_flight: BinaryHeap::new(),
+            packets: Vec::new(),
+            busy_until: 0,
+            previous_dropped: false,
+        }
+    }
+
+    /// Returns `false` if the packet was dropped.
+    fn send(&mut self, now: u64, message: GameMessage, len: usize, rng: &mut SimRng) -> bool {
+        let loss = if self.previous_dropped && self.config.burst_loss > 0.0 {
+            self.config.burst_loss
+        } else {
+            self.config.loss
+        };
+        if rng.chance(loss) {
+            self.previous_dropped = true;
+            return false;
+        }
+        let departure = match self.config.bandwidth {
+            Some(bandwidth) => {
+                let start = self.busy_until.max(now);
+                if start - now > MAX_QUEUE_DELAY_US {
+                    self.previous_dropped = true;
+                    return false;
+                }
+                let transmit = len as u64 * 1_000_000 / bandwidth.max(1) as u64;
+                self.busy_until = start + transmit;
+                self.busy_until
+            }
+            None => now,
+        };
+        self.previous_dropped = false;
+        let mut arrival =
+            departure + self.config.latency.as_micros() as u64 + rng.duration(self.config.jitter);
+        if rng.chance(self.config.reorder) {
+            arrival += self.config.reorder_delay.as_micros() as u64;
+        }
+        let index = self.packets.len();
+        self.packets.push(Some(message));
+        self.in_flight.push(Reverse((arrival, index)));
+        true
+    }
+
+    fn receive(&mut self, now: u64) -> Option<GameMessage> {
+        match self.in_flight.peek() {
+            Some(&Reverse((arrival, index))) if arrival <= now => {
+                self.in_flight.pop();
+                self.packets[index].take()
+            }
+            _ => None,
+        }
+    }
+}
+
+/// Runs a simulation with `config`.
+pub fn simulate(config: &SimConfig) -> SimReport {
+    let players = config.players;
+    assert!(players >= 2);
+    let mut rng = SimRng::new(config.seed);
+    // Indexed by [from * players + to]. Entries where from == to are unused.
+    let mut managers = (0..players * players)
+        .map(|_| AckManager::new())
+        .collect::<Vec<_>>();
+    let mut links = (0..players * players)
+        .map(|_| Link::new(config.link.clone()))
+        .collect::<Vec<_>>();
+    // Time of first receive, indexed by [(turn * players + from) * players + to]
+    let mut received_at: Vec<Option<u64>> = vec![None; config.turns as usize * players * players];
+
+    let turn_interval = config.turn_interval.as_micros() as u64;
+    // Leave some time after the last turn for delivering payloads that are still in flight.
+    let end_time = (config.turns as u64 + 50) * turn_interval;
+    let mut next_turn = 0u32;
+    let mut report = SimReport::default();
+    let mut cpu_time = Duration::ZERO;
+    let mut now = 0;
+    while now <= end_time {
+        for from in 0..players {
+            for to in 0..players {
+                if from == to {
+                    continue;
+                }
+                let link = &mut links[from * players + to];
+                while let Some(message) = link.receive(now) {
+                    // The receiving side of the from -> to route is the `to` player's manager
+                    // for `from`.
+                    let manager = &mut managers[to * players + from];
+                    let start = Instant::now();
+                    manager.handle_incoming(&message);
+                    cpu_time += start.elapsed();
+                    for payload in &message.payloads {
+                        if let Some(Payload::Storm(ref storm)) = payload.payload {
+                            let turn = read_turn(&storm.storm_data);
+                            let index = (turn as usize * players + from) * players + to;
+                            if let Some(entry) = received_at.get_mut(index) {
+                                entry.get_or_insert(now);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        // Players send even after the last turn so that acks keep getting delivered and
+        // payloads resent, Storm similarly keeps sending while waiting for other players.
+        if now >= next_turn as u64 * turn_interval {
+            for from in 0..players {
+                for to in 0..players {
+                    if from == to {
+                        continue;
+                    }
+                    let payload = Payload::Storm(StormWrapper {
+                        storm_data: make_turn_data(next_turn, config.payload_size).into(),
+                    });
+                    let manager = &mut managers[from * players + to];
+                    let start = Instant::now();
+                    let message = manager.build_outgoing(Some(payload));
+                    let len = message.encoded_len();
+                    cpu_time += start.elapsed();
+                    report.packets_sent += 1;
+                    report.bytes_sent += len as u64;
+                    if !links[from * players + to].send(now, message, len, &mut rng) {
+                        report.packets_dropped += 1;
+                    }
+                }
+            }
+            next_turn += 1;
+        }
+        now += TICK_US;
+    }
+
+    let mut payload_latency = Vec::with_capacity(received_at.len());
+    let mut turn_latency = Vec::with_capacity(config.turns as usize);
+    for turn in 0..config.turns as usize {
+        let turn_start = turn as u64 * turn_interval;
+        let mut turn_done = Some(turn_start);
+        for from in 0..players {
+            for to in 0..players {
+                if from == to {
+                    continue;
+                }
+                match received_at[(turn * players + from) * players + to] {
+                    Some(time) => {
+                        payload_latency.push(Duration::from_micros(time - turn_start));
+                        turn_done = turn_done.map(|x| x.max(time));
+                    }
+                    None => {
+                        report.undelivered += 1;
+                        turn_done = None;
+                    }
+                }
+            }
+        }
+        if let Some(time) = turn_done {
+            turn_latency.push(Duration::from_micros(time - turn_start));
+        }
+    }
+    report.payload_latency = Percentiles::from_samples(payload_latency);
+    report.turn_latency = Percentiles::from_samples(turn_latency);
+    let routes = (players * (players - 1)) as f64;
+    let seconds = end_time as f64 / 1_000_000.0;
+    report.bytes_per_second = report.bytes_sent as f64 / routes / seconds;
+    if report.packets_sent != 0 {
+        // Each packet is built once and handled at most once
+        report.cpu_per_packet = cpu_time / (report.packets_sent as u32);
+    }
+    report
+}
+
+fn make_turn_data(turn: u32, size: usize) -> Vec<u8> {
+    let mut data = vec![0u8; size.max(4)];
+    data[..4].copy_from_slice(&turn.to_le_bytes());
+    data
+}
+
+fn read_turn(data: &[u8]) -> u32 {
+    let mut bytes = [0u8; 4];
+    bytes.copy_from_slice(&data[..4]);
+    u32::from_le_bytes(bytes)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use super::{simulate, LinkConfig, SimConfig};
+
+    fn run(name: &str, config: SimConfig) -> super::SimReport {
+        let report = simulate(&config);
+        println!("{}:\n{}", name, report);
+        report
+    }
+
+    #[test]
+    fn deterministic() {
+        let config = SimConfig {
+            turns: 200,
+            link: LinkConfig {
+                loss: 0.1,
+                jitter: Duration::from_millis(20),
+                ..Default::default()
+            },
+            ..Default::default()
+        };
+        let a = simulate(&config);
+        let b = simulate(&config);
+        assert_eq!(a.packets_dropped, b.packets_dropped);
+        assert_eq!(a.bytes_sent, b.bytes_sent);
+        assert_eq!(a.turn_latency.p99, b.turn_latency.p99);
+    }
+
+    #[test]
+    fn perfect_link() {
+        let report = run("perfect", SimConfig::default());
+        assert_eq!(report.undelivered, 0);
+        assert_eq!(report.packets_dropped, 0);
+        // Latency + tick resolution
+        assert!(report.turn_latency.max <= Duration::from_millis(41));
+        // Nothing lost, so only the newest payloads are unacked and resent
+        assert!(report.bytes_per_second < 3000.0);
+    }
+
+    #[test]
+    fn moderate_loss() {
+        let report = run(
+            "5% loss",
+            SimConfig {
+                link: LinkConfig {
+                    loss: 0.05,
+                    ..Default::default()
+                },
+                ..Default::default()
+            },
+        );
+        assert_eq!(report.undelivered, 0);
+        // Lost payloads are carried by the next packet, one turn later
+        assert!(report.payload_latency.p95 <= Duration::from_millis(41));
+        assert!(report.payload_latency.max <= Duration::from_millis(41 + 42 * 3));
+    }
+
+    #[test]
+    fn heavy_loss() {
+        let report = run(
+            "25% loss",
+            SimConfig {
+                link: LinkConfig {
+                    loss: 0.25,
+                    ..Default::default()
+                },
+                ..Default::default()
+            },
+        );
+        assert_eq!(report.undelivered, 0);
+        assert!(report.payload_latency.p50 <= Duration::from_millis(41));
+        assert!(report.turn_latency.p99 <= Duration::from_millis(41 + 42 * 4));
+    }
+
+    #[test]
+    fn burst_loss() {
+        let report = run(
+            "burst loss",
+            SimConfig {
+                link: LinkConfig {
+                    loss: 0.03,
+                    burst_loss: 0.6,
+                    ..Default::default()
+                },
+                ..Default::default()
+            },
+        );
+        assert_eq!(report.undelivered, 0);
+    }
+
+    #[test]
+    fn jitter_and_reorder() {
+        let report = run(
+            "jitter + reorder",
+            SimConfig {
+                link: LinkConfig {
+                    jitter: Duration::from_millis(30),
+                    reorder: 0.1,
+                    ..Default::default()
+                },
+                ..Default::default()
+            },
+        );
+        assert_eq!(report.undelivered, 0);
+        assert!(report.payload_latency.max <= Duration::from_millis(41 + 30 + 30));
+    }
+
+    #[test]
+    fn four_players() {
+        let report = run(
+            "4 players, 5% loss",
+            SimConfig {
+                players: 4,
+                link: LinkConfig {
+                    loss: 0.05,
+                    ..Default::default()
+                },
+                ..Default::default()
+            },
+        );
+        assert_eq!(report.undelivered, 0);
+        // Turn latency is the worst of 12 routes, so it is hurt more by loss
+        assert!(report.turn_latency.p50 <= Duration::from_millis(41 + 42));
+    }
+
+    #[test]
+    fn limited_bandwidth() {
+        let config = SimConfig {
+            payload_size: 200,
+            ..Default::default()
+        };
+        let unlimited = run("unlimited bandwidth", config.clone());
+        // Enough for the packets, but each one takes a while to transmit. Note that the link
+        // needs a good amount of headroom: transmit time makes acks slower, which makes packets
+        // carry more unacked payloads, which makes them take even longer to transmit. With less
+        // than ~2x the bandwidth of an unlimited link this doesn't settle.
+        let bandwidth = unlimited.bytes_per_second * 3.0;
+        let limited = run(
+            "limited bandwidth",
+            SimConfig {
+                link: LinkConfig {
+                    bandwidth: Some(bandwidth as u32),
+                    ..Default::default()
+                },
+                ..config
+            },
+        );
+        assert_eq!(limited.undelivered, 0);
+        assert!(limited.payload_latency.p50 > unlimited.payload_latency.p50);
+        assert!(limited.payload_latency.max < Duration::from_millis(100));
+    }
+
+    mod bench {
+        use std::time::Duration;
+
+        use super::run;
+        use crate::netcode::sim::{LinkConfig, SimConfig};
+
+        fn bench_config(link: LinkConfig) -> SimConfig {
+            SimConfig {
+                players: 8,
+                turns: 24 * 60 * 5,
+                link,
+                ..Default::default()
+            }
+        }
+
+        #[test]
+        #[ignore]
+        fn bench_clean() {
+            run("bench: clean", bench_config(LinkConfig::default()));
+        }
+
+        #[test]
+        #[ignore]
+        fn bench_lossy() {
+            run(
+                "bench: lossy",
+                bench_config(LinkConfig {
+                    loss: 0.1,
+                    burst_loss: 0.3,
+                    jitter: Duration::from_millis(25),
+                    reorder: 0.05,
+                    ..Default::default()
+                }),
+            );
+        }
+    }
+}
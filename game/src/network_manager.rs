@@ -1,7 +1,8 @@
 use std::collections::hash_map::{Entry, HashMap};
+use std::iter;
 use std::net::{IpAddr, Ipv4Addr, SocketAddr};
 use std::sync::Arc;
-use std::time::Duration;
+use std::time::{Duration, Instant};
 
 use bytes::{Bytes, BytesMut};
 use futures::pin_mut;
@@ -15,12 +16,30 @@ use tokio::sync::{mpsc, oneshot};
 use crate::app_messages;
 use crate::app_messages::{LobbyPlayerId, Route as RouteInput};
 use crate::cancel_token::{CancelToken, Canceler};
-use crate::netcode::ack_manager::AckManager;
+use crate::netcode::ack_manager::{AckManager, QueueStatus};
+use crate::netcode::fec::{FecMode, FecState};
+use crate::netcode::multipath::MultipathState;
+use crate::netcode::rtt;
 use crate::netcode::storm::{get_resend_info, get_storm_id, ResendType};
 use crate::proto::messages::game_message_payload::Payload;
 use crate::proto::messages::{GameMessage, StormWrapper};
 use crate::rally_point::{PlayerId, RallyPoint, RallyPointError, RouteId};
 use crate::snp::{self, SendMessages, SnpMessage};
+use crate::timings;
+
+/// Average interval between keep-alives sent to a route, each one is jittered a bit.
+const KEEP_ALIVE_INTERVAL: Duration = Duration::from_millis(500);
+/// Bounds for how often payloads in flight are resent when trying to deliver them at the end
+/// of the game. Between these the time is based on RTT of the route.
+const MIN_DELIVER_RESEND: Duration = Duration::from_millis(42);
+const MAX_DELIVER_RESEND: Duration = Duration::from_millis(250);
+/// How long Storm packets are held back to be sent together with any other packets to the same
+/// player, as a percentage of the length of a turn. Storm usually sends several small packets in
+/// a burst each turn, so even a short delay lets them share a single rally-point packet.
+/// Can be changed with the `SB_NET_COALESCE_PERCENT` environment variable, 0 disables this.
+const DEFAULT_COALESCE_PERCENT: u32 = 12;
+/// Turn rate assumed for computing coalescing delay when the game uses dynamic turn rate.
+const DEFAULT_TURN_RATE: u32 = 24;
 
 pub struct NetworkManager {
     send_messages: mpsc::Sender<NetworkManagerMessage>,
@@ -28,14 +47,19 @@ pub struct NetworkManager {
 
 pub enum NetworkManagerMessage {
     Snp(SnpMessage),
+    /// There are packets waiting in `snp::pop_outgoing_packet`.
+    SnpOutgoing,
     Routes(Vec<RouteInput>),
     InitRoutesWhenReady(),
+    JoinRoutesEarly(),
     WaitNetworkReady(oneshot::Sender<Result<()>>),
     RoutesReady(Result<Vec<Arc<Route>>>),
     PingResult((String, u16), Result<RallyPointServer>),
-    StartKeepAlive(Arc<Route>),
+    StartKeepAlive(RoutePath),
     SetGameInfo(Arc<app_messages::GameSetupInfo>),
-    ReceivePacket(Ipv4Addr, Bytes, SendMessages),
+    /// Ip of the player, index of the `Route::paths` that the packet was received from,
+    /// and when rally-point received it if timings are enabled.
+    ReceivePacket(Ipv4Addr, usize, Bytes, Option<Instant>, SendMessages),
     GameState(GameStateToNetworkMessage),
 }
 
@@ -73,11 +97,19 @@ type Result<T> = std::result::Result<T, NetworkError>;
 
 #[derive(Debug)]
 pub struct Route {
+    /// Rally-point routes to the player. The first one is on the best server for both players,
+    /// if the server enabled redundant routing, the second one is on another server, and
+    /// packets are sent over both of them.
+    paths: Vec<RoutePath>,
+    // Links routes to PlayerInfo
+    lobby_player_id: LobbyPlayerId,
+}
+
+#[derive(Clone, Debug)]
+pub struct RoutePath {
     route_id: RouteId,
     player_id: PlayerId,
     address: SocketAddr,
-    // Links routes to PlayerInfo
-    lobby_player_id: LobbyPlayerId,
 }
 
 enum NetworkState {
@@ -90,21 +122,68 @@ enum NetworkState {
 struct RouteState {
     route: Arc<Route>,
     ack_manager: Arc<Mutex<AckManager>>,
+    multipath: Arc<Mutex<MultipathState>>,
+    fec: Arc<Mutex<FecState>>,
 }
 
 struct ReadyNetwork {
     ip_to_routes: HashMap<Ipv4Addr, RouteState>,
     lobby_id_to_routes: HashMap<LobbyPlayerId, RouteState>,
+    /// How long to wait for more Storm packets before sending queued ones, zero if every packet
+    /// should be sent immediately.
+    coalesce_delay: Duration,
 }
 
 #[derive(Default)]
 struct IncompleteNetwork {
     ready_to_init: bool,
+    /// Routes can be joined as soon as the setup is received, without waiting for
+    /// `ready_to_init`. The network still won't be ready until `ready_to_init` is set.
+    join_early: bool,
     setup: Option<Vec<RouteInput>>,
     routes: Option<Vec<Arc<Route>>>,
     game_info: Option<Arc<app_messages::GameSetupInfo>>,
     // This existing means that storm side is active
     snp_send_messages: Option<snp::SendMessages>,
+    phases: SetupPhases,
+}
+
+/// When each step of network initialization completed, logged once the network is ready to
+/// show where the time went.
+#[derive(Default)]
+struct SetupPhases {
+    setup_received: Option<Instant>,
+    ready_to_init: Option<Instant>,
+    join_started: Option<Instant>,
+    routes_ready: Option<Instant>,
+    game_info: Option<Instant>,
+    snp_active: Option<Instant>,
+}
+
+impl SetupPhases {
+    fn log_summary(&self, network_ready: Instant) {
+        let start = [self.setup_received, self.ready_to_init, self.game_info]
+            .iter()
+            .flatten()
+            .min()
+            .copied()
+            .unwrap_or(network_ready);
+        let ms = |time: Option<Instant>| match time {
+            Some(s) => format!("{}ms", s.duration_since(start).as_millis()),
+            None => "-".into(),
+        };
+        info!(
+            "Network setup phases: setup received {}, ready to init {}, join started {}, \
+            routes ready {}, game info {}, snp active {}, network ready {}",
+            ms(self.setup_received),
+            ms(self.ready_to_init),
+            ms(self.join_started),
+            ms(self.routes_ready),
+            ms(self.game_info),
+            ms(self.snp_active),
+            ms(Some(network_ready)),
+        );
+    }
 }
 
 struct State {
@@ -165,8 +244,9 @@ impl State {
     fn maybe_init_routes(&mut self) {
         let mut setup = None;
         if let NetworkState::Incomplete(ref mut incomplete) = self.network {
-            if incomplete.ready_to_init && incomplete.setup.is_some() {
+            if (incomplete.ready_to_init || incomplete.join_early) && incomplete.setup.is_some() {
                 setup = incomplete.setup.take();
+                incomplete.phases.join_started = Some(Instant::now());
             }
         }
 
@@ -194,56 +274,69 @@ impl State {
         let futures = setup
             .into_iter()
             .map(|route| {
-                let route = Arc::new(route);
-                let route1 = route.clone();
-                let send_messages = self.send_messages.clone();
-                let rally_point = self.rally_point.clone();
-                let server_future = self.pick_server(&route.server);
+                let primary = join_route_path(
+                    self.rally_point.clone(),
+                    self.send_messages.clone(),
+                    self.pick_server(&route.server),
+                    &route.server,
+                    &route.for_player,
+                    &route.route_id,
+                    route.player_id,
+                );
+                let backup = route.backup.as_ref().map(|backup| {
+                    join_route_path(
+                        self.rally_point.clone(),
+                        self.send_messages.clone(),
+                        self.pick_server(&backup.server),
+                        &backup.server,
+                        &route.for_player,
+                        &backup.route_id,
+                        backup.player_id,
+                    )
+                });
+                let lobby_player_id = route.for_player;
                 async move {
-                    let server = server_future.await?;
-                    let route_id = RouteId::from_string(&route1.route_id);
-                    let player_id = PlayerId::from_u32(route1.player_id);
-                    let timeout = Duration::from_millis(5000);
-                    // Route id logged twice since we move from string to u64 here,
-                    // have one line where they both are shown to connect them in case.
-                    debug!(
-                        "Picked server {:?} for route {:?} ({}) [{}ms]",
-                        server,
-                        route_id,
-                        route1.route_id,
-                        server.ping.as_millis(),
-                    );
-                    rally_point
-                        .join_route(server.address, route_id, player_id, timeout)
-                        .await
-                        .map_err(|e| NetworkError::RallyPoint(Arc::new(e)))?;
-
-                    debug!(
-                        "Connected to {} for id {:?} [{:?}]",
-                        route1.server.description, route1.for_player, route_id,
-                    );
-                    let route = Arc::new(Route {
-                        route_id,
-                        player_id,
-                        lobby_player_id: route1.for_player.clone(),
-                        address: server.address,
-                    });
-                    rally_point
-                        .wait_route_ready(&route.route_id, &route.address)
-                        .await
-                        .map_err(|e| NetworkError::RallyPoint(Arc::new(e)))?;
-                    send_messages
-                        .send(NetworkManagerMessage::StartKeepAlive(route.clone()))
-                        .await
-                        .map_err(|_| NetworkError::NotActive)?;
-                    debug!("Route [{:?}] is ready", route.route_id);
-                    Ok(route)
+                    let (primary, backup) = match backup {
+                        Some(backup) => {
+                            let (primary, backup) = future::join(primary, backup).await;
+                            (primary, Some(backup))
+                        }
+                        None => (primary.await, None),
+                    };
+                    let mut paths = vec![primary?];
+                    match backup {
+                        Some(Ok(path)) => paths.push(path),
+                        Some(Err(e)) => {
+                            // The primary route works, so this isn't fatal.
+                            warn!(
+                                "Couldn't join backup route for {:?}: {}",
+                                lobby_player_id, e
+                            );
+                        }
+                        None => (),
+                    }
+                    Ok(Arc::new(Route {
+                        paths,
+                        lobby_player_id,
+                    }))
                 }
             })
             .collect::<Vec<_>>();
         future::try_join_all(futures)
     }
 
+    /// Starts pinging every server in the setup, so that the results are likely to be
+    /// available by the time the routes can be joined.
+    fn start_pings(&mut self, setup: &[RouteInput]) {
+        let servers = setup.iter().flat_map(|route| {
+            iter::once(&route.server).chain(route.backup.as_ref().map(|x| &x.server))
+        });
+        for server in servers {
+            // The result is cached in `self.pings`, nothing needs to wait for it here.
+            drop(self.pick_server(server));
+        }
+    }
+
     fn pick_server(
         &mut self,
         input: &app_messages::RallyPointServer,
@@ -331,17 +424,32 @@ impl State {
         match message {
             NetworkManagerMessage::Routes(setup) => {
                 if let NetworkState::Incomplete(ref mut incomplete) = self.network {
-                    incomplete.setup = Some(setup);
                     debug!("NetworkManager setup received");
+                    incomplete.phases.setup_received = Some(Instant::now());
+                    // Pinging doesn't have to wait for anything, and if the routes can't be
+                    // joined yet the servers will be picked by the time they can.
+                    self.start_pings(&setup);
+                }
+                if let NetworkState::Incomplete(ref mut incomplete) = self.network {
+                    incomplete.setup = Some(setup);
                 }
                 self.maybe_init_routes();
             }
             NetworkManagerMessage::InitRoutesWhenReady() => {
                 if let NetworkState::Incomplete(ref mut incomplete) = self.network {
                     incomplete.ready_to_init = true;
+                    incomplete.phases.ready_to_init = Some(Instant::now());
                     debug!("NetworkManager okay to init routes once setup is received");
                 }
                 self.maybe_init_routes();
+                self.check_network_ready();
+            }
+            NetworkManagerMessage::JoinRoutesEarly() => {
+                if let NetworkState::Incomplete(ref mut incomplete) = self.network {
+                    incomplete.join_early = true;
+                    debug!("NetworkManager okay to join routes once setup is received");
+                }
+                self.maybe_init_routes();
             }
             NetworkManagerMessage::PingResult(key, result) => {
                 self.handle_ping_result(key, result);
@@ -351,6 +459,7 @@ impl State {
                     Ok(routes) => {
                         if let NetworkState::Incomplete(ref mut incomplete) = self.network {
                             incomplete.routes = Some(routes);
+                            incomplete.phases.routes_ready = Some(Instant::now());
                         }
                     }
                     Err(e) => self.network.set_error(e),
@@ -368,94 +477,38 @@ impl State {
                 SnpMessage::CreateNetworkHandler(send) => {
                     if let NetworkState::Incomplete(ref mut incomplete) = self.network {
                         incomplete.snp_send_messages = Some(send);
+                        incomplete.phases.snp_active = Some(Instant::now());
                     }
                     self.check_network_ready();
                 }
-                SnpMessage::Send(target, data) => {
-                    if let NetworkState::Ready(ref network) = self.network {
-                        match get_resend_info(&data) {
-                            Some(ResendType::Request(None)) => {
-                                // NOTE(tec27): We drop all Storm resend requests to the same user
-                                // who original sent them, because they add nothing to our existing
-                                // protocol. Our protocol now resends payloads until they're acked,
-                                // so any missing payloads from this user will already be in flight.
-                                return;
-                            }
-                            Some(ResendType::Request(Some(ref resend_target))) => {
-                                if let Some(last_seen) =
-                                    self.last_seen_packet_time.get(resend_target)
-                                {
-                                    if last_seen.elapsed() < Duration::from_millis(500) {
-                                        // If we've seen a packet from this player recently, then
-                                        // just ignore this request and assume Storm will get what
-                                        // it needs through normal protocol means.
-                                        return;
-                                    }
-                                }
-                            }
-                            // NOTE(tec27): We allow all resend responses through because those are
-                            // *only* for other users' packets, resends of our own packets are sent
-                            // as normal (non-resend) packets.
-                            _ => {}
-                        };
-
-                        let payload = Some(Payload::Storm(StormWrapper {
-                            storm_data: data.into(),
-                        }));
-
-                        if let Some(route_state) = network.ip_to_routes.get(&target) {
-                            let game_message = {
-                                let mut ack_manager = route_state.ack_manager.lock();
-                                ack_manager.build_outgoing(payload)
-                            };
-
-                            let mut packet = BytesMut::with_capacity(game_message.encoded_len());
-                            game_message.encode(&mut packet).unwrap();
-                            let packet = packet.freeze();
-
-                            let route = &route_state.route;
-                            let send = self.rally_point.forward(
-                                &route.route_id,
-                                route.player_id,
-                                packet,
-                                &route.address,
-                            );
-
-                            let task = send.map_err(|e| error!("Send error {}", e)).map(|_| ());
-                            let (cancel_token, canceler) = CancelToken::new();
-                            self.cancel_child_tasks.push(canceler);
-                            tokio::spawn(async move {
-                                pin_mut!(task);
-                                let _ = cancel_token.bind(task).await;
-                            });
-                        } else {
-                            error!("Tried to send packet without a route: {}", target);
-                        }
-                    } else {
-                        warn!("Storm tried to send data without ready network");
-                    }
-                }
+                SnpMessage::Send(target, data) => self.send_storm_packet(target, data.into(), None),
             },
+            NetworkManagerMessage::SnpOutgoing => {
+                while let Some(packet) = snp::pop_outgoing_packet() {
+                    let data = Bytes::copy_from_slice(packet.data());
+                    self.send_storm_packet(packet.target, data, packet.sent);
+                }
+            }
             NetworkManagerMessage::SetGameInfo(info) => {
                 if let NetworkState::Incomplete(ref mut incomplete) = self.network {
                     incomplete.game_info = Some(info);
+                    incomplete.phases.game_info = Some(Instant::now());
                 }
                 self.check_network_ready();
             }
-            NetworkManagerMessage::StartKeepAlive(route) => {
+            NetworkManagerMessage::StartKeepAlive(path) => {
                 let rally_point = self.rally_point.clone();
                 let (cancel_token, canceler) = CancelToken::new();
                 let cancelable = async move {
                     let task = async move {
-                        let mut interval = tokio::time::interval(Duration::from_millis(500));
                         loop {
-                            interval.tick().await;
                             let result = rally_point
-                                .keep_alive(&route.route_id, route.player_id, &route.address)
+                                .keep_alive(&path.route_id, path.player_id, &path.address)
                                 .await;
                             if result.is_err() {
                                 break;
                             }
+                            tokio::time::sleep(rtt::jittered(KEEP_ALIVE_INTERVAL)).await;
                         }
                     };
                     pin_mut!(task);
@@ -467,78 +520,103 @@ impl State {
                 // Doesn't hurt to keep them active but old code stopped them once storm
                 // became active.
             }
-            NetworkManagerMessage::ReceivePacket(ip, mut packet, snp_send) => {
+            NetworkManagerMessage::ReceivePacket(ip, path, packet, received, snp_send) => {
                 if let NetworkState::Ready(ref network) = self.network {
                     if let Some(route_state) = network.ip_to_routes.get(&ip) {
-                        if let Ok(game_message) = GameMessage::decode(&mut packet) {
+                        if let Ok(game_message) = GameMessage::decode(&mut packet.clone()) {
                             // CLion is bad at figuring out this type :(
                             let game_message = game_message as GameMessage;
 
-                            {
-                                let mut ack_manager = route_state.ack_manager.lock();
-                                ack_manager.handle_incoming(&game_message);
+                            let is_first_copy = route_state.multipath.lock().on_receive(
+                                path,
+                                game_message.packet_num,
+                                Instant::now(),
+                            );
+                            if !is_first_copy {
+                                // Already received this packet through another path.
+                                return;
                             }
 
-                            let need_id = if let Some(storm_id) = self.ip_to_storm_id.get(&ip) {
-                                self.last_seen_packet_time
-                                    .insert(*storm_id, std::time::Instant::now());
-                                false
-                            } else {
-                                true
-                            };
+                            let recovered = receive_fec(route_state, &game_message, packet);
+                            for game_message in iter::once(game_message).chain(recovered) {
+                                let loss = {
+                                    let mut ack_manager = route_state.ack_manager.lock();
+                                    ack_manager.handle_incoming(&game_message);
+                                    ack_manager.packet_loss()
+                                };
+                                let max_payload_size = {
+                                    let mut fec = route_state.fec.lock();
+                                    fec.encoder.update_loss_rate(loss);
+                                    fec.encoder.max_payload_size()
+                                };
+                                route_state
+                                    .ack_manager
+                                    .lock()
+                                    .set_max_payload_size(max_payload_size);
+
+                                let need_id = if let Some(storm_id) = self.ip_to_storm_id.get(&ip) {
+                                    self.last_seen_packet_time
+                                        .insert(*storm_id, std::time::Instant::now());
+                                    false
+                                } else {
+                                    true
+                                };
 
-                            for payload in game_message.payloads.into_iter() {
-                                match payload.payload {
-                                    Some(Payload::Storm(s)) => {
-                                        if need_id {
-                                            if let Some(from_id) =
-                                                get_storm_id(s.storm_data.as_ref())
-                                            {
-                                                if from_id != 255
-                                                    && get_resend_info(s.storm_data.as_ref())
-                                                        .is_none()
+                                for payload in game_message.payloads.into_iter() {
+                                    match payload.payload {
+                                        Some(Payload::Storm(s)) => {
+                                            if need_id {
+                                                if let Some(from_id) =
+                                                    get_storm_id(s.storm_data.as_ref())
                                                 {
-                                                    self.ip_to_storm_id
-                                                        .entry(ip)
-                                                        .or_insert(from_id);
-                                                    debug!(
-                                                        "{:?} found to have Storm ID: {}",
-                                                        ip, from_id
-                                                    );
+                                                    if from_id != 255
+                                                        && get_resend_info(s.storm_data.as_ref())
+                                                            .is_none()
+                                                    {
+                                                        self.ip_to_storm_id
+                                                            .entry(ip)
+                                                            .or_insert(from_id);
+                                                        debug!(
+                                                            "{:?} found to have Storm ID: {}",
+                                                            ip, from_id
+                                                        );
+                                                    }
                                                 }
                                             }
+
+                                            let message = snp::ReceivedMessage {
+                                                from: ip,
+                                                data: s.storm_data.clone(),
+                                                received,
+                                            };
+                                            snp_send.send(message)
                                         }
+                                        Some(Payload::FecParity(_)) => {}
+                                        Some(payload) => {
+                                            let message = NetworkToGameStateMessage::ReceivePayload(
+                                                route_state.route.lobby_player_id.clone(),
+                                                payload,
+                                            );
 
-                                        let message = snp::ReceivedMessage {
-                                            from: ip,
-                                            data: s.storm_data.clone(),
-                                        };
-                                        snp_send.send(message)
-                                    }
-                                    Some(payload) => {
-                                        let message = NetworkToGameStateMessage::ReceivePayload(
-                                            route_state.route.lobby_player_id.clone(),
-                                            payload,
-                                        );
-
-                                        let game_state_send = self.game_state_send.clone();
-                                        let (cancel_token, canceler) = CancelToken::new();
-                                        self.cancel_child_tasks.push(canceler);
-
-                                        let cancelable = async move {
-                                            let task = async move {
-                                                game_state_send
-                                                    .send(message)
-                                                    .map_err(|e| error!("Send error {}", e))
-                                                    .map(|_| ())
-                                                    .await
+                                            let game_state_send = self.game_state_send.clone();
+                                            let (cancel_token, canceler) = CancelToken::new();
+                                            self.cancel_child_tasks.push(canceler);
+
+                                            let cancelable = async move {
+                                                let task = async move {
+                                                    game_state_send
+                                                        .send(message)
+                                                        .map_err(|e| error!("Send error {}", e))
+                                                        .map(|_| ())
+                                                        .await
+                                                };
+                                                pin_mut!(task);
+                                                let _ = cancel_token.bind(task).await;
                                             };
-                                            pin_mut!(task);
-                                            let _ = cancel_token.bind(task).await;
-                                        };
-                                        tokio::spawn(cancelable);
+                                            tokio::spawn(cancelable);
+                                        }
+                                        _ => {}
                                     }
-                                    _ => {}
                                 }
                             }
                         } else {
@@ -555,24 +633,13 @@ impl State {
                 GameStateToNetworkMessage::SendPayload(target, payload) => {
                     if let NetworkState::Ready(ref network) = self.network {
                         if let Some(route_state) = network.lobby_id_to_routes.get(&target) {
-                            let game_message = {
+                            let packets = {
                                 let mut ack_manager = route_state.ack_manager.lock();
-                                ack_manager.build_outgoing(payload)
+                                build_outgoing_packets(&mut ack_manager, &route_state.fec, payload)
                             };
 
-                            let mut packet = BytesMut::with_capacity(game_message.encoded_len());
-                            game_message.encode(&mut packet).unwrap();
-                            let packet = packet.freeze();
-
-                            let route = &route_state.route;
-                            let send = self.rally_point.forward(
-                                &route.route_id,
-                                route.player_id,
-                                packet,
-                                &route.address,
-                            );
-
-                            let task = send.map_err(|e| error!("Send error {}", e)).map(|_| ());
+                            let task =
+                                send_packets_to_route(&self.rally_point, route_state, packets);
                             let (cancel_token, canceler) = CancelToken::new();
                             self.cancel_child_tasks.push(canceler);
                             tokio::spawn(async move {
@@ -592,40 +659,36 @@ impl State {
                             let (cancel_token, canceler) = CancelToken::new();
                             self.cancel_child_tasks.push(canceler);
                             let rally_point = self.rally_point.clone();
-                            let ack_manager = route_state.ack_manager.clone();
-                            let route = route_state.route.clone();
+                            let route_state = route_state.clone();
 
                             let cancelable = async move {
                                 let task = async move {
                                     let mut attempts = 0;
 
                                     loop {
-                                        let game_message = {
-                                            let mut ack_manager = ack_manager.lock();
+                                        let (packets, resend_time) = {
+                                            let mut ack_manager = route_state.ack_manager.lock();
                                             if ack_manager.payloads_in_flight() == 0 {
                                                 break;
                                             }
-                                            ack_manager.build_outgoing(None)
+                                            let resend_time = ack_manager
+                                                .rtt()
+                                                .rto()
+                                                .clamp(MIN_DELIVER_RESEND, MAX_DELIVER_RESEND);
+                                            let packets = build_outgoing_packets(
+                                                &mut ack_manager,
+                                                &route_state.fec,
+                                                None,
+                                            );
+                                            (packets, resend_time)
                                         };
 
-                                        let mut packet =
-                                            BytesMut::with_capacity(game_message.encoded_len());
-                                        game_message.encode(&mut packet).unwrap();
-                                        let packet = packet.freeze();
-
-                                        let _ = rally_point
-                                            .forward(
-                                                &route.route_id,
-                                                route.player_id,
-                                                packet.clone(),
-                                                &route.address,
-                                            )
-                                            .await
-                                            .map_err(|e| error!("Send error {}", e));
+                                        send_packets_to_route(&rally_point, &route_state, packets)
+                                            .await;
 
                                         attempts += 1;
                                         if attempts < 50 {
-                                            tokio::time::sleep(Duration::from_millis(42)).await;
+                                            tokio::time::sleep(resend_time).await;
                                         } else {
                                             break;
                                         }
@@ -649,6 +712,100 @@ impl State {
         }
     }
 
+    /// `sent` is when Storm sent the packet, if timings are enabled.
+    fn send_storm_packet(&mut self, target: Ipv4Addr, data: Bytes, sent: Option<Instant>) {
+        if let NetworkState::Ready(ref network) = self.network {
+            match get_resend_info(&data) {
+                Some(ResendType::Request(None)) => {
+                    // NOTE(tec27): We drop all Storm resend requests to the same user
+                    // who original sent them, because they add nothing to our existing
+                    // protocol. Our protocol now resends payloads until they're acked,
+                    // so any missing payloads from this user will already be in flight.
+                    return;
+                }
+                Some(ResendType::Request(Some(ref resend_target))) => {
+                    if let Some(last_seen) = self.last_seen_packet_time.get(resend_target) {
+                        if last_seen.elapsed() < Duration::from_millis(500) {
+                            // If we've seen a packet from this player recently, then
+                            // just ignore this request and assume Storm will get what
+                            // it needs through normal protocol means.
+                            return;
+                        }
+                    }
+                }
+                // NOTE(tec27): We allow all resend responses through because those are
+                // *only* for other users' packets, resends of our own packets are sent
+                // as normal (non-resend) packets.
+                _ => {}
+            };
+
+            let payload = Payload::Storm(StormWrapper { storm_data: data });
+
+            if let Some(route_state) = network.ip_to_routes.get(&target) {
+                let delay = network.coalesce_delay;
+                let (packets, start_wait) = {
+                    let mut ack_manager = route_state.ack_manager.lock();
+                    if delay.is_zero() {
+                        (
+                            build_outgoing_packets(
+                                &mut ack_manager,
+                                &route_state.fec,
+                                Some(payload),
+                            ),
+                            false,
+                        )
+                    } else {
+                        match ack_manager.queue_payload(payload) {
+                            QueueStatus::Full => (
+                                build_queued_packets(&mut ack_manager, &route_state.fec),
+                                false,
+                            ),
+                            QueueStatus::Started => (Vec::new(), true),
+                            QueueStatus::Waiting => (Vec::new(), false),
+                        }
+                    }
+                };
+
+                let task = if start_wait {
+                    // Send whatever has been queued once the delay is over. If the
+                    // queue fills up and gets sent before that, this may send the
+                    // next batch early, but it won't ever make it wait longer.
+                    let rally_point = self.rally_point.clone();
+                    let route_state = route_state.clone();
+                    async move {
+                        tokio::time::sleep(delay).await;
+                        let packets = {
+                            let mut ack_manager = route_state.ack_manager.lock();
+                            build_queued_packets(&mut ack_manager, &route_state.fec)
+                        };
+                        send_packets_to_route(&rally_point, &route_state, packets).await;
+                        timings::SEND_LATENCY.record_since(sent);
+                    }
+                    .boxed()
+                } else if !packets.is_empty() {
+                    let send = send_packets_to_route(&self.rally_point, route_state, packets);
+                    async move {
+                        send.await;
+                        timings::SEND_LATENCY.record_since(sent);
+                    }
+                    .boxed()
+                } else {
+                    return;
+                };
+                let (cancel_token, canceler) = CancelToken::new();
+                self.cancel_child_tasks.push(canceler);
+                tokio::spawn(async move {
+                    pin_mut!(task);
+                    let _ = cancel_token.bind(task).await;
+                });
+            } else {
+                error!("Tried to send packet without a route: {}", target);
+            }
+        } else {
+            warn!("Storm tried to send data without ready network");
+        }
+    }
+
     // If we have all parts needed to init network, do all of the remaining work
     fn check_network_ready(&mut self) {
         let game_info;
@@ -656,7 +813,12 @@ impl State {
         let snp_send_messages;
         match self.network {
             NetworkState::Incomplete(ref mut i) => {
-                if i.game_info.is_some() && i.routes.is_some() && i.snp_send_messages.is_some() {
+                if i.ready_to_init
+                    && i.game_info.is_some()
+                    && i.routes.is_some()
+                    && i.snp_send_messages.is_some()
+                {
+                    i.phases.log_summary(Instant::now());
                     game_info = i.game_info.take().unwrap();
                     routes = i.routes.take().unwrap();
                     snp_send_messages = i.snp_send_messages.take().unwrap();
@@ -685,6 +847,7 @@ impl State {
             .iter()
             .filter(|x| x.is_human() || x.is_observer())
             .filter(|x| x.id != game_info.host.id);
+        let fec_mode = FecMode::from_env();
         let lobby_id_to_routes = host
             .into_iter()
             .chain(rest.clone())
@@ -694,11 +857,18 @@ impl State {
                     .iter()
                     .find(|x| x.lobby_player_id == player.id)
                     .map(|route| {
+                        let fec = FecState::new(fec_mode);
+                        let mut ack_manager = AckManager::new();
+                        ack_manager.set_max_payload_size(fec.encoder.max_payload_size());
                         (
                             player.id.clone(),
                             RouteState {
                                 route: route.clone(),
-                                ack_manager: Arc::new(Mutex::new(AckManager::new())),
+                                ack_manager: Arc::new(Mutex::new(ack_manager)),
+                                multipath: Arc::new(Mutex::new(MultipathState::new(
+                                    route.paths.len(),
+                                ))),
+                                fec: Arc::new(Mutex::new(fec)),
                             },
                         )
                     })
@@ -727,21 +897,30 @@ impl State {
         // Create the task which receives packets and forwards them to Storm
         let streams_done = ip_to_routes
             .iter()
-            .map(|(&ip, RouteState { ref route, .. })| {
+            .flat_map(|(&ip, RouteState { ref route, .. })| {
+                route
+                    .paths
+                    .iter()
+                    .enumerate()
+                    .map(move |(path_index, path)| (ip, path_index, path))
+            })
+            .map(|(ip, path_index, path)| {
                 let snp_send = snp_send_messages.clone();
                 let net_message_sender = self.send_messages.clone();
                 let stream = self
                     .rally_point
-                    .listen_route_data(&route.route_id, &route.address);
+                    .listen_route_data(&path.route_id, &path.address);
                 async move {
                     pin_mut!(stream);
                     while let Some(message) = stream.next().await {
                         match message {
-                            Ok(message) => {
+                            Ok((message, received)) => {
                                 let result = net_message_sender
                                     .send(NetworkManagerMessage::ReceivePacket(
                                         ip,
+                                        path_index,
                                         message,
+                                        received,
                                         snp_send.clone(),
                                     ))
                                     .await;
@@ -773,6 +952,7 @@ impl State {
         let ready = ReadyNetwork {
             ip_to_routes,
             lobby_id_to_routes,
+            coalesce_delay: coalesce_delay(&game_info),
         };
         self.network = NetworkState::Ready(ready);
         for waiting in self.waiting_for_network.drain(..) {
@@ -781,6 +961,199 @@ impl State {
     }
 }
 
+fn coalesce_delay(game_info: &app_messages::GameSetupInfo) -> Duration {
+    let percent = std::env::var("SB_NET_COALESCE_PERCENT")
+        .ok()
+        .and_then(|s| s.parse::<u32>().ok())
+        .unwrap_or(DEFAULT_COALESCE_PERCENT)
+        .min(100);
+    let turn_rate = match game_info.turn_rate {
+        Some(rate) if rate != 0 => rate,
+        _ => DEFAULT_TURN_RATE,
+    };
+    Duration::from_micros(1_000_000 * percent as u64 / (100 * turn_rate as u64))
+}
+
+/// Joins a single rally-point route and starts keeping it alive once it is ready.
+fn join_route_path(
+    rally_point: RallyPoint,
+    send_messages: mpsc::Sender<NetworkManagerMessage>,
+    server_future: impl Future<Output = Result<RallyPointServer>>,
+    input_server: &app_messages::RallyPointServer,
+    for_player: &LobbyPlayerId,
+    route_id: &str,
+    player_id: u32,
+) -> impl Future<Output = Result<RoutePath>> {
+    let description = input_server.description.clone();
+    let for_player = for_player.clone();
+    let route_id_string = route_id.to_string();
+    async move {
+        let start = Instant::now();
+        let server = server_future.await?;
+        let picked = Instant::now();
+        let route_id = RouteId::from_string(&route_id_string);
+        let player_id = PlayerId::from_u32(player_id);
+        let timeout = Duration::from_millis(5000);
+        // Route id logged twice since we move from string to u64 here,
+        // have one line where they both are shown to connect them in case.
+        debug!(
+            "Picked server {:?} for route {:?} ({}) [{}ms]",
+            server,
+            route_id,
+            route_id_string,
+            server.ping.as_millis(),
+        );
+        rally_point
+            .join_route(server.address, route_id, player_id, timeout)
+            .await
+            .map_err(|e| NetworkError::RallyPoint(Arc::new(e)))?;
+        let joined = Instant::now();
+
+        debug!(
+            "Connected to {} for id {:?} [{:?}] [{}ms]",
+            description,
+            for_player,
+            route_id,
+            joined.duration_since(picked).as_millis(),
+        );
+        let path = RoutePath {
+            route_id,
+            player_id,
+            address: server.address,
+        };
+        rally_point
+            .wait_route_ready(&path.route_id, &path.address)
+            .await
+            .map_err(|e| NetworkError::RallyPoint(Arc::new(e)))?;
+        send_messages
+            .send(NetworkManagerMessage::StartKeepAlive(path.clone()))
+            .await
+            .map_err(|_| NetworkError::NotActive)?;
+        debug!(
+            "Route [{:?}] is ready: ping {}ms, join {}ms, waiting for other player {}ms",
+            path.route_id,
+            picked.duration_since(start).as_millis(),
+            joined.duration_since(picked).as_millis(),
+            joined.elapsed().as_millis(),
+        );
+        Ok(path)
+    }
+}
+
+/// Passes a received packet to the FEC decoder, returning any packets that were lost but could
+/// be rebuilt from parity after receiving this one.
+fn receive_fec(route_state: &RouteState, message: &GameMessage, packet: Bytes) -> Vec<GameMessage> {
+    let recovered = {
+        let mut fec = route_state.fec.lock();
+        let mut recovered = fec.decoder.on_packet(message.packet_num, packet);
+        for payload in &message.payloads {
+            if let Some(Payload::FecParity(ref parity)) = payload.payload {
+                recovered.extend(fec.decoder.on_parity(parity.clone()));
+            }
+        }
+        recovered
+    };
+    let mut multipath = route_state.multipath.lock();
+    recovered
+        .into_iter()
+        .filter(|&(packet_num, _)| multipath.on_recovered(packet_num))
+        .filter_map(
+            |(packet_num, mut data)| match GameMessage::decode(&mut data) {
+                Ok(message) if message.packet_num == packet_num => Some(message),
+                _ => {
+                    warn!("Packet {} rebuilt from FEC parity was invalid", packet_num);
+                    None
+                }
+            },
+        )
+        .collect()
+}
+
+/// Builds packets for `payload` (or an ack request if `None`) and anything that was queued
+/// before it.
+fn build_outgoing_packets(
+    ack_manager: &mut AckManager,
+    fec: &Mutex<FecState>,
+    payload: Option<Payload>,
+) -> Vec<Bytes> {
+    let first = ack_manager.build_outgoing(payload);
+    let messages = iter::once(first)
+        .chain(iter::from_fn(|| ack_manager.build_queued()))
+        .collect::<Vec<_>>();
+    encode_packets(ack_manager, fec, messages)
+}
+
+/// Builds packets for everything that is queued, returning an empty `Vec` if nothing is.
+fn build_queued_packets(ack_manager: &mut AckManager, fec: &Mutex<FecState>) -> Vec<Bytes> {
+    let messages = iter::from_fn(|| ack_manager.build_queued()).collect::<Vec<_>>();
+    encode_packets(ack_manager, fec, messages)
+}
+
+/// Encodes `messages`, adding FEC parity packets after them if the route uses FEC.
+fn encode_packets(
+    ack_manager: &mut AckManager,
+    fec: &Mutex<FecState>,
+    messages: Vec<GameMessage>,
+) -> Vec<Bytes> {
+    let mut fec = fec.lock();
+    let mut packets = Vec::with_capacity(messages.len());
+    for message in messages {
+        let packet = encode_message(&message);
+        let parity = fec.encoder.add_packet(message.packet_num, &packet);
+        packets.push(packet);
+        if let Some(parity) = parity {
+            let message = ack_manager.build_untracked(Payload::FecParity(parity));
+            packets.push(encode_message(&message));
+        }
+    }
+    packets
+}
+
+fn encode_message(message: &GameMessage) -> Bytes {
+    let mut packet = BytesMut::with_capacity(message.encoded_len());
+    message.encode(&mut packet).unwrap();
+    packet.freeze()
+}
+
+fn send_packets_to_route(
+    rally_point: &RallyPoint,
+    route_state: &RouteState,
+    packets: Vec<Bytes>,
+) -> impl Future<Output = ()> {
+    let sends = packets
+        .into_iter()
+        .map(|packet| send_to_route(rally_point, route_state, packet))
+        .collect::<Vec<_>>();
+    future::join_all(sends).map(|_| ())
+}
+
+/// Sends `packet` over the paths of the route that `MultipathState` considers worth using.
+fn send_to_route(
+    rally_point: &RallyPoint,
+    route_state: &RouteState,
+    packet: Bytes,
+) -> impl Future<Output = ()> {
+    let mask = route_state.multipath.lock().send_paths(Instant::now());
+    let sends = route_state
+        .route
+        .paths
+        .iter()
+        .enumerate()
+        .filter(|&(i, _)| mask & (1 << i) != 0)
+        .map(|(_, path)| {
+            rally_point
+                .forward(
+                    &path.route_id,
+                    path.player_id,
+                    packet.clone(),
+                    &path.address,
+                )
+                .map_err(|e| error!("Send error {}", e))
+        })
+        .collect::<Vec<_>>();
+    future::join_all(sends).map(|_| ())
+}
+
 // Select ip4/6 address based on which finishses the ping faster
 fn ping_server(
     rally_point: &RallyPoint,
@@ -843,6 +1216,7 @@ impl NetworkManager {
                     x = receive_messages.recv() => x,
                     x = internal_receive_messages.recv() => x,
                     x = game_state_recv.recv() => x.map(NetworkManagerMessage::GameState),
+                    _ = snp::outgoing_packets_ready() => Some(NetworkManagerMessage::SnpOutgoing),
                 };
                 match message {
                     Some(m) => state.handle_message(m),
@@ -887,6 +1261,21 @@ impl NetworkManager {
         }
     }
 
+    /// Allows joining routes as soon as the setup has been received, before
+    /// `init_routes_when_ready`. The network will still not become ready before that.
+    ///
+    /// Players other than the host can use this: routes only become ready once both ends have
+    /// joined, and the host only joins after creating the lobby, so it still can't be joined
+    /// too early.
+    pub fn join_routes_early(&self) -> impl Future<Output = Result<()>> {
+        let send = self.send_messages.clone();
+        async move {
+            send.send(NetworkManagerMessage::JoinRoutesEarly())
+                .await
+                .map_err(|_| NetworkError::NotActive)
+        }
+    }
+
     pub fn set_routes(&self, routes: Vec<RouteInput>) -> impl Future<Output = Result<()>> {
         let send = self.send_messages.clone();
         async move {
@@ -4,8 +4,10 @@ use std::collections::{
 };
 
 use std::io;
+use std::mem;
 use std::net::{SocketAddr, SocketAddrV6};
-use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::atomic::{AtomicU32, AtomicUsize, Ordering};
+use std::sync::Arc;
 use std::time::{Duration, Instant};
 
 use byteorder::{ReadBytesExt, WriteBytesExt, LE};
@@ -13,11 +15,14 @@ use bytes::Bytes;
 use futures::future::Either;
 use futures::pin_mut;
 use futures::prelude::*;
+use parking_lot::Mutex;
 use quick_error::quick_error;
 use tokio::select;
 use tokio::sync::{mpsc, oneshot};
 
 use crate::cancel_token::{cancelable_channel, CancelToken, CancelableSender, Canceler};
+use crate::netcode::rtt::RttEstimator;
+use crate::timings;
 use crate::udp::{self, UdpRecv, UdpSend};
 
 quick_error! {
@@ -44,8 +49,14 @@ quick_error! {
     }
 }
 
+/// Upper bound for waiting a ping response, used as is for servers that haven't
+/// been pinged before.
 const PING_TIMEOUT: Duration = Duration::from_millis(2000);
-const RESEND_TIMEOUT: Duration = Duration::from_millis(500);
+/// Lower bound for the RTT-based ping timeout, so that a single delayed response on a
+/// low-latency link doesn't get a working server considered unreachable.
+const MIN_PING_TIMEOUT: Duration = Duration::from_millis(1000);
+/// Max amount of datagrams given to the UDP send thread at once.
+const MAX_SEND_BATCH: usize = 32;
 
 const MSG_JOIN_ROUTE: u8 = 0x5;
 const MSG_JOIN_ROUTE_SUCCESS: u8 = 0x6;
@@ -65,13 +76,18 @@ struct RouteKey(SocketAddrV6, RouteId);
 struct JoinState {
     done: oneshot::Sender<Result<(), RallyPointError>>,
     player_id: PlayerId,
+    started: Instant,
+    /// How many times the join message has been sent, the time to success is only
+    /// used as a RTT sample if it was sent once.
+    send_count: Arc<AtomicU32>,
 }
 
 struct ActiveRoute {
     player_id: PlayerId,
     ready: bool,
     waiting_for_ready: Vec<oneshot::Sender<Result<(), RallyPointError>>>,
-    on_data: Vec<mpsc::Sender<Bytes>>,
+    /// Received data and when it was received, if timings are enabled.
+    on_data: Vec<mpsc::Sender<(Bytes, Option<Instant>)>>,
 }
 
 // Keep internal addrs as IPv6 since UDP recvs come as IPv6 always.
@@ -87,6 +103,8 @@ struct State {
         Option<oneshot::Sender<RallyPointError>>,
     )>,
     pings: HashMap<(u32, SocketAddrV6), Ping>,
+    /// RTT estimates for each rally-point server, shared with `RallyPoint`.
+    rtt: Arc<Mutex<HashMap<SocketAddrV6, RttEstimator>>>,
     #[allow(dead_code)]
     end_recv_task: Canceler,
 }
@@ -138,11 +156,14 @@ impl State {
                 let key = route_key(&address, &route);
                 let (send_done, recv_done) = oneshot::channel();
                 let (send_error, mut recv_error) = mpsc::channel(1);
+                let send_count = Arc::new(AtomicU32::new(0));
                 self.joins.insert(
                     key.clone(),
                     JoinState {
                         done: send_done,
                         player_id: player,
+                        started: Instant::now(),
+                        send_count: send_count.clone(),
                     },
                 );
                 self.joined_servers.insert(address);
@@ -152,10 +173,9 @@ impl State {
                     opt_err.ok_or(())
                 };
                 let send_bytes = self.send_bytes.clone();
+                let rtt = self.rtt.clone();
                 let send_requests = async move {
-                    let mut interval = resend_interval();
                     loop {
-                        interval.tick().await;
                         let (send_this_error, recv_this_error) = oneshot::channel();
                         let send_error = send_error.clone();
                         let forward_error = async move {
@@ -165,9 +185,12 @@ impl State {
                         };
                         tokio::spawn(forward_error);
                         let to_send = (message.clone(), address, Some(send_this_error));
+                        let resends = send_count.fetch_add(1, Ordering::Relaxed);
                         if let Err(_) = send_bytes.send(to_send).await {
                             break;
                         }
+                        let rto = rtt_estimate(&rtt, &address).backoff_rto(resends);
+                        tokio::time::sleep(rto).await;
                     }
                 };
                 let task = async move {
@@ -218,6 +241,14 @@ impl State {
                     },
                 );
                 let message = ping_message(id);
+                // Servers that have been pinged before should respond in a roughly known
+                // time, give up on them early if response is taking too long.
+                let timeout = self
+                    .rtt
+                    .lock()
+                    .get(&address)
+                    .map(|rtt| rtt.backoff_rto(2).clamp(MIN_PING_TIMEOUT, PING_TIMEOUT))
+                    .unwrap_or(PING_TIMEOUT);
 
                 let send_bytes = self.send_bytes.clone();
                 let send_requests = self.send_requests.clone();
@@ -243,7 +274,7 @@ impl State {
                         }
                     };
                     let result = async move {
-                        let timeout_result = tokio::time::timeout(PING_TIMEOUT, inner_result).await;
+                        let timeout_result = tokio::time::timeout(timeout, inner_result).await;
                         match timeout_result {
                             Ok(inner) => inner,
                             Err(_) => Err(RallyPointError::Timeout),
@@ -284,7 +315,7 @@ impl State {
                 let message = keep_alive_message(&route, player);
                 let send_bytes = self.send_bytes.clone();
                 let send = async move {
-                    let _ = send_bytes.send((message, address, None));
+                    let _ = send_bytes.send((message, address, None)).await;
                 };
                 send.boxed()
             }
@@ -323,6 +354,9 @@ impl State {
                 let send_ack = send_bytes_future(&self.send_bytes, ack, addr);
                 if let Entry::Occupied(entry) = join_entry {
                     let (_, join_state) = entry.remove_entry();
+                    if join_state.send_count.load(Ordering::Relaxed) == 1 {
+                        self.add_rtt_sample(addr, join_state.started.elapsed());
+                    }
                     self.active_routes.insert(
                         key,
                         ActiveRoute {
@@ -350,7 +384,9 @@ impl State {
             }
             ServerMessage::Ping(ping_id) => {
                 if let Some(ping) = self.pings.remove(&(ping_id, addr)) {
-                    let _ = ping.done.send(ping.start.elapsed());
+                    let rtt = ping.start.elapsed();
+                    self.add_rtt_sample(addr, rtt);
+                    let _ = ping.done.send(rtt);
                 }
                 future::ready(()).boxed()
             }
@@ -375,20 +411,21 @@ impl State {
             ServerMessage::Receive(route, bytes) => {
                 let key = route_key(&addr, &route);
                 if let Some(route) = self.active_routes.get_mut(&key) {
+                    let received = timings::now();
                     let mut send_futures = Vec::new();
                     // If any of the listeners have been dropped, clean them up here
                     let mut closed_indices = Vec::new();
                     for (i, send) in route.on_data.iter_mut().enumerate() {
-                        match send.try_send(bytes.clone()) {
+                        match send.try_send((bytes.clone(), received)) {
                             Ok(()) => (),
                             Err(err) => match err {
                                 mpsc::error::TrySendError::Closed(..) => {
                                     closed_indices.push(i);
                                 }
-                                mpsc::error::TrySendError::Full(bytes) => {
+                                mpsc::error::TrySendError::Full(data) => {
                                     let send = send.clone();
                                     let future = async move {
-                                        let _ = send.send(bytes).await;
+                                        let _ = send.send(data).await;
                                     };
                                     send_futures.push(future);
                                 }
@@ -408,9 +445,18 @@ impl State {
         }
     }
 
+    fn add_rtt_sample(&mut self, addr: SocketAddrV6, rtt: Duration) {
+        self.rtt
+            .lock()
+            .entry(addr)
+            .or_insert_with(RttEstimator::new)
+            .add_sample(rtt);
+    }
+
     fn new(
         addr: &SocketAddr,
         send_requests: mpsc::Sender<Request>,
+        rtt: Arc<Mutex<HashMap<SocketAddrV6, RttEstimator>>>,
     ) -> Result<State, RallyPointError> {
         let (udp_send, udp_recv) = match udp::udp_socket(addr) {
             Ok(o) => o,
@@ -434,6 +480,7 @@ impl State {
             send_requests,
             send_bytes,
             pings: HashMap::default(),
+            rtt,
             end_recv_task,
         })
     }
@@ -447,19 +494,46 @@ async fn udp_send_task(
         Option<oneshot::Sender<RallyPointError>>,
     )>,
 ) {
-    // TODO UdpSend should take report_error as an argument when sending so this
-    // wouldn't have to flush after each send
-    while let Some((bytes, addr, report_error)) = recv_bytes.recv().await {
-        match udp_send.send((bytes, addr.into())).await {
-            Ok(()) => (),
+    let mut batch = Vec::with_capacity(MAX_SEND_BATCH);
+    let mut report_errors = Vec::with_capacity(MAX_SEND_BATCH);
+    while let Some(first) = recv_bytes.recv().await {
+        // Send everything that has been queued while the previous batch was being sent
+        // at once.
+        let mut next = Some(first);
+        while let Some((bytes, addr, report_error)) = next {
+            batch.push((bytes, SocketAddr::from(addr)));
+            report_errors.push(report_error);
+            if batch.len() >= MAX_SEND_BATCH {
+                break;
+            }
+            next = recv_bytes.try_recv().ok();
+        }
+        let addrs = batch.iter().map(|x| x.1).collect::<Vec<_>>();
+        match udp_send.send_batch(mem::take(&mut batch)).await {
+            Ok(results) => {
+                for ((result, addr), report) in
+                    results.into_iter().zip(addrs).zip(report_errors.drain(..))
+                {
+                    if let Err(e) = result {
+                        error!("UDP send error: {}", e);
+                        if let Some(report) = report {
+                            let _ = report.send(RallyPointError::Send(e, addr));
+                        }
+                    }
+                }
+            }
             Err(e) => {
                 error!("UDP send error: {}", e);
-                if let Some(report) = report_error {
-                    let _ = report.send(RallyPointError::Send(e, addr.into()));
+                for (report, addr) in report_errors.drain(..).zip(addrs) {
+                    if let Some(report) = report {
+                        let error = io::Error::new(e.kind(), e.to_string());
+                        let _ = report.send(RallyPointError::Send(error, addr));
+                    }
                 }
             }
         }
     }
+    debug!("UDP send task end, {}", udp_send.stats());
 }
 
 async fn udp_recv_task(mut udp_recv: UdpRecv, send_requests: mpsc::Sender<Request>) {
@@ -479,8 +553,14 @@ async fn udp_recv_task(mut udp_recv: UdpRecv, send_requests: mpsc::Sender<Reques
     }
 }
 
-fn resend_interval() -> tokio::time::Interval {
-    tokio::time::interval(RESEND_TIMEOUT)
+fn rtt_estimate(
+    rtt: &Mutex<HashMap<SocketAddrV6, RttEstimator>>,
+    address: &SocketAddrV6,
+) -> RttEstimator {
+    rtt.lock()
+        .get(address)
+        .copied()
+        .unwrap_or_else(RttEstimator::new)
 }
 
 pub fn init() -> RallyPoint {
@@ -498,7 +578,9 @@ pub fn init() -> RallyPoint {
     // Separate channel for internal communication, so that dropping RallyPoint
     // will cause main_future to stop.
     let (internal_send_requests, mut internal_recv_requests) = mpsc::channel(16);
-    let mut state = State::new(&addr, internal_send_requests).expect("Couldn't bind rally-point");
+    let rtt = Arc::new(Mutex::new(HashMap::default()));
+    let mut state =
+        State::new(&addr, internal_send_requests, rtt.clone()).expect("Couldn't bind rally-point");
     let main_future = async move {
         loop {
             let request = select! {
@@ -523,7 +605,7 @@ pub fn init() -> RallyPoint {
         debug!("Rally-point task ended");
     };
     tokio::spawn(main_future);
-    RallyPoint { send_requests }
+    RallyPoint { send_requests, rtt }
 }
 
 /// Messages sent from server to players
@@ -553,7 +635,11 @@ enum ExternalRequest {
         oneshot::Sender<Result<(), RallyPointError>>,
     ),
     KeepAlive(RouteId, PlayerId, SocketAddrV6),
-    ListenData(RouteId, SocketAddrV6, mpsc::Sender<Bytes>),
+    ListenData(
+        RouteId,
+        SocketAddrV6,
+        mpsc::Sender<(Bytes, Option<Instant>)>,
+    ),
     Forward(RouteId, PlayerId, Bytes, SocketAddrV6),
 }
 
@@ -567,6 +653,7 @@ enum Request {
 #[derive(Clone)]
 pub struct RallyPoint {
     send_requests: mpsc::Sender<Request>,
+    rtt: Arc<Mutex<HashMap<SocketAddrV6, RttEstimator>>>,
 }
 
 #[derive(Copy, Clone, Debug, Hash, Eq, PartialEq)]
@@ -589,6 +676,13 @@ impl PlayerId {
 }
 
 impl RallyPoint {
+    /// Returns the current RTT estimate to a rally-point server, based on pings and
+    /// route joins. If the server hasn't been communicated with, the estimator
+    /// has no samples and uses a default RTO.
+    pub fn rtt(&self, address: &SocketAddr) -> RttEstimator {
+        rtt_estimate(&self.rtt, &to_ipv6_addr(address))
+    }
+
     pub fn join_route(
         &self,
         address: SocketAddr,
@@ -668,7 +762,7 @@ impl RallyPoint {
         &self,
         route: &RouteId,
         address: &SocketAddr,
-    ) -> impl Stream<Item = Result<Bytes, RallyPointError>> {
+    ) -> impl Stream<Item = Result<(Bytes, Option<Instant>), RallyPointError>> {
         let address = to_ipv6_addr(&address);
         let (send, recv) = mpsc::channel(32);
         let request = ExternalRequest::ListenData(*route, address, send);
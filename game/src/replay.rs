@@ -2,14 +2,17 @@
 
 use std::convert::TryInto;
 use std::io;
+use std::sync::{mpsc, Mutex};
 
 use byteorder::{ReadBytesExt, WriteBytesExt, LE};
+use lazy_static::lazy_static;
 use libc::c_void;
+use tokio::sync::oneshot;
 
 use crate::app_messages::GameSetupInfo;
 use crate::bw::Bw;
 use crate::game_thread;
-use crate::windows;
+use crate::windows::{self, OwnedHandle};
 
 static REPLAY_MAGIC: &[u8] = &[
     0xc2, 0x19, 0xc2, 0x93, 0x01, 0x00, 0x00, 0x00,
@@ -17,6 +20,10 @@ static REPLAY_MAGIC: &[u8] = &[
 ];
 
 pub const SECTION_ID: u32 = 0x74616253; // Sbat
+/// Replays that have the Sbat section appended end with u32 section_offset, u32 FOOTER_MAGIC,
+/// so that the section can be found without walking through rest of the sections.
+pub const FOOTER_MAGIC: u32 = 0x46746253; // SbtF
+pub const FOOTER_LENGTH: usize = 8;
 // Change added by each version
 // 1: Replay uses order queue limit fixes
 // 2: Replay has UMS user selectable slots saved correctly
@@ -30,27 +37,79 @@ pub struct SbatReplayData {
     pub game_logic_version: u16,
 }
 
-/// Checks if the start of file matches what SC:R currently writes to every replay
-/// (This does not check for 1.16.1 / early SC:R magic bytes)
-pub unsafe fn has_replay_magic_bytes(file: *mut c_void) -> bool {
-    match has_replay_magic_bytes_res(file) {
-        Ok(o) => o,
-        Err(e) => {
-            error!("Unable to check file for replay magic: {}", e);
-            false
-        }
-    }
+/// Replay file I/O that BW's thread doesn't need to wait for. Requests are handled in order
+/// on a single thread, so e.g. copying a replay after `add_shieldbattery_data` will copy the
+/// file with the Sbat section added.
+enum ReplayIoRequest {
+    /// Duplicate of the replay file handle, Sbat section to append if it is a replay.
+    AppendSection(OwnedHandle, Vec<u8>),
+    Run(Box<dyn FnOnce() + Send>),
+}
+
+lazy_static! {
+    static ref REPLAY_IO_SEND: Mutex<mpsc::Sender<ReplayIoRequest>> = {
+        let (send, recv) = mpsc::channel();
+        std::thread::spawn(move || {
+            while let Ok(request) = recv.recv() {
+                match request {
+                    ReplayIoRequest::AppendSection(file, section) => {
+                        if let Err(e) = append_section(&file, section) {
+                            error!("Unable to write extended replay data: {}", e);
+                        }
+                    }
+                    ReplayIoRequest::Run(func) => func(),
+                }
+            }
+        });
+        Mutex::new(send)
+    };
 }
 
-unsafe fn has_replay_magic_bytes_res(file: *mut c_void) -> Result<bool, io::Error> {
+fn send_io_request(request: ReplayIoRequest) {
+    let _ = REPLAY_IO_SEND.lock().unwrap().send(request);
+}
+
+/// Runs `func` on the replay I/O thread once earlier replay writes are done.
+pub fn run_after_pending_writes<F: FnOnce() + Send + 'static>(func: F) {
+    send_io_request(ReplayIoRequest::Run(Box::new(func)));
+}
+
+/// Completes once everything queued before this has been written.
+pub async fn wait_for_pending_writes() {
+    let (send, recv) = oneshot::channel();
+    run_after_pending_writes(move || {
+        let _ = send.send(());
+    });
+    let _ = recv.await;
+}
+
+/// Checks if the start of file matches what SC:R currently writes to every replay
+/// (This does not check for 1.16.1 / early SC:R magic bytes)
+unsafe fn has_replay_magic_bytes(file: *mut c_void) -> Result<bool, io::Error> {
     windows::file_seek(file, std::io::SeekFrom::Start(0))?;
     let mut buffer = [0u8; 0x10];
     windows::file_read(file, &mut buffer[..])?;
     Ok(buffer == REPLAY_MAGIC)
 }
 
-/// Adds shieldbattery replay data to end of a winapi file.
-/// (Seeks to the end if not already)
+fn append_section(file: &OwnedHandle, mut section: Vec<u8>) -> Result<(), io::Error> {
+    unsafe {
+        let file = file.get() as *mut c_void;
+        if !has_replay_magic_bytes(file)? {
+            return Ok(());
+        }
+        let offset = windows::file_seek(file, std::io::SeekFrom::End(0))?;
+        let offset: u32 = offset
+            .try_into()
+            .map_err(|_| io::Error::new(io::ErrorKind::Other, "Replay is too large"))?;
+        write_footer(&mut section, offset);
+        windows::file_write(file, &section)
+    }
+}
+
+/// Adds shieldbattery replay data to end of a winapi file, if it is a replay.
+///
+/// The file is written in background, so `file` can be closed once this returns.
 pub unsafe fn add_shieldbattery_data(
     file: *mut c_void,
     bw: &dyn Bw,
@@ -58,7 +117,18 @@ pub unsafe fn add_shieldbattery_data(
     setup_info: &GameSetupInfo,
     player_id_mapping: &[game_thread::PlayerIdMapping],
 ) -> Result<(), io::Error> {
-    windows::file_seek(file, std::io::SeekFrom::End(0))?;
+    let section = shieldbattery_section(bw, exe_build, setup_info, player_id_mapping)?;
+    let file = OwnedHandle::duplicate(file as _)?;
+    send_io_request(ReplayIoRequest::AppendSection(file, section));
+    Ok(())
+}
+
+unsafe fn shieldbattery_section(
+    bw: &dyn Bw,
+    exe_build: u32,
+    setup_info: &GameSetupInfo,
+    player_id_mapping: &[game_thread::PlayerIdMapping],
+) -> Result<Vec<u8>, io::Error> {
     // Current format: (The first two u32s are required by SC:R, after that we can have anything)
     // u32 section_id
     // u32 data_length (Not counting these first 8 bytes)
@@ -78,6 +148,10 @@ pub unsafe fn add_shieldbattery_data(
     //      header, though there are 12 of them)
     // --- Format version 1 ---
     // 0x56     u16 game_logic_version (2)
+    // Footer, not part of the versioned format, always the last 8 bytes of the section:
+    // 0x58     u32 section_offset
+    //      File offset of this section's header.
+    // 0x5c     u32 footer_magic (FOOTER_MAGIC)
     let game = bw.game();
     let mut buffer = Vec::with_capacity(128);
     buffer.write_u32::<LE>(SECTION_ID)?;
@@ -105,11 +179,33 @@ pub unsafe fn add_shieldbattery_data(
         buffer.write_u32::<LE>(user_id)?;
     }
     buffer.write_u16::<LE>(GAME_LOGIC_VERSION)?;
+    // Offset is filled once the file length is known
+    buffer.write_u32::<LE>(0)?;
+    buffer.write_u32::<LE>(FOOTER_MAGIC)?;
 
     let length = buffer.len() as u32 - 8;
     (&mut buffer[4..]).write_u32::<LE>(length)?;
-    windows::file_write(file, &buffer)?;
-    Ok(())
+    Ok(buffer)
+}
+
+fn write_footer(section: &mut [u8], section_offset: u32) {
+    let pos = section.len() - FOOTER_LENGTH;
+    (&mut section[pos..])
+        .write_u32::<LE>(section_offset)
+        .unwrap();
+}
+
+/// Returns offset of the Sbat section from the last `FOOTER_LENGTH` bytes of a replay, if it
+/// has the footer.
+pub fn parse_footer(data: &[u8]) -> Option<u32> {
+    let mut data = data.get(data.len().checked_sub(FOOTER_LENGTH)?..)?;
+    let offset = data.read_u32::<LE>().ok()?;
+    let magic = data.read_u32::<LE>().ok()?;
+    if magic == FOOTER_MAGIC {
+        Some(offset)
+    } else {
+        None
+    }
 }
 
 /// Id is expected to be "12345678-9abc-def0-1234-56789abcdef0"
@@ -160,6 +256,17 @@ fn test_write_uuid() {
     );
 }
 
+#[test]
+fn test_footer() {
+    let mut section = vec![0u8; 0x60];
+    (&mut section[0x5c..]).write_u32::<LE>(FOOTER_MAGIC).unwrap();
+    assert_eq!(parse_footer(&section), Some(0));
+    write_footer(&mut section, 0x1234);
+    assert_eq!(parse_footer(&section), Some(0x1234));
+    assert_eq!(parse_footer(&section[..0x5f]), None);
+    assert_eq!(parse_footer(&section[..4]), None);
+}
+
 pub fn parse_shieldbattery_data(data: &[u8]) -> Option<SbatReplayData> {
     let format = (&data[0..]).read_u16::<LE>().ok()?;
     if format > 1 {
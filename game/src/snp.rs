@@ -1,9 +1,16 @@
+mod ring;
+
+use std::cell::UnsafeCell;
+use std::future::Future;
 use std::mem;
 use std::net::Ipv4Addr;
 use std::ptr::null_mut;
 use std::sync::{Arc, Mutex};
+use std::task::Poll;
+use std::time::Instant;
 
 use bytes::Bytes;
+use futures::task::AtomicWaker;
 use lazy_static::lazy_static;
 use libc::{c_void, sockaddr};
 use winapi::shared::ntdef::HANDLE;
@@ -13,8 +20,11 @@ use winapi::um::sysinfoapi::GetTickCount;
 
 use crate::bw;
 use crate::game_thread::{send_game_msg_to_async, GameThreadMessage};
+use crate::timings;
 use crate::windows::OwnedHandle;
 
+use self::ring::SpscRing;
+
 // 'SBAT'
 pub const PROVIDER_ID: u32 = 0x53424154;
 // NOTE(tec27): The value below is what *Storm* will obey and deal with fragmenting around. We
@@ -23,6 +33,13 @@ pub const PROVIDER_ID: u32 = 0x53424154;
 // min-MTU - (rally-point-overhead) - (max-IP-header-size + udp-header-size) - netcode-overhead
 pub const SNP_PAYLOAD_SIZE: u32 = 576 - 13 - (60 + 8) - 23;
 const STORM_ERROR_NO_MESSAGES_WAITING: u32 = 0x8510006b;
+/// How many received packets can be given to Storm without allocating. Storm frees them right
+/// after copying the data, so this only needs to cover a burst of packets between two polls.
+const RECEIVE_SLAB_SIZE: usize = 256;
+/// Received packets (slab or not) that can be waiting for Storm to pick them up.
+const RECEIVED_RING_SIZE: usize = 1024;
+/// Packets sent by Storm that can be waiting for the network task to handle them.
+const OUTGOING_RING_SIZE: usize = 128;
 
 pub static CAPABILITIES: bw::SnpCapabilities = bw::SnpCapabilities {
     size: mem::size_of::<bw::SnpCapabilities>() as u32,
@@ -55,7 +72,52 @@ struct State {
     spoofed_game: Option<bw::SnpGameInfo>,
     spoofed_game_dirty: bool,
     current_client_info: Option<bw::ClientInfo>,
-    messages: Vec<ReceivedMessage>,
+}
+
+/// Packets are passed between BW's thread and the network task through these rings, so that
+/// neither side has to wait on a lock held by the other, and BW's side doesn't allocate.
+///
+/// Storm is expected to call `receive_packet` and `free_packet` from one thread at a time,
+/// and `send_packet` from one thread at a time, as each of them is the only producer or
+/// consumer of its ring on BW's side. The network side of the rings is behind `network_side`.
+struct PacketRings {
+    /// Received packets, pushed by `SendMessages::send`, popped in `receive_packet`.
+    received: SpscRing<ReceivedPtr>,
+    /// Slab slots that Storm is done with, pushed in `free_packet`, reused by
+    /// `SendMessages::send`.
+    freed: SpscRing<ReceivedPtr>,
+    /// Packets from `send_packet`, popped by the network task with `pop_outgoing_packet`.
+    outgoing: SpscRing<OutgoingPacket>,
+    outgoing_waker: AtomicWaker,
+    receive_slab: Box<[UnsafeCell<RawReceivedMessage>]>,
+    network_side: parking_lot::Mutex<NetworkSide>,
+}
+
+unsafe impl Sync for PacketRings {}
+
+struct NetworkSide {
+    /// Slab slots that aren't used by anything.
+    available: Vec<ReceivedPtr>,
+}
+
+/// Pointer to a received packet, either in `receive_slab` or a leaked `Box` if the slab
+/// was full.
+struct ReceivedPtr(*mut RawReceivedMessage);
+
+unsafe impl Send for ReceivedPtr {}
+
+pub struct OutgoingPacket {
+    pub target: Ipv4Addr,
+    /// When Storm sent this, if timings are enabled.
+    pub sent: Option<Instant>,
+    len: u32,
+    data: [u8; SNP_PAYLOAD_SIZE as usize],
+}
+
+impl OutgoingPacket {
+    pub fn data(&self) -> &[u8] {
+        &self.data[..self.len as usize]
+    }
 }
 
 lazy_static! {
@@ -63,8 +125,38 @@ lazy_static! {
         spoofed_game: None,
         spoofed_game_dirty: false,
         current_client_info: None,
-        messages: Vec::with_capacity(32),
     });
+    static ref PACKET_RINGS: PacketRings = {
+        let receive_slab: Box<[_]> = (0..RECEIVE_SLAB_SIZE)
+            .map(|_| {
+                UnsafeCell::new(RawReceivedMessage {
+                    from: unsafe { mem::zeroed() },
+                    data: Bytes::new(),
+                    received: None,
+                })
+            })
+            .collect();
+        let available = receive_slab
+            .iter()
+            .map(|slot| ReceivedPtr(slot.get()))
+            .collect();
+        PacketRings {
+            received: SpscRing::with_capacity(RECEIVED_RING_SIZE),
+            freed: SpscRing::with_capacity(RECEIVE_SLAB_SIZE),
+            outgoing: SpscRing::with_capacity(OUTGOING_RING_SIZE),
+            outgoing_waker: AtomicWaker::new(),
+            receive_slab,
+            network_side: parking_lot::Mutex::new(NetworkSide { available }),
+        }
+    };
+}
+
+impl PacketRings {
+    fn is_slab_slot(&self, ptr: *mut RawReceivedMessage) -> bool {
+        let start = self.receive_slab.as_ptr() as *mut RawReceivedMessage;
+        let end = start.wrapping_add(self.receive_slab.len());
+        ptr >= start && ptr < end
+    }
 }
 
 fn with_state<F: FnOnce(&mut State) -> R, R>(func: F) -> R {
@@ -128,6 +220,8 @@ pub fn spoof_game(name: &str, address: Ipv4Addr) {
 /// Messages sent to the async SNP task from BW's side.
 pub enum SnpMessage {
     CreateNetworkHandler(SendMessages),
+    /// Only used if the packet didn't fit in the outgoing ring, see `pop_outgoing_packet`
+    /// for the normal path.
     Send(Ipv4Addr, Vec<u8>),
 }
 
@@ -142,16 +236,75 @@ pub struct SendMessages {
 
 impl SendMessages {
     pub fn send(&self, message: ReceivedMessage) {
-        with_state(|state| {
-            state.messages.push(message);
-        });
+        let rings = &*PACKET_RINGS;
+        {
+            let mut network_side = rings.network_side.lock();
+            if network_side.available.is_empty() {
+                while let Some(slot) = unsafe { rings.freed.pop() } {
+                    network_side.available.push(slot);
+                }
+            }
+            let from = std_ip_to_sockaddr(message.from);
+            let ptr = match network_side.available.pop() {
+                Some(slot) => unsafe {
+                    // Also drops the data of the packet that was previously in this slot,
+                    // so that happens here instead of BW's thread.
+                    *slot.0 = RawReceivedMessage {
+                        from,
+                        data: message.data,
+                        received: message.received,
+                    };
+                    slot
+                },
+                None => ReceivedPtr(Box::into_raw(Box::new(RawReceivedMessage {
+                    from,
+                    data: message.data,
+                    received: message.received,
+                }))),
+            };
+            if let Err(ptr) = unsafe { rings.received.push(ptr) } {
+                // Storm hasn't been picking up packets for a long time, it will have to
+                // request a resend for this.
+                warn!("Dropping received packet, too many packets waiting");
+                if rings.is_slab_slot(ptr.0) {
+                    network_side.available.push(ptr);
+                } else {
+                    unsafe {
+                        drop(Box::from_raw(ptr.0));
+                    }
+                }
+                return;
+            }
+        }
         (self.receive_callback)();
     }
 }
 
+/// Takes the next packet that Storm has sent. Only the network task should be calling this.
+pub fn pop_outgoing_packet() -> Option<OutgoingPacket> {
+    let rings = &*PACKET_RINGS;
+    let _guard = rings.network_side.lock();
+    unsafe { rings.outgoing.pop() }
+}
+
+/// Completes once there are packets for `pop_outgoing_packet`.
+pub fn outgoing_packets_ready() -> impl Future<Output = ()> {
+    futures::future::poll_fn(|cx| {
+        let rings = &*PACKET_RINGS;
+        rings.outgoing_waker.register(cx.waker());
+        if rings.outgoing.is_empty() {
+            Poll::Pending
+        } else {
+            Poll::Ready(())
+        }
+    })
+}
+
 pub struct ReceivedMessage {
     pub from: Ipv4Addr,
     pub data: Bytes,
+    /// When rally-point received this, if timings are enabled.
+    pub received: Option<Instant>,
 }
 
 #[repr(C)]
@@ -160,6 +313,7 @@ struct RawReceivedMessage {
     // (so we can free what Storm gives us)
     from: sockaddr,
     data: Bytes,
+    received: Option<Instant>,
 }
 
 fn send_snp_message(message: SnpMessage) {
@@ -171,7 +325,14 @@ pub unsafe extern "stdcall" fn free_packet(
     _data: *const u8,
     _data_len: u32,
 ) -> i32 {
-    drop(Box::from_raw(from as *mut RawReceivedMessage));
+    let rings = &*PACKET_RINGS;
+    let ptr = from as *mut RawReceivedMessage;
+    if rings.is_slab_slot(ptr) {
+        // `freed` is large enough to hold the entire slab, so this can't fail.
+        let _ = rings.freed.push(ReceivedPtr(ptr));
+    } else {
+        drop(Box::from_raw(ptr));
+    }
     1
 }
 
@@ -207,19 +368,8 @@ pub unsafe extern "stdcall" fn receive_packet(
     if addr.is_null() || data.is_null() || length.is_null() {
         return 0;
     }
-    let msg = with_state(|state| {
-        if state.messages.is_empty() {
-            None
-        } else {
-            Some(state.messages.remove(0))
-        }
-    });
-    if let Some(msg) = msg {
-        let msg = RawReceivedMessage {
-            from: std_ip_to_sockaddr(msg.from),
-            data: msg.data,
-        };
-        let ptr = Box::into_raw(Box::new(msg));
+    if let Some(ReceivedPtr(ptr)) = PACKET_RINGS.received.pop() {
+        timings::RECEIVE_LATENCY.record_since((*ptr).received);
         *addr = ptr as *mut sockaddr;
         *data = (*ptr).data.as_ptr();
         *length = (*ptr).data.len() as u32;
@@ -240,6 +390,21 @@ pub unsafe extern "stdcall" fn send_packet(
 ) -> i32 {
     let target = sockaddr_to_std_ip(*target);
     let data = std::slice::from_raw_parts(data, data_len as usize);
+    let rings = &*PACKET_RINGS;
+    if data.len() <= SNP_PAYLOAD_SIZE as usize {
+        let mut packet = OutgoingPacket {
+            target,
+            sent: timings::now(),
+            len: data_len,
+            data: [0; SNP_PAYLOAD_SIZE as usize],
+        };
+        packet.data[..data.len()].copy_from_slice(data);
+        if rings.outgoing.push(packet).is_ok() {
+            rings.outgoing_waker.wake();
+            return 1;
+        }
+    }
+    // Shouldn't really happen, but the slower path through game thread messages still works.
     send_snp_message(SnpMessage::Send(target, data.into()));
     1
 }
@@ -0,0 +1,173 @@
+use std::cell::UnsafeCell;
+use std::mem::MaybeUninit;
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+/// Keeps the read and write positions on separate cache lines, so that the producer and
+/// consumer threads don't keep taking the line away from each other.
+#[repr(align(64))]
+struct CachePadded(AtomicUsize);
+
+/// Fixed-capacity lock-free queue for passing values from one thread to another.
+///
+/// Any number of threads may hold a reference to the ring, but at most one of them may be
+/// pushing and at most one may be popping at the same time, which is why `push` and `pop` are
+/// unsafe. Neither of them ever blocks or allocates.
+pub struct SpscRing<T> {
+    slots: Box<[UnsafeCell<MaybeUninit<T>>]>,
+    /// Index of the next value to be popped, only written by the consumer.
+    /// Both this and `tail` count up forever and are masked when indexing `slots`.
+    head: CachePadded,
+    /// Index of the next value to be pushed, only written by the producer.
+    tail: CachePadded,
+}
+
+unsafe impl<T: Send> Send for SpscRing<T> {}
+unsafe impl<T: Send> Sync for SpscRing<T> {}
+
+impl<T> SpscRing<T> {
+    /// `capacity` must be a power of two.
+    pub fn with_capacity(capacity: usize) -> SpscRing<T> {
+        assert!(capacity.is_power_of_two());
+        SpscRing {
+            slots: (0..capacity)
+                .map(|_| UnsafeCell::new(MaybeUninit::uninit()))
+                .collect(),
+            head: CachePadded(AtomicUsize::new(0)),
+            tail: CachePadded(AtomicUsize::new(0)),
+        }
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.slots.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.head.0.load(Ordering::Acquire) == self.tail.0.load(Ordering::Acquire)
+    }
+
+    /// Returns the value back if the ring is full.
+    ///
+    /// Unsafe as the caller must guarantee that no other thread is pushing at the same time.
+    pub unsafe fn push(&self, value: T) -> Result<(), T> {
+        let tail = self.tail.0.load(Ordering::Relaxed);
+        let head = self.head.0.load(Ordering::Acquire);
+        if tail.wrapping_sub(head) == self.slots.len() {
+            return Err(value);
+        }
+        let slot = self.slots[tail & (self.slots.len() - 1)].get();
+        (*slot).as_mut_ptr().write(value);
+        self.tail.0.store(tail.wrapping_add(1), Ordering::Release);
+        Ok(())
+    }
+
+    /// Unsafe as the caller must guarantee that no other thread is popping at the same time.
+    pub unsafe fn pop(&self) -> Option<T> {
+        let head = self.head.0.load(Ordering::Relaxed);
+        let tail = self.tail.0.load(Ordering::Acquire);
+        if head == tail {
+            return None;
+        }
+        let slot = self.slots[head & (self.slots.len() - 1)].get();
+        let value = (*slot).as_ptr().read();
+        self.head.0.store(head.wrapping_add(1), Ordering::Release);
+        Some(value)
+    }
+}
+
+impl<T> Drop for SpscRing<T> {
+    fn drop(&mut self) {
+        // &mut self, so nobody else can be using the ring anymore
+        unsafe { while self.pop().is_some() {} }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::sync::Arc;
+    use std::thread;
+
+    use super::SpscRing;
+
+    #[test]
+    fn push_pop() {
+        let ring = SpscRing::with_capacity(4);
+        unsafe {
+            assert!(ring.is_empty());
+            assert_eq!(ring.pop(), None);
+            for i in 0..4 {
+                assert_eq!(ring.push(i), Ok(()));
+            }
+            assert_eq!(ring.push(4), Err(4));
+            assert_eq!(ring.pop(), Some(0));
+            assert_eq!(ring.push(4), Ok(()));
+            for i in 1..5 {
+                assert_eq!(ring.pop(), Some(i));
+            }
+            assert_eq!(ring.pop(), None);
+            assert!(ring.is_empty());
+        }
+    }
+
+    #[test]
+    fn wraps_around() {
+        let ring = SpscRing::with_capacity(8);
+        unsafe {
+            for i in 0..1000u32 {
+                assert_eq!(ring.push(i), Ok(()));
+                assert_eq!(ring.push(i + 1), Ok(()));
+                assert_eq!(ring.pop(), Some(i));
+                assert_eq!(ring.pop(), Some(i + 1));
+            }
+        }
+    }
+
+    #[test]
+    fn drops_remaining_values() {
+        let value = Arc::new(());
+        {
+            let ring = SpscRing::with_capacity(4);
+            unsafe {
+                ring.push(value.clone()).unwrap();
+                ring.push(value.clone()).unwrap();
+                ring.pop().unwrap();
+            }
+            assert_eq!(Arc::strong_count(&value), 2);
+        }
+        assert_eq!(Arc::strong_count(&value), 1);
+    }
+
+    #[test]
+    fn threaded() {
+        const COUNT: u32 = 100_000;
+        let ring = Arc::new(SpscRing::with_capacity(16));
+        let producer = {
+            let ring = ring.clone();
+            thread::spawn(move || {
+                for i in 0..COUNT {
+                    let mut value = Box::new(i);
+                    loop {
+                        match unsafe { ring.push(value) } {
+                            Ok(()) => break,
+                            Err(v) => {
+                                value = v;
+                                thread::yield_now();
+                            }
+                        }
+                    }
+                }
+            })
+        };
+        let mut expected = 0;
+        while expected < COUNT {
+            match unsafe { ring.pop() } {
+                Some(value) => {
+                    assert_eq!(*value, expected);
+                    expected += 1;
+                }
+                None => thread::yield_now(),
+            }
+        }
+        producer.join().unwrap();
+        assert!(ring.is_empty());
+    }
+}
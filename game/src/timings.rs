@@ -0,0 +1,239 @@
+//! Latency histograms collected during a game, summarized in the game results.
+//!
+//! Recording is a few relaxed atomic operations, so these can be used from BW's thread and
+//! the async threads without locking. When disabled (`SB_GAME_TIMINGS=off`), `now()` returns
+//! `None` and nothing else gets done, not even reading the clock.
+
+use std::cell::Cell;
+use std::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+use crate::app_messages::{GameTimings, TimingSummary};
+
+/// Values below this many microseconds get a bucket each, larger values are split into
+/// `SUB_BUCKETS` buckets per power of two, giving ~3% precision.
+const SUB_BUCKETS: usize = 32;
+const SUB_BUCKET_BITS: u32 = 5;
+/// Largest power of two that has its own buckets, larger values go to the last bucket.
+/// 2 ** 27 microseconds is a bit over two minutes.
+const MAX_EXPONENT: u32 = 27;
+const BUCKET_COUNT: usize = SUB_BUCKETS + (MAX_EXPONENT - SUB_BUCKET_BITS) as usize * SUB_BUCKETS;
+
+static ENABLED: AtomicBool = AtomicBool::new(true);
+
+/// From `snp::send_packet` until the packet has been handed to rally-point for forwarding.
+/// When packets are coalesced, only the first packet of each batch is measured, so this
+/// includes the full coalescing delay.
+pub static SEND_LATENCY: Histogram = Histogram::new();
+/// From rally-point receiving a packet until Storm picks it up in `snp::receive_packet`.
+pub static RECEIVE_LATENCY: Histogram = Histogram::new();
+pub static STEP_REPLAY_COMMANDS: Histogram = Histogram::new();
+pub static AFTER_STEP_GAME: Histogram = Histogram::new();
+/// Time between game frames, which includes rendering and any time spent waiting on network.
+pub static FRAME_TIME: Histogram = Histogram::new();
+
+thread_local! {
+    static LAST_FRAME: Cell<Option<Instant>> = Cell::new(None);
+}
+
+pub struct Histogram {
+    buckets: [AtomicU32; BUCKET_COUNT],
+    count: AtomicU32,
+    /// Microseconds
+    sum: AtomicU64,
+    /// Microseconds
+    max: AtomicU64,
+}
+
+impl Histogram {
+    pub const fn new() -> Histogram {
+        const ZERO: AtomicU32 = AtomicU32::new(0);
+        Histogram {
+            buckets: [ZERO; BUCKET_COUNT],
+            count: AtomicU32::new(0),
+            sum: AtomicU64::new(0),
+            max: AtomicU64::new(0),
+        }
+    }
+
+    pub fn record(&self, duration: Duration) {
+        let micros = duration.as_micros().min(u64::MAX as u128) as u64;
+        self.buckets[bucket_index(micros)].fetch_add(1, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(micros, Ordering::Relaxed);
+        self.max.fetch_max(micros, Ordering::Relaxed);
+    }
+
+    /// Records time since `start`, which is expected to be from `now()`.
+    pub fn record_since(&self, start: Option<Instant>) {
+        if let Some(start) = start {
+            self.record(start.elapsed());
+        }
+    }
+
+    fn reset(&self) {
+        for bucket in &self.buckets {
+            bucket.store(0, Ordering::Relaxed);
+        }
+        self.count.store(0, Ordering::Relaxed);
+        self.sum.store(0, Ordering::Relaxed);
+        self.max.store(0, Ordering::Relaxed);
+    }
+
+    pub fn summary(&self) -> TimingSummary {
+        let count = self.count.load(Ordering::Relaxed);
+        let max = self.max.load(Ordering::Relaxed);
+        let percentile = |p: u64| {
+            let target = ((count as u64 * p + 99) / 100).max(1);
+            let mut seen = 0u64;
+            for (i, bucket) in self.buckets.iter().enumerate() {
+                seen += bucket.load(Ordering::Relaxed) as u64;
+                if seen >= target {
+                    let (low, width) = bucket_range(i);
+                    return (low + width / 2).min(max) as u32;
+                }
+            }
+            max as u32
+        };
+        if count == 0 {
+            return TimingSummary::default();
+        }
+        TimingSummary {
+            count,
+            mean: (self.sum.load(Ordering::Relaxed) / count as u64) as u32,
+            p50: percentile(50),
+            p90: percentile(90),
+            p99: percentile(99),
+            max: max.min(u32::MAX as u64) as u32,
+        }
+    }
+}
+
+fn bucket_index(micros: u64) -> usize {
+    if micros < SUB_BUCKETS as u64 {
+        return micros as usize;
+    }
+    let exponent = 63 - micros.leading_zeros();
+    if exponent >= MAX_EXPONENT {
+        return BUCKET_COUNT - 1;
+    }
+    let shift = exponent - SUB_BUCKET_BITS;
+    let sub_bucket = (micros >> shift) as usize & (SUB_BUCKETS - 1);
+    SUB_BUCKETS + shift as usize * SUB_BUCKETS + sub_bucket
+}
+
+/// Returns (lowest value, width) of a bucket.
+fn bucket_range(index: usize) -> (u64, u64) {
+    if index < SUB_BUCKETS {
+        return (index as u64, 1);
+    }
+    let shift = ((index - SUB_BUCKETS) / SUB_BUCKETS) as u32;
+    let sub_bucket = ((index - SUB_BUCKETS) % SUB_BUCKETS) as u64;
+    ((SUB_BUCKETS as u64 + sub_bucket) << shift, 1 << shift)
+}
+
+/// Current time if timings are being collected.
+#[inline]
+pub fn now() -> Option<Instant> {
+    if ENABLED.load(Ordering::Relaxed) {
+        Some(Instant::now())
+    } else {
+        None
+    }
+}
+
+/// Should be called at start of each game frame on BW's thread, with a time from `now()`.
+pub fn frame_started(now: Option<Instant>) {
+    if let Some(now) = now {
+        if let Some(previous) = LAST_FRAME.with(|last| last.replace(Some(now))) {
+            FRAME_TIME.record(now.saturating_duration_since(previous));
+        }
+    }
+}
+
+/// Clears everything recorded so far, and rereads whether timings are enabled.
+///
+/// Called on BW's thread when the game starts, anything recorded before that (e.g. packets
+/// sent during game init) is not included in the results.
+pub fn reset() {
+    let enabled = std::env::var("SB_GAME_TIMINGS").map_or(true, |value| value != "off");
+    ENABLED.store(enabled, Ordering::Relaxed);
+    LAST_FRAME.with(|last| last.set(None));
+    for histogram in all_histograms() {
+        histogram.reset();
+    }
+}
+
+fn all_histograms() -> [&'static Histogram; 5] {
+    [
+        &SEND_LATENCY,
+        &RECEIVE_LATENCY,
+        &STEP_REPLAY_COMMANDS,
+        &AFTER_STEP_GAME,
+        &FRAME_TIME,
+    ]
+}
+
+pub fn game_timings() -> GameTimings {
+    GameTimings {
+        send_latency: SEND_LATENCY.summary(),
+        receive_latency: RECEIVE_LATENCY.summary(),
+        step_replay_commands: STEP_REPLAY_COMMANDS.summary(),
+        after_step_game: AFTER_STEP_GAME.summary(),
+        frame_time: FRAME_TIME.summary(),
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::time::Duration;
+
+    use super::{bucket_index, bucket_range, Histogram, BUCKET_COUNT, SUB_BUCKETS};
+
+    #[test]
+    fn buckets_are_contiguous() {
+        let mut expected_low = 0;
+        for i in 0..BUCKET_COUNT {
+            let (low, width) = bucket_range(i);
+            assert_eq!(low, expected_low);
+            assert_eq!(bucket_index(low), i);
+            assert_eq!(bucket_index(low + width - 1), i);
+            expected_low = low + width;
+        }
+        assert_eq!(bucket_index(u64::MAX), BUCKET_COUNT - 1);
+    }
+
+    #[test]
+    fn bucket_precision() {
+        for &value in &[31u64, 32, 100, 1000, 41_666, 1_000_000, 60_000_000] {
+            let (low, width) = bucket_range(bucket_index(value));
+            assert!(value >= low && value < low + width);
+            assert!(width <= (value / SUB_BUCKETS as u64).max(1));
+        }
+    }
+
+    #[test]
+    fn summary() {
+        let histogram = Histogram::new();
+        assert_eq!(histogram.summary().count, 0);
+        for i in 1..=100 {
+            histogram.record(Duration::from_millis(i));
+        }
+        let summary = histogram.summary();
+        assert_eq!(summary.count, 100);
+        assert_eq!(summary.mean, 50_500);
+        assert_eq!(summary.max, 100_000);
+        let close = |value: u32, expected: u32| {
+            let diff = (value as i64 - expected as i64).abs();
+            diff <= expected as i64 / 32
+        };
+        assert!(close(summary.p50, 50_000), "{}", summary.p50);
+        assert!(close(summary.p90, 90_000), "{}", summary.p90);
+        assert!(close(summary.p99, 99_000), "{}", summary.p99);
+
+        histogram.record(Duration::from_secs(1000));
+        assert_eq!(histogram.summary().max, 1_000_000_000);
+        histogram.reset();
+        assert_eq!(histogram.summary().count, 0);
+    }
+}
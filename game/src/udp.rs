@@ -3,39 +3,130 @@
 /// but tokio/mio do not expose a way to poll the completion step, any failing sends are
 /// reported as successes.
 ///
-/// The implementation just spawns two threads for send/recv and uses the blocking
-/// std::net::UdpSocket, which is relatively fine as we only need a single UDP socket for
-/// rally-point. The more scalable solution would be to create improved version of
-/// mio::net::UdpSocket, but I'm concerned that it would end up being a maintenance burden to
-/// keep up to date when mio/miow/tokio change, as it would end up being comparatively complex
-/// and hard to follow.
+/// The implementation just spawns two threads for send/recv and uses std::net::UdpSocket,
+/// which is relatively fine as we only need a single UDP socket for rally-point.
+/// The threads pass datagrams to the async side in batches, so a burst of packets
+/// doesn't have to wake the async side for each of them. The more scalable solution would
+/// be to create improved version of mio::net::UdpSocket, but I'm concerned that it would
+/// end up being a maintenance burden to keep up to date when mio/miow/tokio change, as it
+/// would end up being comparatively complex and hard to follow.
+use std::collections::VecDeque;
 use std::io;
 use std::mem;
 use std::net::{SocketAddr, SocketAddrV6, UdpSocket};
-use std::os::windows::io::FromRawSocket;
+use std::os::windows::io::{AsRawSocket, FromRawSocket};
 use std::pin::Pin;
-use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
 use std::sync::Arc;
 use std::task::{self, Poll};
+use std::time::{Duration, Instant};
 
-use bytes::Bytes;
+use bytes::{Bytes, BytesMut};
 use futures::prelude::*;
 use tokio::sync::mpsc::{unbounded_channel, UnboundedReceiver};
 use winapi::shared::ws2def::{AF_INET6, IPPROTO_IPV6, SOCK_DGRAM};
 use winapi::shared::ws2ipdef::{IPV6_V6ONLY, SOCKADDR_IN6_LH};
 use winapi::um::winsock2::{
-    bind, setsockopt, socket, WSAGetLastError, WSAStartup, INVALID_SOCKET, WSADATA,
+    bind, setsockopt, socket, WSAGetLastError, WSAPoll, WSAStartup, INVALID_SOCKET, POLLRDNORM,
+    POLLWRNORM, SOCKET, WSADATA, WSAPOLLFD,
 };
 
+/// Max amount of datagrams that are passed between the async side and a socket thread
+/// at once.
+const MAX_BATCH_SIZE: usize = 32;
+/// Receive buffers are split from a shared allocation of this size, refilled once
+/// less than `MAX_DATAGRAM_SIZE` is left.
+const RECV_POOL_SIZE: usize = 64 * 1024;
+const MAX_DATAGRAM_SIZE: usize = 2048;
+/// How often the recv thread wakes up to check if the socket has been closed.
+const POLL_TIMEOUT_MS: i32 = 500;
+
 pub struct UdpSend {
-    thread_sender: std::sync::mpsc::Sender<(Bytes, SocketAddrV6)>,
-    results: UnboundedReceiver<Result<(), io::Error>>,
+    thread_sender: std::sync::mpsc::Sender<Vec<(Bytes, SocketAddrV6)>>,
+    results: UnboundedReceiver<Vec<Result<(), io::Error>>>,
     pending_results: usize,
+    stats: Arc<UdpStats>,
 }
 
 pub struct UdpRecv {
-    thread_receiver: UnboundedReceiver<Result<(Bytes, SocketAddrV6), io::Error>>,
+    thread_receiver: UnboundedReceiver<Vec<Result<(Bytes, SocketAddrV6), io::Error>>>,
+    /// Rest of the most recently received batch.
+    received: VecDeque<Result<(Bytes, SocketAddrV6), io::Error>>,
     closed: Arc<AtomicBool>,
+    stats: Arc<UdpStats>,
+}
+
+/// Counters shared by both halves of the socket.
+struct UdpStats {
+    created: Instant,
+    packets_sent: AtomicU64,
+    send_syscalls: AtomicU64,
+    packets_received: AtomicU64,
+    recv_syscalls: AtomicU64,
+}
+
+#[derive(Debug, Clone)]
+pub struct UdpStatsSnapshot {
+    pub elapsed: Duration,
+    pub packets_sent: u64,
+    pub send_syscalls: u64,
+    pub packets_received: u64,
+    pub recv_syscalls: u64,
+}
+
+impl UdpStats {
+    fn new() -> UdpStats {
+        UdpStats {
+            created: Instant::now(),
+            packets_sent: AtomicU64::new(0),
+            send_syscalls: AtomicU64::new(0),
+            packets_received: AtomicU64::new(0),
+            recv_syscalls: AtomicU64::new(0),
+        }
+    }
+
+    fn snapshot(&self) -> UdpStatsSnapshot {
+        UdpStatsSnapshot {
+            elapsed: self.created.elapsed(),
+            packets_sent: self.packets_sent.load(Ordering::Relaxed),
+            send_syscalls: self.send_syscalls.load(Ordering::Relaxed),
+            packets_received: self.packets_received.load(Ordering::Relaxed),
+            recv_syscalls: self.recv_syscalls.load(Ordering::Relaxed),
+        }
+    }
+}
+
+impl UdpStatsSnapshot {
+    pub fn sent_per_second(&self) -> f64 {
+        self.packets_sent as f64 / self.elapsed.as_secs_f64().max(0.001)
+    }
+
+    pub fn received_per_second(&self) -> f64 {
+        self.packets_received as f64 / self.elapsed.as_secs_f64().max(0.001)
+    }
+
+    pub fn send_syscalls_per_packet(&self) -> f64 {
+        self.send_syscalls as f64 / self.packets_sent.max(1) as f64
+    }
+
+    pub fn recv_syscalls_per_packet(&self) -> f64 {
+        self.recv_syscalls as f64 / self.packets_received.max(1) as f64
+    }
+}
+
+impl std::fmt::Display for UdpStatsSnapshot {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(
+            f,
+            "sent {} ({:.1}/s, {:.2} syscalls/packet), received {} ({:.1}/s, {:.2} syscalls/packet)",
+            self.packets_sent,
+            self.sent_per_second(),
+            self.send_syscalls_per_packet(),
+            self.packets_received,
+            self.received_per_second(),
+            self.recv_syscalls_per_packet(),
+        )
+    }
 }
 
 fn to_ipv6_addr(addr: &SocketAddr) -> SocketAddrV6 {
@@ -89,29 +180,129 @@ fn bind_udp_ipv6_ipv4_socket(local_addr: &SocketAddrV6) -> Result<UdpSocket, io:
     }
 }
 
+/// Waits until `socket` is readable/writable (`events` being POLLRDNORM/POLLWRNORM),
+/// or `timeout_ms` has passed. Returns false on timeout.
+fn poll_socket(socket: &UdpSocket, events: i16, timeout_ms: i32) -> Result<bool, io::Error> {
+    let mut fd = WSAPOLLFD {
+        fd: socket.as_raw_socket() as SOCKET,
+        events,
+        revents: 0,
+    };
+    let result = unsafe { WSAPoll(&mut fd, 1, timeout_ms) };
+    if result < 0 {
+        return Err(io::Error::from_raw_os_error(unsafe { WSAGetLastError() }));
+    }
+    Ok(result != 0)
+}
+
+fn send_datagram(
+    socket: &UdpSocket,
+    data: &[u8],
+    addr: SocketAddrV6,
+    stats: &UdpStats,
+) -> Result<(), io::Error> {
+    loop {
+        stats.send_syscalls.fetch_add(1, Ordering::Relaxed);
+        match socket.send_to(data, addr) {
+            Ok(len) => {
+                if data.len() == len {
+                    return Ok(());
+                } else {
+                    return Err(io::Error::new(
+                        io::ErrorKind::Other,
+                        "Failed to send all of the data",
+                    ));
+                }
+            }
+            Err(e) if e.kind() == io::ErrorKind::WouldBlock => {
+                // Send buffer is full
+                stats.send_syscalls.fetch_add(1, Ordering::Relaxed);
+                poll_socket(socket, POLLWRNORM, POLL_TIMEOUT_MS)?;
+            }
+            Err(e) => return Err(e),
+        }
+    }
+}
+
+/// Receives datagrams until there are no more available or the batch is full.
+/// Blocks until at least one datagram (or error) has been received, or until the
+/// poll timeout, in which case an empty batch is returned.
+fn recv_batch(
+    socket: &UdpSocket,
+    pool: &mut BytesMut,
+    stats: &UdpStats,
+) -> Vec<Result<(Bytes, SocketAddrV6), io::Error>> {
+    let mut batch = Vec::new();
+    while batch.len() < MAX_BATCH_SIZE {
+        if pool.len() < MAX_DATAGRAM_SIZE {
+            // Allocates a new pool buffer, the old one gets freed once all
+            // datagrams received to it have been dropped. The buffer is zeroed once
+            // here so that datagrams can be received to its initialized bytes, without
+            // clearing anything for each datagram.
+            pool.clear();
+            pool.reserve(RECV_POOL_SIZE);
+            pool.resize(pool.capacity(), 0);
+        }
+        stats.recv_syscalls.fetch_add(1, Ordering::Relaxed);
+        match socket.recv_from(&mut pool[..MAX_DATAGRAM_SIZE]) {
+            Ok((n, addr)) => {
+                let bytes = pool.split_to(n).freeze();
+                batch.push(Ok((bytes, to_ipv6_addr(&addr))));
+            }
+            Err(e) if e.kind() == io::ErrorKind::WouldBlock => {
+                if !batch.is_empty() {
+                    break;
+                }
+                stats.recv_syscalls.fetch_add(1, Ordering::Relaxed);
+                match poll_socket(socket, POLLRDNORM, POLL_TIMEOUT_MS) {
+                    Ok(true) => (),
+                    Ok(false) => break,
+                    Err(e) => {
+                        batch.push(Err(e));
+                        break;
+                    }
+                }
+            }
+            Err(e) => batch.push(Err(e)),
+        }
+    }
+    stats.packets_received.fetch_add(
+        batch.iter().filter(|x| x.is_ok()).count() as u64,
+        Ordering::Relaxed,
+    );
+    batch
+}
+
 pub fn udp_socket(local_addr: &SocketAddr) -> Result<(UdpSend, UdpRecv), io::Error> {
     let socket = bind_udp_ipv6_ipv4_socket(&to_ipv6_addr(local_addr))?;
     debug!("UDP socket bound to {:?}", socket.local_addr());
+    // Nonblocking so that the recv thread can receive everything that is available
+    // without a separate syscall to check if there's more, instead of passing each
+    // datagram separately to the async side.
+    // Send thread will have to wait on the socket in the rare case where send buffer
+    // is full.
+    socket.set_nonblocking(true)?;
     let socket2 = socket.try_clone()?;
+    let stats = Arc::new(UdpStats::new());
     let (send, recv) = std::sync::mpsc::channel();
     let (send_result, recv_result) = unbounded_channel();
+    let send_stats = stats.clone();
     std::thread::spawn(move || {
-        while let Ok((val, addr)) = recv.recv() {
-            let val: Bytes = val;
-            let result = match socket.send_to(&val, addr) {
-                Ok(len) => {
-                    if val.len() == len {
-                        Ok(())
-                    } else {
-                        Err(io::Error::new(
-                            io::ErrorKind::Other,
-                            "Failed to send all of the data",
-                        ))
-                    }
-                }
-                Err(e) => Err(e),
-            };
-            if let Err(_) = send_result.send(result) {
+        while let Ok(batch) = recv.recv() {
+            let mut batch: Vec<(Bytes, SocketAddrV6)> = batch;
+            // Anything that was sent while this thread was busy gets handled in the
+            // same batch.
+            while let Ok(more) = recv.try_recv() {
+                batch.extend(more);
+            }
+            let results = batch
+                .iter()
+                .map(|(val, addr)| send_datagram(&socket, &val[..], *addr, &send_stats))
+                .collect::<Vec<_>>();
+            send_stats
+                .packets_sent
+                .fetch_add(batch.len() as u64, Ordering::Relaxed);
+            if let Err(_) = send_result.send(results) {
                 break;
             }
         }
@@ -121,36 +312,86 @@ pub fn udp_socket(local_addr: &SocketAddr) -> Result<(UdpSend, UdpRecv), io::Err
         thread_sender: send,
         results: recv_result,
         pending_results: 0,
+        stats: stats.clone(),
     };
     let closed = Arc::new(AtomicBool::new(false));
     let closed2 = closed.clone();
     let (send, recv) = unbounded_channel();
+    let recv_stats = stats.clone();
     std::thread::spawn(move || {
-        let mut buf = vec![0; 2048];
+        let mut pool = BytesMut::with_capacity(RECV_POOL_SIZE);
         loop {
             if closed2.load(Ordering::Relaxed) == true {
                 break;
             }
-            let result = match socket2.recv_from(&mut buf) {
-                Ok((n, addr)) => {
-                    let bytes = Bytes::copy_from_slice(&buf[..n]);
-                    Ok((bytes, to_ipv6_addr(&addr)))
-                }
-                Err(e) => Err(e),
-            };
-            if let Err(_) = send.send(result) {
+            let batch = recv_batch(&socket2, &mut pool, &recv_stats);
+            if batch.is_empty() {
+                continue;
+            }
+            if let Err(_) = send.send(batch) {
                 break;
             }
         }
-        debug!("UDP recv thread end");
+        debug!("UDP recv thread end, {}", recv_stats.snapshot());
     });
     let udp_recv = UdpRecv {
         thread_receiver: recv,
+        received: VecDeque::new(),
         closed,
+        stats,
     };
     Ok((udp_send, udp_recv))
 }
 
+impl UdpSend {
+    /// Sends all of `packets` at once, returning a result for each of them.
+    ///
+    /// More efficient than sending each packet separately through `Sink`,
+    /// as the packets are passed to the send thread together.
+    pub async fn send_batch(
+        &mut self,
+        packets: Vec<(Bytes, SocketAddr)>,
+    ) -> Result<Vec<Result<(), io::Error>>, io::Error> {
+        self.flush().await?;
+        let packets = packets
+            .into_iter()
+            .map(|(data, addr)| (data, to_ipv6_addr(&addr)))
+            .collect::<Vec<_>>();
+        let count = packets.len();
+        let mut results = Vec::with_capacity(count);
+        if count == 0 {
+            return Ok(results);
+        }
+        if let Err(e) = self.thread_sender.send(packets) {
+            return Err(io::Error::new(io::ErrorKind::Other, e));
+        }
+        // The send thread may combine this with other batches, so the results
+        // can come in more than one message.
+        while results.len() < count {
+            match self.results.recv().await {
+                Some(batch) => results.extend(batch),
+                None => {
+                    return Err(io::Error::new(
+                        io::ErrorKind::Other,
+                        "Child thread has closed",
+                    ))
+                }
+            }
+        }
+        Ok(results)
+    }
+
+    pub fn stats(&self) -> UdpStatsSnapshot {
+        self.stats.snapshot()
+    }
+}
+
+impl UdpRecv {
+    pub fn stats(&self) -> UdpStatsSnapshot {
+        self.stats.snapshot()
+    }
+}
+
 impl Drop for UdpRecv {
     fn drop(&mut self) {
         self.closed.store(true, Ordering::Relaxed);
@@ -161,7 +402,16 @@ impl Stream for UdpRecv {
     type Item = Result<(Bytes, SocketAddrV6), io::Error>;
 
     fn poll_next(mut self: Pin<&mut Self>, cx: &mut task::Context) -> Poll<Option<Self::Item>> {
-        self.thread_receiver.poll_recv(cx)
+        loop {
+            if let Some(next) = self.received.pop_front() {
+                return Poll::Ready(Some(next));
+            }
+            match self.thread_receiver.poll_recv(cx) {
+                Poll::Ready(Some(batch)) => self.received.extend(batch),
+                Poll::Ready(None) => return Poll::Ready(None),
+                Poll::Pending => return Poll::Pending,
+            }
+        }
     }
 }
 
@@ -173,7 +423,10 @@ impl Sink<(Bytes, SocketAddr)> for UdpSend {
     }
 
     fn start_send(mut self: Pin<&mut Self>, data: (Bytes, SocketAddr)) -> Result<(), io::Error> {
-        match self.thread_sender.send((data.0, to_ipv6_addr(&data.1))) {
+        match self
+            .thread_sender
+            .send(vec![(data.0, to_ipv6_addr(&data.1))])
+        {
             Ok(()) => {
                 self.pending_results += 1;
                 Ok(())
@@ -186,12 +439,11 @@ impl Sink<(Bytes, SocketAddr)> for UdpSend {
         while self.pending_results != 0 {
             match self.results.poll_recv(cx) {
                 Poll::Pending => return Poll::Pending,
-                Poll::Ready(Some(Ok(()))) => {
-                    self.pending_results -= 1;
-                }
-                Poll::Ready(Some(Err(e))) => {
-                    self.pending_results -= 1;
-                    return Poll::Ready(Err(e));
+                Poll::Ready(Some(results)) => {
+                    self.pending_results = self.pending_results.saturating_sub(results.len());
+                    if let Some(e) = results.into_iter().filter_map(|x| x.err()).next() {
+                        return Poll::Ready(Err(e));
+                    }
                 }
                 Poll::Ready(None) => {
                     let err = io::Error::new(io::ErrorKind::Other, "Child thread has closed");
@@ -270,3 +270,134 @@ pub unsafe fn file_write(file: *mut c_void, data: &[u8]) -> Result<(), io::Error
         _ => Ok(()),
     }
 }
+
+/// Locks a single byte of `file` at `offset`. The byte doesn't have to be inside
+/// the file, so offsets far past end of the file can be used as locks that
+/// don't prevent other processes from accessing file contents.
+///
+/// If `wait` is false and the byte is locked by someone else, returns `Ok(false)`
+/// instead of blocking.
+pub fn lock_file_range(
+    file: &std::fs::File,
+    offset: u64,
+    exclusive: bool,
+    wait: bool,
+) -> Result<bool, io::Error> {
+    use std::os::windows::io::AsRawHandle;
+    use winapi::shared::winerror::ERROR_LOCK_VIOLATION;
+    use winapi::um::fileapi::LockFileEx;
+    use winapi::um::minwinbase::{LOCKFILE_EXCLUSIVE_LOCK, LOCKFILE_FAIL_IMMEDIATELY, OVERLAPPED};
+
+    let mut flags = 0;
+    if exclusive {
+        flags |= LOCKFILE_EXCLUSIVE_LOCK;
+    }
+    if !wait {
+        flags |= LOCKFILE_FAIL_IMMEDIATELY;
+    }
+    unsafe {
+        let mut overlapped: OVERLAPPED = mem::zeroed();
+        overlapped.u.s_mut().Offset = offset as u32;
+        overlapped.u.s_mut().OffsetHigh = (offset >> 32) as u32;
+        let ok = LockFileEx(file.as_raw_handle() as HANDLE, flags, 0, 1, 0, &mut overlapped);
+        if ok != 0 {
+            Ok(true)
+        } else {
+            let error = io::Error::last_os_error();
+            if !wait && error.raw_os_error() == Some(ERROR_LOCK_VIOLATION as i32) {
+                Ok(false)
+            } else {
+                Err(error)
+            }
+        }
+    }
+}
+
+/// Releases a lock taken with `lock_file_range`.
+pub fn unlock_file_range(file: &std::fs::File, offset: u64) -> Result<(), io::Error> {
+    use std::os::windows::io::AsRawHandle;
+    use winapi::um::fileapi::UnlockFileEx;
+    use winapi::um::minwinbase::OVERLAPPED;
+
+    unsafe {
+        let mut overlapped: OVERLAPPED = mem::zeroed();
+        overlapped.u.s_mut().Offset = offset as u32;
+        overlapped.u.s_mut().OffsetHigh = (offset >> 32) as u32;
+        match UnlockFileEx(file.as_raw_handle() as HANDLE, 0, 1, 0, &mut overlapped) {
+            0 => Err(io::Error::last_os_error()),
+            _ => Ok(()),
+        }
+    }
+}
+
+/// Read-write memory mapping of an entire file.
+pub struct MappedFile {
+    ptr: *mut u8,
+    len: usize,
+}
+
+unsafe impl Send for MappedFile {}
+unsafe impl Sync for MappedFile {}
+
+impl MappedFile {
+    /// Maps `file`, which has to be opened with read and write access.
+    ///
+    /// The mapping size is the file size at the time of mapping; anything written
+    /// past that afterwards won't be visible in the mapping.
+    pub fn new(file: &std::fs::File) -> Result<MappedFile, io::Error> {
+        use std::os::windows::io::AsRawHandle;
+        use winapi::um::memoryapi::{CreateFileMappingW, MapViewOfFile, FILE_MAP_WRITE};
+        use winapi::um::winnt::PAGE_READWRITE;
+
+        let len = file.metadata()?.len();
+        if len == 0 || len > usize::MAX as u64 {
+            return Err(io::Error::new(io::ErrorKind::InvalidInput, "Can't map file of this size"));
+        }
+        unsafe {
+            let mapping = CreateFileMappingW(
+                file.as_raw_handle() as HANDLE,
+                null_mut(),
+                PAGE_READWRITE,
+                0,
+                0,
+                null_mut(),
+            );
+            if mapping.is_null() {
+                return Err(io::Error::last_os_error());
+            }
+            // The view keeps the mapping alive.
+            defer!({
+                CloseHandle(mapping);
+            });
+            let ptr = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, len as usize);
+            if ptr.is_null() {
+                return Err(io::Error::last_os_error());
+            }
+            Ok(MappedFile {
+                ptr: ptr as *mut u8,
+                len: len as usize,
+            })
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn as_slice(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.ptr, self.len) }
+    }
+
+    pub fn as_mut_slice(&mut self) -> &mut [u8] {
+        unsafe { std::slice::from_raw_parts_mut(self.ptr, self.len) }
+    }
+}
+
+impl Drop for MappedFile {
+    fn drop(&mut self) {
+        use winapi::um::memoryapi::UnmapViewOfFile;
+        unsafe {
+            UnmapViewOfFile(self.ptr as *mut _);
+        }
+    }
+}
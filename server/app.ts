@@ -16,6 +16,7 @@ import AwsStore from './lib/file-upload/aws'
 import LocalFileStore from './lib/file-upload/local-filesystem'
 import logMiddleware from './lib/logging/log-middleware'
 import log from './lib/logging/logger'
+import { MatchmakingService } from './lib/matchmaking/matchmaking-service'
 import { prometheusHttpMetrics, prometheusMiddleware } from './lib/monitoring/prometheus-middleware'
 import { redirectToCanonical } from './lib/network/redirect-to-canonical'
 import userIpsMiddleware from './lib/network/user-ips-middleware'
@@ -203,6 +204,8 @@ const rallyPointInitPromise = rallyPointService.initialize(
     log.error({ err }, 'redis error')
   })
 
+  container.resolve(MatchmakingService).startSavingQueues()
+
   fileStoreMiddleware(app)
 
   createRoutes(app, websocketServer)
@@ -0,0 +1,46 @@
+import { makeSbChannelId, ServerChatMessageType } from '../../../common/chat'
+import { makeSbUserId } from '../../../common/users/sb-user'
+import { ChannelMessageCache } from './channel-message-cache'
+import { ChatMessage } from './chat-models'
+
+function createMessage(id: number): ChatMessage {
+  return {
+    msgId: `MESSAGE_${id}`,
+    userId: makeSbUserId(1),
+    userName: 'pachi',
+    channelId: makeSbChannelId(1),
+    sent: new Date(id * 1000),
+    data: { type: ServerChatMessageType.TextMessage, text: `Message ${id}` },
+  }
+}
+
+function ids(messages: ChatMessage[] | undefined) {
+  return messages?.map(m => m.msgId)
+}
+
+describe('chat/channel-message-cache/ChannelMessageCache', () => {
+  test('returns the latest messages', () => {
+    const cache = new ChannelMessageCache([1, 2, 3].map(createMessage), 5)
+
+    expect(ids(cache.getLatest(2))).toEqual(['MESSAGE_2', 'MESSAGE_3'])
+    // All of the channel's messages are known, so asking for more is fine
+    expect(ids(cache.getLatest(10))).toEqual(['MESSAGE_1', 'MESSAGE_2', 'MESSAGE_3'])
+  })
+
+  test('drops the oldest messages when full', () => {
+    const cache = new ChannelMessageCache([1, 2, 3].map(createMessage), 3)
+    cache.add(createMessage(4))
+
+    expect(ids(cache.getLatest(3))).toEqual(['MESSAGE_2', 'MESSAGE_3', 'MESSAGE_4'])
+    expect(cache.getLatest(4)).toBeUndefined()
+  })
+
+  test('deletes messages', () => {
+    const cache = new ChannelMessageCache([1, 2, 3].map(createMessage), 3)
+    cache.delete('MESSAGE_2')
+
+    expect(ids(cache.getLatest(2))).toEqual(['MESSAGE_1', 'MESSAGE_3'])
+    // The cache was loaded full, so there may be older messages that it doesn't have
+    expect(cache.getLatest(3)).toBeUndefined()
+  })
+})
@@ -0,0 +1,55 @@
+import { ChatMessage } from './chat-models'
+
+/** The number of the most recent messages that are kept in memory for each active channel. */
+export const CACHED_CHANNEL_MESSAGES = 100
+
+/**
+ * The most recent messages of a channel, kept in memory so that loading the latest page of a
+ * channel's history (which is what everyone joining or connecting does) doesn't require a query.
+ * Only up to `capacity` messages are kept, the oldest ones are dropped as new ones are added.
+ */
+export class ChannelMessageCache {
+  /** The messages, ordered from oldest to newest. */
+  private messages: ChatMessage[]
+  /**
+   * Whether the cache contains all of the channel's messages (that is, there are no older ones
+   * that weren't loaded or have been dropped).
+   */
+  private complete: boolean
+
+  /**
+   * Constructs a cache from the most recent messages of a channel, ordered from oldest to newest.
+   */
+  constructor(messages: ChatMessage[], readonly capacity = CACHED_CHANNEL_MESSAGES) {
+    this.complete = messages.length < capacity
+    this.messages = messages.slice(-capacity)
+  }
+
+  /** Adds a new message, dropping the oldest message if the cache is full. */
+  add(message: ChatMessage) {
+    this.messages.push(message)
+    if (this.messages.length > this.capacity) {
+      this.messages.shift()
+      this.complete = false
+    }
+  }
+
+  /** Removes the message with the specified ID, if it is in the cache. */
+  delete(messageId: string) {
+    const index = this.messages.findIndex(m => m.msgId === messageId)
+    if (index !== -1) {
+      this.messages.splice(index, 1)
+    }
+  }
+
+  /**
+   * Returns the `limit` most recent messages (ordered from oldest to newest), or `undefined` if
+   * the cache doesn't contain enough messages to know what they are.
+   */
+  getLatest(limit: number): ChatMessage[] | undefined {
+    if (limit > this.messages.length && !this.complete) {
+      return undefined
+    }
+    return this.messages.slice(-limit)
+  }
+}
@@ -188,11 +188,12 @@ export class ChatApi {
   async getChannelHistory(ctx: RouterContext): Promise<GetChannelHistoryServerResponse> {
     const channelId = getValidatedChannelId(ctx)
     const {
-      query: { limit, beforeTime },
+      query: { limit, beforeTime, beforeId },
     } = validateRequest(ctx, {
-      query: Joi.object<{ limit: number; beforeTime: number }>({
+      query: Joi.object<{ limit: number; beforeTime: number; beforeId: string }>({
         limit: Joi.number().min(1).max(100),
         beforeTime: Joi.number().min(-1),
+        beforeId: Joi.string().uuid(),
       }),
     })
 
@@ -201,6 +202,7 @@ export class ChatApi {
       userId: ctx.session!.userId,
       limit,
       beforeTime,
+      beforeId,
     })
   }
 
@@ -373,11 +375,12 @@ export class AdminChatApi {
   async getChannelHistory(ctx: RouterContext): Promise<GetChannelHistoryServerResponse> {
     const channelId = getValidatedChannelId(ctx)
     const {
-      query: { limit, beforeTime },
+      query: { limit, beforeTime, beforeId },
     } = validateRequest(ctx, {
-      query: Joi.object<{ limit: number; beforeTime: number }>({
+      query: Joi.object<{ limit: number; beforeTime: number; beforeId: string }>({
         limit: Joi.number().min(1).max(100),
         beforeTime: Joi.number().min(-1),
+        beforeId: Joi.string().uuid(),
       }),
     })
 
@@ -386,6 +389,7 @@ export class AdminChatApi {
       userId: ctx.session!.userId,
       limit,
       beforeTime,
+      beforeId,
       isAdmin: true,
     })
   }
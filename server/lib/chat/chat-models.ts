@@ -227,10 +227,15 @@ export async function addMessageToChannel<T extends ChatMessageData>(
   }
 }
 
+/**
+ * Returns the most recent `limit` messages of a channel, ordered from oldest to newest. If a
+ * `before` message is given, only messages that come before it are returned. This is given as the
+ * message ID along with its time, and the time is only used if the message doesn't exist (anymore).
+ */
 export async function getMessagesForChannel(
   channelId: SbChannelId,
   limit = 50,
-  beforeDate?: Date,
+  before?: { time: Date; id?: string },
 ): Promise<ChatMessage[]> {
   const { client, done } = await db()
 
@@ -240,14 +245,26 @@ export async function getMessagesForChannel(
         FROM channel_messages as m INNER JOIN users as u ON m.user_id = u.id
         WHERE m.channel_id = ${channelId} `
 
-  if (beforeDate !== undefined) {
-    query.append(sql`AND m.sent < ${beforeDate}`)
+  if (before?.id !== undefined) {
+    // NOTE: Messages are paginated on (sent, id) so that messages with the same time as the
+    // `before` message are neither skipped nor repeated. The time is looked up from the message
+    // itself because the one the client has is truncated to milliseconds.
+    query.append(sql`
+        AND (m.sent, m.id) < (
+          COALESCE((SELECT sent FROM channel_messages WHERE id = ${before.id}), ${before.time}),
+          COALESCE(
+            (SELECT id FROM channel_messages WHERE id = ${before.id}),
+            '00000000-0000-0000-0000-000000000000'
+          )
+        )`)
+  } else if (before !== undefined) {
+    query.append(sql`AND m.sent < ${before.time}`)
   }
 
   query.append(sql`
-        ORDER BY m.sent DESC
+        ORDER BY m.sent DESC, m.id DESC
         LIMIT ${limit}
-      ) SELECT * FROM messages ORDER BY sent ASC`)
+      ) SELECT * FROM messages ORDER BY sent ASC, msg_id ASC`)
 
   try {
     const result = await client.query<DbChatMessage>(query)
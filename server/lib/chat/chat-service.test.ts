@@ -1314,6 +1314,71 @@ describe('chat/chat-service', () => {
         expectItWorks(result)
       })
     })
+
+    describe('for channels with users online', () => {
+      const getMessagesForChannelMock = asMockedFunction(getMessagesForChannel)
+
+      beforeEach(async () => {
+        await joinUserToChannel(
+          user1,
+          testChannel,
+          user1TestChannelEntry,
+          joinUser1TestChannelMessage,
+        )
+        mockTextMessages()
+      })
+
+      test('only loads the latest messages once', async () => {
+        expectItWorks(
+          await chatService.getChannelHistory({ channelId: testChannel.id, userId: user1.id }),
+        )
+        expectItWorks(
+          await chatService.getChannelHistory({ channelId: testChannel.id, userId: user1.id }),
+        )
+
+        expect(getMessagesForChannelMock).toHaveBeenCalledTimes(1)
+      })
+
+      test('keeps the latest messages up to date', async () => {
+        await chatService.getChannelHistory({ channelId: testChannel.id, userId: user1.id })
+
+        mockTextMessage(user1, testChannel, 'Hello again!', [])
+        await chatService.sendChatMessage(testChannel.id, user1.id, textMessage.data.text)
+        await chatService.deleteMessage({
+          channelId: testChannel.id,
+          messageId: textMessage1.msgId,
+          userId: user1.id,
+          isAdmin: true,
+        })
+        const result = await chatService.getChannelHistory({
+          channelId: testChannel.id,
+          userId: user1.id,
+        })
+
+        expect(getMessagesForChannelMock).toHaveBeenCalledTimes(1)
+        expect(result.messages).toEqual([
+          toJoinChannelMessageJson(joinUser1TestChannelMessage),
+          toTextMessageJson(textMessage2),
+          toTextMessageJson(textMessage),
+        ])
+      })
+
+      test('loads older messages from the DB', async () => {
+        await chatService.getChannelHistory({ channelId: testChannel.id, userId: user1.id })
+        await chatService.getChannelHistory({
+          channelId: testChannel.id,
+          userId: user1.id,
+          beforeTime: Number(textMessage1.sent),
+          beforeId: textMessage1.msgId,
+        })
+
+        expect(getMessagesForChannelMock).toHaveBeenCalledTimes(2)
+        expect(getMessagesForChannelMock).toHaveBeenLastCalledWith(testChannel.id, undefined, {
+          time: textMessage1.sent,
+          id: textMessage1.msgId,
+        })
+      })
+    })
   })
 
   describe('getChannelUsers', () => {
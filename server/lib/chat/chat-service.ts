@@ -5,6 +5,7 @@ import {
   ChannelInfo,
   ChannelModerationAction,
   ChannelPermissions,
+  ChatBatchEvent,
   ChatEvent,
   ChatInitEvent,
   ChatServiceErrorCode,
@@ -29,8 +30,10 @@ import { getPermissions } from '../models/permissions'
 import { MIN_IDENTIFIER_MATCHES } from '../users/client-ids'
 import { findConnectedUsers } from '../users/user-identifiers'
 import { findUserById, findUsersById } from '../users/user-model'
+import { PublishBatcher } from '../websockets/publish-batcher'
 import { UserSocketsGroup, UserSocketsManager } from '../websockets/socket-groups'
 import { TypedPublisher } from '../websockets/typed-publisher'
+import { CACHED_CHANNEL_MESSAGES, ChannelMessageCache } from './channel-message-cache'
 import {
   addMessageToChannel,
   addUserToChannel,
@@ -83,11 +86,27 @@ const MAX_JOIN_ATTEMPTS = 3
 @singleton()
 export default class ChatService {
   private state = new ChatState()
+  /**
+   * Publishes the events for chat channels. Presence changes are queued (and batched together),
+   * since a lot of them can happen at once in busy channels, e.g. when everyone reconnects after a
+   * restart.
+   */
+  private channelEvents: PublishBatcher<ChatEvent, ChatBatchEvent>
+  /** The most recent messages of each channel that has users online. */
+  private messageCaches = new global.Map<SbChannelId, ChannelMessageCache>()
+  private messageCacheLoads = new global.Map<SbChannelId, Promise<ChannelMessageCache>>()
+  /**
+   * Requests for the user lists of channels that are currently in progress. These are shared by
+   * anyone requesting the same channel's users in the meantime (e.g. everyone reconnecting at once
+   * after a restart).
+   */
+  private channelUserLoads = new global.Map<SbChannelId, Promise<SbUser[]>>()
 
   constructor(
     private publisher: TypedPublisher<ChatEvent | ChatUserEvent>,
     private userSocketsManager: UserSocketsManager,
   ) {
+    this.channelEvents = new PublishBatcher(publisher, events => ({ action: 'batch', events }))
     userSocketsManager
       .on('newUser', userSockets =>
         this.handleNewUser(userSockets).catch(err =>
@@ -108,8 +127,10 @@ export default class ChatService {
       .updateIn(['channels', channelInfo.id], (s = Set<SbUserId>()) => (s as any).add(userInfo.id))
       // TODO(tec27): Remove `any` cast once Immutable properly types this call again
       .updateIn(['users', userInfo.id], (s = Set<string>()) => (s as any).add(channelInfo.id))
+    this.channelUserLoads.delete(channelInfo.id)
+    this.addToMessageCache(message)
 
-    this.publisher.publish(getChannelPath(channelInfo.id), {
+    this.channelEvents.publish(getChannelPath(channelInfo.id), {
       action: 'join2',
       user: userInfo,
       message: {
@@ -311,7 +332,7 @@ export default class ChatService {
 
     const newOwnerId = await this.removeUserFromChannel(channelId, userId)
 
-    this.publisher.publish(getChannelPath(channelId), {
+    this.channelEvents.publish(getChannelPath(channelId), {
       action: 'leave2',
       userId: userSockets.userId,
       newOwnerId,
@@ -408,7 +429,7 @@ export default class ChatService {
     // owner.
     const newOwnerId = await this.removeUserFromChannel(channelId, targetId)
 
-    this.publisher.publish(getChannelPath(channelId), {
+    this.channelEvents.publish(getChannelPath(channelId), {
       action: moderationAction,
       targetId,
       newOwnerId,
@@ -442,8 +463,9 @@ export default class ChatService {
       text: processedText,
       mentions: mentions.map(m => m.id),
     })
+    this.addToMessageCache(result)
 
-    this.publisher.publish(getChannelPath(channelId), {
+    this.channelEvents.publish(getChannelPath(channelId), {
       action: 'message2',
       message: {
         id: result.msgId,
@@ -483,8 +505,10 @@ export default class ChatService {
     }
 
     await deleteChannelMessage(messageId, channelId)
+    this.messageCacheLoads.delete(channelId)
+    this.messageCaches.get(channelId)?.delete(messageId)
 
-    this.publisher.publish(getChannelPath(channelId), {
+    this.channelEvents.publish(getChannelPath(channelId), {
       action: 'messageDeleted',
       messageId,
     })
@@ -534,12 +558,14 @@ export default class ChatService {
     userId,
     limit,
     beforeTime,
+    beforeId,
     isAdmin,
   }: {
     channelId: SbChannelId
     userId: SbUserId
     limit?: number
     beforeTime?: number
+    beforeId?: string
     isAdmin?: boolean
   }): Promise<GetChannelHistoryServerResponse> {
     if (
@@ -553,11 +579,13 @@ export default class ChatService {
       )
     }
 
-    const dbMessages = await getMessagesForChannel(
-      channelId,
-      limit,
-      beforeTime && beforeTime > -1 ? new Date(beforeTime) : undefined,
-    )
+    const dbMessages =
+      beforeTime && beforeTime > -1
+        ? await getMessagesForChannel(channelId, limit, {
+            time: new Date(beforeTime),
+            id: beforeId,
+          })
+        : await this.getLatestMessages(channelId, limit)
 
     const messages: ServerChatMessage[] = []
     // TODO(2Pac): Move this to a Set to eliminate duplicates
@@ -626,7 +654,68 @@ export default class ChatService {
       )
     }
 
-    return getUsersForChannel(channelId)
+    let loading = this.channelUserLoads.get(channelId)
+    if (!loading) {
+      loading = getUsersForChannel(channelId).finally(() => {
+        if (this.channelUserLoads.get(channelId) === loading) {
+          this.channelUserLoads.delete(channelId)
+        }
+      })
+      this.channelUserLoads.set(channelId, loading)
+    }
+    return loading
+  }
+
+  /**
+   * Returns the most recent messages of a channel, from the message cache if the channel has users
+   * online (loading the cache first if needed).
+   */
+  private async getLatestMessages(channelId: SbChannelId, limit = 50): Promise<ChatMessage[]> {
+    if (!this.state.channels.has(channelId)) {
+      return getMessagesForChannel(channelId, limit)
+    }
+
+    const cache = this.messageCaches.get(channelId) ?? (await this.loadMessageCache(channelId))
+    return cache.getLatest(limit) ?? getMessagesForChannel(channelId, limit)
+  }
+
+  private loadMessageCache(channelId: SbChannelId): Promise<ChannelMessageCache> {
+    const existing = this.messageCacheLoads.get(channelId)
+    if (existing) {
+      return existing
+    }
+
+    const loading = getMessagesForChannel(channelId, CACHED_CHANNEL_MESSAGES)
+      .then(messages => {
+        const cache = new ChannelMessageCache(messages)
+        // If messages were added or deleted while this was loading, they may not be included, so
+        // the result isn't kept (and will be loaded again by the next request)
+        if (
+          this.messageCacheLoads.get(channelId) === loading &&
+          this.state.channels.has(channelId)
+        ) {
+          this.messageCaches.set(channelId, cache)
+        }
+        return cache
+      })
+      .finally(() => {
+        if (this.messageCacheLoads.get(channelId) === loading) {
+          this.messageCacheLoads.delete(channelId)
+        }
+      })
+    this.messageCacheLoads.set(channelId, loading)
+    return loading
+  }
+
+  private addToMessageCache(message: ChatMessage) {
+    this.messageCacheLoads.delete(message.channelId)
+    this.messageCaches.get(message.channelId)?.add(message)
+  }
+
+  /** Drops the cached data of a channel that no longer has any users online. */
+  private forgetInactiveChannel(channelId: SbChannelId) {
+    this.messageCaches.delete(channelId)
+    this.messageCacheLoads.delete(channelId)
   }
 
   async getChatUserProfile(channelId: SbChannelId, userId: SbUserId, targetId: SbUserId) {
@@ -789,11 +878,15 @@ export default class ChatService {
     userId: SbUserId,
   ): Promise<SbUserId | undefined> {
     const { newOwnerId } = await removeUserFromChannel(userId, channelId)
+    this.channelUserLoads.delete(channelId)
 
     const updated = this.state.channels.get(channelId)!.delete(userId)
-    this.state = updated.size
-      ? this.state.setIn(['channels', channelId], updated)
-      : this.state.deleteIn(['channels', channelId])
+    if (updated.size) {
+      this.state = this.state.setIn(['channels', channelId], updated)
+    } else {
+      this.state = this.state.deleteIn(['channels', channelId])
+      this.forgetInactiveChannel(channelId)
+    }
 
     if (this.state.users.has(userId) && this.state.users.get(userId)!.has(channelId)) {
       // TODO(tec27): Remove `any` cast once Immutable properly types this call again
@@ -820,7 +913,7 @@ export default class ChatService {
       .mergeDeepIn(['channels'], inChannels)
       .setIn(['users', userSockets.userId], channelSet)
     for (const userChannel of userChannels) {
-      this.publisher.publish(getChannelPath(userChannel.channelId), {
+      this.channelEvents.queue(getChannelPath(userChannel.channelId), {
         action: 'userActive2',
         userId: userSockets.userId,
       })
@@ -841,14 +934,17 @@ export default class ChatService {
     const channels = this.state.users.get(userId)!
     for (const channel of channels.values()) {
       const updated = this.state.channels.get(channel)?.delete(userId)
-      this.state = updated?.size
-        ? this.state.setIn(['channels', channel], updated)
-        : this.state.deleteIn(['channels', channel])
+      if (updated?.size) {
+        this.state = this.state.setIn(['channels', channel], updated)
+      } else {
+        this.state = this.state.deleteIn(['channels', channel])
+        this.forgetInactiveChannel(channel)
+      }
     }
     this.state = this.state.deleteIn(['users', userId])
 
     for (const c of channels.values()) {
-      this.publisher.publish(getChannelPath(c), {
+      this.channelEvents.queue(getChannelPath(c), {
         action: 'userOffline2',
         userId,
       })
@@ -10,7 +10,9 @@ import { GetGameResponse, toGameRecordJson } from '../../../common/games/games'
 import {
   ALL_GAME_CLIENT_RESULTS,
   GameResultErrorCode,
+  GameTimings,
   SubmitGameResultsRequest,
+  TimingSummary,
 } from '../../../common/games/results'
 import { toMapInfoJson } from '../../../common/maps'
 import { toPublicMatchmakingRatingChangeJson } from '../../../common/matchmaking'
@@ -46,6 +48,15 @@ const GAME_ID_PARAM = Joi.object<{ gameId: string }>({
   gameId: Joi.string().required(),
 })
 
+const TIMING_SUMMARY = Joi.object<TimingSummary>({
+  count: Joi.number().integer().min(0).required(),
+  mean: Joi.number().min(0).required(),
+  p50: Joi.number().min(0).required(),
+  p90: Joi.number().min(0).required(),
+  p99: Joi.number().min(0).required(),
+  max: Joi.number().min(0).required(),
+})
+
 @singleton()
 class GameCountEmitter {
   static readonly GAME_COUNT_UPDATE_TIME_MS = 30 * 1000
@@ -231,7 +242,7 @@ export class GameApi {
   async submitGameResults(ctx: RouterContext): Promise<void> {
     const {
       params: { gameId },
-      body: { userId, resultCode, time, playerResults },
+      body: { userId, resultCode, time, playerResults, timings },
     } = validateRequest(ctx, {
       params: GAME_ID_PARAM,
       body: Joi.object<SubmitGameResultsRequest>({
@@ -254,6 +265,13 @@ export class GameApi {
           .min(1)
           .max(8)
           .required(),
+        timings: Joi.object<GameTimings>({
+          sendLatency: TIMING_SUMMARY.required(),
+          receiveLatency: TIMING_SUMMARY.required(),
+          stepReplayCommands: TIMING_SUMMARY.required(),
+          afterStepGame: TIMING_SUMMARY.required(),
+          frameTime: TIMING_SUMMARY.required(),
+        }),
       }).required(),
     })
 
@@ -263,6 +281,7 @@ export class GameApi {
       resultCode,
       time,
       playerResults,
+      timings,
       logger: ctx.log,
     })
 
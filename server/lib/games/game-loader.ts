@@ -93,16 +93,20 @@ function createRoutes(players: Set<Slot>): Promise<RouteResult[]> {
   const rallyPointService = container.resolve(RallyPointService)
   const activityRegistry = container.resolve(GameplayActivityRegistry)
 
-  return Promise.all(
-    needRoutes.map(([p1, p2]) =>
-      rallyPointService
-        .createBestRoute(
-          activityRegistry.getClientForUser(p1.userId!)!,
-          activityRegistry.getClientForUser(p2.userId!)!,
-        )
-        .then(result => ({ ...result, p1Slot: p1, p2Slot: p2 })),
-    ),
-  )
+  return rallyPointService
+    .createBestRoutes(
+      needRoutes.map(([p1, p2]) => [
+        activityRegistry.getClientForUser(p1.userId!)!,
+        activityRegistry.getClientForUser(p2.userId!)!,
+      ]),
+    )
+    .then(results =>
+      results.map((result, i) => ({
+        ...result,
+        p1Slot: needRoutes[i][0],
+        p2Slot: needRoutes[i][1],
+      })),
+    )
 }
 
 const createLoadingData = Record({
@@ -387,13 +391,38 @@ export class GameLoader {
         p2Slot,
         server,
         route: { routeId, p1Id, p2Id },
+        backup,
       } = route
       return result
         .update(p1Slot, List(), val =>
-          val.push({ for: p2Slot.id, server, routeId, playerId: p1Id }),
+          val.push({
+            for: p2Slot.id,
+            server,
+            routeId,
+            playerId: p1Id,
+            backup: backup
+              ? {
+                  server: backup.server,
+                  routeId: backup.route.routeId,
+                  playerId: backup.route.p1Id,
+                }
+              : undefined,
+          }),
         )
         .update(p2Slot, List(), val =>
-          val.push({ for: p1Slot.id, server, routeId, playerId: p2Id }),
+          val.push({
+            for: p1Slot.id,
+            server,
+            routeId,
+            playerId: p2Id,
+            backup: backup
+              ? {
+                  server: backup.server,
+                  routeId: backup.route.routeId,
+                  playerId: backup.route.p2Id,
+                }
+              : undefined,
+          }),
         )
     }, IMap<Slot, List<GameRoute>>())
 
@@ -116,6 +116,27 @@ export async function updateRouteDebugInfo(
   }
 }
 
+/**
+ * Returns the route debug info for the specified game, or `undefined` if the game couldn't be found
+ * or had no routes recorded (e.g. it only had a single human player).
+ */
+export async function getRouteDebugInfo(
+  gameId: string,
+  withClient?: DbClient,
+): Promise<GameRouteDebugInfo[] | undefined> {
+  const { client, done } = await db(withClient)
+  try {
+    const result = await client.query<{ routes: GameRouteDebugInfo[] | null }>(sql`
+      SELECT routes
+      FROM games
+      WHERE id = ${gameId}
+    `)
+    return result.rows[0]?.routes ?? undefined
+  } finally {
+    done()
+  }
+}
+
 /**
  * Returns the number of games that have been completed (that is, have non-null results).
  */
@@ -1,4 +1,5 @@
 import { Logger } from 'pino'
+import { Counter, exponentialBuckets, Histogram } from 'prom-client'
 import { singleton } from 'tsyringe'
 import { assertUnreachable } from '../../../common/assert-unreachable'
 import { GameSource } from '../../../common/games/configuration'
@@ -9,7 +10,11 @@ import {
   MatchmakingResultsEvent,
   toGameRecordJson,
 } from '../../../common/games/games'
-import { GameClientPlayerResult, GameResultErrorCode } from '../../../common/games/results'
+import {
+  GameClientPlayerResult,
+  GameResultErrorCode,
+  GameTimings,
+} from '../../../common/games/results'
 import { League, toClientLeagueUserChangeJson, toLeagueJson } from '../../../common/leagues'
 import { MatchmakingType, toPublicMatchmakingRatingChangeJson } from '../../../common/matchmaking'
 import { RaceChar } from '../../../common/races'
@@ -19,10 +24,14 @@ import { UserStats } from '../../../common/users/user-stats'
 import { UNIQUE_VIOLATION } from '../db/pg-error-codes'
 import transact from '../db/transaction'
 import { CodedError } from '../errors/coded-error'
-import { findUnreconciledGames, setReconciledResult } from '../games/game-models'
+import {
+  findUnreconciledGames,
+  getRouteDebugInfo,
+  setReconciledResult,
+} from '../games/game-models'
 import { hasCompletedResults, reconcileResults } from '../games/results'
 import { JobScheduler } from '../jobs/job-scheduler'
-import { updateLeaderboards } from '../leagues/leaderboard'
+import { LeaderboardService } from '../leagues/leaderboard'
 import {
   getActiveLeaguesForUsers,
   getLeaguesById,
@@ -49,7 +58,6 @@ import {
   setReportedResults,
   setUserReconciledResult,
 } from '../models/games-users'
-import { Redis } from '../redis'
 import { Clock } from '../time/clock'
 import { incrementUserStatsCount, makeCountKeys } from '../users/user-stats-model'
 import { ClientSocketsManager } from '../websockets/socket-groups'
@@ -70,6 +78,26 @@ const FORCE_RECONCILE_TIMEOUT_MINUTES = 3 * 60
 
 @singleton()
 export default class GameResultService {
+  private unreconciledGamesFoundMetric = new Counter({
+    name: 'shieldbattery_game_results_unreconciled_games_found_total',
+    help: 'Total number of games found by the job that reconciles incomplete results',
+  })
+  private reconcileDurationMetric = new Histogram({
+    name: 'shieldbattery_game_results_reconcile_seconds',
+    labelNames: ['forced'],
+    help: 'Duration of reconciling the results of a game (and updating ratings/stats) in seconds',
+    buckets: exponentialBuckets(0.005, 1.5, 20),
+  })
+  private clientTimingsMetric = new Histogram({
+    name: 'shieldbattery_game_client_timings_seconds',
+    labelNames: ['timing', 'stat', 'rally_point_server'],
+    help:
+      'Mean and 99th percentile of the latencies and frame times measured by game clients over ' +
+      'a game, in seconds. Labeled with the rally-point server most of the reporting ' +
+      "player's routes went through",
+    buckets: exponentialBuckets(0.0001, 2, 16),
+  })
+
   constructor(
     private clientSocketsManager: ClientSocketsManager,
     private typedPublisher: TypedPublisher<GameSubscriptionEvent>,
@@ -77,7 +105,7 @@ export default class GameResultService {
     private jobScheduler: JobScheduler,
     private matchmakingSeasonsService: MatchmakingSeasonsService,
     private clock: Clock,
-    private redis: Redis,
+    private leaderboardService: LeaderboardService,
   ) {
     const jobStartTime = new Date(this.clock.now())
     jobStartTime.setMinutes(jobStartTime.getMinutes() + RECONCILE_INCOMPLETE_RESULTS_MINUTES)
@@ -90,7 +118,7 @@ export default class GameResultService {
         const reconcileBefore = new Date(this.clock.now())
         reconcileBefore.setMinutes(reconcileBefore.getMinutes() - FORCE_RECONCILE_TIMEOUT_MINUTES)
         const toReconcile = await findUnreconciledGames(reconcileBefore)
-        // TODO(tec27): add prometheues metric for number of unreconciled games found
+        this.unreconciledGamesFoundMetric.inc(toReconcile.length)
 
         for (const gameId of toReconcile) {
           try {
@@ -198,6 +226,7 @@ export default class GameResultService {
     resultCode,
     time,
     playerResults,
+    timings,
     logger,
   }: {
     gameId: string
@@ -205,6 +234,7 @@ export default class GameResultService {
     resultCode: string
     time: number
     playerResults: ReadonlyArray<[playerId: SbUserId, result: GameClientPlayerResult]>
+    timings?: GameTimings
     logger: Logger
   }): Promise<void> {
     const gameUserRecord = await getUserGameRecord(userId, gameId)
@@ -242,6 +272,11 @@ export default class GameResultService {
       },
       reportedAt: new Date(this.clock.now()),
     })
+    if (timings) {
+      this.recordClientTimings(gameId, userId, timings).catch(err => {
+        logger.error({ err }, 'error recording game client timings')
+      })
+    }
 
     // We don't need to hold up the response while we check for reconciling
     Promise.resolve()
@@ -297,6 +332,35 @@ export default class GameResultService {
       })
   }
 
+  private async recordClientTimings(gameId: string, userId: SbUserId, timings: GameTimings) {
+    // Games with a single human player don't have any routes
+    const routes = (await getRouteDebugInfo(gameId)) ?? []
+    const routeCounts = new Map<number, number>()
+    for (const route of routes) {
+      if (route.p1 === userId || route.p2 === userId) {
+        routeCounts.set(route.server, (routeCounts.get(route.server) ?? 0) + 1)
+      }
+    }
+    let server = 'none'
+    let maxCount = 0
+    for (const [id, count] of routeCounts) {
+      if (count > maxCount) {
+        server = String(id)
+        maxCount = count
+      }
+    }
+
+    for (const [timing, summary] of Object.entries(timings)) {
+      if (!summary.count) {
+        continue
+      }
+      const labels = { timing, rally_point_server: server }
+      // Summaries are in microseconds
+      this.clientTimingsMetric.observe({ ...labels, stat: 'mean' }, summary.mean / 1000000)
+      this.clientTimingsMetric.observe({ ...labels, stat: 'p99' }, summary.p99 / 1000000)
+    }
+  }
+
   private async maybeReconcileResults(gameRecord: GameRecord, force = false): Promise<void> {
     const gameId = gameRecord.id
     const currentResults = await getCurrentReportedResults(gameId)
@@ -304,6 +368,7 @@ export default class GameResultService {
       return
     }
 
+    const endTimer = this.reconcileDurationMetric.startTimer({ forced: String(force) })
     const reconciled = reconcileResults(currentResults)
     const reconcileDate = new Date(this.clock.now())
     await transact(async client => {
@@ -522,18 +587,12 @@ export default class GameResultService {
         setReconciledResult(client, gameId, reconciled),
       ])
 
-      if (leagueLeaderboardChanges.length) {
-        // NOTE(tec27): This is a best-effort thing, as these leaderboards are basically just a
-        // cache and can be regenerated from the data at any time. We don't want to update them
-        // unless the DB queries succeed, but the DB queries succeeding and this failing is "okay"
-        // as far as accepting the game results
-        updateLeaderboards(this.redis, leagueLeaderboardChanges).catch(err => {
-          logger.error({ err }, 'Error updating league leaderboards')
-          // TODO(tec27): If this fails, the leaderboards should be queued for regeneration at some
-          // point in the (near) future
-        })
-      }
-    })
+      // NOTE(tec27): This is a best-effort thing, as these leaderboards are basically just a cache
+      // and can be regenerated from the data at any time. We don't want to update them unless the
+      // DB queries succeed, but the DB queries succeeding and this failing is "okay" as far as
+      // accepting the game results
+      this.leaderboardService.update(leagueLeaderboardChanges)
+    }).finally(endTimer)
   }
 
   static getGameSubPath(gameId: string) {
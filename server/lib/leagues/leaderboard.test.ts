@@ -0,0 +1,312 @@
+import { LeagueId } from '../../../common/leagues'
+import { benchmark, measure } from '../../../common/testing/benchmark'
+import { makeSbUserId } from '../../../common/users/sb-user'
+import { Redis } from '../redis'
+import { FakeClock, StopCriteria } from '../time/testing/fake-clock'
+import {
+  CachedLeaderboard,
+  compareLeaderboardEntries,
+  LeaderboardEntry,
+  LeaderboardService,
+  LEADERBOARD_CACHE_MS,
+  LEADERBOARD_WRITE_DELAY_MS,
+  MAX_CACHED_LEADERBOARDS,
+} from './leaderboard'
+import { LeagueUser } from './league-models'
+
+const LEAGUE = 'league-1' as LeagueId
+const OTHER_LEAGUE = 'league-2' as LeagueId
+
+function createLeagueUser(leagueId: LeagueId, userId: number, points: number): LeagueUser {
+  return {
+    leagueId,
+    userId: makeSbUserId(userId),
+    points,
+    pointsConverged: false,
+    wins: 0,
+    losses: 0,
+    pWins: 0,
+    pLosses: 0,
+    tWins: 0,
+    tLosses: 0,
+    zWins: 0,
+    zLosses: 0,
+    rWins: 0,
+    rLosses: 0,
+    rPWins: 0,
+    rPLosses: 0,
+    rTWins: 0,
+    rTLosses: 0,
+    rZWins: 0,
+    rZLosses: 0,
+  }
+}
+
+/** A fake of the sorted set commands used for leaderboards. */
+class FakeRedis {
+  sets = new Map<string, Map<string, number>>()
+  zadd = jest.fn((key: string, ...args: Array<string | number>) => {
+    let set = this.sets.get(key)
+    if (!set) {
+      set = new Map()
+      this.sets.set(key, set)
+    }
+    for (let i = 0; i < args.length; i += 2) {
+      set.set(String(args[i + 1]), Number(args[i]))
+    }
+  })
+  pipelines = 0
+
+  pipeline() {
+    this.pipelines += 1
+    const commands: Array<() => void> = []
+    const pipeline = {
+      zadd: (key: string, ...args: Array<string | number>) => {
+        commands.push(() => this.zadd(key, ...args))
+        return pipeline
+      },
+      exec: async () => {
+        for (const command of commands) {
+          command()
+        }
+        return []
+      },
+    }
+    return pipeline
+  }
+
+  zrange = jest.fn(async (key: string) => {
+    const entries = Array.from(this.sets.get(key) ?? [], ([userId, points]) => ({
+      userId: makeSbUserId(Number(userId)),
+      points,
+    }))
+    entries.sort(compareLeaderboardEntries)
+    return entries.flatMap(e => [String(e.userId), String(e.points)])
+  })
+}
+
+describe('leagues/leaderboard/CachedLeaderboard', () => {
+  test('moves updated users to their new rank', () => {
+    const leaderboard = new CachedLeaderboard(
+      [
+        { userId: makeSbUserId(1), points: 300 },
+        { userId: makeSbUserId(2), points: 200 },
+        { userId: makeSbUserId(3), points: 100 },
+      ],
+      0,
+    )
+
+    leaderboard.update(makeSbUserId(3), 250)
+    expect(leaderboard.getUserIds()).toEqual([1, 3, 2])
+    leaderboard.update(makeSbUserId(1), 50)
+    expect(leaderboard.getUserIds()).toEqual([3, 2, 1])
+    leaderboard.update(makeSbUserId(4), 200)
+    expect(leaderboard.getUserIds()).toEqual([3, 4, 2, 1])
+    expect(leaderboard.getUserIds(2)).toEqual([3, 4])
+    expect(leaderboard.size).toBe(4)
+  })
+
+  test('orders ties the same way as Redis', () => {
+    const entries: LeaderboardEntry[] = [
+      { userId: makeSbUserId(5), points: 100 },
+      { userId: makeSbUserId(40), points: 100 },
+      { userId: makeSbUserId(100), points: 100 },
+    ]
+    // Redis orders members of equal score lexicographically, so these are reversed as strings
+    expect(entries.slice().sort(compareLeaderboardEntries).map(e => e.userId)).toEqual([5, 40, 100])
+
+    const leaderboard = new CachedLeaderboard([], 0)
+    for (const entry of entries.slice().reverse()) {
+      leaderboard.update(entry.userId, entry.points)
+    }
+    expect(leaderboard.getUserIds()).toEqual([5, 40, 100])
+  })
+})
+
+describe('leagues/leaderboard/LeaderboardService', () => {
+  let redis: FakeRedis
+  let clock: FakeClock
+  let service: LeaderboardService
+
+  beforeEach(() => {
+    redis = new FakeRedis()
+    clock = new FakeClock()
+    clock.autoRunTimeouts = false
+    service = new LeaderboardService(redis as unknown as Redis, clock)
+  })
+
+  test('coalesces changes into a single write', async () => {
+    service.update([createLeagueUser(LEAGUE, 1, 100), createLeagueUser(LEAGUE, 2, 50)])
+    service.update([createLeagueUser(LEAGUE, 1, 120), createLeagueUser(OTHER_LEAGUE, 3, 10)])
+    service.update([createLeagueUser(LEAGUE, 2, 70)])
+    expect(redis.zadd).not.toHaveBeenCalled()
+
+    await clock.runTimeoutsUntil({ criteria: StopCriteria.EmptyQueue })
+
+    expect(redis.pipelines).toBe(1)
+    expect(redis.zadd).toHaveBeenCalledTimes(2)
+    expect(redis.zadd).toHaveBeenCalledWith('leaderboard:league-1', 120, 1, 70, 2)
+    expect(redis.zadd).toHaveBeenCalledWith('leaderboard:league-2', 10, 3)
+    expect(clock.now()).toBe(LEADERBOARD_WRITE_DELAY_MS)
+  })
+
+  test('serves cached leaderboards and applies written changes to them', async () => {
+    redis.zadd('leaderboard:league-1', 300, 1, 200, 2, 100, 3)
+
+    expect(await service.getLeaderboard(LEAGUE)).toEqual([1, 2, 3])
+    expect(await service.getLeaderboard(LEAGUE, 2)).toEqual([1, 2])
+    expect(redis.zrange).toHaveBeenCalledTimes(1)
+
+    service.update([createLeagueUser(LEAGUE, 3, 400), createLeagueUser(LEAGUE, 4, 150)])
+    await clock.runTimeoutsUntil({
+      criteria: StopCriteria.TimeReached,
+      timeMillis: LEADERBOARD_WRITE_DELAY_MS,
+    })
+
+    expect(await service.getLeaderboard(LEAGUE)).toEqual([3, 1, 2, 4])
+    expect(redis.zrange).toHaveBeenCalledTimes(1)
+  })
+
+  test('shares concurrent reads and expires cached leaderboards', async () => {
+    redis.zadd('leaderboard:league-1', 300, 1, 200, 2)
+
+    const results = await Promise.all([
+      service.getLeaderboard(LEAGUE),
+      service.getLeaderboard(LEAGUE),
+    ])
+    expect(results).toEqual([
+      [1, 2],
+      [1, 2],
+    ])
+    expect(redis.zrange).toHaveBeenCalledTimes(1)
+
+    // Simulate another server writing to the leaderboard
+    redis.zadd('leaderboard:league-1', 500, 2)
+    expect(await service.getLeaderboard(LEAGUE)).toEqual([1, 2])
+
+    clock.setCurrentTime(LEADERBOARD_CACHE_MS)
+    expect(await service.getLeaderboard(LEAGUE)).toEqual([2, 1])
+    expect(redis.zrange).toHaveBeenCalledTimes(2)
+  })
+
+  test('writes queued changes immediately when flushed', async () => {
+    service.update([createLeagueUser(LEAGUE, 1, 100)])
+    await service.flush()
+    expect(redis.zadd).toHaveBeenCalledWith('leaderboard:league-1', 100, 1)
+    expect(clock.now()).toBe(0)
+
+    // The delayed write has nothing left to do
+    await clock.runTimeoutsUntil({ criteria: StopCriteria.EmptyQueue })
+    expect(redis.pipelines).toBe(1)
+  })
+
+  test('evicts leaderboards when they expire', async () => {
+    redis.zadd('leaderboard:league-1', 300, 1)
+    await service.getLeaderboard(LEAGUE)
+    expect(service.cachedCount).toBe(1)
+
+    await clock.runTimeoutsUntil({ criteria: StopCriteria.EmptyQueue })
+    expect(clock.now()).toBe(LEADERBOARD_CACHE_MS)
+    expect(service.cachedCount).toBe(0)
+  })
+
+  test('keeps the most recently read leaderboards', async () => {
+    const leagues = Array.from({ length: MAX_CACHED_LEADERBOARDS + 1 }, (_, i) => {
+      const leagueId = `league-${i}` as LeagueId
+      redis.zadd(`leaderboard:${leagueId}`, 100, i + 1)
+      return leagueId
+    })
+    for (const leagueId of leagues.slice(0, -1)) {
+      await service.getLeaderboard(leagueId)
+    }
+    // Reading the first league again makes the second one the least recently read
+    await service.getLeaderboard(leagues[0])
+    await service.getLeaderboard(leagues[MAX_CACHED_LEADERBOARDS])
+    expect(service.cachedCount).toBe(MAX_CACHED_LEADERBOARDS)
+    expect(redis.zrange).toHaveBeenCalledTimes(MAX_CACHED_LEADERBOARDS + 1)
+
+    await service.getLeaderboard(leagues[0])
+    expect(redis.zrange).toHaveBeenCalledTimes(MAX_CACHED_LEADERBOARDS + 1)
+    await service.getLeaderboard(leagues[1])
+    expect(redis.zrange).toHaveBeenCalledTimes(MAX_CACHED_LEADERBOARDS + 2)
+  })
+})
+
+describe('leagues/leaderboard/LeaderboardService with Redis', () => {
+  // Runs against the Redis server configured with SB_REDIS_HOST/SB_REDIS_PORT, using a new league
+  // ID that is deleted afterwards. This compares the previous approach (a pipeline per game, and
+  // reading the whole sorted set for every request) against the batched writes and cached reads.
+  benchmark('100k member league', async report => {
+    const MEMBERS = 100000
+    const GAMES = 500
+    const READS = 100
+
+    const redis = new Redis()
+    const leagueId = `benchmark-${Date.now()}` as LeagueId
+    const key = `leaderboard:${leagueId}`
+    try {
+      for (let i = 0; i < MEMBERS; i += 1000) {
+        const args: number[] = []
+        for (let j = i; j < Math.min(i + 1000, MEMBERS); j++) {
+          args.push(Math.round(Math.random() * 5000), j + 1)
+        }
+        await redis.zadd(key, ...args)
+      }
+      // Timers aren't needed here (writes are flushed manually), so they're just never run
+      const clock = new FakeClock()
+      clock.autoRunTimeouts = false
+      const service = new LeaderboardService(redis, clock)
+
+      const uncachedReadTime = await measure(async () => {
+        for (let i = 0; i < READS; i++) {
+          await redis.zrange(key, 0, -1, 'REV')
+        }
+      })
+      const loadTime = await measure(() => service.getLeaderboard(leagueId))
+      const cachedReadTime = await measure(async () => {
+        for (let i = 0; i < READS; i++) {
+          await service.getLeaderboard(leagueId)
+        }
+      })
+      report(
+        `${READS} reads of the whole set from Redis ${uncachedReadTime.toFixed(1)}ms, ` +
+          `initial load ${loadTime.toFixed(1)}ms + ${READS} cached reads ` +
+          `${cachedReadTime.toFixed(1)}ms`,
+      )
+
+      // A busy window of game results, 2 players each
+      const games = Array.from({ length: GAMES }, () =>
+        [0, 1].map(() =>
+          createLeagueUser(
+            leagueId,
+            Math.floor(Math.random() * MEMBERS) + 1,
+            Math.round(Math.random() * 5000),
+          ),
+        ),
+      )
+      const perGameWriteTime = await measure(() =>
+        Promise.all(
+          games.map(changes => {
+            const pipeline = redis.pipeline()
+            for (const change of changes) {
+              pipeline.zadd(key, change.points, change.userId)
+            }
+            return pipeline.exec()
+          }),
+        ),
+      )
+      for (const changes of games) {
+        service.update(changes)
+      }
+      const batchedWriteTime = await measure(() => service.flush())
+      report(
+        `${GAMES} games written with a pipeline each ${perGameWriteTime.toFixed(1)}ms, ` +
+          `batched ${batchedWriteTime.toFixed(1)}ms`,
+      )
+      expect(await service.getLeaderboard(leagueId)).toHaveLength(await redis.zcard(key))
+    } finally {
+      await redis.del(key)
+      redis.disconnect()
+    }
+  })
+})
@@ -1,37 +1,260 @@
+import { singleton } from 'tsyringe'
 import { LeagueId } from '../../../common/leagues'
 import { makeSbUserId, SbUserId } from '../../../common/users/sb-user'
+import logger from '../logging/logger'
 import { Redis } from '../redis'
+import { Clock, TimeoutId } from '../time/clock'
 import { LeagueUser } from './league-models'
 
+/** How long leaderboard changes are collected for before they are written to Redis together. */
+export const LEADERBOARD_WRITE_DELAY_MS = 2000
+/**
+ * How long a leaderboard read from Redis is served from memory. Changes written by this server are
+ * applied to the cached leaderboards directly, so this only limits how long changes written by
+ * other servers can take to show up.
+ */
+export const LEADERBOARD_CACHE_MS = 60 * 1000
+/**
+ * The maximum number of leaderboards kept in memory. Leaderboards can be quite large, and usually
+ * only those of the few currently running leagues are being viewed, so the least recently read
+ * ones are evicted past this.
+ */
+export const MAX_CACHED_LEADERBOARDS = 8
+
 function leaderboardKey(leagueId: LeagueId) {
   return `leaderboard:${leagueId}`
 }
 
-/** Updates all the leaderboards for the given updated `LeagueUser`s. */
-export async function updateLeaderboards(redis: Redis, changes: ReadonlyArray<LeagueUser>) {
-  if (!changes.length) {
-    return
+export interface LeaderboardEntry {
+  userId: SbUserId
+  points: number
+}
+
+/**
+ * Orders leaderboard entries the same way Redis orders a reversed sorted set: from most to least
+ * points, with ties ordered by their member string (descending).
+ */
+export function compareLeaderboardEntries(a: LeaderboardEntry, b: LeaderboardEntry): number {
+  if (a.points !== b.points) {
+    return b.points - a.points
+  }
+  const aMember = String(a.userId)
+  const bMember = String(b.userId)
+  if (aMember === bMember) {
+    return 0
+  }
+  return aMember < bMember ? 1 : -1
+}
+
+/** Returns the index in the (sorted) `entries` that `entry` is at, or should be inserted at. */
+function findEntryIndex(entries: ReadonlyArray<LeaderboardEntry>, entry: LeaderboardEntry) {
+  let low = 0
+  let high = entries.length
+  while (low < high) {
+    const mid = (low + high) >>> 1
+    if (compareLeaderboardEntries(entries[mid], entry) < 0) {
+      low = mid + 1
+    } else {
+      high = mid
+    }
   }
+  return low
+}
 
-  const pipeline = redis.pipeline()
+/** A leaderboard that is kept in memory. */
+export class CachedLeaderboard {
+  private entries: LeaderboardEntry[]
+  private points: Map<SbUserId, number>
 
-  for (const change of changes) {
-    const key = leaderboardKey(change.leagueId)
-    pipeline.zadd(key, change.points, change.userId)
+  /**
+   * Constructs a leaderboard from `entries`, which must already be ordered from most to least
+   * points (as they are when read from Redis).
+   */
+  constructor(entries: LeaderboardEntry[], readonly expiresAt: number) {
+    this.entries = entries
+    this.points = new Map(entries.map(e => [e.userId, e.points]))
   }
 
-  await pipeline.exec()
+  get size() {
+    return this.entries.length
+  }
+
+  /** Returns the `SbUserId`s in the leaderboard, ordered from most to least points. */
+  getUserIds(limit?: number): SbUserId[] {
+    const entries = limit !== undefined ? this.entries.slice(0, limit) : this.entries
+    return entries.map(e => e.userId)
+  }
+
+  /** Sets the points of a user, moving them to their new rank (or adding them if needed). */
+  update(userId: SbUserId, points: number) {
+    const oldPoints = this.points.get(userId)
+    if (oldPoints === points) {
+      return
+    }
+    if (oldPoints !== undefined) {
+      this.entries.splice(findEntryIndex(this.entries, { userId, points: oldPoints }), 1)
+    }
+
+    const entry = { userId, points }
+    this.entries.splice(findEntryIndex(this.entries, entry), 0, entry)
+    this.points.set(userId, points)
+  }
+}
+
+async function readLeaderboard(redis: Redis, leagueId: LeagueId): Promise<LeaderboardEntry[]> {
+  const results = await redis.zrange(leaderboardKey(leagueId), 0, -1, 'REV', 'WITHSCORES')
+  const entries: LeaderboardEntry[] = []
+  for (let i = 0; i < results.length; i += 2) {
+    entries.push({ userId: makeSbUserId(Number(results[i])), points: Number(results[i + 1]) })
+  }
+  return entries
 }
 
 /**
- * Returns the `SbUserId`s in a league's leaderboard, ordered from most to least points.
+ * Manages the league leaderboards, which are stored as sorted sets in Redis. Changes are collected
+ * for a short time and then written in a single pipeline, since game results for a league tend to
+ * come in bursts (and a user's points often change multiple times in a burst). Leaderboards that
+ * are read are kept in memory (until they expire, for up to `MAX_CACHED_LEADERBOARDS` leagues), so
+ * that viewing them doesn't require reading the entire sorted set from Redis every time.
  */
-export async function getLeaderboard(
-  redis: Redis,
-  leagueId: LeagueId,
-  limit?: number,
-): Promise<SbUserId[]> {
-  const key = leaderboardKey(leagueId)
-  const entries = await redis.zrange(key, 0, (limit ?? 0) - 1, 'REV')
-  return entries.map(entry => makeSbUserId(Number(entry)))
+@singleton()
+export class LeaderboardService {
+  /** Points that still need to be written to Redis, keyed by league and then by user. */
+  private pending = new Map<LeagueId, Map<SbUserId, number>>()
+  private writeTimeout: TimeoutId | undefined
+  private cache = new Map<LeagueId, CachedLeaderboard>()
+  private loading = new Map<LeagueId, Promise<CachedLeaderboard>>()
+
+  constructor(private redis: Redis, private clock: Clock) {}
+
+  /**
+   * Queues updates to the leaderboards for the given updated `LeagueUser`s. These are written to
+   * Redis (and applied to the cached leaderboards) after `LEADERBOARD_WRITE_DELAY_MS`.
+   */
+  update(changes: ReadonlyArray<LeagueUser>) {
+    for (const change of changes) {
+      let league = this.pending.get(change.leagueId)
+      if (!league) {
+        league = new Map()
+        this.pending.set(change.leagueId, league)
+      }
+      league.set(change.userId, change.points)
+    }
+
+    if (this.pending.size && !this.writeTimeout) {
+      const timeout = this.clock.setTimeout(() => {
+        if (this.writeTimeout !== timeout) {
+          // Already written by `flush`
+          return
+        }
+        this.writeTimeout = undefined
+        this.writePending().catch(err => {
+          // NOTE: This is a best-effort thing, as these leaderboards are basically just a cache and
+          // can be regenerated from the data at any time
+          logger.error({ err }, 'Error updating league leaderboards')
+        })
+      }, LEADERBOARD_WRITE_DELAY_MS)
+      this.writeTimeout = timeout
+    }
+  }
+
+  /**
+   * Writes any queued changes to Redis immediately, instead of waiting for the write delay.
+   */
+  async flush(): Promise<void> {
+    if (this.writeTimeout) {
+      clearTimeout(this.writeTimeout)
+      this.writeTimeout = undefined
+    }
+    if (this.pending.size) {
+      await this.writePending()
+    }
+  }
+
+  /**
+   * Returns the `SbUserId`s in a league's leaderboard, ordered from most to least points.
+   */
+  async getLeaderboard(leagueId: LeagueId, limit?: number): Promise<SbUserId[]> {
+    let leaderboard = this.cache.get(leagueId)
+    if (!leaderboard || leaderboard.expiresAt <= this.clock.now()) {
+      leaderboard = await this.load(leagueId)
+    } else {
+      // Move it to the end, so the map is ordered from least to most recently read
+      this.cache.delete(leagueId)
+      this.cache.set(leagueId, leaderboard)
+    }
+    return leaderboard.getUserIds(limit)
+  }
+
+  /** Returns the number of leaderboards currently kept in memory. */
+  get cachedCount() {
+    return this.cache.size
+  }
+
+  private addToCache(leagueId: LeagueId, leaderboard: CachedLeaderboard) {
+    this.cache.delete(leagueId)
+    this.cache.set(leagueId, leaderboard)
+    for (const oldest of this.cache.keys()) {
+      if (this.cache.size <= MAX_CACHED_LEADERBOARDS) {
+        break
+      }
+      this.cache.delete(oldest)
+    }
+
+    this.clock.setTimeout(() => {
+      if (this.cache.get(leagueId) === leaderboard) {
+        this.cache.delete(leagueId)
+      }
+    }, leaderboard.expiresAt - this.clock.now())
+  }
+
+  private load(leagueId: LeagueId): Promise<CachedLeaderboard> {
+    const existing = this.loading.get(leagueId)
+    if (existing) {
+      return existing
+    }
+
+    const loading = readLeaderboard(this.redis, leagueId)
+      .then(entries => {
+        const leaderboard = new CachedLeaderboard(entries, this.clock.now() + LEADERBOARD_CACHE_MS)
+        // If changes were written while this was being read, they may not be included, so the
+        // result isn't cached (and will be read again by the next request)
+        if (this.loading.get(leagueId) === loading) {
+          this.addToCache(leagueId, leaderboard)
+        }
+        return leaderboard
+      })
+      .finally(() => {
+        if (this.loading.get(leagueId) === loading) {
+          this.loading.delete(leagueId)
+        }
+      })
+    this.loading.set(leagueId, loading)
+    return loading
+  }
+
+  private async writePending() {
+    const pending = this.pending
+    this.pending = new Map()
+
+    const pipeline = this.redis.pipeline()
+    for (const [leagueId, points] of pending) {
+      const args: number[] = []
+      for (const [userId, userPoints] of points) {
+        args.push(userPoints, userId)
+      }
+      pipeline.zadd(leaderboardKey(leagueId), ...args)
+    }
+    await pipeline.exec()
+
+    for (const [leagueId, points] of pending) {
+      this.loading.delete(leagueId)
+      const leaderboard = this.cache.get(leagueId)
+      if (leaderboard) {
+        for (const [userId, userPoints] of points) {
+          leaderboard.update(userId, userPoints)
+        }
+      }
+    }
+  }
 }
@@ -36,11 +36,10 @@ import { handleMultipartFiles } from '../file-upload/handle-multipart-files'
 import { httpApi, httpBeforeAll } from '../http/http-api'
 import { httpBefore, httpGet, httpPatch, httpPost } from '../http/route-decorators'
 import { checkAllPermissions } from '../permissions/check-permissions'
-import { Redis } from '../redis'
 import ensureLoggedIn from '../session/ensure-logged-in'
 import { findUsersById } from '../users/user-model'
 import { validateRequest } from '../validation/joi-validator'
-import { getLeaderboard } from './leaderboard'
+import { LeaderboardService } from './leaderboard'
 import {
   adminGetAllLeagues,
   adminGetLeague,
@@ -95,7 +94,7 @@ function leagueIdFromUrl(ctx: RouterContext): LeagueId {
 @httpApi('/leagues/')
 @httpBeforeAll(convertLeagueApiErrors)
 export class LeagueApi {
-  constructor(private redis: Redis) {}
+  constructor(private leaderboardService: LeaderboardService) {}
 
   @httpGet('/')
   async getLeagues(ctx: RouterContext): Promise<GetLeaguesListResponse> {
@@ -142,7 +141,7 @@ export class LeagueApi {
     const now = new Date()
     const [league, leaderboard] = await Promise.all([
       getLeague(leagueId, now),
-      getLeaderboard(this.redis, leagueId),
+      this.leaderboardService.getLeaderboard(leagueId),
     ])
 
     if (!league) {
@@ -13,6 +13,8 @@ import { deleteFiles } from '../file-upload'
 import { handleMultipartFiles } from '../file-upload/handle-multipart-files'
 import { httpApi, httpBeforeAll } from '../http/http-api'
 import { httpBefore, httpDelete, httpGet, httpPatch, httpPost } from '../http/route-decorators'
+import { JobScheduler } from '../jobs/job-scheduler'
+import logger from '../logging/logger'
 import {
   addMapToFavorites,
   getFavoritedMaps,
@@ -30,7 +32,7 @@ import ensureLoggedIn from '../session/ensure-logged-in'
 import createThrottle from '../throttle/create-throttle'
 import throttleMiddleware from '../throttle/middleware'
 import { validateRequest } from '../validation/joi-validator'
-import { processStoredMapFile, reparseMapsAsNeeded } from './map-operations'
+import { processStoredMapFile, reparseMapsAsNeeded, reparseOutdatedMaps } from './map-operations'
 
 const mapsListThrottle = createThrottle('mapslist', {
   rate: 30,
@@ -58,9 +60,41 @@ const mapRemoveThrottle = createThrottle('mapremove', {
   window: 60000,
 })
 
+/** How often outdated maps are re-parsed in the background. */
+const REPARSE_OUTDATED_MAPS_MINUTES = 1
+/**
+ * How many outdated maps are re-parsed each time. This limits how much load re-parsing every map
+ * puts on the server, while still getting through them in a reasonable amount of time.
+ */
+const REPARSE_OUTDATED_MAPS_BATCH_SIZE = 20
+
 @httpApi('/maps')
 @httpBeforeAll(ensureLoggedIn)
 export class MapsApi {
+  private reparseAfterHash: string | undefined
+
+  constructor(private jobScheduler: JobScheduler) {
+    const startTime = new Date()
+    startTime.setMinutes(startTime.getMinutes() + REPARSE_OUTDATED_MAPS_MINUTES)
+
+    this.jobScheduler.scheduleJob(
+      'lib/maps#reparseOutdatedMaps',
+      startTime,
+      REPARSE_OUTDATED_MAPS_MINUTES * 60 * 1000,
+      async () => {
+        const lastHash = await reparseOutdatedMaps(
+          REPARSE_OUTDATED_MAPS_BATCH_SIZE,
+          this.reparseAfterHash,
+        )
+        if (lastHash) {
+          logger.info(`re-parsed outdated maps up to ${lastHash}`)
+        }
+        // Once the end has been reached, start over to retry any that failed
+        this.reparseAfterHash = lastHash
+      },
+    )
+  }
+
   @httpGet('/')
   @httpBefore(throttleMiddleware(mapsListThrottle, ctx => String(ctx.session!.userId)))
   async list(ctx: RouterContext): Promise<any> {
@@ -316,10 +350,11 @@ export class MapsApi {
     }
 
     await updateMapImages(map.hash, async () => {
-      await processStoredMapFile(
-        map,
-        async ({ path }) => await storeRegeneratedImages(path, map.mapData.format),
-      )
+      let changed = false
+      await processStoredMapFile(map, async ({ path }) => {
+        changed = await storeRegeneratedImages(path, map.mapData.format)
+      })
+      return changed
     })
 
     // TODO(tec27): Should probably return the updated map info here, since the URLs will change
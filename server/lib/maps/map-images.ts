@@ -0,0 +1,29 @@
+import sharp from 'sharp'
+import { RenderedMapImage } from './map-parse-pool'
+
+/** The widths of the images that are generated for each map, from smallest to largest. */
+export const MAP_IMAGE_SIZES = [256, 512, 1024, 2048] as const
+export type MapImageSize = typeof MAP_IMAGE_SIZES[number]
+
+const JPEG_QUALITY = 90
+
+/**
+ * Encodes a rendered map image as a JPEG for each of the `MAP_IMAGE_SIZES`. The map is only
+ * rendered once, at the largest size, and the smaller images are downscaled from that.
+ */
+export async function encodeMapImages(
+  image: RenderedMapImage,
+): Promise<Map<MapImageSize, Buffer>> {
+  const { data, width, height } = image
+  const source = sharp(Buffer.from(data.buffer, data.byteOffset, data.byteLength), {
+    raw: { width, height, channels: 3 },
+  })
+
+  const encoded = await Promise.all(
+    MAP_IMAGE_SIZES.map(async size => {
+      const resized = size === width ? source.clone() : source.clone().resize(size)
+      return [size, await resized.jpeg({ quality: JPEG_QUALITY }).toBuffer()] as const
+    }),
+  )
+  return new Map(encoded)
+}
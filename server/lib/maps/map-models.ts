@@ -255,22 +255,61 @@ export async function updateParseData(
   }
 }
 
+/**
+ * Returns up to `limit` uploaded maps whose parsed data is from an older version of the map parser
+ * than `parserVersion`, ordered by map hash. Only one uploaded map is returned for each map file.
+ *
+ * @param afterHash if specified, only maps with a hash after this one will be returned
+ */
+export async function getMapsWithOutdatedParseData(
+  parserVersion: number,
+  limit: number,
+  afterHash?: string,
+): Promise<Array<{ id: string; hash: string }>> {
+  const query = sql`
+    SELECT DISTINCT ON (m.hash) um.id, m.hash
+    FROM maps AS m
+    INNER JOIN uploaded_maps AS um
+    ON um.map_hash = m.hash
+    WHERE m.parser_version < ${parserVersion}
+  `
+  if (afterHash) {
+    query.append(sql` AND m.hash > ${Buffer.from(afterHash, 'hex')}`)
+  }
+  query.append(sql`
+    ORDER BY m.hash
+    LIMIT ${limit}
+  `)
+
+  const { client, done } = await db()
+  try {
+    const result = await client.query<{ id: string; hash: Buffer }>(query)
+    return result.rows.map(row => ({ id: row.id, hash: row.hash.toString('hex') }))
+  } finally {
+    done()
+  }
+}
+
 /**
  * Updates the map's generated images in the database, calling `storeImagesFn` to store them for
- * serving to clients.
+ * serving to clients. `storeImagesFn` should return whether the images were changed, the image
+ * version (which clients use to bust their caches) is only updated if they were.
  */
 export async function updateMapImages(
   mapHash: string,
-  storeImagesFn: () => Promise<void>,
+  storeImagesFn: () => Promise<boolean>,
 ): Promise<void> {
   return transact(async client => {
+    if (!(await storeImagesFn())) {
+      return
+    }
+
     const hashBuffer = Buffer.from(mapHash, 'hex')
-    const queryPromise = client.query<never>(sql`
+    await client.query<never>(sql`
       UPDATE maps
       SET image_version = image_version + 1
       WHERE hash = ${hashBuffer}
     `)
-    await Promise.all([queryPromise, storeImagesFn()])
   })
 }
 
@@ -4,7 +4,7 @@ import { MapInfo } from '../../../common/maps'
 import { SbUserId } from '../../../common/users/sb-user'
 import { readFile } from '../file-upload'
 import { MapParseResult, mapPath, parseMap } from '../maps/store'
-import { getMapInfo, updateParseData } from './map-models'
+import { getMapInfo, getMapsWithOutdatedParseData, updateParseData } from './map-models'
 import { MapParseData } from './parse-data'
 import { MAP_PARSER_VERSION } from './parser-version'
 
@@ -73,3 +73,27 @@ export async function reparseMapsAsNeeded(
     favoritedBy,
   )
 }
+
+/**
+ * Re-parses up to `limit` maps that were parsed with an older version of the map parser, in order
+ * of their hash. This is meant to be run periodically in the background after the parser version
+ * changes, so that maps don't all need to be re-parsed on demand.
+ *
+ * @param afterHash the hash returned by the previous call, to continue from where it stopped
+ * @returns the hash of the last map that was re-parsed, or `undefined` if there were no maps left
+ *   to re-parse (after `afterHash`)
+ */
+export async function reparseOutdatedMaps(
+  limit: number,
+  afterHash?: string,
+): Promise<string | undefined> {
+  const maps = await getMapsWithOutdatedParseData(MAP_PARSER_VERSION, limit, afterHash)
+  if (!maps.length) {
+    return undefined
+  }
+
+  // Maps that fail to parse stay outdated, continuing after them ensures they don't block the rest
+  // from being re-parsed
+  await reparseMapsAsNeeded(await getMapInfo(maps.map(m => m.id)))
+  return maps.at(-1)!.hash
+}
@@ -0,0 +1,170 @@
+import { exponentialBuckets, Gauge, Histogram } from 'prom-client'
+import { Worker } from 'worker_threads'
+import { MapExtension } from '../../../common/maps'
+import log from '../logging/logger'
+import { MapParseData } from './parse-data'
+
+/** How long a map can take to parse before its worker is assumed to be stuck and is replaced. */
+const PARSE_TIMEOUT_MS = 60000
+
+export interface MapParseRequest {
+  path: string
+  extension: MapExtension
+  /** The path to the BW data files used to render images, or an empty string to skip images. */
+  bwDataPath: string
+}
+
+/** A rendered image of a map, in 8-bit RGB. */
+export interface RenderedMapImage {
+  data: Uint8Array
+  width: number
+  height: number
+}
+
+export interface MapParseResponse {
+  mapData: MapParseData
+  /** The largest size image of the map, if images were generated. */
+  image?: RenderedMapImage
+}
+
+interface ParseJob {
+  id: number
+  request: MapParseRequest
+  resolve: (response: MapParseResponse) => void
+  reject: (err: Error) => void
+}
+
+interface PoolWorker {
+  worker: Worker
+  job?: ParseJob
+  timeout?: ReturnType<typeof setTimeout>
+}
+
+/**
+ * A pool of worker threads that parse maps (and generate their images). Workers are kept around
+ * between parses, so the cost of starting them up (which is mostly compiling the parsing code) is
+ * only paid once per worker, rather than once per map.
+ */
+export class MapParsePool {
+  private workers: PoolWorker[] = []
+  private queue: ParseJob[] = []
+  private lastId = 0
+
+  private queueDepthMetric = new Gauge({
+    name: 'shieldbattery_map_parse_queue_depth',
+    help: 'Number of maps waiting for a map parsing worker',
+  })
+  private parseTimeMetric = new Histogram({
+    name: 'shieldbattery_map_parse_seconds',
+    labelNames: ['result'],
+    help: 'Duration of map parsing (including time spent waiting for a worker) in seconds',
+    buckets: exponentialBuckets(0.05, 1.75, 14),
+  })
+
+  constructor(size: number) {
+    for (let i = 0; i < size; i++) {
+      this.workers.push(this.createWorker())
+    }
+  }
+
+  parse(request: MapParseRequest): Promise<MapParseResponse> {
+    return new Promise((resolve, reject) => {
+      const endTimer = this.parseTimeMetric.startTimer()
+      this.queue.push({
+        id: ++this.lastId,
+        request,
+        resolve: response => {
+          endTimer({ result: 'success' })
+          resolve(response)
+        },
+        reject: err => {
+          endTimer({ result: 'error' })
+          reject(err)
+        },
+      })
+      this.queueDepthMetric.set(this.queue.length)
+      this.runQueued()
+    })
+  }
+
+  private createWorker(): PoolWorker {
+    const poolWorker: PoolWorker = {
+      worker: new Worker(require.resolve('./map-parse-worker')),
+    }
+    poolWorker.worker
+      .on('message', (message: { id: number; error?: string } & MapParseResponse) => {
+        const job = poolWorker.job
+        if (!job || job.id !== message.id) {
+          return
+        }
+        this.finishJob(poolWorker)
+        if (message.error !== undefined) {
+          job.reject(new Error(`parsing map failed: ${message.error}`))
+        } else {
+          job.resolve({ mapData: message.mapData, image: message.image })
+        }
+        this.runQueued()
+      })
+      .on('error', err => {
+        log.error({ err }, 'map parsing worker error')
+      })
+      .on('exit', code => {
+        if (this.replaceWorker(poolWorker)) {
+          log.error(`map parsing worker exited unexpectedly with code ${code}`)
+          poolWorker.job?.reject(new Error(`map parsing worker exited with code ${code}`))
+          this.finishJob(poolWorker)
+          this.runQueued()
+        }
+      })
+
+    return poolWorker
+  }
+
+  /**
+   * Replaces a worker in the pool with a newly created one.
+   *
+   * @returns `false` if the worker had already been replaced
+   */
+  private replaceWorker(poolWorker: PoolWorker): boolean {
+    const index = this.workers.indexOf(poolWorker)
+    if (index === -1) {
+      return false
+    }
+    this.workers[index] = this.createWorker()
+    return true
+  }
+
+  private finishJob(poolWorker: PoolWorker) {
+    if (poolWorker.timeout) {
+      clearTimeout(poolWorker.timeout)
+      poolWorker.timeout = undefined
+    }
+    poolWorker.job = undefined
+  }
+
+  private runQueued() {
+    for (const poolWorker of this.workers) {
+      if (!this.queue.length) {
+        break
+      }
+      if (poolWorker.job) {
+        continue
+      }
+
+      const job = this.queue.shift()!
+      poolWorker.job = job
+      poolWorker.timeout = setTimeout(() => {
+        log.warn(`map parsing timed out for ${job.request.path}, restarting its worker`)
+        this.replaceWorker(poolWorker)
+        this.finishJob(poolWorker)
+        job.reject(new Error('map parsing timed out'))
+        poolWorker.worker.terminate().catch(err => {
+          log.error({ err }, 'error terminating map parsing worker')
+        })
+        this.runQueued()
+      }, PARSE_TIMEOUT_MS)
+      poolWorker.worker.postMessage({ id: job.id, ...job.request })
+    }
+    this.queueDepthMetric.set(this.queue.length)
+  }
+}
@@ -1,21 +1,16 @@
 process.env.BABEL_ENV = 'node'
+// Uses the same setup as the server's main thread, so that (with babel's on-disk cache enabled) the
+// modules the server already compiled can be read from the cache instead of compiled again
+require('../../../babel-register')
 
-require('@babel/register')({
-  extensions: ['.es6', '.es', '.jsx', '.js', '.mjs', '.ts', '.tsx'],
-  // This is necessary to make babel compile stuff outside the "working directory".
-  // See this issue for more info: https://github.com/babel/babel/issues/8321
-  ignore: [/node_modules/],
-})
-
-const fs = require('fs')
+const { parentPort } = require('worker_threads')
 const Chk = require('bw-chk')
-const jpeg = require('jpeg-js')
 const { filterColorCodes } = require('../../../common/maps')
 const { parseAndHashMap } = require('./parse-map')
 
-// A map parsing script that runs in a separate process
-
-const [path, extension, bwDataPath] = process.argv.slice(2)
+// A map parsing script that runs in a worker thread (see `map-parse-pool.ts`). Each worker is kept
+// around and parses one map at a time, so the startup cost of registering babel and loading the
+// parser is only paid once per thread, rather than once per map.
 
 function createLobbyInitData(chk) {
   const raceIdToName = {
@@ -58,92 +53,49 @@ function createLobbyInitData(chk) {
   }
 }
 
-// Creates an image with the provided width and calculates height so the aspect ratio is preserved.
-function generateImage(map, bwDataPath, width = 1024) {
+/** The width of the image rendered for each map, smaller images are resized from it. */
+const MASTER_IMAGE_WIDTH = 2048
+
+// Renders the map as an RGB image, with the height calculated so the aspect ratio is preserved.
+async function renderImage(map, bwDataPath) {
   if (!bwDataPath) {
-    return Promise.resolve()
+    return undefined
   }
 
+  const width = MASTER_IMAGE_WIDTH
   const height = Math.round((width * map.size[1]) / map.size[0])
-
-  return map.image(Chk.fsFileAccess(bwDataPath), width, height, { melee: true }).then(imageRgb => {
-    const rgbaBuffer = Buffer.alloc(width * height * 4)
-    for (let i = 0; i < width * height; i++) {
-      rgbaBuffer[i * 4] = imageRgb[i * 3]
-      rgbaBuffer[i * 4 + 1] = imageRgb[i * 3 + 1]
-      rgbaBuffer[i * 4 + 2] = imageRgb[i * 3 + 2]
-    }
-    const { data } = jpeg.encode(
-      {
-        data: rgbaBuffer,
-        width,
-        height,
-      },
-      90,
-    )
-    return data
-  })
+  const data = await map.image(Chk.fsFileAccess(bwDataPath), width, height, { melee: true })
+  return { data, width, height }
 }
 
-function createStreamPromise(data, fd) {
-  return new Promise((resolve, reject) => {
-    const stream = fs.createWriteStream('', { fd, flags: 'w' })
-    stream.on('error', reject).on('finish', resolve)
-    stream.write(data)
-    stream.end()
-  })
-}
+async function parse({ path, extension, bwDataPath }) {
+  const { hash, map } = await parseAndHashMap(path, extension)
+  const image = await renderImage(map, bwDataPath)
 
-process.once('message', async msg => {
-  console.assert(msg === 'init')
-  process.send('init')
+  return {
+    mapData: {
+      hash,
+      title: filterColorCodes(map.title),
+      description: filterColorCodes(map.description),
+      width: map.size[0],
+      height: map.size[1],
+      tileset: map.tileset,
+      meleePlayers: map.maxPlayers(false),
+      umsPlayers: map.maxPlayers(true),
+      isEud: map.isEudMap(),
+      lobbyInitData: createLobbyInitData(map),
+    },
+    image,
+  }
+}
 
+parentPort.on('message', async ({ id, ...request }) => {
   try {
-    const { hash, map } = await parseAndHashMap(path, extension)
-    const [image256, image512, image1024, image2048] = await Promise.all([
-      generateImage(map, bwDataPath, 256 /* width */),
-      generateImage(map, bwDataPath, 512 /* width */),
-      generateImage(map, bwDataPath, 1024 /* width */),
-      generateImage(map, bwDataPath, 2048 /* width */),
-    ])
-    const image256Promise = image256 ? createStreamPromise(image256, 3 /* fd */) : Promise.resolve()
-    const image512Promise = image512 ? createStreamPromise(image512, 4 /* fd */) : Promise.resolve()
-    const image1024Promise = image1024
-      ? createStreamPromise(image1024, 5 /* fd */)
-      : Promise.resolve()
-    const image2048Promise = image2048
-      ? createStreamPromise(image2048, 6 /* fd */)
-      : Promise.resolve()
-
-    const sendPromise = new Promise(resolve =>
-      process.send(
-        {
-          hash,
-          title: filterColorCodes(map.title),
-          description: filterColorCodes(map.description),
-          width: map.size[0],
-          height: map.size[1],
-          tileset: map.tileset,
-          meleePlayers: map.maxPlayers(false),
-          umsPlayers: map.maxPlayers(true),
-          isEud: map.isEudMap(),
-          lobbyInitData: createLobbyInitData(map),
-        },
-        resolve,
-      ),
-    )
-
-    await Promise.all([
-      sendPromise,
-      image256Promise,
-      image512Promise,
-      image1024Promise,
-      image2048Promise,
-    ])
+    const { mapData, image } = await parse(request)
+    // NOTE: The image buffer isn't transferred, as we don't know whether it owns its underlying
+    // memory. It's copied instead, which is cheap compared to rendering it.
+    parentPort.postMessage({ id, mapData, image })
   } catch (err) {
-    console.log(err)
-    setImmediate(() => {
-      process.exit(1)
-    })
+    parentPort.postMessage({ id, error: String(err?.stack ?? err) })
   }
 })
@@ -0,0 +1,99 @@
+import IntervalTree from 'node-interval-tree'
+import { QueuedMatchmakingEntity } from './matchmaker-queue'
+import { getNumPlayersInEntity, isNewPlayer, MatchmakingInterval } from './matchmaking-entity'
+
+/**
+ * The queued players/parties of a `Matchmaker`, indexed by their search interval.
+ *
+ * New and experienced players are kept in separate trees, since the first thing the match chooser
+ * does is narrow the candidates down to the ones with the same experience status as the searcher.
+ * Doing that while searching means that the candidates with the other status don't need to be
+ * looked at at all, unless there aren't enough of the same status to make a match.
+ *
+ * Entities must be removed before their interval is changed (and then re-inserted), as the trees
+ * are keyed on it.
+ */
+export class MatchmakerIndex {
+  private newPlayers = new IntervalTree<QueuedMatchmakingEntity>()
+  private experiencedPlayers = new IntervalTree<QueuedMatchmakingEntity>()
+
+  // NOTE(tec27): The rounding just makes it easier to do the "right" thing as far as rounding
+  // intervals. We don't want to store them pre-rounded because we're adjusting the interval after
+  // searches and this would introduce a lot of potential floating point error.
+  insert(entity: QueuedMatchmakingEntity): boolean {
+    return this.treeFor(entity).insert(
+      Math.round(entity.interval.low),
+      Math.round(entity.interval.high),
+      entity,
+    )
+  }
+
+  remove(entity: QueuedMatchmakingEntity): boolean {
+    return this.treeFor(entity).remove(
+      Math.round(entity.interval.low),
+      Math.round(entity.interval.high),
+      entity,
+    )
+  }
+
+  /**
+   * Returns the entities that could be matched with `entity`: ones whose search interval contains
+   * `rating` (the effective rating of `entity`) and overlaps with the search interval of `entity`.
+   *
+   * If there are at least `neededPlayers` players with the same new player status as `entity`
+   * among them, only those are returned. The result is in no particular order.
+   */
+  findCandidates(
+    entity: Readonly<QueuedMatchmakingEntity>,
+    rating: number,
+    neededPlayers: number,
+  ): QueuedMatchmakingEntity[] {
+    const isNew = isNewPlayer(entity)
+    const preferred = this.searchTree(
+      isNew ? this.newPlayers : this.experiencedPlayers,
+      entity,
+      rating,
+    )
+    let players = 0
+    for (const candidate of preferred) {
+      players += getNumPlayersInEntity(candidate)
+    }
+    if (players >= neededPlayers) {
+      return preferred
+    }
+
+    const rest = this.searchTree(isNew ? this.experiencedPlayers : this.newPlayers, entity, rating)
+    return preferred.concat(rest)
+  }
+
+  /** Returns all the entities whose (rounded) search interval overlaps with `interval`. */
+  findOverlapping(interval: Readonly<MatchmakingInterval>): QueuedMatchmakingEntity[] {
+    const low = Math.round(interval.low)
+    const high = Math.round(interval.high)
+    return this.newPlayers.search(low, high).concat(this.experiencedPlayers.search(low, high))
+  }
+
+  private treeFor(entity: Readonly<QueuedMatchmakingEntity>) {
+    return isNewPlayer(entity) ? this.newPlayers : this.experiencedPlayers
+  }
+
+  private searchTree(
+    tree: IntervalTree<QueuedMatchmakingEntity>,
+    entity: Readonly<QueuedMatchmakingEntity>,
+    rating: number,
+  ): QueuedMatchmakingEntity[] {
+    const low = Math.round(entity.interval.low)
+    const high = Math.round(entity.interval.high)
+    // The tree has rounded intervals, so search for ones that contain either integer next to the
+    // rating, and then check against the actual interval.
+    return tree
+      .search(Math.floor(rating), Math.ceil(rating))
+      .filter(
+        p =>
+          p.interval.low <= rating &&
+          rating <= p.interval.high &&
+          Math.round(p.interval.low) <= high &&
+          Math.round(p.interval.high) >= low,
+      )
+  }
+}
@@ -0,0 +1,77 @@
+import { makeSbUserId } from '../../../common/users/sb-user'
+import { initializeEntity } from './matchmaker'
+import { applySavedProgress, toSavedProgress } from './matchmaker-persistence'
+import { MatchmakingParty, MatchmakingPlayer } from './matchmaking-entity'
+
+function createPlayer(rating = 1500): MatchmakingPlayer {
+  return {
+    id: makeSbUserId(1),
+    name: 'tec27',
+    numGamesPlayed: 0,
+    rating,
+    searchIterations: 0,
+    race: 'r',
+    preferenceData: {
+      useAlternateRace: false,
+      alternateRace: 'z',
+    },
+    mapSelections: [],
+    interval: {
+      low: rating - 120,
+      high: rating + 120,
+    },
+  }
+}
+
+function createParty(ids: number[]): MatchmakingParty {
+  return {
+    players: ids.map(id => ({ ...createPlayer(), id: makeSbUserId(id) })),
+    leaderId: makeSbUserId(ids[0]),
+    partyId: 'party',
+    searchIterations: 0,
+    interval: {
+      low: 1380,
+      high: 1620,
+    },
+  }
+}
+
+describe('matchmaking/matchmaker-persistence/applySavedProgress', () => {
+  test('should continue the search of the same player', () => {
+    const queued = initializeEntity(createPlayer())
+    queued.searchIterations = 6
+    queued.interval = { low: 1350, high: 1650 }
+    // Round-trip through JSON like it would be through Redis
+    const saved = JSON.parse(JSON.stringify(toSavedProgress(queued)))
+
+    const player = createPlayer()
+    expect(applySavedProgress(player, saved)).toBe(true)
+    expect(player.searchIterations).toBe(6)
+    expect(player.interval).toEqual({ low: 1350, high: 1650 })
+    expect(player.startingInterval).toEqual({ low: 1380, high: 1620 })
+    expect(player.maxInterval).toEqual(queued.maxInterval)
+  })
+
+  test("shouldn't apply progress if the rating changed", () => {
+    const queued = initializeEntity(createPlayer())
+    queued.searchIterations = 6
+    const saved = toSavedProgress(queued)
+
+    const player = createPlayer(1550)
+    expect(applySavedProgress(player, saved)).toBe(false)
+    expect(player.searchIterations).toBe(0)
+    expect(player.startingInterval).toBeUndefined()
+  })
+
+  test("shouldn't apply progress if the party members changed", () => {
+    const queued = initializeEntity(createParty([1, 2]))
+    queued.searchIterations = 6
+    const saved = toSavedProgress(queued)
+
+    expect(applySavedProgress(createParty([1, 3]), saved)).toBe(false)
+    expect(applySavedProgress(createParty([1, 2, 3]), saved)).toBe(false)
+    const party = createParty([1, 2])
+    expect(applySavedProgress(party, saved)).toBe(true)
+    expect(party.searchIterations).toBe(6)
+  })
+})
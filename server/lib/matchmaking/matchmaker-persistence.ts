@@ -0,0 +1,188 @@
+import { singleton } from 'tsyringe'
+import { MatchmakingType } from '../../../common/matchmaking'
+import { SbUserId } from '../../../common/users/sb-user'
+import logger from '../logging/logger'
+import { Redis } from '../redis'
+import { Clock } from '../time/clock'
+import { calcEffectiveRating, Matchmaker } from './matchmaker'
+import { QueuedMatchmakingEntity } from './matchmaker-queue'
+import {
+  getMatchmakingEntityId,
+  getPlayersFromEntity,
+  MatchmakingEntity,
+  MatchmakingInterval,
+} from './matchmaking-entity'
+
+/** How often the state of the matchmaking queues is written to Redis. */
+export const QUEUE_SAVE_INTERVAL_MS = 5 * 1000
+/**
+ * How long the saved search progress of a player/party is kept after it was last written. Players
+ * that queue again within this time after being disconnected (e.g. by a redeploy) continue their
+ * search from where they were, rather than starting over.
+ */
+export const SAVED_PROGRESS_TTL_MS = 2 * 60 * 1000
+
+function progressKey(type: MatchmakingType, entity: Readonly<MatchmakingEntity>) {
+  return `matchmaking:queue:${type}:${getMatchmakingEntityId(entity)}`
+}
+
+function populationKey(type: MatchmakingType) {
+  return `matchmaking:population:${type}`
+}
+
+/** The search progress of a queued player/party, as it is saved in Redis. */
+export interface SavedQueueProgress {
+  /** The IDs of the players in the entity, sorted. */
+  players: SbUserId[]
+  rating: number
+  searchIterations: number
+  interval: MatchmakingInterval
+  startingInterval: MatchmakingInterval
+  maxInterval: MatchmakingInterval
+}
+
+function getSortedPlayerIds(entity: Readonly<MatchmakingEntity>): SbUserId[] {
+  return Array.from(getPlayersFromEntity(entity), p => p.id).sort((a, b) => a - b)
+}
+
+export function toSavedProgress(entity: Readonly<QueuedMatchmakingEntity>): SavedQueueProgress {
+  return {
+    players: getSortedPlayerIds(entity),
+    rating: calcEffectiveRating([entity]),
+    searchIterations: entity.searchIterations,
+    interval: entity.interval,
+    startingInterval: entity.startingInterval,
+    maxInterval: entity.maxInterval,
+  }
+}
+
+/**
+ * Continues the search of a newly created entity (in-place) from `saved`, if it was saved for the
+ * same players with the same rating.
+ *
+ * @returns `true` if the progress was applied
+ */
+export function applySavedProgress(entity: MatchmakingEntity, saved: SavedQueueProgress): boolean {
+  const players = getSortedPlayerIds(entity)
+  if (
+    saved.rating !== calcEffectiveRating([entity]) ||
+    saved.players.length !== players.length ||
+    saved.players.some((id, i) => id !== players[i])
+  ) {
+    return false
+  }
+
+  entity.searchIterations = saved.searchIterations
+  entity.interval = { ...saved.interval }
+  entity.startingInterval = { ...saved.startingInterval }
+  entity.maxInterval = { ...saved.maxInterval }
+  return true
+}
+
+/**
+ * Saves the state of the matchmaking queues to Redis, so that it survives a restart of the server
+ * instance, rather than everyone starting from scratch. Every instance regularly saves the search
+ * progress of the players/parties queued on it, along with its population estimates, which are
+ * loaded again when an instance starts.
+ *
+ * This doesn't share queues between instances: queued players are matched by the instance they're
+ * connected to, since their sockets and gameplay activity only exist there.
+ */
+@singleton()
+export class MatchmakerPersistence {
+  private matchmakers: ReadonlyMap<MatchmakingType, Matchmaker> = new Map()
+  private started = false
+
+  constructor(private redis: Redis, private clock: Clock) {}
+
+  /**
+   * Restores the saved population estimates of the given matchmakers, then starts regularly saving
+   * the state of their queues.
+   */
+  start(matchmakers: ReadonlyMap<MatchmakingType, Matchmaker>) {
+    if (this.started) {
+      return
+    }
+
+    this.started = true
+    this.matchmakers = matchmakers
+    Promise.all(Array.from(matchmakers.entries(), e => this.restorePopulation(...e)))
+      .catch(err => {
+        logger.error({ err }, 'error restoring matchmaking population estimates')
+      })
+      .finally(() => {
+        this.clock.setTimeout(this.saveAll, QUEUE_SAVE_INTERVAL_MS)
+      })
+  }
+
+  /**
+   * Looks up the saved search progress for a newly created entity and applies it to the entity
+   * (in-place) if there is any. Saved progress is only used once.
+   */
+  async restoreProgress(type: MatchmakingType, entity: MatchmakingEntity): Promise<void> {
+    try {
+      const saved = await this.redis.getdel(progressKey(type, entity))
+      if (saved && applySavedProgress(entity, JSON.parse(saved))) {
+        logger.info(
+          `restored saved ${type} search progress for ${getMatchmakingEntityId(entity)}`,
+        )
+      }
+    } catch (err) {
+      logger.error({ err }, 'error restoring saved matchmaking progress')
+    }
+  }
+
+  /**
+   * Deletes the saved search progress of an entity that is no longer searching (e.g. because it
+   * canceled or found a match), so it won't be restored if they queue again.
+   */
+  forgetProgress(type: MatchmakingType, entities: ReadonlyArray<Readonly<MatchmakingEntity>>) {
+    if (!entities.length) {
+      return
+    }
+    this.redis.del(entities.map(e => progressKey(type, e))).catch(err => {
+      logger.error({ err }, 'error deleting saved matchmaking progress')
+    })
+  }
+
+  private saveAll = () => {
+    Promise.all(Array.from(this.matchmakers.entries(), e => this.save(...e)))
+      .catch(err => {
+        logger.error({ err }, 'error saving matchmaking queues')
+      })
+      .finally(() => {
+        this.clock.setTimeout(this.saveAll, QUEUE_SAVE_INTERVAL_MS)
+      })
+  }
+
+  private async restorePopulation(type: MatchmakingType, matchmaker: Matchmaker) {
+    const estimates = await this.redis.get(populationKey(type))
+    if (estimates) {
+      matchmaker.restorePopulationEstimates(JSON.parse(estimates))
+    }
+  }
+
+  private async save(type: MatchmakingType, matchmaker: Matchmaker) {
+    // NOTE: Entities are saved to separate keys (rather than a hash of the whole queue) so that
+    // they expire individually, players that have left the queue by disconnecting keep their
+    // progress even after the next save, and instances don't overwrite each other's players.
+    const pipeline = this.redis.pipeline()
+    for (const entity of matchmaker.queuedEntities()) {
+      pipeline.set(
+        progressKey(type, entity),
+        JSON.stringify(toSavedProgress(entity)),
+        'PX',
+        SAVED_PROGRESS_TTL_MS,
+      )
+    }
+    // The population estimates are shared between instances, so these are just whichever instance
+    // saved last. They're only a starting point for the estimates of a newly started instance.
+    pipeline.set(
+      populationKey(type),
+      JSON.stringify(matchmaker.getPopulationEstimates()),
+      'PX',
+      SAVED_PROGRESS_TTL_MS,
+    )
+    await pipeline.exec()
+  }
+}
@@ -1,9 +1,27 @@
 /* eslint-disable jest/no-commented-out-tests */
 import { mockRandomForEach } from 'jest-mock-random'
+import { MatchmakingType } from '../../../common/matchmaking'
+import { benchmark } from '../../../common/testing/benchmark'
 import { makeSbUserId } from '../../../common/users/sb-user'
-import { DEFAULT_MATCH_CHOOSER, initializeEntity } from './matchmaker'
+import { FakeClock, StopCriteria } from '../time/testing/fake-clock'
+import { LazyScheduler } from './lazy-scheduler'
+import {
+  calcEffectiveRating,
+  DEFAULT_MATCH_CHOOSER,
+  findOptimalTeams,
+  initializeEntity,
+  Matchmaker,
+  MATCHMAKING_INTERVAL_MS,
+  TARGETED_SEARCH_DELAY_MS,
+} from './matchmaker'
+import { MatchmakerIndex } from './matchmaker-index'
 import { QueuedMatchmakingEntity } from './matchmaker-queue'
-import { MatchmakingPlayer } from './matchmaking-entity'
+import {
+  getNumPlayersInEntity,
+  MatchmakingParty,
+  MatchmakingPlayer,
+  MatchmakingPlayerData,
+} from './matchmaking-entity'
 
 let curUserId = 1
 
@@ -40,6 +58,38 @@ function createPlayer(data: Partial<MatchmakingPlayer> = {}): QueuedMatchmakingE
   return player
 }
 
+function createParty(ratings: number[]): QueuedMatchmakingEntity {
+  const players = ratings.map<MatchmakingPlayerData>(rating => ({
+    id: makeSbUserId(curUserId++),
+    name: `PartyMember${curUserId}`,
+    numGamesPlayed: 0,
+    rating,
+    race: 'r',
+    preferenceData: {
+      useAlternateRace: false,
+      alternateRace: 'z',
+    },
+    mapSelections: [],
+  }))
+  const rating = Math.sqrt(ratings.reduce((sum, r) => sum + r * r, 0) / ratings.length)
+
+  const party: MatchmakingParty = {
+    players,
+    leaderId: players[0].id,
+    partyId: `party${players[0].id}`,
+    searchIterations: 0,
+    interval: {
+      low: rating - 120,
+      high: rating + 120,
+    },
+  }
+  return initializeEntity(party)
+}
+
+function countPlayers(team: ReadonlyArray<QueuedMatchmakingEntity>) {
+  return team.reduce((total, entity) => total + getNumPlayersInEntity(entity), 0)
+}
+
 describe('matchmaking/matchmaker/DEFAULT_MATCH_CHOOSER', () => {
   // NOTE(tec27): These values are mostly meaningless, just want to avoid return some combination
   // of the same value + different ones to ferret out bugs
@@ -243,4 +293,300 @@ describe('matchmaking/matchmaker/DEFAULT_MATCH_CHOOSER', () => {
       ]
     `)
   })
+
+  test('3v3 - should pick enough players and keep parties together', () => {
+    const player = createPlayer()
+    const party = createParty([1500, 1500])
+    const others = [1, 2, 3, 4].map(i => createPlayer({ name: `Solo${i}` }))
+
+    const result = DEFAULT_MATCH_CHOOSER(3, player, [...others, party])
+    expect(result).toHaveLength(2)
+    const [teamA, teamB] = result as [QueuedMatchmakingEntity[], QueuedMatchmakingEntity[]]
+    expect(teamA).toContain(player)
+    expect([...teamA, ...teamB]).toContain(party)
+    expect(countPlayers(teamA)).toBe(3)
+    expect(countPlayers(teamB)).toBe(3)
+  })
+})
+
+describe('matchmaking/matchmaker/findOptimalTeams', () => {
+  beforeEach(() => {
+    curUserId = 1
+  })
+
+  function ratingDiff([teamA, teamB]: [
+    ReadonlyArray<QueuedMatchmakingEntity>,
+    ReadonlyArray<QueuedMatchmakingEntity>,
+  ]) {
+    return Math.abs(calcEffectiveRating(teamA) - calcEffectiveRating(teamB))
+  }
+
+  test('3v3 - should find the most balanced teams', () => {
+    const player = createPlayer({ rating: 2000 })
+    const others = [1000, 1900, 1500, 1100, 1400].map(rating => createPlayer({ rating }))
+
+    const [teamA, teamB] = findOptimalTeams(3, player, others)!
+    expect(teamA).toContain(player)
+    expect(teamB).toHaveLength(3)
+    // 2000 + 1000 + 1400 vs 1900 + 1500 + 1100 is the most even split
+    expect(new Set(teamA)).toEqual(new Set([player, others[0], others[4]]))
+  })
+
+  test('4v4 - should keep parties together', () => {
+    const party = createParty([2000, 1900])
+    const otherParty = createParty([1000, 1100, 1200])
+    const solos = [1500, 1600, 1300].map(rating => createPlayer({ rating }))
+
+    const teams = findOptimalTeams(4, party, [otherParty, ...solos])!
+    expect(teams[0]).toContain(party)
+    expect(teams[1]).toContain(otherParty)
+    expect(countPlayers(teams[0])).toBe(4)
+    expect(countPlayers(teams[1])).toBe(4)
+
+    for (const rest of solos) {
+      const pair = solos.filter(s => s !== rest)
+      expect(ratingDiff(teams)).toBeLessThanOrEqual(
+        ratingDiff([
+          [party, ...pair],
+          [otherParty, rest],
+        ]),
+      )
+    }
+  })
+
+  test("should return undefined if the parties can't be split evenly", () => {
+    const party = createParty([1500, 1500])
+    const others = [createParty([1500, 1500]), createParty([1500, 1500])]
+
+    expect(findOptimalTeams(3, party, others)).toBeUndefined()
+  })
+
+  test('should throw if the selections have the wrong amount of players', () => {
+    const player = createPlayer()
+    const others = [createPlayer(), createPlayer()]
+
+    expect(() => findOptimalTeams(3, player, others)).toThrow()
+  })
+
+  test('should use restored population estimates for new search intervals', () => {
+    const { matchmaker } = createMatchmaker(MatchmakingType.Match2v2)
+    const estimates = matchmaker.getPopulationEstimates()
+    estimates[20] = 4
+    matchmaker.restorePopulationEstimates(estimates)
+    expect(matchmaker.getPopulationEstimates()).toEqual(estimates)
+
+    // The only players expected are at 2000-2100, so the max interval is widened just enough to
+    // include them (without any estimates, it would be widened to cover every rating)
+    const player = createPlayer({ rating: 1500 })
+    matchmaker.addToQueue(player)
+    expect(player.maxInterval).toEqual({ low: 900, high: 2100 })
+  })
+
+  benchmark('team sizes and party mixes', report => {
+    const mixes: Array<[name: string, teamSize: number, partySizes: number[]]> = [
+      ['2v2 solos', 2, [1, 1, 1, 1]],
+      ['2v2 parties', 2, [2, 2]],
+      ['3v3 solos', 3, [1, 1, 1, 1, 1, 1]],
+      ['3v3 pairs', 3, [2, 2, 1, 1]],
+      ['3v3 full parties', 3, [3, 3]],
+      ['4v4 solos', 4, [1, 1, 1, 1, 1, 1, 1, 1]],
+      ['4v4 mixed', 4, [3, 2, 1, 1, 1]],
+      ['4v4 pairs', 4, [2, 2, 2, 2]],
+    ]
+    const ITERATIONS = 10000
+    for (const [name, teamSize, partySizes] of mixes) {
+      const sets = Array.from({ length: 100 }, () =>
+        partySizes.map(size => {
+          const ratings = Array.from({ length: size }, () => 500 + Math.random() * 2000)
+          return size === 1 ? createPlayer({ rating: ratings[0] }) : createParty(ratings)
+        }),
+      )
+
+      const start = performance.now()
+      for (let i = 0; i < ITERATIONS; i++) {
+        const [entity, ...selections] = sets[i % sets.length]
+        findOptimalTeams(teamSize, entity, selections)
+      }
+      const elapsed = performance.now() - start
+
+      report(`${name}, ${((elapsed * 1000) / ITERATIONS).toFixed(2)}us per call`)
+    }
+  })
+})
+
+describe('matchmaking/matchmaker/MatchmakerIndex', () => {
+  beforeEach(() => {
+    curUserId = 1
+  })
+
+  test('should only return candidates whose interval contains the rating', () => {
+    const index = new MatchmakerIndex()
+    const player = createPlayer({ rating: 1500 })
+    const inRange = createPlayer({ rating: 1600 })
+    const overlapsButTooLow = createPlayer({ rating: 1300, interval: { low: 1200, high: 1450 } })
+    const tooHigh = createPlayer({ rating: 2000 })
+    for (const p of [inRange, overlapsButTooLow, tooHigh]) {
+      index.insert(p)
+    }
+
+    expect(index.findCandidates(player, 1500, 1)).toEqual([inRange])
+  })
+
+  test('should prefer candidates with the same new player status if there are enough', () => {
+    const index = new MatchmakerIndex()
+    const player = createPlayer()
+    const sameStatus = createPlayer({ name: 'Same' })
+    const otherStatus = createPlayer({ name: 'Other', numGamesPlayed: 9001 })
+    const otherStatus2 = createPlayer({ name: 'Other2', numGamesPlayed: 9001 })
+    for (const p of [sameStatus, otherStatus, otherStatus2]) {
+      index.insert(p)
+    }
+
+    expect(index.findCandidates(player, 1500, 1)).toEqual([sameStatus])
+    expect(new Set(index.findCandidates(player, 1500, 3))).toEqual(
+      new Set([sameStatus, otherStatus, otherStatus2]),
+    )
+
+    expect(index.remove(sameStatus)).toBe(true)
+    expect(new Set(index.findCandidates(player, 1500, 1))).toEqual(
+      new Set([otherStatus, otherStatus2]),
+    )
+  })
+})
+
+describe('matchmaking/matchmaker/Matchmaker', () => {
+  beforeEach(() => {
+    curUserId = 1
+  })
+
+  function createMatchmaker(type: MatchmakingType) {
+    const clock = new FakeClock()
+    clock.autoRunTimeouts = false
+    const matches: Array<[teamA: ReadonlyArray<unknown>, teamB: ReadonlyArray<unknown>]> = []
+    const matchmaker = new Matchmaker(new LazyScheduler(clock), clock)
+      .setMatchmakingType(type)
+      .setOnMatchFound((teamA, teamB) => matches.push([teamA, teamB]))
+    const search = () => matchmaker['searchForMatches']()
+    return { clock, matchmaker, matches, search }
+  }
+
+  /** Deterministic ratings/game counts so benchmark runs are comparable. */
+  function* randomPlayers(count: number) {
+    let seed = 27
+    const next = () => {
+      seed = (seed * 1103515245 + 12345) % 2147483648
+      return seed / 2147483648
+    }
+    for (let i = 0; i < count; i++) {
+      // Roughly normal distribution around 1500
+      const rating = Math.round(600 + (next() + next() + next()) * 600)
+      yield createPlayer({ name: `Player${i}`, rating, numGamesPlayed: Math.floor(next() * 50) })
+    }
+  }
+
+  test("should match players that are in each other's range", () => {
+    const { matchmaker, matches, search } = createMatchmaker(MatchmakingType.Match1v1)
+    const player = createPlayer({ rating: 1500 })
+    const opponent = createPlayer({ rating: 1550 })
+    const farAway = createPlayer({ rating: 2500 })
+    for (const p of [player, opponent, farAway]) {
+      matchmaker.addToQueue(p)
+    }
+
+    expect(search()).toBe(true)
+    expect(matches).toEqual([[[player], [opponent]]])
+    expect(matchmaker.queueSize).toBe(1)
+  })
+
+  test('should widen the search range until players find each other', () => {
+    const { matchmaker, matches, search } = createMatchmaker(MatchmakingType.Match1v1)
+    const player = createPlayer({ rating: 1500 })
+    const opponent = createPlayer({ rating: 1700 })
+    matchmaker.addToQueue(player)
+    matchmaker.addToQueue(opponent)
+
+    let iterations = 0
+    while (!matches.length && iterations < 20) {
+      search()
+      iterations++
+    }
+
+    expect(matches).toEqual([[[player], [opponent]]])
+    expect(iterations).toBeGreaterThan(3)
+    expect(matchmaker.queueSize).toBe(0)
+  })
+
+  test('should search for newly queued players without waiting for a full search', async () => {
+    const { clock, matchmaker, matches } = createMatchmaker(MatchmakingType.Match1v1)
+    const player = createPlayer({ rating: 1500 })
+    const farAway = createPlayer({ rating: 2500 })
+    matchmaker.addToQueue(player)
+    matchmaker.addToQueue(farAway)
+    await clock.runTimeoutsUntil({ criteria: StopCriteria.NumTasks, numTasks: 1 })
+    expect(clock.now()).toBe(TARGETED_SEARCH_DELAY_MS)
+    expect(matches).toHaveLength(0)
+
+    const opponent = createPlayer({ rating: 1550 })
+    matchmaker.addToQueue(opponent)
+    await clock.runTimeoutsUntil({ criteria: StopCriteria.NumTasks, numTasks: 1 })
+    expect(clock.now()).toBe(TARGETED_SEARCH_DELAY_MS * 2)
+    expect(matches).toEqual([[[player], [opponent]]])
+    // Targeted searches don't count as search iterations
+    expect(farAway.searchIterations).toBe(0)
+  })
+
+  test('should stop running as soon as the queue is empty', async () => {
+    const { clock, matchmaker, matches } = createMatchmaker(MatchmakingType.Match1v1)
+    matchmaker.addToQueue(createPlayer())
+    matchmaker.addToQueue(createPlayer())
+
+    await clock.runTimeoutsUntil({ criteria: StopCriteria.EmptyQueue })
+    expect(matches).toHaveLength(1)
+    expect(clock.now()).toBe(MATCHMAKING_INTERVAL_MS)
+  })
+
+  test('should apply population estimate updates that were missed while idle', async () => {
+    const { clock, matchmaker } = createMatchmaker(MatchmakingType.Match1v1)
+    matchmaker.addToQueue(createPlayer())
+    matchmaker.addToQueue(createPlayer())
+    await clock.runTimeoutsUntil({ criteria: StopCriteria.EmptyQueue })
+
+    // 31 intervals pass before the next run, so 3 estimate updates were missed (with the interval
+    // from before going idle): the first one with the 2 players from before, then 2 empty ones.
+    clock.setCurrentTime(MATCHMAKING_INTERVAL_MS * 31)
+    matchmaker.addToQueue(createPlayer())
+    await clock.runTimeoutsUntil({
+      criteria: StopCriteria.TimeReached,
+      timeMillis: MATCHMAKING_INTERVAL_MS * 32,
+    })
+
+    const bucket = matchmaker.populationEstimate[15]
+    expect(bucket.value).toBeCloseTo(2 * bucket.alpha * Math.pow(1 - bucket.alpha, 2))
+    expect(matchmaker.populationEstimate[14].value).toBe(0)
+    expect(matchmaker.populationPeak[15]).toBe(1)
+  })
+
+  benchmark('searching with a large queue', report => {
+    for (const type of [MatchmakingType.Match1v1, MatchmakingType.Match2v2]) {
+      for (const count of [1000, 5000, 10000]) {
+        const { matchmaker, matches, search } = createMatchmaker(type)
+        for (const p of randomPlayers(count)) {
+          matchmaker.addToQueue(p)
+        }
+
+        const times: number[] = []
+        for (let i = 0; i < 5; i++) {
+          const start = performance.now()
+          search()
+          times.push(performance.now() - start)
+        }
+
+        report(
+          `${type}, ${count} queued: ${matches.length} matches, ` +
+            `${matchmaker.queueSize} left in queue, ` +
+            `search times ${times.map(t => t.toFixed(1) + 'ms').join(', ')}`,
+        )
+      }
+    }
+  })
 })
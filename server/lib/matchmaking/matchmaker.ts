@@ -1,14 +1,16 @@
 import { OrderedMap } from 'immutable'
-import IntervalTree from 'node-interval-tree'
-import { Gauge } from 'prom-client'
+import { exponentialBuckets, Gauge, Histogram } from 'prom-client'
 import { injectable } from 'tsyringe'
+import { FenwickTree } from '../../../common/data-structures/fenwick-tree'
 import { MatchmakingType, TEAM_SIZES } from '../../../common/matchmaking'
 import { multipleRandomItems, randomItem } from '../../../common/random'
 import { range } from '../../../common/range'
 import { ExponentialSmoothValue } from '../../../common/statistics/exponential-smoothing'
 import { SbUserId } from '../../../common/users/sb-user'
 import logger from '../logging/logger'
+import { Clock, TimeoutId } from '../time/clock'
 import { LazyScheduler } from './lazy-scheduler'
+import { MatchmakerIndex } from './matchmaker-index'
 import { QueuedMatchmakingEntity } from './matchmaker-queue'
 import {
   getMatchmakingEntityId,
@@ -22,6 +24,11 @@ import {
 
 /** How often to run the matchmaker 'find match' process. */
 export const MATCHMAKING_INTERVAL_MS = 6 * 1000
+/**
+ * How long after a player/party is added to the queue to run a search limited to the players they
+ * could match with. Other players that are added within this time are included in the same search.
+ */
+export const TARGETED_SEARCH_DELAY_MS = 250
 /**
  * How many iterations to search for a player's "ideal match" only, i.e. a player directly within
  * rating +/- (uncertainty / 2). After this many iterations, we start to widen the search range.
@@ -42,7 +49,8 @@ const MAX_SEARCH_BOUND_INCREASES = Math.ceil(120 / SEARCH_BOUND_INCREASE)
 //    of N minutes (using exponential smoothing on the value we record every N minutes)
 // 3) When placing a player/team in the queue, use these bucketed smoothed values to find a
 //    radius that we think will have at least the right number of players (e.g. 1 other player
-//    for 1v1, 3 other players for 2v2 solo, ...)
+//    for 1v1, 3 other players for 2v2 solo, ...). The estimates are kept in a Fenwick tree so
+//    that the population of any radius can be found quickly.
 // 4) If the calculated radius is less than their normal search radius, leave the normal search
 //    radius intact. If it's bigger, adjust their search radius to match
 
@@ -64,14 +72,13 @@ const POPULATION_NUM_BUCKETS = Math.floor(POPULATION_TRACKING_MAX_RATING / POPUL
  * (shorter times = better?) and not causing too much system load (longer times = less CPU spent on
  * it).
  *
- * This time is also the minimum time that the matchmaker can remain active for (as we have to
- * update the estimates before shutting down). Probably optimizing for that is the wrong thing,
- * though, since it's optimizing for people *not* using the service :)
+ * The matchmaker doesn't need to keep running for the estimates to be updated, any updates that
+ * were missed while it was idle are applied at once when it starts again.
  */
 const POPULATION_ESTIMATE_UPDATE_INTERVAL = 10
 /**
- * How many missed update intervals to update for individually. Any amount of missed intervals over
- * this will simply reset all the estimates to 0.
+ * After how many missed update intervals the estimates will simply be reset to 0, rather than
+ * decayed (they'd be close enough to 0 at that point anyway).
  */
 const MAX_MISSED_POPULATION_UPDATES = 20
 
@@ -132,49 +139,107 @@ type MatchedTeams = [
   teamB: Array<Readonly<QueuedMatchmakingEntity>>,
 ]
 
-function findOptimalTeams(
+/**
+ * Splits `entity` and `selections` into two teams of `teamSize` players each, keeping parties
+ * together, such that the difference between the effective ratings of the teams is as small as
+ * possible. `entity` will always be placed on the first team.
+ *
+ * @returns the teams, or `undefined` if the parties can't be split into teams of the right size
+ */
+export function findOptimalTeams(
   teamSize: number,
   entity: Readonly<QueuedMatchmakingEntity>,
   // TODO(tec27): Make this a ReadonlyArray once we're on TS 4.6+ (prior to that, Array.at is only
   // available on non-readonly arrays)
   selections: Array<Readonly<QueuedMatchmakingEntity>>,
-): MatchedTeams {
-  if (teamSize !== 2) {
-    // TODO(tec27): Rework for 3v3. This is incredibly simple for 2v2 (it's simply the matching
-    // player + each of the other players vs whatever is leftover), not so much with more players on
-    // each team.
-    throw new Error('Team optimization is not yet implemented for team sizes > 2')
-  }
-
+): MatchedTeams | undefined {
   if (!selections.length) {
     throw new Error('selections must not be empty')
   }
 
-  if (isMatchmakingParty(entity) || selections.length < teamSize) {
-    if (selections.some(s => !isMatchmakingParty(s))) {
-      // This should never happen for 2v2, just a sanity check
-      throw new Error('selections less than team size but contain a non-party')
+  if (teamSize === 2 && !isMatchmakingParty(entity) && selections.length === 3) {
+    // With 4 solo players, this is just the matching player + each of the other players vs
+    // whatever is leftover. Select the one that minimizes the difference between the two teams'
+    // effective ratings.
+    let bestTeams: MatchedTeams
+    let lowestRatingDiff = Infinity
+    for (let i = 0; i < selections.length; i++) {
+      const teamA = [entity, selections[i]]
+      const teamB = [selections.at(i - 1)!, selections.at((i + 1) % selections.length)!]
+      const ratingDiff = Math.abs(calcEffectiveRating(teamA) - calcEffectiveRating(teamB))
+      if (ratingDiff < lowestRatingDiff) {
+        lowestRatingDiff = ratingDiff
+        bestTeams = [teamA, teamB]
+      }
     }
 
-    // Teams can't differ, so just return them as is
-    return [[entity], selections]
+    return bestTeams!
+  }
+
+  const entities = [entity, ...selections]
+  if (entities.length > 31) {
+    // Can't happen with any team size we have, but the team is stored as a bitmask below
+    throw new Error('too many selections')
+  }
+  // Both teams have the same number of players, so their effective ratings (see
+  // `calcEffectiveRating`) are closest when their sums of squared ratings are. These are
+  // calculated once for each entity, rather than for every arrangement that is checked.
+  const playerCounts = entities.map(e => getNumPlayersInEntity(e))
+  const squaredRatings = entities.map(e => {
+    let sum = 0
+    for (const player of getPlayersFromEntity(e)) {
+      sum += player.rating * player.rating
+    }
+    return sum
+  })
+  // How many players are in `entities[i..]`, used to skip arrangements that can't fill the team
+  const remainingPlayers = playerCounts.slice()
+  for (let i = remainingPlayers.length - 2; i >= 0; i--) {
+    remainingPlayers[i] += remainingPlayers[i + 1]
   }
+  if (remainingPlayers[0] !== teamSize * 2) {
+    throw new Error(`selections must contain ${teamSize * 2 - playerCounts[0]} players`)
+  }
+  const totalSquared = squaredRatings.reduce((a, b) => a + b, 0)
+
+  let bestTeam = 0
+  let lowestDiff = Infinity
+  // Depth-first search over which entities are on the first team, not descending into branches
+  // that would overfill or underfill it, and stopping once the teams are perfectly balanced.
+  const search = (index: number, team: number, players: number, squared: number) => {
+    if (players === teamSize) {
+      const diff = Math.abs(totalSquared - 2 * squared)
+      if (diff < lowestDiff) {
+        lowestDiff = diff
+        bestTeam = team
+      }
+      return
+    }
+    if (index >= entities.length || players + remainingPlayers[index] < teamSize) {
+      return
+    }
 
-  // Find all the different permutations of teams, select the one that minimizes the difference
-  // between the two teams' effective ratings.
-  let bestTeams: MatchedTeams
-  let lowestRatingDiff = Infinity
-  for (let i = 0; i < selections.length; i++) {
-    const teamA = [entity, selections[i]]
-    const teamB = [selections.at(i - 1)!, selections.at((i + 1) % selections.length)!]
-    const ratingDiff = Math.abs(calcEffectiveRating(teamA) - calcEffectiveRating(teamB))
-    if (ratingDiff < lowestRatingDiff) {
-      lowestRatingDiff = ratingDiff
-      bestTeams = [teamA, teamB]
+    if (players + playerCounts[index] <= teamSize) {
+      search(
+        index + 1,
+        team | (1 << index),
+        players + playerCounts[index],
+        squared + squaredRatings[index],
+      )
+    }
+    if (lowestDiff > 0) {
+      search(index + 1, team, players, squared)
     }
   }
+  search(1, 1, playerCounts[0], squaredRatings[0])
 
-  return bestTeams!
+  if (lowestDiff === Infinity) {
+    return undefined
+  }
+  return [
+    entities.filter((_, i) => bestTeam & (1 << i)),
+    entities.filter((_, i) => !(bestTeam & (1 << i))),
+  ]
 }
 
 /**
@@ -202,37 +267,58 @@ const FILTERS: ReadonlyArray<EntityFilter> = [
 
   // 5) Choose the players that have been waiting in queue the longest.
   (_, potentials, neededPlayers) => {
-    const sorted = potentials.slice().sort((a, b) => b.searchIterations - a.searchIterations)
     // Pick an iteration number that would still give us enough players
-    if (sorted.length < neededPlayers) {
-      // TODO(tec27): Instead, account for parties in picking the index to look at)
-      return sorted
+    // TODO(tec27): Instead, account for parties in picking the index to look at)
+    const iterations = nthSmallest(potentials.map(p => -p.searchIterations), neededPlayers)
+    if (iterations === undefined) {
+      return potentials.slice()
     }
-    const iterations = sorted[neededPlayers - 1].searchIterations
-    return sorted.filter(p => p.searchIterations >= iterations)
+    return potentials.filter(p => p.searchIterations >= -iterations)
   },
 
   // 6) Choose the players with the closest rating.
   (entity, potentials, neededPlayers) => {
-    // Sort by rating difference (lowest difference first)
     const entityRating = getRatingFromEntity(entity)
-    const sorted = potentials
-      .map<[potential: typeof entity, ratingDiff: number]>(p => [
-        p,
-        Math.abs(getRatingFromEntity(p) - entityRating),
-      ])
-      .sort((a, b) => a[1] - b[1])
-
-    if (sorted.length < neededPlayers) {
-      // TODO(tec27): Instead, account for parties in picking the index to look at)
-      return sorted.map(p => p[0])
-    }
+    const ratingDiffs = potentials.map(p => Math.abs(getRatingFromEntity(p) - entityRating))
     // Pick a rating difference that would still give us enough players
-    const ratingDiff = sorted[neededPlayers - 1][1]
-    return sorted.filter(p => p[1] <= ratingDiff).map(p => p[0])
+    // TODO(tec27): Instead, account for parties in picking the index to look at)
+    const ratingDiff = nthSmallest(ratingDiffs, neededPlayers)
+    if (ratingDiff === undefined) {
+      return potentials.slice()
+    }
+    return potentials.filter((_, i) => ratingDiffs[i] <= ratingDiff)
   },
 ]
 
+/**
+ * Returns the `n`th smallest (1-based) of `values`, or `undefined` if there are less than `n`
+ * values. `n` is at most the number of players in a match, so this is a lot cheaper than sorting
+ * all of the values.
+ */
+function nthSmallest(values: ReadonlyArray<number>, n: number): number | undefined {
+  if (values.length < n) {
+    return undefined
+  }
+
+  // The `n` smallest values seen so far, in ascending order
+  const smallest: number[] = []
+  for (const value of values) {
+    if (smallest.length === n) {
+      if (value >= smallest[n - 1]) {
+        continue
+      }
+      smallest.pop()
+    }
+    let i = smallest.length
+    while (i > 0 && smallest[i - 1] > value) {
+      i--
+    }
+    smallest.splice(i, 0, value)
+  }
+
+  return smallest[n - 1]
+}
+
 function getTotalPlayersInPotentials(potentials: Readonly<QueuedMatchmakingEntity>[]) {
   return potentials.reduce((total, entity) => total + getNumPlayersInEntity(entity), 0)
 }
@@ -272,11 +358,33 @@ export const DEFAULT_MATCH_CHOOSER: MatchChooser = (teamSize, entity, potentials
     if (teamSize === 1) {
       const selection = randomItem(filtered)
       return [[entity], [selection]]
+    } else if (teamSize > 2) {
+      // Take candidates in random order, skipping any that would overfill the match, and then
+      // find the best teams for them. Larger parties are taken first, as there's always a spot for
+      // solo players at the end if there are enough of them. If the parties that were picked can't
+      // be split into even teams, this player will just have to try again on the next search.
+      const shuffled = multipleRandomItems(filtered.length, filtered).sort(
+        (a, b) => getNumPlayersInEntity(b) - getNumPlayersInEntity(a),
+      )
+      const selections: Array<Readonly<QueuedMatchmakingEntity>> = []
+      let players = 0
+      for (const candidate of shuffled) {
+        const candidatePlayers = getNumPlayersInEntity(candidate)
+        if (players + candidatePlayers <= neededPlayers) {
+          selections.push(candidate)
+          players += candidatePlayers
+          if (players === neededPlayers) {
+            return findOptimalTeams(teamSize, entity, selections) ?? []
+          }
+        }
+      }
+
+      return []
     } else {
       // This is kind of annoying because we potentially have combinations in this list that do
       // not result in a valid team. So instead of just selecting enough to cover N players, we need
       // to be careful to get the right size of entities. This is already pretty terrible for 2v2,
-      // for 3v3 it seems like it needs a full rethink
+      // which is why larger team sizes are handled separately above
       const shuffled = multipleRandomItems(filtered.length, filtered)
       if (isMatchmakingParty(entity)) {
         while (shuffled.length) {
@@ -315,7 +423,7 @@ export const DEFAULT_MATCH_CHOOSER: MatchChooser = (teamSize, entity, potentials
             for (let i = 1; i < shuffled.length; i++) {
               // Find the first other solo player and group them
               if (!isMatchmakingParty(shuffled[i])) {
-                return findOptimalTeams(teamSize, entity, [partner, shuffled[0], shuffled[i]])
+                return findOptimalTeams(teamSize, entity, [partner, shuffled[0], shuffled[i]]) ?? []
               }
             }
           }
@@ -354,8 +462,9 @@ type MatchChooser = (
 @injectable()
 export class Matchmaker {
   static queueSizeMetric: Gauge<'matchmaking_type'> | undefined
+  static searchDurationMetric: Histogram<'matchmaking_type' | 'search_type'> | undefined
 
-  protected tree = new IntervalTree<QueuedMatchmakingEntity>()
+  protected index = new MatchmakerIndex()
   protected entities = OrderedMap<SbUserId, QueuedMatchmakingEntity>()
 
   readonly populationCurrent = Array.from(range(0, POPULATION_NUM_BUCKETS), () => 0)
@@ -365,7 +474,23 @@ export class Matchmaker {
     // TODO(tec27): Try to calculate a more accurate alpha value
     () => new ExponentialSmoothValue(0.25, 0),
   )
+  /** The values of `populationEstimate`, for summing the estimates of a range of buckets. */
+  private populationEstimateSums = new FenwickTree(POPULATION_NUM_BUCKETS)
+  /** How many matchmaking intervals have passed since the estimates were last updated. */
   private populationInterval = 0
+  /**
+   * The peak population of the estimate interval that was in progress when the queue last became
+   * empty, if the matchmaker hasn't run since. Players that join while the matchmaker is idle
+   * shouldn't count towards that interval.
+   */
+  private idlePopulationPeak: number[] | undefined
+
+  /**
+   * Search intervals of the players/parties added since the last search. Only queued entities with
+   * an interval overlapping one of these can have gained a possible match since then.
+   */
+  private dirtyRanges: MatchmakingInterval[] = []
+  private targetedSearchTimeout: TimeoutId | undefined
 
   private matchmakingType = MatchmakingType.Match1v1
   /**
@@ -378,7 +503,7 @@ export class Matchmaker {
   }
   private matchChooser: MatchChooser = DEFAULT_MATCH_CHOOSER
 
-  constructor(private scheduler: LazyScheduler) {
+  constructor(private scheduler: LazyScheduler, private clock: Clock) {
     if (!Matchmaker.queueSizeMetric) {
       Matchmaker.queueSizeMetric = new Gauge({
         name: 'shieldbattery_matchmaker_queue_size',
@@ -386,6 +511,14 @@ export class Matchmaker {
         help: 'Current number of players in the matchmaking queue',
       })
     }
+    if (!Matchmaker.searchDurationMetric) {
+      Matchmaker.searchDurationMetric = new Histogram({
+        name: 'shieldbattery_matchmaker_search_seconds',
+        labelNames: ['matchmaking_type', 'search_type'],
+        help: 'Duration of a matchmaker search over the queue in seconds',
+        buckets: exponentialBuckets(0.0001, 2, 16),
+      })
+    }
 
     scheduler.setDelay(MATCHMAKING_INTERVAL_MS)
     scheduler.setErrorHandler(err => {
@@ -399,23 +532,25 @@ export class Matchmaker {
       )
 
       this.populationInterval += intervalsSinceLast
-
-      if (this.populationInterval >= POPULATION_ESTIMATE_UPDATE_INTERVAL) {
-        this.updatePopulationEstimates()
-      }
+      this.updatePopulationEstimates()
 
       let keepGoing = true
+      // Everyone gets searched for here, so any pending targeted search isn't needed
+      this.dirtyRanges = []
+      const endTimer = Matchmaker.searchDurationMetric
+        ?.labels(this.matchmakingType, 'full')
+        .startTimer()
       try {
         keepGoing = this.searchForMatches()
       } catch (err) {
         logger.error({ err }, 'error while matching players')
       }
+      endTimer?.()
 
-      // If populationInterval is over 0, we always continue until it hits the interval and gets
-      // reset to 0. This allows us to ensure the peak population will always be 0 in every bucket
-      // when we pick back up after scheduler shutdowns, so we can easily put in the missed estimate
-      // updates accurately.
-      return keepGoing || this.populationInterval > 0
+      if (!keepGoing) {
+        this.idlePopulationPeak = this.populationPeak.slice()
+      }
+      return keepGoing
     })
   }
 
@@ -434,6 +569,30 @@ export class Matchmaker {
     return this.entities.size
   }
 
+  /** Returns the players/parties currently in the queue, in queue order. */
+  queuedEntities(): Iterable<Readonly<QueuedMatchmakingEntity>> {
+    return this.entities.values()
+  }
+
+  /** Returns the current population estimate of each rating bucket. */
+  getPopulationEstimates(): number[] {
+    return this.populationEstimate.map(e => e.value)
+  }
+
+  /**
+   * Replaces the population estimates with ones previously returned by `getPopulationEstimates`
+   * (e.g. before a restart). Estimates with a different number of buckets are ignored.
+   */
+  restorePopulationEstimates(estimates: ReadonlyArray<number>) {
+    if (estimates.length !== this.populationEstimate.length) {
+      return
+    }
+    for (let i = 0; i < estimates.length; i++) {
+      this.populationEstimate[i].reset(estimates[i])
+    }
+    this.populationEstimateSums.setAll(estimates)
+  }
+
   /**
    * Adds a player/party to the queue used to find potential matches.
    *
@@ -462,6 +621,7 @@ export class Matchmaker {
       }
 
       this.scheduler.scheduleIfNeeded()
+      this.markDirty(queuedEntity.interval)
     }
     return isAdded
   }
@@ -485,23 +645,55 @@ export class Matchmaker {
     return player
   }
 
-  // NOTE(tec27): These just make it easier to do the "right" thing as far as rounding intervals.
-  // We don't want to store them pre-rounded because we're adjusting the interval after searches
-  // and this would introduce a lot of potential floating point error.
+  /**
+   * Schedules a targeted search for the players that could match with someone in `interval`.
+   * Removing players or widening search intervals doesn't need this: the former can't create new
+   * matches, and the latter only happens during a full search, which searches with the new
+   * interval right away.
+   */
+  private markDirty(interval: Readonly<MatchmakingInterval>) {
+    this.dirtyRanges.push({ low: interval.low, high: interval.high })
+    if (!this.targetedSearchTimeout) {
+      this.targetedSearchTimeout = this.clock.setTimeout(
+        this.runTargetedSearch,
+        TARGETED_SEARCH_DELAY_MS,
+      )
+    }
+  }
+
+  private runTargetedSearch = () => {
+    this.targetedSearchTimeout = undefined
+    const ranges = this.dirtyRanges
+    this.dirtyRanges = []
+    if (!ranges.length) {
+      return
+    }
+
+    const endTimer = Matchmaker.searchDurationMetric
+      ?.labels(this.matchmakingType, 'targeted')
+      .startTimer()
+    try {
+      const affected = new Set<QueuedMatchmakingEntity>()
+      for (const range of ranges) {
+        for (const entity of this.index.findOverlapping(range)) {
+          affected.add(entity)
+        }
+      }
+      if (affected.size > 1) {
+        this.searchForMatches(affected)
+      }
+    } catch (err) {
+      logger.error({ err }, 'error while matching players')
+    }
+    endTimer?.()
+  }
+
   private insertInTree(entity: QueuedMatchmakingEntity): boolean {
-    return this.tree.insert(
-      Math.round(entity.interval.low),
-      Math.round(entity.interval.high),
-      entity,
-    )
+    return this.index.insert(entity)
   }
 
   private removeFromTree(entity: QueuedMatchmakingEntity): boolean {
-    return this.tree.remove(
-      Math.round(entity.interval.low),
-      Math.round(entity.interval.high),
-      entity,
-    )
+    return this.index.remove(entity)
   }
 
   /**
@@ -517,42 +709,44 @@ export class Matchmaker {
   }
 
   private updatePopulationEstimates(): void {
-    if (
-      this.populationInterval >=
-      MAX_MISSED_POPULATION_UPDATES * POPULATION_ESTIMATE_UPDATE_INTERVAL
-    ) {
-      // Just reset all the estimates to 0
-      for (let i = 0; i < this.populationEstimate.length; i++) {
-        this.populationEstimate[i].reset(0)
+    const updates = Math.floor(this.populationInterval / POPULATION_ESTIMATE_UPDATE_INTERVAL)
+    const peaks = this.idlePopulationPeak ?? this.populationPeak
+    this.idlePopulationPeak = undefined
+    if (updates === 0) {
+      if (peaks !== this.populationPeak) {
+        // Still in the same interval as when we went idle, so its peak still counts
+        for (let i = 0; i < this.populationPeak.length; i++) {
+          this.populationPeak[i] = Math.max(this.populationPeak[i], peaks[i])
+        }
       }
-
       return
     }
 
-    do {
-      const multipleIntervals = this.populationInterval >= POPULATION_ESTIMATE_UPDATE_INTERVAL * 2
-      for (let i = 0; i < this.populationCurrent.length; i++) {
+    this.populationInterval -= updates * POPULATION_ESTIMATE_UPDATE_INTERVAL
+    for (let i = 0; i < this.populationEstimate.length; i++) {
+      if (updates >= MAX_MISSED_POPULATION_UPDATES) {
+        this.populationEstimate[i].reset(0)
+      } else {
         // NOTE(tec27): If we're updating for skipped intervals, the population for those skipped
         // intervals was 0 (or the scheduler would have been running). This ensures that the player
         // that just joined doesn't erroneously increase the population estimate for the previous
         // empty times
-        this.populationEstimate[i].add(multipleIntervals ? 0 : this.populationPeak[i])
+        this.populationEstimate[i].add(peaks[i]).decay(updates - 1)
       }
-      this.populationInterval -= POPULATION_ESTIMATE_UPDATE_INTERVAL
-    } while (this.populationInterval >= POPULATION_ESTIMATE_UPDATE_INTERVAL)
-
-    for (let i = 0; i < this.populationCurrent.length; i++) {
       this.populationPeak[i] = this.populationCurrent[i]
     }
+    this.populationEstimateSums.setAll(this.populationEstimate.map(e => e.value))
   }
 
   /**
    * Finds the best match for each player and removes them from a queue. If a match is not found,
    * the player stays in the queue, with their interval bounds increased as needed.
    *
+   * @param onlySearchFor If specified, only these players/parties will search for a match (in
+   *     queue order), and this won't count as a search iteration for them
    * @returns `true` if there are still players in the queue, `false` otherwise
    */
-  private searchForMatches(): boolean {
+  private searchForMatches(onlySearchFor?: ReadonlySet<QueuedMatchmakingEntity>): boolean {
     let matchedEntities = new Set<MatchmakingEntity>()
 
     for (const entity of this.entities.values()) {
@@ -560,13 +754,18 @@ export class Matchmaker {
         // We already matched this player with someone else; skip them
         continue
       }
+      if (onlySearchFor && !onlySearchFor.has(entity)) {
+        continue
+      }
 
       // Before searching, remove the player searching from the tree so they're not included in
       // results
       this.removeFromTree(entity)
-      entity.searchIterations += 1
+      if (!onlySearchFor) {
+        entity.searchIterations += 1
+      }
 
-      if (entity.searchIterations > IDEAL_MATCH_ITERATIONS) {
+      if (!onlySearchFor && entity.searchIterations > IDEAL_MATCH_ITERATIONS) {
         const atMaxBounds =
           entity.interval.low <= entity.maxInterval.low &&
           entity.interval.high >= entity.maxInterval.high
@@ -590,9 +789,10 @@ export class Matchmaker {
         }
       }
 
-      const results = this.tree.search(
-        Math.round(entity.interval.low),
-        Math.round(entity.interval.high),
+      const results = this.index.findCandidates(
+        entity,
+        getRatingFromEntity(entity),
+        this.teamSize * 2 - getNumPlayersInEntity(entity),
       )
 
       let teamA, teamB: Array<Readonly<QueuedMatchmakingEntity>> | undefined
@@ -657,30 +857,31 @@ export class Matchmaker {
       POPULATION_NUM_BUCKETS,
     )
 
-    let estimatedPlayers = 0
-    for (let i = lowBucket; i < highBucket; i++) {
-      estimatedPlayers += this.populationEstimate[i].value
-    }
-
+    const estimate = this.populationEstimateSums
     const neededPlayers = this.teamSize * 2
 
-    if (estimatedPlayers >= neededPlayers) {
+    if (estimate.rangeSum(lowBucket, highBucket) >= neededPlayers) {
       return curMaxInterval
     }
 
-    while (
-      estimatedPlayers < neededPlayers &&
-      (lowBucket > 0 || highBucket < this.populationEstimate.length)
-    ) {
-      if (lowBucket > 0) {
-        lowBucket -= 1
-        estimatedPlayers += this.populationEstimate[lowBucket].value
-      }
-      if (highBucket < this.populationEstimate.length) {
-        highBucket += 1
-        estimatedPlayers += this.populationEstimate[highBucket - 1].value
+    // Find the smallest amount of buckets to expand the range by (on both sides, as far as
+    // possible) that gets us enough players, or stop at the full range of buckets. The estimate
+    // only grows as the range gets wider, so this can be a binary search.
+    const expansionFor = (amount: number): [low: number, high: number] => [
+      Math.max(lowBucket - amount, 0),
+      Math.min(highBucket + amount, POPULATION_NUM_BUCKETS),
+    ]
+    let minExpansion = 1
+    let maxExpansion = Math.max(lowBucket, POPULATION_NUM_BUCKETS - highBucket)
+    while (minExpansion < maxExpansion) {
+      const mid = Math.floor((minExpansion + maxExpansion) / 2)
+      if (estimate.rangeSum(...expansionFor(mid)) >= neededPlayers) {
+        maxExpansion = mid
+      } else {
+        minExpansion = mid + 1
       }
     }
+    ;[lowBucket, highBucket] = expansionFor(maxExpansion)
 
     const result = {
       low: lowBucket * POPULATION_BUCKET_RATING,
@@ -77,6 +77,7 @@ import {
   UserSocketsManager,
 } from '../websockets/socket-groups'
 import { TypedPublisher } from '../websockets/typed-publisher'
+import { MatchmakerPersistence } from './matchmaker-persistence'
 import { MatchmakingSeasonsService } from './matchmaking-seasons'
 import { MatchmakingServiceError } from './matchmaking-service-error'
 import { adjustMatchmakingRatingForInactivity } from './rating'
@@ -298,6 +299,7 @@ export class MatchmakingService {
 
       const matchInfo = new Match(cuid(), playerEntry.type, [teamA, teamB])
       this.matches.set(matchInfo.id, matchInfo)
+      this.persistence.forgetProgress(matchInfo.type, [...teamA, ...teamB])
 
       for (const entities of [teamA, teamB]) {
         for (const entity of entities) {
@@ -510,6 +512,7 @@ export class MatchmakingService {
     private matchmakingSeasonsService: MatchmakingSeasonsService,
     private clock: Clock,
     private userIdentifierManager: UserIdentifierManager,
+    private persistence: MatchmakerPersistence,
   ) {
     this.matchmakers = new Map(
       ALL_MATCHMAKING_TYPES.map(type => [
@@ -522,6 +525,14 @@ export class MatchmakingService {
     )
   }
 
+  /**
+   * Starts saving the state of the matchmaking queues, and restores what was saved previously.
+   * Requires a working Redis connection.
+   */
+  startSavingQueues() {
+    this.persistence.start(this.matchmakers)
+  }
+
   /**
    * Adds a user to the matchmaking queue. This can only be used for solo players, players in a
    * party should use `findAsParty` instead (this call will fail for them).
@@ -608,6 +619,7 @@ export class MatchmakingService {
       searchIterations: 0,
     }
 
+    await this.persistence.restoreProgress(type, player)
     this.matchmakers.get(type)!.addToQueue(player)
     this.queueEntries.set(userId, {
       type,
@@ -732,6 +744,7 @@ export class MatchmakingService {
       ]),
     )
 
+    await this.persistence.restoreProgress(type, matchmakingParty)
     this.matchmakers.get(type)!.addToQueue(matchmakingParty)
     for (const [userId, { userSockets, clientSockets }] of userToSockets.entries()) {
       this.queueEntries.set(userId, {
@@ -1084,6 +1097,11 @@ export class MatchmakingService {
 
       const entity = this.matchmakers.get(entry.type)!.removeFromQueue(entry.registeredId)
       if (entity) {
+        if (!isDisconnect) {
+          // Players that get disconnected (e.g. by a server restart) can continue their search if
+          // they queue again soon, but canceling starts it over
+          this.persistence.forgetProgress(entry.type, [entity])
+        }
         toUnregister.length = 0
         for (const player of getPlayersFromEntity(entity)) {
           toUnregister.push(player.id)
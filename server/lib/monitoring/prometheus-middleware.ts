@@ -1,3 +1,4 @@
+import { RouterParamContext } from '@koa/router'
 import Koa from 'koa'
 import promClient from 'prom-client'
 
@@ -35,18 +36,18 @@ export function prometheusMiddleware() {
  * early as possible in the middleware chain for accurate timings.
  */
 export function prometheusHttpMetrics() {
-  // TODO(tec27): add API class (and method maybe?) that gets hit? URI is too high cardinality
-  // given that it contains IDs a lot of the time, but it'd be nice to have some way to track
-  // individual API methods
   const labelNames = ['method', 'code']
+  // NOTE: The URI is too high cardinality to use as a label (it contains IDs a lot of the time),
+  // so requests are instead labeled with the pattern of the route that handled them
+  const routeLabelNames = ['method', 'route', 'code']
   const httpRequestsTotal = new promClient.Counter({
-    labelNames,
+    labelNames: routeLabelNames,
     name: 'http_requests_total',
     help: 'Total number of HTTP requests',
   })
 
   const httpServerRequestsSeconds = new promClient.Histogram({
-    labelNames: ['method', 'code'],
+    labelNames: routeLabelNames,
     name: 'http_server_requests_seconds',
     help: 'Duration of HTTP requests in seconds',
     buckets: promClient.exponentialBuckets(0.025, 1.3, 20),
@@ -77,9 +78,11 @@ export function prometheusHttpMetrics() {
         .labels(ctx.request.method, String(ctx.response.status))
         .observe(ctx.response.length)
     }
+    // Requests that didn't match any route (e.g. static files) are grouped together
+    const route = String((ctx as Partial<RouterParamContext>)._matchedRoute ?? 'none')
     httpServerRequestsSeconds
-      .labels(ctx.request.method, String(ctx.response.status))
+      .labels(ctx.request.method, route, String(ctx.response.status))
       .observe((getMicroseconds() - startEpoch) / 1000000)
-    httpRequestsTotal.labels(ctx.request.method, String(ctx.response.status)).inc()
+    httpRequestsTotal.labels(ctx.request.method, route, String(ctx.response.status)).inc()
   }
 }
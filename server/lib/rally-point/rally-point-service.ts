@@ -9,10 +9,19 @@ import { RallyPointServer, ResolvedRallyPointServer } from '../../../common/rall
 import { SbUserId } from '../../../common/users/sb-user'
 import isDev from '../env/is-dev'
 import log from '../logging/logger'
+import { Clock } from '../time/clock'
 import { ClientSocketsGroup, ClientSocketsManager } from '../websockets/socket-groups'
 import { addRallyPointServer, retrieveRallyPointServers, updateRallyPointServer } from './models'
+import { RoutePool } from './route-pool'
+import { chooseGameServers } from './route-selection'
 
 const SERVER_UPDATE_PATH = '/rallyPoint/serverList'
+/**
+ * Whether a second route on the next best server should be created for each pair of players.
+ * Game clients send their packets over both routes, which makes games resilient to latency spikes
+ * and outages of a single server, at the cost of doubling the traffic through rally-point.
+ */
+const REDUNDANT_ROUTES = process.env.SB_RALLY_POINT_REDUNDANT_ROUTES === 'true'
 
 export interface RallyPointRouteInfo {
   /** The user ID of player 1. */
@@ -28,6 +37,14 @@ export interface RallyPointRouteInfo {
   server: ResolvedRallyPointServer
   /** The estimated latency between players (this is one-way, from player A to the server to B). */
   estimatedLatency: number
+  /**
+   * A route on a different server that the players should send their packets over as well. Only
+   * created if redundant routes are enabled and there is more than one usable server.
+   */
+  backup?: {
+    route: CreatedRoute
+    server: ResolvedRallyPointServer
+  }
 }
 
 @singleton()
@@ -36,8 +53,17 @@ export class RallyPointService {
   private readonly clientPings = new Map<ClientSocketsGroup, Map<number, number>>()
   private readonly pingDeferreds = new Map<ClientSocketsGroup, Deferred<void>>()
   private routeCreator: RallyPointCreator | undefined
+  private readonly routePool: RoutePool
+
+  constructor(
+    private nydus: NydusServer,
+    private clientSocketsManager: ClientSocketsManager,
+    clock: Clock,
+  ) {
+    this.routePool = new RoutePool(clock, server =>
+      this.routeCreator!.createRoute(server.address4 ?? server.address6!, server.port),
+    )
 
-  constructor(private nydus: NydusServer, private clientSocketsManager: ClientSocketsManager) {
     this.clientSocketsManager.on('newClient', c => {
       if (c.clientType === 'electron') {
         c.subscribe(SERVER_UPDATE_PATH, () => {
@@ -171,6 +197,7 @@ export class RallyPointService {
       return server
     } else if (oldServer?.enabled && !server.enabled) {
       this.servers.delete(server.id)
+      this.routePool.clear(server.id)
 
       for (const pingMap of this.clientPings.values()) {
         pingMap.delete(server.id)
@@ -183,6 +210,7 @@ export class RallyPointService {
       return server
     } else {
       const resolvedServerPromise = lookupHostOrDisable(server)
+      this.routePool.clear(server.id)
       for (const pingMap of this.clientPings.values()) {
         pingMap.delete(server.id)
       }
@@ -207,56 +235,106 @@ export class RallyPointService {
   }
 
   /**
-   * Creates the best available route between two players.
+   * Creates the best available route between each of the given pairs of players. The results are
+   * in the same order as `pairs`.
    *
-   * The best available route is calculated by finding the available server with the lowest
-   * cumulative latency for both players (that is, it minimizes `p1Latency + p2Latency`).
+   * The servers are chosen for the whole game at once (see `chooseGameServers`): the game is kept
+   * as fast as its slowest pair allows (measured as `p1Latency + p2Latency` on that pair's best
+   * server), and within that latency pairs share as few servers as possible. Routes are taken from
+   * the pool of pre-created routes where possible, and all the ones that are missing are created at
+   * once.
    */
-  async createBestRoute(
-    player1: ClientSocketsGroup,
-    player2: ClientSocketsGroup,
-  ): Promise<RallyPointRouteInfo> {
+  async createBestRoutes(
+    pairs: ReadonlyArray<[player1: ClientSocketsGroup, player2: ClientSocketsGroup]>,
+  ): Promise<RallyPointRouteInfo[]> {
     if (!this.routeCreator) {
       throw new Error('RallyPointService is not initialized')
     }
 
-    const pings1 = this.clientPings.get(player1) ?? new Map()
-    const pings2 = this.clientPings.get(player2) ?? new Map()
-    const totalPings = Array.from(this.servers.keys(), serverId => {
-      // NOTE(tec27): We operate from the server keys so that we're not including servers that have
-      // recently been removed from the list but these clients had pings for
-      const totalPing =
-        (pings1.get(serverId) ?? Number.MAX_VALUE) + (pings2.get(serverId) ?? Number.MAX_VALUE)
-      return [serverId, totalPing]
-    })
-
-    let minPing = Number.MAX_VALUE
-    let minServer = -1
-    for (const [serverId, totalPing] of totalPings) {
-      if (totalPing < minPing) {
-        minPing = totalPing
-        minServer = serverId
+    // NOTE(tec27): We operate from the current server list so that we're not including servers that
+    // have recently been removed from the list but these clients had pings for
+    const servers = Array.from(this.servers.values())
+    const playerPings = new Map<ClientSocketsGroup, number[]>()
+    for (const pair of pairs) {
+      for (const player of pair) {
+        if (!playerPings.has(player)) {
+          const pings = this.clientPings.get(player)
+          playerPings.set(player, servers.map(s => pings?.get(s.id) ?? Number.MAX_VALUE))
+        }
       }
     }
 
-    if (minServer === -1) {
-      throw new Error(`could not find a route between ${player1.name} and ${player2.name}`)
-    }
+    // Pick the servers for every pair first, so the routes needed on each server can be requested
+    // together
+    const serverChoices = chooseGameServers(
+      pairs.map(([player1, player2]) => {
+        const pings1 = playerPings.get(player1)!
+        const pings2 = playerPings.get(player2)!
+        return servers.map((_, i) => pings1[i] + pings2[i])
+      }),
+    )
+    const needed = new Map<ResolvedRallyPointServer, number>()
+    const neededBackups = new Map<ResolvedRallyPointServer, number>()
+    const choices = serverChoices.map((choice, i) => {
+      if (choice.server === -1) {
+        const [player1, player2] = pairs[i]
+        throw new Error(`could not find a route between ${player1.name} and ${player2.name}`)
+      }
 
-    const server = this.servers.get(minServer)!
-    const route = await this.routeCreator.createRoute(
-      server.address4 ?? server.address6!,
-      server.port,
+      const server = servers[choice.server]
+      const backupServer =
+        REDUNDANT_ROUTES && choice.backupServer !== -1 ? servers[choice.backupServer] : undefined
+      needed.set(server, (needed.get(server) ?? 0) + 1)
+      if (backupServer) {
+        neededBackups.set(backupServer, (neededBackups.get(backupServer) ?? 0) + 1)
+      }
+      return { server, backupServer, latency: choice.latency }
+    })
+
+    const [routes, backupRoutes] = await Promise.all([
+      this.takeRoutes(needed),
+      this.takeRoutes(neededBackups, (server, err) => {
+        // The game works without the backup routes, so this doesn't need to fail the game
+        log.warn(`failed to create backup routes on ${server.description}: ${err}`)
+        return []
+      }),
+    ])
+
+    return choices.map(({ server, backupServer, latency }, i) => {
+      const backupRoute = backupServer ? backupRoutes.get(backupServer)!.pop() : undefined
+      return {
+        p1: pairs[i][0].userId,
+        p2: pairs[i][1].userId,
+        route: routes.get(server)!.pop()!,
+        server,
+        // latency is the round trip time from both players, summed, we divide by 2 to get the
+        // 1-way latency
+        estimatedLatency: latency / 2,
+        backup: backupRoute ? { route: backupRoute, server: backupServer! } : undefined,
+      }
+    })
+  }
+
+  /** Takes the given number of routes for each server from the route pool. */
+  private async takeRoutes(
+    counts: ReadonlyMap<ResolvedRallyPointServer, number>,
+    onError?: (server: ResolvedRallyPointServer, err: unknown) => CreatedRoute[],
+  ): Promise<Map<ResolvedRallyPointServer, CreatedRoute[]>> {
+    const results = await Promise.all(
+      Array.from(counts.entries(), async ([server, count]) => {
+        let routes: CreatedRoute[]
+        try {
+          routes = await this.routePool.take(server, count)
+        } catch (err) {
+          if (!onError) {
+            throw err
+          }
+          routes = onError(server, err)
+        }
+        return [server, routes] as const
+      }),
     )
-    return {
-      p1: player1.userId,
-      p2: player2.userId,
-      route,
-      server,
-      // minPing is the round trip time from both players, summed, we divide by 2 to get the
-      // 1-way latency
-      estimatedLatency: minPing / 2,
-    }
+    return new Map(results)
   }
 
   /**
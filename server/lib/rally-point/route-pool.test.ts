@@ -0,0 +1,129 @@
+import { CreatedRoute } from 'rally-point-creator'
+import { ResolvedRallyPointServer } from '../../../common/rally-point'
+import { FakeClock, StopCriteria } from '../time/testing/fake-clock'
+import { POOLED_ROUTE_MAX_AGE_MS, ROUTE_DEMAND_WINDOW_MS, RoutePool } from './route-pool'
+
+function createServer(): ResolvedRallyPointServer {
+  return {
+    id: 1,
+    description: 'Test Server',
+    enabled: true,
+    hostname: 'localhost',
+    port: 14098,
+    address6: '::1',
+  }
+}
+
+function waitForRefill() {
+  return new Promise(resolve => setTimeout(resolve, 0))
+}
+
+describe('rally-point/route-pool', () => {
+  let clock: FakeClock
+  let created: number
+  let createRoute: jest.Mock<Promise<CreatedRoute>, [ResolvedRallyPointServer]>
+  let pool: RoutePool
+
+  beforeEach(() => {
+    clock = new FakeClock()
+    clock.autoRunTimeouts = false
+    created = 0
+    createRoute = jest.fn(async () => {
+      created += 1
+      return { p1Id: `p1-${created}`, p2Id: `p2-${created}`, routeId: `route-${created}` }
+    })
+    pool = new RoutePool(clock, createRoute)
+  })
+
+  test('should create routes on demand and keep ready the ones expected to be needed', async () => {
+    const server = createServer()
+    const routes = await pool.take(server, 4)
+    expect(routes.map(r => r.routeId)).toEqual(['route-1', 'route-2', 'route-3', 'route-4'])
+    await waitForRefill()
+    // 4 routes were taken in the demand window, so 2 are expected to be taken within the max age
+    expect(createRoute).toHaveBeenCalledTimes(6)
+
+    const pooled = await pool.take(server, 2)
+    expect(pooled.map(r => r.routeId)).toEqual(['route-5', 'route-6'])
+  })
+
+  test('should only create the routes that are missing from the pool', async () => {
+    const server = createServer()
+    await pool.take(server, 6)
+    await waitForRefill()
+    createRoute.mockClear()
+
+    const routes = await pool.take(server, 4)
+    expect(routes).toHaveLength(4)
+    expect(routes.map(r => r.routeId).slice(0, 3)).toEqual(['route-7', 'route-8', 'route-9'])
+    // 1 on demand, then the pool is refilled to the 5 routes expected to be needed next
+    expect(createRoute).toHaveBeenCalledTimes(6)
+  })
+
+  test("shouldn't keep routes ready that would expire before being needed", async () => {
+    const server = createServer()
+    await pool.take(server, 1)
+    await waitForRefill()
+    expect(createRoute).toHaveBeenCalledTimes(1)
+  })
+
+  test("shouldn't hand out routes that have been pooled for too long", async () => {
+    const server = createServer()
+    await pool.take(server, 2)
+    await waitForRefill()
+
+    clock.setCurrentTime(POOLED_ROUTE_MAX_AGE_MS)
+    const routes = await pool.take(server, 1)
+    expect(routes.map(r => r.routeId)).toEqual(['route-4'])
+  })
+
+  test('should replace pooled routes that expire while the server is still in demand', async () => {
+    const server = createServer()
+    await pool.take(server, 4)
+    await waitForRefill()
+
+    await clock.runTimeoutsUntil({
+      criteria: StopCriteria.TimeReached,
+      timeMillis: POOLED_ROUTE_MAX_AGE_MS,
+    })
+    expect(createRoute).toHaveBeenCalledTimes(8)
+
+    const routes = await pool.take(server, 2)
+    expect(routes.map(r => r.routeId)).toEqual(['route-7', 'route-8'])
+  })
+
+  test('should stop replacing pooled routes once the server stops being used', async () => {
+    const server = createServer()
+    await pool.take(server, 4)
+    await waitForRefill()
+
+    await clock.runTimeoutsUntil({ criteria: StopCriteria.EmptyQueue })
+    // Replaced once while the demand was recent, then dropped once it fell out of the window
+    expect(createRoute).toHaveBeenCalledTimes(8)
+    expect(clock.now()).toBe(ROUTE_DEMAND_WINDOW_MS)
+
+    const routes = await pool.take(server, 2)
+    expect(routes.map(r => r.routeId)).toEqual(['route-9', 'route-10'])
+  })
+
+  test('should drop the pooled routes of servers that have changed', async () => {
+    const server = createServer()
+    await pool.take(server, 2)
+    await waitForRefill()
+
+    const updated = { ...server, port: 14099 }
+    const routes = await pool.take(updated, 1)
+    expect(routes.map(r => r.routeId)).toEqual(['route-4'])
+    expect(createRoute).toHaveBeenLastCalledWith(updated)
+  })
+
+  test("shouldn't retire routes for servers that have been cleared", async () => {
+    const server = createServer()
+    await pool.take(server, 4)
+    await waitForRefill()
+
+    pool.clear(server.id)
+    await clock.runTimeoutsUntil({ criteria: StopCriteria.EmptyQueue })
+    expect(createRoute).toHaveBeenCalledTimes(6)
+  })
+})
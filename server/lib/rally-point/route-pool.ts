@@ -0,0 +1,161 @@
+import { CreatedRoute } from 'rally-point-creator'
+import { ResolvedRallyPointServer } from '../../../common/rally-point'
+import log from '../logging/logger'
+import { Clock, TimeoutId } from '../time/clock'
+
+/**
+ * How long after its creation a pooled route can still be handed out. This is kept well below the
+ * time rally-point servers keep routes around for if nobody joins them, so routes that get too old
+ * are just dropped from the pool and left for the server to clean up.
+ */
+export const POOLED_ROUTE_MAX_AGE_MS = 60 * 1000
+/** How far back the routes taken from a server count towards how many to keep ready for it. */
+export const ROUTE_DEMAND_WINDOW_MS = 2 * 60 * 1000
+/** The most routes that will be kept ready for a single server (enough for an 8 player game). */
+export const MAX_POOLED_ROUTES = 28
+
+export type CreateRouteFunc = (server: ResolvedRallyPointServer) => Promise<CreatedRoute>
+
+interface PooledRoute {
+  route: CreatedRoute
+  createdAt: number
+}
+
+interface ServerPool {
+  /**
+   * The server the routes were created on. If the server's info changes, the pool is replaced and
+   * its routes are dropped.
+   */
+  server: ResolvedRallyPointServer
+  routes: PooledRoute[]
+  /** The number of routes currently being created to refill the pool. */
+  pending: number
+  /** When routes were taken from this server (one entry per route), oldest first. */
+  demand: number[]
+  /** The timer for retiring the oldest route in the pool once it gets too old to hand out. */
+  expiryTimer?: TimeoutId
+}
+
+/**
+ * Keeps routes on each rally-point server created ahead of time, so that they can be handed out
+ * right away when a game is loading, rather than waiting for a round trip to the server. How many
+ * routes are kept ready for a server depends on how many are expected to be taken from it before
+ * they get too old, so servers that aren't being used much don't have routes created on them.
+ * Routes that do get too old are replaced as long as the server is still seeing that demand.
+ */
+export class RoutePool {
+  private pools = new Map<number, ServerPool>()
+
+  constructor(private clock: Clock, private createRoute: CreateRouteFunc) {}
+
+  /**
+   * Returns `count` routes on `server`, using pooled routes first and creating any others that are
+   * needed. The pool for the server is refilled in the background afterwards.
+   */
+  async take(server: ResolvedRallyPointServer, count: number): Promise<CreatedRoute[]> {
+    const now = this.clock.now()
+    const pool = this.getPool(server)
+    for (let i = 0; i < count; i++) {
+      pool.demand.push(now)
+    }
+
+    const usable = pool.routes.filter(r => r.createdAt > now - POOLED_ROUTE_MAX_AGE_MS)
+    const taken = usable.slice(0, count).map(r => r.route)
+    pool.routes = usable.slice(count)
+
+    const created = Promise.all(
+      Array.from({ length: count - taken.length }, () => this.createRoute(server)),
+    )
+    this.refill(pool)
+    return taken.concat(await created)
+  }
+
+  /** Drops all the pooled routes for a server (e.g. because it was disabled). */
+  clear(serverId: number) {
+    const pool = this.pools.get(serverId)
+    if (pool) {
+      clearTimeout(pool.expiryTimer)
+      this.pools.delete(serverId)
+    }
+  }
+
+  private getPool(server: ResolvedRallyPointServer): ServerPool {
+    let pool = this.pools.get(server.id)
+    if (!pool || pool.server !== server) {
+      if (pool) {
+        clearTimeout(pool.expiryTimer)
+      }
+      pool = { server, routes: [], pending: 0, demand: [] }
+      this.pools.set(server.id, pool)
+    }
+    return pool
+  }
+
+  /**
+   * Returns how many routes to keep ready on a server: as many as are expected to be taken from it
+   * while they are still young enough to hand out, going by the rate they were taken at recently.
+   */
+  private targetSize(pool: ServerPool): number {
+    const now = this.clock.now()
+    while (pool.demand.length && pool.demand[0] <= now - ROUTE_DEMAND_WINDOW_MS) {
+      pool.demand.shift()
+    }
+    const expected = (pool.demand.length * POOLED_ROUTE_MAX_AGE_MS) / ROUTE_DEMAND_WINDOW_MS
+    return Math.min(Math.floor(expected), MAX_POOLED_ROUTES)
+  }
+
+  private refill(pool: ServerPool) {
+    const target = this.targetSize(pool)
+    const missing = target - pool.routes.length - pool.pending
+    for (let i = 0; i < missing; i++) {
+      pool.pending += 1
+      this.createRoute(pool.server)
+        .then(route => {
+          // Routes created for a pool that has been replaced or cleared are just dropped
+          if (this.pools.get(pool.server.id) === pool) {
+            pool.routes.push({ route, createdAt: this.clock.now() })
+            this.scheduleExpiry(pool)
+          }
+        })
+        .catch(err => {
+          log.warn(`failed to create pooled route on ${pool.server.description}: ${err}`)
+        })
+        .finally(() => {
+          pool.pending -= 1
+        })
+    }
+  }
+  private scheduleExpiry(pool: ServerPool) {
+    if (pool.expiryTimer !== undefined || !pool.routes.length) {
+      return
+    }
+
+    // Routes are added in the order they were created, so the first one is the next to expire
+    const expiresIn = pool.routes[0].createdAt + POOLED_ROUTE_MAX_AGE_MS - this.clock.now()
+    const timer = this.clock.setTimeout(() => {
+      if (pool.expiryTimer !== timer || this.pools.get(pool.server.id) !== pool) {
+        return
+      }
+      pool.expiryTimer = undefined
+      this.retireExpired(pool)
+    }, expiresIn)
+    pool.expiryTimer = timer
+  }
+
+  /**
+   * Drops the routes in a pool that are too old to be handed out anymore, and replaces them if the
+   * server's demand still calls for them.
+   */
+  private retireExpired(pool: ServerPool) {
+    const now = this.clock.now()
+    pool.routes = pool.routes.filter(r => r.createdAt > now - POOLED_ROUTE_MAX_AGE_MS)
+    this.refill(pool)
+
+    if (pool.routes.length) {
+      this.scheduleExpiry(pool)
+    } else if (!pool.pending && !pool.demand.length) {
+      // Nobody has used this server in a while, so there's nothing left to keep track of
+      this.pools.delete(pool.server.id)
+    }
+  }
+}
@@ -0,0 +1,55 @@
+import { chooseGameServers } from './route-selection'
+
+const UNUSABLE = Number.MAX_VALUE
+
+describe('rally-point/route-selection/chooseGameServers', () => {
+  test('should pick the fastest server of a single pair', () => {
+    const choices = chooseGameServers([[80, 40, 60]])
+    expect(choices).toEqual([{ server: 1, backupServer: 2, latency: 40 }])
+  })
+
+  test('should put pairs on a shared server when it keeps the game just as fast', () => {
+    // Players A, B, C, with the pairs AB, AC, BC. AC is the slowest pair at 120 on server 0, so
+    // AB doesn't need to be on server 1 to keep the game at that latency.
+    const choices = chooseGameServers([
+      [100, 40],
+      [120, 130],
+      [110, 150],
+    ])
+    expect(choices.map(c => c.server)).toEqual([0, 0, 0])
+    expect(choices.map(c => c.latency)).toEqual([100, 120, 110])
+    expect(choices[0].backupServer).toBe(1)
+  })
+
+  test("shouldn't make the slowest pair any slower", () => {
+    const pairLatencies = [
+      [50, 90, 200],
+      [300, 90, 60],
+      [250, 150, 80],
+    ]
+    const choices = chooseGameServers(pairLatencies)
+    const gameLatency = Math.max(...pairLatencies.map(l => Math.min(...l)))
+    expect(Math.max(...choices.map(c => c.latency))).toBe(gameLatency)
+    // Server 2 fits both of the slower pairs within the game's latency of 80
+    expect(choices.map(c => c.server)).toEqual([0, 2, 2])
+  })
+
+  test('should break ties by the total latency of the pairs', () => {
+    const choices = chooseGameServers([
+      [60, 50],
+      [100, 100],
+    ])
+    expect(choices.map(c => c.server)).toEqual([1, 1])
+  })
+
+  test("should mark pairs that can't use any server", () => {
+    const choices = chooseGameServers([
+      [UNUSABLE, UNUSABLE],
+      [40, UNUSABLE],
+    ])
+    expect(choices).toEqual([
+      { server: -1, backupServer: -1, latency: UNUSABLE },
+      { server: 0, backupServer: -1, latency: 40 },
+    ])
+  })
+})
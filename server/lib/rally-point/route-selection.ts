@@ -0,0 +1,88 @@
+/** The servers chosen for a pair of players, as indexes into the list of servers. */
+export interface PairServerChoice {
+  /** The server the pair's route should be created on, or -1 if none of them are usable. */
+  server: number
+  /** The fastest server for the pair other than `server`, or -1 if there is no other one. */
+  backupServer: number
+  /** The summed round trip time of both players to `server`, in milliseconds. */
+  latency: number
+}
+
+function isUsable(latency: number) {
+  return latency < Number.MAX_VALUE
+}
+
+/**
+ * Picks the servers for all the routes of a game at once. `pairLatencies[pair][server]` is the
+ * summed round trip time of both players of the pair to the server, with `Number.MAX_VALUE` (or
+ * anything larger) for servers that can't be used by the pair.
+ *
+ * Games run in lockstep, so how fast a game can go is set by its slowest pair, and that is as low
+ * as it gets when that pair uses its fastest server. Every other pair can then use any server that
+ * is no slower than this without slowing the game down, so rather than picking the fastest server
+ * for each pair independently, pairs are packed onto as few servers as possible within that
+ * latency. This greedily picks the server that the most remaining pairs can use (breaking ties by
+ * their total latency on it), which means players send to fewer servers, and routes come from fewer
+ * of the pre-created pools.
+ *
+ * This takes O(pairs * servers) time for every server that gets picked.
+ */
+export function chooseGameServers(
+  pairLatencies: ReadonlyArray<ReadonlyArray<number>>,
+): PairServerChoice[] {
+  const fastest = pairLatencies.map(latencies => Math.min(...latencies))
+  const gameLatency = Math.max(0, ...fastest.filter(isUsable))
+
+  const chosen = pairLatencies.map(() => -1)
+  let remaining = fastest.filter(isUsable).length
+  const serverCount = pairLatencies.length ? pairLatencies[0].length : 0
+  while (remaining > 0) {
+    let bestServer = -1
+    let bestCount = 0
+    let bestTotal = Number.MAX_VALUE
+    for (let server = 0; server < serverCount; server++) {
+      let count = 0
+      let total = 0
+      for (let pair = 0; pair < pairLatencies.length; pair++) {
+        const latency = pairLatencies[pair][server]
+        if (chosen[pair] === -1 && isUsable(latency) && latency <= gameLatency) {
+          count += 1
+          total += latency
+        }
+      }
+      if (count > bestCount || (count > 0 && count === bestCount && total < bestTotal)) {
+        bestServer = server
+        bestCount = count
+        bestTotal = total
+      }
+    }
+
+    // Every pair can use its own fastest server, so this always assigns at least one pair
+    for (let pair = 0; pair < pairLatencies.length; pair++) {
+      const latency = pairLatencies[pair][bestServer]
+      if (chosen[pair] === -1 && isUsable(latency) && latency <= gameLatency) {
+        chosen[pair] = bestServer
+        remaining -= 1
+      }
+    }
+  }
+
+  return pairLatencies.map((latencies, pair) => {
+    const server = chosen[pair]
+    let backupServer = -1
+    for (let i = 0; i < latencies.length; i++) {
+      if (
+        i !== server &&
+        isUsable(latencies[i]) &&
+        (backupServer === -1 || latencies[i] < latencies[backupServer])
+      ) {
+        backupServer = i
+      }
+    }
+    return {
+      server,
+      backupServer: server !== -1 ? backupServer : -1,
+      latency: server !== -1 ? latencies[server] : Number.MAX_VALUE,
+    }
+  })
+}
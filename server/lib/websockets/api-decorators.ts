@@ -1,4 +1,5 @@
 import { NydusServer, RouteHandler } from 'nydus'
+import { exponentialBuckets, Histogram } from 'prom-client'
 
 // Used to decorate classes that contain methods that can be INVOKE'd, allowing them to specify a
 // base path that all methods should be mounted at.
@@ -44,6 +45,32 @@ export function Api(path: string, ...middleware: Array<string | RouteHandler>) {
   }
 }
 
+const apiRequestSecondsMetric = new Histogram({
+  labelNames: ['route', 'code'],
+  name: 'shieldbattery_wsapi_requests_seconds',
+  help: 'Duration of websocket API requests in seconds',
+  buckets: exponentialBuckets(0.001, 1.6, 20),
+})
+
+/**
+ * Creates a middleware that tracks the duration of requests to a route. The route pattern (rather
+ * than the actual path, which usually contains IDs and names) is used as a label to keep the
+ * cardinality of the metric low.
+ */
+function trackRequestDuration(route: string): RouteHandler {
+  return async (data, next) => {
+    const endTimer = apiRequestSecondsMetric.startTimer({ route })
+    try {
+      const result = await next(data)
+      endTimer({ code: 200 })
+      return result
+    } catch (err: any) {
+      endTimer({ code: err?.status ?? 500 })
+      throw err
+    }
+  }
+}
+
 /**
  * Register the decorated `@Api` methods for a class on a particular `NydusServer` instance.
  */
@@ -63,6 +90,12 @@ export function registerApiRoutes(apiObject: any, nydus: NydusServer) {
     const middleware = desc.middleware.map(f =>
       typeof f === 'string' ? apiObject[f].bind(apiObject) : f,
     )
-    nydus.registerRoute(`${basePath}${desc.path}`, ...middleware, apiObject[method].bind(apiObject))
+    const route = `${basePath}${desc.path}`
+    nydus.registerRoute(
+      route,
+      trackRequestDuration(route),
+      ...middleware,
+      apiObject[method].bind(apiObject),
+    )
   }
 }
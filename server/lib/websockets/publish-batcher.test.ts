@@ -0,0 +1,69 @@
+import { NydusServer } from 'nydus'
+import { PublishBatcher } from './publish-batcher'
+import { TypedPublisher } from './typed-publisher'
+
+interface TestEvent {
+  id: number
+}
+
+interface TestBatch {
+  events: TestEvent[]
+}
+
+function nextTurn() {
+  return new Promise(resolve => setImmediate(resolve))
+}
+
+describe('websockets/publish-batcher/PublishBatcher', () => {
+  let publish: jest.Mock
+  let batcher: PublishBatcher<TestEvent, TestBatch>
+
+  beforeEach(() => {
+    publish = jest.fn()
+    const publisher = new TypedPublisher<TestEvent | TestBatch>({ publish } as any as NydusServer)
+    batcher = new PublishBatcher(publisher, events => ({ events }))
+  })
+
+  test('publishes queued events for a path as one batch', async () => {
+    batcher.queue('/a', { id: 1 })
+    batcher.queue('/a', { id: 2 })
+    batcher.queue('/b', { id: 3 })
+    expect(publish).not.toHaveBeenCalled()
+
+    await nextTurn()
+
+    expect(publish).toHaveBeenCalledTimes(2)
+    expect(publish).toHaveBeenCalledWith('/a', { events: [{ id: 1 }, { id: 2 }] })
+    // Single events aren't wrapped in a batch
+    expect(publish).toHaveBeenCalledWith('/b', { id: 3 })
+  })
+
+  test('publishes queued events before directly published ones', async () => {
+    batcher.queue('/a', { id: 1 })
+    batcher.queue('/b', { id: 2 })
+    batcher.publish('/a', { id: 3 })
+
+    expect(publish.mock.calls).toEqual([
+      ['/a', { id: 1 }],
+      ['/a', { id: 3 }],
+    ])
+
+    await nextTurn()
+
+    expect(publish).toHaveBeenCalledTimes(3)
+    expect(publish).toHaveBeenLastCalledWith('/b', { id: 2 })
+  })
+
+  test('starts a new batch after publishing', async () => {
+    batcher.queue('/a', { id: 1 })
+    await nextTurn()
+    batcher.queue('/a', { id: 2 })
+    batcher.queue('/a', { id: 3 })
+    await nextTurn()
+
+    expect(publish.mock.calls).toEqual([
+      ['/a', { id: 1 }],
+      ['/a', { events: [{ id: 2 }, { id: 3 }] }],
+    ])
+  })
+})
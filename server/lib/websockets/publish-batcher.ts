@@ -0,0 +1,65 @@
+import { TypedPublisher } from './typed-publisher'
+
+/**
+ * Publishes events to paths, combining the events that are queued for the same path within one
+ * turn of the event loop into a single message. This is meant for events that can come in large
+ * bursts (e.g. many users coming online in a channel after a restart), so that each subscribed
+ * socket gets one message per burst instead of one message per event.
+ *
+ * Events published directly (rather than queued) are sent right away, after any events that were
+ * queued for the same path, so the order of events on a path is always kept.
+ */
+export class PublishBatcher<T, B> {
+  private pending = new Map<string, T[]>()
+  private flushScheduled = false
+
+  /**
+   * @param publisher the publisher to publish events with
+   * @param makeBatch a function that combines multiple queued events into a single message. This
+   *   is only used if more than one event was queued for a path.
+   */
+  constructor(private publisher: TypedPublisher<T | B>, private makeBatch: (events: T[]) => B) {}
+
+  /** Queues an event to be published to `path` at the end of the current turn of the event loop. */
+  queue(path: string, event: T) {
+    const events = this.pending.get(path)
+    if (events) {
+      events.push(event)
+    } else {
+      this.pending.set(path, [event])
+    }
+
+    if (!this.flushScheduled) {
+      this.flushScheduled = true
+      setImmediate(this.flushAll)
+    }
+  }
+
+  /** Publishes an event to `path` immediately (after any events queued for it). */
+  publish(path: string, event: T) {
+    this.flush(path)
+    this.publisher.publish(path, event)
+  }
+
+  /** Publishes any events that have been queued for `path`. */
+  flush(path: string) {
+    const events = this.pending.get(path)
+    if (events) {
+      this.pending.delete(path)
+      this.publishEvents(path, events)
+    }
+  }
+
+  private flushAll = () => {
+    this.flushScheduled = false
+    const pending = this.pending
+    this.pending = new Map()
+    for (const [path, events] of pending) {
+      this.publishEvents(path, events)
+    }
+  }
+
+  private publishEvents(path: string, events: T[]) {
+    this.publisher.publish(path, events.length === 1 ? events[0] : this.makeBatch(events))
+  }
+}
@@ -1,4 +1,3 @@
-import { Map, Set } from 'immutable'
 import { NydusClient, NydusServer } from 'nydus'
 import { container, inject, singleton } from 'tsyringe'
 import { EventMap, TypedEventEmitter } from '../../../common/typed-emitter'
@@ -26,8 +25,8 @@ interface SocketGroupEvents<T> extends EventMap {
 abstract class SocketGroup<T> extends TypedEventEmitter<SocketGroupEvents<T>> {
   readonly name: string
   readonly userId: SbUserId
-  sockets = Set<NydusClient>()
-  subscriptions = Map<string, Readonly<SubscriptionInfo<this>>>()
+  readonly sockets = new Set<NydusClient>()
+  readonly subscriptions = new Map<string, Readonly<SubscriptionInfo<this>>>()
 
   constructor(private nydus: NydusServer, readonly session: SessionInfo) {
     super()
@@ -47,25 +46,30 @@ abstract class SocketGroup<T> extends TypedEventEmitter<SocketGroupEvents<T>> {
   abstract getType(): string
 
   add(socket: NydusClient) {
-    const newSockets = this.sockets.add(socket)
-    if (newSockets !== this.sockets) {
-      this.sockets = newSockets
-      socket.once('close', () => this.delete(socket))
-      this.applySubscriptions(socket)
-      this.emit('connection', this as any, socket)
+    if (this.sockets.has(socket)) {
+      return
     }
+
+    this.sockets.add(socket)
+    socket.once('close', () => this.delete(socket))
+    this.applySubscriptions(socket)
+    this.emit('connection', this as any, socket)
   }
 
   delete(socket: NydusClient) {
-    this.sockets = this.sockets.delete(socket)
-    if (this.sockets.isEmpty()) {
+    if (!this.sockets.delete(socket)) {
+      return
+    }
+
+    if (!this.sockets.size) {
       this.applyCleanups()
       this.emit('close', this as any)
     }
   }
 
   closeAll() {
-    for (const s of this.sockets) {
+    // Closing a socket removes it from the group, so this iterates over a copy
+    for (const s of Array.from(this.sockets)) {
       s.close()
     }
   }
@@ -91,7 +95,7 @@ abstract class SocketGroup<T> extends TypedEventEmitter<SocketGroupEvents<T>> {
       return
     }
 
-    this.subscriptions = this.subscriptions.set(path, {
+    this.subscriptions.set(path, {
       getter: initialDataGetter,
       cleanup,
     })
@@ -126,13 +130,11 @@ abstract class SocketGroup<T> extends TypedEventEmitter<SocketGroupEvents<T>> {
    * @returns `true` if the group was previously subscribed, `false` otherwise
    */
   unsubscribe(path: string): boolean {
-    const updated = this.subscriptions.delete(path)
-    if (updated === this.subscriptions) return false
+    if (!this.subscriptions.delete(path)) return false
 
     for (const socket of this.sockets) {
       this.nydus.unsubscribeClient(socket, path)
     }
-    this.subscriptions = updated
 
     return true
   }
@@ -174,7 +176,7 @@ interface UserSocketsManagerEvents extends EventMap {
 
 @singleton()
 export class UserSocketsManager extends TypedEventEmitter<UserSocketsManagerEvents> {
-  users = Map<number, UserSocketsGroup>()
+  readonly users = new Map<number, UserSocketsGroup>()
 
   constructor(
     private nydus: NydusServer,
@@ -199,7 +201,7 @@ export class UserSocketsManager extends TypedEventEmitter<UserSocketsManagerEven
       if (!this.users.has(userId)) {
         const user = new UserSocketsGroup(this.nydus, session!)
         user.add(socket)
-        this.users = this.users.set(userId, user)
+        this.users.set(userId, user)
         user.once('close', () => this.removeUser(userId))
         this.emit('newUser', user)
       } else {
@@ -227,7 +229,7 @@ export class UserSocketsManager extends TypedEventEmitter<UserSocketsManagerEven
   }
 
   private removeUser(userId: SbUserId) {
-    this.users = this.users.delete(userId)
+    this.users.delete(userId)
     this.emit('userQuit', userId)
     return this
   }
@@ -240,7 +242,7 @@ interface ClientSocketsManagerEvents extends EventMap {
 
 @singleton()
 export class ClientSocketsManager extends TypedEventEmitter<ClientSocketsManagerEvents> {
-  clients = Map<string, ClientSocketsGroup>()
+  readonly clients = new Map<string, ClientSocketsGroup>()
 
   constructor(private nydus: NydusServer, private sessionLookup: RequestSessionLookup) {
     super()
@@ -255,7 +257,7 @@ export class ClientSocketsManager extends TypedEventEmitter<ClientSocketsManager
       if (!this.clients.has(userClientId)) {
         const client = new ClientSocketsGroup(this.nydus, session)
         client.add(socket)
-        this.clients = this.clients.set(userClientId, client)
+        this.clients.set(userClientId, client)
         client.once('close', () => this.removeClient(userClientId))
         this.emit('newClient', client)
       } else {
@@ -284,9 +286,9 @@ export class ClientSocketsManager extends TypedEventEmitter<ClientSocketsManager
   }
 
   private removeClient(userClientId: string) {
-    if (this.clients.has(userClientId)) {
-      const client = this.clients.get(userClientId)!
-      this.clients = this.clients.delete(userClientId)
+    const client = this.clients.get(userClientId)
+    if (client) {
+      this.clients.delete(userClientId)
       this.emit('clientQuit', client)
     }
     return this
@@ -1,5 +1,6 @@
 import errors from 'http-errors'
 import { List, Map, Record, Set } from 'immutable'
+import { Counter } from 'prom-client'
 import { container } from 'tsyringe'
 import CancelToken from '../../../common/async/cancel-token'
 import createDeferred from '../../../common/async/deferred'
@@ -60,6 +61,12 @@ function checkSubTypeValidity(gameType, gameSubType = 0, numSlots) {
 
 const MOUNT_BASE = '/lobbies'
 
+const lobbyTransitionsMetric = new Counter({
+  name: 'shieldbattery_lobby_transitions_total',
+  labelNames: ['transition'],
+  help: 'Total number of lobby state transitions',
+})
+
 @Mount(MOUNT_BASE)
 export class LobbyApi {
   constructor(nydus, userSockets, clientSockets) {
@@ -179,6 +186,7 @@ export class LobbyApi {
 
     this.lobbies = this.lobbies.set(name, lobby)
     this.lobbyClients = this.lobbyClients.set(client, name)
+    lobbyTransitionsMetric.labels('created').inc()
     this._subscribeClientToLobby(lobby, user, client)
 
     this._publishListChange('add', Lobbies.toSummaryJson(lobby))
@@ -633,6 +641,7 @@ export class LobbyApi {
       this.lobbies = this.lobbies.delete(lobby.name)
       this.lobbyBannedUsers = this.lobbyBannedUsers.delete(lobby.name)
       this._publishListChange('delete', lobby.name)
+      lobbyTransitionsMetric.labels('closed').inc()
     } else {
       this.lobbies = this.lobbies.set(lobby.name, updatedLobby)
       this._publishLobbyDiff(
@@ -699,6 +708,7 @@ export class LobbyApi {
 
     this._publishTo(lobby, { type: 'startCountdown' })
     this._publishListChange('delete', lobby.name)
+    lobbyTransitionsMetric.labels('countdownStarted').inc()
 
     const gameConfig = {
       gameType: lobby.gameType,
@@ -781,6 +791,7 @@ export class LobbyApi {
 
   _onGameSetup(lobby, setup = {}, resultCodes) {
     this.loadingLobbies = this.loadingLobbies.set(lobby.name, setup.gameId)
+    lobbyTransitionsMetric.labels('loadingStarted').inc()
     const players = getHumanSlots(lobby)
     for (const player of players) {
       this._publishToClient(lobby, player.userId, {
@@ -813,6 +824,7 @@ export class LobbyApi {
       type: 'cancelLoading',
     })
     this._publishListChange('add', Lobbies.toSummaryJson(lobby))
+    lobbyTransitionsMetric.labels('loadingCanceled').inc()
   }
 
   _onGameLoaded(lobby) {
@@ -834,6 +846,7 @@ export class LobbyApi {
       })
     this.lobbies = this.lobbies.delete(lobby.name)
     this.loadingLobbies = this.loadingLobbies.delete(lobby.name)
+    lobbyTransitionsMetric.labels('gameStarted').inc()
   }
 
   // Cancels the countdown if one was occurring (no-op if it was not)
@@ -848,6 +861,7 @@ export class LobbyApi {
     this._publishTo(lobby, {
       type: 'cancelCountdown',
     })
+    lobbyTransitionsMetric.labels('countdownCanceled').inc()
     this._publishListChange('add', Lobbies.toSummaryJson(lobby))
   }
 
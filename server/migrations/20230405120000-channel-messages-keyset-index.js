@@ -0,0 +1,24 @@
+// Replaces the index on `channel_id` with one that orders each channel's messages the same way
+// they're paginated, so that loading a page of history is a single index range scan.
+exports.up = async function (db) {
+  await db.runSql(`
+    CREATE INDEX channel_messages_channel_id_sent_id_index
+    ON channel_messages (channel_id, sent DESC, id DESC);
+  `)
+  await db.runSql(`
+    DROP INDEX channel_messages_channel_id_index;
+  `)
+}
+
+exports.down = async function (db) {
+  await db.runSql(`
+    CREATE INDEX channel_messages_channel_id_index ON channel_messages (channel_id);
+  `)
+  await db.runSql(`
+    DROP INDEX channel_messages_channel_id_sent_id_index;
+  `)
+}
+
+exports._meta = {
+  version: 1,
+}
@@ -0,0 +1,535 @@
+// A load generator that simulates a large number of game clients using a running server: signing
+// up/logging in, connecting over websockets, queueing for matchmaking, accepting matches, reporting
+// game status and results, and making/joining/leaving lobbies. Runs are reproducible for a given
+// seed (the same users are used and they make the same choices), so the server-side metrics of
+// different runs can be compared.
+//
+// The server being tested should have SB_DISABLE_THROTTLING set, an active matchmaking season and
+// 1v1 map pool, and (for matches to actually be loaded) a rally-point server. The clients identify
+// themselves as standalone (Electron) clients, since matchmaking requires that.
+//
+// Configuration is done through environment variables (see `config` below), e.g.:
+// `SB_LOAD_TEST_CLIENTS=2000 SB_LOAD_TEST_RAMP_SECONDS=120 ./server/testing/run_load_test.sh`
+import http from 'http'
+import https from 'https'
+import createNydus, { NydusClient, NydusClientOptions, RouteInfo } from 'nydus-client'
+import { GameStatus } from '../../common/game-status'
+import { GameClientPlayerResult, GameClientResult } from '../../common/games/results'
+import { SlotType } from '../../common/lobbies/slot'
+import {
+  GetMatchmakingMapPoolBody,
+  MatchmakingEvent,
+  MatchmakingType,
+  MatchReadyEvent,
+} from '../../common/matchmaking'
+import { AssignedRaceChar } from '../../common/races'
+import { SbUserId } from '../../common/users/sb-user'
+import { ClientSessionInfo } from '../../common/users/session'
+
+function numberFromEnv(name: string, defaultValue: number) {
+  const value = process.env[name]
+  return value !== undefined && value !== '' ? Number(value) : defaultValue
+}
+
+const config = {
+  /** The server to test against. */
+  server:
+    process.env.SB_LOAD_TEST_SERVER ?? process.env.SB_CANONICAL_HOST ?? 'http://localhost:5555',
+  /** The total number of simulated clients. */
+  clients: numberFromEnv('SB_LOAD_TEST_CLIENTS', 200),
+  /** The percentage of clients that use lobbies (the rest use matchmaking). */
+  lobbyPercent: numberFromEnv('SB_LOAD_TEST_LOBBY_PERCENT', 20),
+  /** How many players each lobby is filled with before it is started being left. */
+  lobbySize: numberFromEnv('SB_LOAD_TEST_LOBBY_SIZE', 4),
+  /** How long it takes for all clients to be started. */
+  rampSeconds: numberFromEnv('SB_LOAD_TEST_RAMP_SECONDS', 60),
+  /** How long the test runs for (including the ramp). */
+  durationSeconds: numberFromEnv('SB_LOAD_TEST_DURATION_SECONDS', 300),
+  /** The average length of a simulated game. */
+  gameSeconds: numberFromEnv('SB_LOAD_TEST_GAME_SECONDS', 60),
+  /** The seed for all random choices, and part of every user's name. */
+  seed: numberFromEnv('SB_LOAD_TEST_SEED', 1),
+  /** How often a summary of the collected statistics is printed. */
+  reportSeconds: numberFromEnv('SB_LOAD_TEST_REPORT_SECONDS', 15),
+}
+
+const ORIGIN = 'shieldbattery://app'
+const PASSWORD = 'load-test-password'
+const RACES: ReadonlyArray<AssignedRaceChar> = ['p', 't', 'z']
+
+const serverUrl = new URL(config.server)
+// NOTE: The modules have compatible APIs, but TS can't call the overloads on a union of them
+const requestModule = (serverUrl.protocol === 'https:' ? https : http) as typeof http
+const agent = new requestModule.Agent({ keepAlive: true })
+
+/** A small, seedable PRNG (mulberry32), so that runs with the same seed make the same choices. */
+function createRandom(seed: number) {
+  let state = seed >>> 0
+  return () => {
+    state = (state + 0x6d2b79f5) >>> 0
+    let t = state
+    t = Math.imul(t ^ (t >>> 15), t | 1)
+    t ^= t + Math.imul(t ^ (t >>> 7), t | 61)
+    return ((t ^ (t >>> 14)) >>> 0) / 4294967296
+  }
+}
+
+/** Returns a stable hash of a string, used to make choices that all players of a game agree on. */
+function hashString(str: string) {
+  let hash = 0
+  for (let i = 0; i < str.length; i++) {
+    hash = (Math.imul(hash, 31) + str.charCodeAt(i)) | 0
+  }
+  return hash >>> 0
+}
+
+function delay(ms: number) {
+  return new Promise<void>(resolve => setTimeout(resolve, ms))
+}
+
+/** Collects durations (in milliseconds) and counts for named operations. */
+class Stats {
+  private durations = new Map<string, number[]>()
+  private counts = new Map<string, number>()
+
+  record(name: string, durationMs: number) {
+    let durations = this.durations.get(name)
+    if (!durations) {
+      durations = []
+      this.durations.set(name, durations)
+    }
+    durations.push(durationMs)
+  }
+
+  count(name: string) {
+    this.counts.set(name, (this.counts.get(name) ?? 0) + 1)
+  }
+
+  print() {
+    const lines = [`--- ${new Date().toISOString()} ---`]
+    for (const [name, durations] of Array.from(this.durations).sort()) {
+      const sorted = durations.slice().sort((a, b) => a - b)
+      const percentile = (p: number) =>
+        sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))].toFixed(1)
+      lines.push(
+        `${name.padEnd(40)} n=${String(sorted.length).padEnd(7)} p50=${percentile(0.5)}ms ` +
+          `p90=${percentile(0.9)}ms p99=${percentile(0.99)}ms max=${percentile(1)}ms`,
+      )
+    }
+    for (const [name, count] of Array.from(this.counts).sort()) {
+      lines.push(`${name.padEnd(40)} ${count}`)
+    }
+    console.log(lines.join('\n'))
+  }
+}
+
+const stats = new Stats()
+
+class RequestError extends Error {
+  constructor(readonly status: number, message: string) {
+    super(message)
+  }
+}
+
+/** A simulated client, with its own user, cookies and websocket connection. */
+class LoadTestClient {
+  readonly username: string
+  readonly clientId: string
+  private readonly random: () => number
+  private readonly cookies = new Map<string, string>()
+  private userId = 0 as SbUserId
+  private socket: NydusClient | undefined
+
+  private stopped = false
+  private searchStartTime: number | undefined
+  private matchReadyTime: number | undefined
+  private currentMatch: MatchReadyEvent | undefined
+
+  constructor(readonly index: number) {
+    this.username = `lt${config.seed}-${index}`
+    this.clientId = `load-test-${config.seed}-${index}`
+    this.random = createRandom(hashString(this.username))
+  }
+
+  private get cookieHeader() {
+    return Array.from(this.cookies, ([name, value]) => `${name}=${value}`).join('; ')
+  }
+
+  /** Makes a request to the server's HTTP API, recording its duration under `name`. */
+  request<T = unknown>(name: string, method: string, path: string, body?: unknown): Promise<T> {
+    const payload = body !== undefined ? JSON.stringify(body) : undefined
+    const startTime = performance.now()
+
+    return new Promise<T>((resolve, reject) => {
+      const req = requestModule.request(
+        new URL(`/api/1${path}`, serverUrl),
+        {
+          method,
+          agent,
+          headers: {
+            Origin: ORIGIN,
+            Cookie: this.cookieHeader,
+            ...(payload !== undefined
+              ? { 'Content-Type': 'application/json', 'Content-Length': Buffer.byteLength(payload) }
+              : {}),
+          },
+        },
+        res => {
+          for (const cookie of res.headers['set-cookie'] ?? []) {
+            const [nameValue] = cookie.split(';', 1)
+            const separator = nameValue.indexOf('=')
+            this.cookies.set(nameValue.slice(0, separator), nameValue.slice(separator + 1))
+          }
+
+          let data = ''
+          res.setEncoding('utf8')
+          res.on('data', chunk => (data += chunk))
+          res.on('end', () => {
+            stats.record(name, performance.now() - startTime)
+            const status = res.statusCode ?? 0
+            if (status < 200 || status >= 300) {
+              stats.count(`${name} failed (${status})`)
+              reject(new RequestError(status, `${method} ${path} failed with ${status}: ${data}`))
+            } else {
+              resolve(data ? JSON.parse(data) : undefined)
+            }
+          })
+        },
+      )
+      req.on('error', reject)
+      req.end(payload)
+    })
+  }
+
+  private get identifiers(): Array<[type: number, hashStr: string]> {
+    // Every simulated user gets their own "machine" so they aren't considered linked to each other
+    return [0, 1, 2, 3].map(type => [type, `${this.clientId}-${type}`])
+  }
+
+  async start() {
+    let session: ClientSessionInfo
+    try {
+      session = await this.request<ClientSessionInfo>('signup', 'POST', '/users', {
+        username: this.username,
+        password: PASSWORD,
+        email: `${this.username}@example.org`,
+        clientIds: this.identifiers,
+      })
+    } catch (err) {
+      if (!(err instanceof RequestError) || err.status !== 409) {
+        throw err
+      }
+      // The user was already created by a previous run with this seed
+      session = await this.request<ClientSessionInfo>('login', 'POST', '/sessions', {
+        username: this.username,
+        password: PASSWORD,
+        remember: true,
+        clientIds: this.identifiers,
+      })
+    }
+    this.userId = session.user.id
+
+    await this.connect()
+  }
+
+  private connect() {
+    const url = new URL(serverUrl.href)
+    url.protocol = serverUrl.protocol === 'https:' ? 'wss:' : 'ws:'
+    const socket = createNydus(url.origin, {
+      query: { clientId: this.clientId },
+      transports: ['websocket'],
+      extraHeaders: { Origin: ORIGIN, Cookie: this.cookieHeader },
+      // NOTE: The typings for engine.io stuff don't include all the possible options
+    } as any as Partial<NydusClientOptions>)
+    this.socket = socket
+
+    socket.registerRoute('/rallyPoint/serverList', (route: RouteInfo, event: any) => {
+      this.onRallyPointServers(event).catch(err => this.onError('rally-point pings', err))
+    })
+    const onMatchmakingEvent = (route: RouteInfo, event: MatchmakingEvent) => {
+      this.onMatchmakingEvent(event).catch(err => this.onError(`matchmaking ${event.type}`, err))
+    }
+    socket.registerRoute('/matchmaking/:userId', onMatchmakingEvent)
+    socket.registerRoute('/matchmaking/:userId/:clientId', onMatchmakingEvent)
+
+    return new Promise<void>((resolve, reject) => {
+      const startTime = performance.now()
+      socket.once('connect', () => {
+        stats.record('websocket connect', performance.now() - startTime)
+        resolve()
+      })
+      socket.once('error', reject)
+      socket.on('disconnect', () => {
+        if (!this.stopped) {
+          stats.count('websocket disconnected')
+        }
+      })
+      socket.connect()
+    })
+  }
+
+  stop() {
+    this.stopped = true
+    this.socket?.disconnect()
+  }
+
+  private onError(action: string, err: unknown) {
+    if (this.stopped) {
+      return
+    }
+    stats.count(`${action} errors`)
+    if (!(err instanceof RequestError)) {
+      console.error(`${this.username}: ${action} failed`, err)
+    }
+  }
+
+  private async onRallyPointServers(event: {
+    type: string
+    servers?: Array<{ id: number; enabled: boolean }>
+  }) {
+    if (event.type !== 'fullUpdate' || !event.servers) {
+      return
+    }
+    const servers = event.servers.filter(s => s.enabled)
+    // Report pings for a few servers, the same ones each run
+    await Promise.all(
+      servers.slice(0, 3).map(server =>
+        this.request(
+          'PUT /rally-point/pings',
+          'PUT',
+          `/rally-point/pings/${this.userId}/${this.clientId}/${server.id}`,
+          { ping: 20 + Math.round(this.random() * 100) },
+        ),
+      ),
+    )
+  }
+
+  /** Runs the matchmaking flow for this client (further steps are driven by server events). */
+  async runMatchmaking() {
+    await this.queue()
+  }
+
+  private async queue() {
+    if (this.stopped) {
+      return
+    }
+    const race = RACES[Math.floor(this.random() * RACES.length)]
+    const { pool } = await this.request<GetMatchmakingMapPoolBody>(
+      'GET /matchmaking-map-pools/current',
+      'GET',
+      `/matchmaking-map-pools/${MatchmakingType.Match1v1}/current`,
+    )
+    this.searchStartTime = performance.now()
+    await this.request('POST /matchmaking/find', 'POST', '/matchmaking/find', {
+      clientId: this.clientId,
+      identifiers: this.identifiers,
+      preferences: {
+        userId: this.userId,
+        matchmakingType: MatchmakingType.Match1v1,
+        race,
+        mapPoolId: pool.id,
+        mapSelections: [],
+        data: {},
+      },
+    })
+  }
+
+  /** Queues again after a short (random) delay, e.g. after a game has finished. */
+  private requeue() {
+    this.currentMatch = undefined
+    this.matchReadyTime = undefined
+    delay(1000 + this.random() * 4000)
+      .then(() => this.queue())
+      .catch(err => this.onError('requeue', err))
+  }
+
+  private async onMatchmakingEvent(event: MatchmakingEvent) {
+    if (this.stopped) {
+      return
+    }
+
+    switch (event.type) {
+      case 'matchFound':
+        if (this.searchStartTime !== undefined) {
+          stats.record('search (find -> matchFound)', performance.now() - this.searchStartTime)
+          this.searchStartTime = undefined
+        }
+        // Real users take a little while to accept
+        await delay(500 + this.random() * 2500)
+        await this.request('POST /matchmaking/accept', 'POST', '/matchmaking/accept')
+        break
+      case 'matchReady':
+        this.currentMatch = event
+        this.matchReadyTime = performance.now()
+        break
+      case 'startWhenReady':
+        await this.request('PUT /games/:gameId/status', 'PUT', `/games/${event.gameId}/status`, {
+          status: GameStatus.Playing,
+        })
+        break
+      case 'gameStarted':
+        if (this.matchReadyTime !== undefined) {
+          stats.record('load (matchReady -> gameStarted)', performance.now() - this.matchReadyTime)
+        }
+        stats.count('games started')
+        await this.playGame()
+        break
+      case 'acceptTimeout':
+      case 'cancelLoading':
+        stats.count(`matchmaking ${event.type}`)
+        this.requeue()
+        break
+      case 'requeue':
+        stats.count('matchmaking requeue')
+        this.searchStartTime = performance.now()
+        break
+    }
+  }
+
+  private async playGame() {
+    const match = this.currentMatch
+    if (!match?.resultCode) {
+      this.requeue()
+      return
+    }
+
+    const gameSeconds = config.gameSeconds * (0.5 + this.random())
+    await delay(gameSeconds * 1000)
+    if (this.stopped) {
+      return
+    }
+
+    // Every player in the game reports the same winner
+    const { gameId } = match.setup
+    const humans = match.slots.filter(s => s.type === SlotType.Human)
+    const winner = humans[hashString(gameId) % humans.length].userId
+    const playerResults = humans.map((slot): [SbUserId, GameClientPlayerResult] => [
+      slot.userId,
+      {
+        result: slot.userId === winner ? GameClientResult.Victory : GameClientResult.Defeat,
+        race: slot.race !== 'r' ? slot.race : RACES[hashString(`${gameId}${slot.userId}`) % 3],
+        apm: 50 + (hashString(`${gameId}${slot.userId}apm`) % 200),
+      },
+    ])
+    await this.request('POST /games/:gameId/results2', 'POST', `/games/${gameId}/results2`, {
+      userId: this.userId,
+      resultCode: match.resultCode,
+      time: Math.round(gameSeconds * 1000),
+      playerResults,
+    })
+    stats.count('game results submitted')
+    this.requeue()
+  }
+
+  private invoke(name: string, path: string, body?: unknown) {
+    const startTime = performance.now()
+    return this.socket!.invoke(path, body).then(
+      (result: unknown) => {
+        stats.record(name, performance.now() - startTime)
+        return result
+      },
+      (err: unknown) => {
+        stats.record(name, performance.now() - startTime)
+        stats.count(`${name} failed`)
+        throw err
+      },
+    )
+  }
+
+  /**
+   * Runs the lobby flow for this client: the first client of each group of `config.lobbySize`
+   * creates a lobby, the others join it, everyone chats for a bit and then leaves, and repeat.
+   */
+  async runLobbies(mapId: string) {
+    const groupIndex = Math.floor(this.index / config.lobbySize)
+    const isHost = this.index % config.lobbySize === 0
+
+    for (let round = 0; !this.stopped; round++) {
+      const name = `lt${config.seed} lobby ${groupIndex} #${round}`
+      try {
+        if (isHost) {
+          await this.invoke('/lobbies/create', '/lobbies/create', {
+            name,
+            map: mapId,
+            gameType: 'melee',
+            gameSubType: 0,
+            allowObservers: false,
+          })
+        } else {
+          // Give the host some time to create the lobby
+          await delay(1000 + this.random() * 2000)
+          await this.invoke('/lobbies/join', '/lobbies/join', { name })
+        }
+
+        for (let i = 0; i < 3 && !this.stopped; i++) {
+          await delay(1000 + this.random() * 3000)
+          await this.invoke('/lobbies/sendChat', '/lobbies/sendChat', { text: `hello ${i}` })
+        }
+
+        await delay((isHost ? 6000 : 0) + this.random() * 4000)
+        await this.invoke('/lobbies/leave', '/lobbies/leave')
+      } catch (err) {
+        this.onError('lobby', err)
+      }
+      await delay(2000 + this.random() * 3000)
+    }
+  }
+}
+
+async function main() {
+  console.log(`Running load test against ${serverUrl.origin}: ${JSON.stringify(config)}`)
+
+  const clients = Array.from({ length: config.clients }, (_, i) => new LoadTestClient(i))
+  const numLobbyClients = Math.round((config.clients * config.lobbyPercent) / 100)
+  let mapId: string | undefined
+
+  const reportInterval = setInterval(() => stats.print(), config.reportSeconds * 1000)
+  const testEndTime = Date.now() + config.durationSeconds * 1000
+  const rampDelayMs = (config.rampSeconds * 1000) / Math.max(config.clients, 1)
+
+  const running: Array<Promise<void>> = []
+  for (const client of clients) {
+    if (Date.now() >= testEndTime) {
+      break
+    }
+
+    const isLobbyClient = client.index >= config.clients - numLobbyClients
+    running.push(
+      (async () => {
+        await client.start()
+        if (isLobbyClient) {
+          if (!mapId) {
+            const { pool } = await client.request<GetMatchmakingMapPoolBody>(
+              'GET /matchmaking-map-pools/current',
+              'GET',
+              `/matchmaking-map-pools/${MatchmakingType.Match1v1}/current`,
+            )
+            mapId = pool.maps[0]
+          }
+          await client.runLobbies(mapId)
+        } else {
+          await client.runMatchmaking()
+        }
+      })().catch(err => {
+        stats.count('client start errors')
+        console.error(`${client.username}: failed to start`, err)
+      }),
+    )
+    await delay(rampDelayMs)
+  }
+
+  await delay(Math.max(testEndTime - Date.now(), 0))
+  for (const client of clients) {
+    client.stop()
+  }
+  clearInterval(reportInterval)
+  stats.print()
+  await Promise.race([Promise.all(running), delay(5000)])
+  agent.destroy()
+  process.exit(0)
+}
+
+main().catch(err => {
+  console.error(err)
+  process.exit(1)
+})
@@ -0,0 +1,7 @@
+#!/bin/bash
+set -e
+
+cd "$(dirname "${BASH_SOURCE[0]}")"
+cd ../..
+
+node -r "./babel-register" -r "core-js/proposals/reflect-metadata" -r "dotenv/config" "./server/testing/load-test.ts" || exit 1